@@ -0,0 +1,437 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <wayland-client.h>
+#include <wayland-client-protocol.h>
+
+#include "base/command_line.h"
+#include "base/logging.h"
+#include "base/memory/shared_memory.h"
+#include "base/strings/string_number_conversions.h"
+#include "brillo/syslog_logging.h"
+
+constexpr char kModeFlag[] = "mode";
+constexpr char kFramesFlag[] = "frames";
+constexpr char kWidthFlag[] = "width";
+constexpr char kHeightFlag[] = "height";
+constexpr char kRectsFlag[] = "rects";
+constexpr char kFrameCallbacksFlag[] = "frame-callbacks";
+constexpr char kPidFlag[] = "sommelier-pid";
+constexpr char kLabelFlag[] = "label";
+
+// Size of the square that is updated each frame in partial mode.
+constexpr int32_t kPartialSize = 64;
+
+enum bench_mode {
+  BENCH_MODE_FULL,
+  BENCH_MODE_PARTIAL,
+  BENCH_MODE_RESIZE,
+  BENCH_MODE_FLOOD,
+};
+
+struct bench_buffer {
+  struct wl_buffer* buffer;
+  uint32_t* pixels;
+  int32_t width;
+  int32_t height;
+  bool busy;
+};
+
+struct bench_data {
+  enum bench_mode mode;
+  uint32_t frames;
+  uint32_t width;
+  uint32_t height;
+  uint32_t rects;
+  bool frame_callbacks;
+  struct wl_compositor* compositor;
+  struct wl_shell* shell;
+  struct wl_shm* shm;
+  struct wl_shm_pool* pool;
+  struct wl_surface* surface;
+  struct bench_buffer buffers[2];
+  uint64_t commit_usec;
+  bool pending;
+  std::vector<uint64_t> latencies;
+};
+
+static uint64_t bench_now_usec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+static uint64_t bench_cpu_usec() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ull +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Returns user and system time of |pid| in microseconds, or 0 if it can't be
+// read.
+static uint64_t bench_process_cpu_usec(int pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return 0;
+
+  unsigned long utime = 0, stime = 0;
+  // Skip to fields 14 and 15. The command name can't contain ')' for
+  // sommelier so a plain scan is good enough.
+  int rv = fscanf(file,
+                  "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                  &utime, &stime);
+  fclose(file);
+  if (rv != 2)
+    return 0;
+
+  return (utime + stime) * 1000000ull / sysconf(_SC_CLK_TCK);
+}
+
+// Returns resident set size of |pid| in KiB, or 0 if it can't be read.
+static unsigned long bench_process_rss_kb(int pid) {
+  char path[64];
+  char line[128];
+  unsigned long rss = 0;
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "VmRSS: %lu kB", &rss) == 1)
+      break;
+  }
+  fclose(file);
+  return rss;
+}
+
+void bench_registry_listener(void* data,
+                             struct wl_registry* registry,
+                             uint32_t id,
+                             const char* interface,
+                             uint32_t version) {
+  struct bench_data* data_ptr = reinterpret_cast<struct bench_data*>(data);
+  if (!strcmp("wl_compositor", interface)) {
+    data_ptr->compositor = reinterpret_cast<struct wl_compositor*>(
+        wl_registry_bind(registry, id, &wl_compositor_interface, version));
+  } else if (!strcmp("wl_shell", interface)) {
+    data_ptr->shell = reinterpret_cast<struct wl_shell*>(
+        wl_registry_bind(registry, id, &wl_shell_interface, 1));
+  } else if (!strcmp("wl_shm", interface)) {
+    data_ptr->shm = reinterpret_cast<struct wl_shm*>(
+        wl_registry_bind(registry, id, &wl_shm_interface, 1));
+  }
+}
+
+void bench_registry_remover(void* data,
+                            struct wl_registry* registry,
+                            uint32_t id) {}
+
+void shell_surface_ping(void* data,
+                        struct wl_shell_surface* shell_surface,
+                        uint32_t serial) {
+  wl_shell_surface_pong(shell_surface, serial);
+}
+
+void shell_surface_configure(void* data,
+                             struct wl_shell_surface* shell_surface,
+                             uint32_t edges,
+                             int32_t width,
+                             int32_t height) {}
+
+void shell_surface_popup_done(void* data,
+                              struct wl_shell_surface* shell_surface) {}
+
+void buffer_release(void* data, struct wl_buffer* buffer) {
+  struct bench_buffer* bench_buffer =
+      reinterpret_cast<struct bench_buffer*>(data);
+  bench_buffer->busy = false;
+}
+
+const struct wl_buffer_listener buffer_listener = {buffer_release};
+
+// Called when the host has processed the commit, either through the sync
+// request that follows it or through its frame callback.
+void bench_done(void* data, struct wl_callback* callback, uint32_t time) {
+  struct bench_data* data_ptr = reinterpret_cast<struct bench_data*>(data);
+  wl_callback_destroy(callback);
+  data_ptr->latencies.push_back(bench_now_usec() - data_ptr->commit_usec);
+  data_ptr->pending = false;
+}
+
+const struct wl_callback_listener done_listener = {bench_done};
+
+static struct bench_buffer* bench_get_buffer(struct bench_data* data,
+                                             struct wl_display* display,
+                                             int32_t width,
+                                             int32_t height) {
+  for (;;) {
+    for (size_t i = 0; i < 2; ++i) {
+      struct bench_buffer* buffer = &data->buffers[i];
+      if (buffer->busy)
+        continue;
+
+      // Buffers are recreated when the size changes, like a client that is
+      // being resized would do.
+      if (buffer->buffer &&
+          (buffer->width != width || buffer->height != height)) {
+        wl_buffer_destroy(buffer->buffer);
+        buffer->buffer = nullptr;
+      }
+      if (!buffer->buffer) {
+        buffer->buffer = wl_shm_pool_create_buffer(
+            data->pool, i * data->width * data->height * 4, width, height,
+            data->width * 4, WL_SHM_FORMAT_XRGB8888);
+        wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+        buffer->width = width;
+        buffer->height = height;
+      }
+      return buffer;
+    }
+    if (wl_display_dispatch(display) == -1)
+      return nullptr;
+  }
+}
+
+// Draws frame |n| into |buffer| and damages the parts that changed.
+static void bench_draw(struct bench_data* data,
+                       struct bench_buffer* buffer,
+                       uint32_t n) {
+  uint32_t color = 0xff000000 | (n * 0x010203);
+
+  switch (data->mode) {
+    case BENCH_MODE_FULL:
+    case BENCH_MODE_RESIZE:
+      for (int32_t y = 0; y < buffer->height; ++y) {
+        std::fill_n(buffer->pixels + y * data->width, buffer->width, color);
+      }
+      wl_surface_damage(data->surface, 0, 0, buffer->width, buffer->height);
+      break;
+    case BENCH_MODE_PARTIAL: {
+      int32_t size = std::min(kPartialSize, std::min(buffer->width,
+                                                     buffer->height));
+      int32_t x = (n * 7) % (buffer->width - size + 1);
+      int32_t y = (n * 5) % (buffer->height - size + 1);
+      for (int32_t i = 0; i < size; ++i) {
+        std::fill_n(buffer->pixels + (y + i) * data->width + x, size, color);
+      }
+      wl_surface_damage(data->surface, x, y, size, size);
+      break;
+    }
+    case BENCH_MODE_FLOOD:
+      // Many small scattered rects stress damage accumulation rather than
+      // the copy itself.
+      for (uint32_t i = 0; i < data->rects; ++i) {
+        int32_t x = (n * 31 + i * 97) % buffer->width;
+        int32_t y = (n * 17 + i * 61) % buffer->height;
+        buffer->pixels[y * data->width + x] = color;
+        wl_surface_damage(data->surface, x, y, 1, 1);
+      }
+      break;
+  }
+}
+
+static void bench_report(struct bench_data* data,
+                         const std::string& label,
+                         uint64_t usec,
+                         uint64_t cpu_usec,
+                         int pid,
+                         uint64_t sommelier_cpu_usec) {
+  std::vector<uint64_t>& latencies = data->latencies;
+  size_t count = latencies.size();
+  if (!count)
+    return;
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("%s: %zu commits in %.2f s, %.1f commits/s\n", label.c_str(), count,
+         usec / 1e6, count * 1e6 / usec);
+  printf("%s: latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", label.c_str(),
+         latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3,
+         latencies[count - 1] / 1e3);
+  printf("%s: client cpu %.1f us/frame\n", label.c_str(),
+         static_cast<double>(cpu_usec) / count);
+  if (pid > 0) {
+    printf("%s: sommelier cpu %.1f us/frame, rss %lu kB\n", label.c_str(),
+           static_cast<double>(sommelier_cpu_usec) / count,
+           bench_process_rss_kb(pid));
+  }
+}
+
+// Commits frames as fast as the compositor accepts them and reports
+// throughput and latency. Each commit is followed by a sync request, or when
+// --frame-callbacks is passed, a frame callback, and the time until that is
+// done is the commit latency.
+int main(int argc, char* argv[]) {
+  brillo::InitLog(brillo::kLogToStderr);
+
+  base::CommandLine::Init(argc, argv);
+  base::CommandLine* cl = base::CommandLine::ForCurrentProcess();
+  struct bench_data data;
+  data.mode = BENCH_MODE_FULL;
+  data.frames = 600;
+  data.width = 1280;
+  data.height = 720;
+  data.rects = 256;
+  data.frame_callbacks = cl->HasSwitch(kFrameCallbacksFlag);
+  data.compositor = nullptr;
+  data.shell = nullptr;
+  data.shm = nullptr;
+  data.pending = false;
+  memset(data.buffers, 0, sizeof(data.buffers));
+
+  std::string mode = "full";
+  if (cl->HasSwitch(kModeFlag))
+    mode = cl->GetSwitchValueASCII(kModeFlag);
+  if (mode == "full") {
+    data.mode = BENCH_MODE_FULL;
+  } else if (mode == "partial") {
+    data.mode = BENCH_MODE_PARTIAL;
+  } else if (mode == "resize") {
+    data.mode = BENCH_MODE_RESIZE;
+  } else if (mode == "flood") {
+    data.mode = BENCH_MODE_FLOOD;
+  } else {
+    LOG(ERROR) << "Invalid mode, expected full, partial, resize or flood";
+    return -1;
+  }
+  if (cl->HasSwitch(kFramesFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kFramesFlag),
+                          &data.frames)) {
+    LOG(ERROR) << "Invalid frames parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kWidthFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kWidthFlag), &data.width)) {
+    LOG(ERROR) << "Invalid width parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kHeightFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kHeightFlag),
+                          &data.height)) {
+    LOG(ERROR) << "Invalid height parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kRectsFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kRectsFlag), &data.rects)) {
+    LOG(ERROR) << "Invalid rects parameter passed";
+    return -1;
+  }
+  int pid = 0;
+  if (cl->HasSwitch(kPidFlag) &&
+      !base::StringToInt(cl->GetSwitchValueASCII(kPidFlag), &pid)) {
+    LOG(ERROR) << "Invalid sommelier-pid parameter passed";
+    return -1;
+  }
+  std::string label = mode;
+  if (cl->HasSwitch(kLabelFlag))
+    label = cl->GetSwitchValueASCII(kLabelFlag) + "/" + mode;
+  if (!data.width || !data.height) {
+    LOG(ERROR) << "Invalid buffer size";
+    return -1;
+  }
+
+  struct wl_display* display = wl_display_connect(nullptr);
+  if (!display) {
+    LOG(ERROR) << "Failed connecting to display";
+    return -1;
+  }
+
+  struct wl_registry_listener registry_listener = {
+      bench_registry_listener, bench_registry_remover,
+  };
+  struct wl_registry* registry = wl_display_get_registry(display);
+  wl_registry_add_listener(registry, &registry_listener, &data);
+  wl_display_roundtrip(display);
+
+  if (!data.compositor || !data.shell || !data.shm) {
+    LOG(ERROR) << "Missing compositor, shell or shm global";
+    return -1;
+  }
+
+  data.surface = wl_compositor_create_surface(data.compositor);
+  struct wl_shell_surface* shell_surface =
+      wl_shell_get_shell_surface(data.shell, data.surface);
+  const struct wl_shell_surface_listener shell_surface_listener = {
+      shell_surface_ping, shell_surface_configure, shell_surface_popup_done};
+  wl_shell_surface_add_listener(shell_surface, &shell_surface_listener,
+                                nullptr);
+  wl_shell_surface_set_toplevel(shell_surface);
+  wl_shell_surface_set_title(shell_surface, "wayland_bench");
+
+  // One pool holds both buffers at the largest size.
+  size_t buffer_size = data.width * data.height * 4;
+  base::SharedMemory shared_mem;
+  if (!shared_mem.CreateAndMapAnonymous(buffer_size * 2)) {
+    LOG(ERROR) << "Failed to allocate shared memory";
+    return -1;
+  }
+  data.pool =
+      wl_shm_create_pool(data.shm, shared_mem.handle().fd, buffer_size * 2);
+  for (size_t i = 0; i < 2; ++i) {
+    data.buffers[i].pixels = reinterpret_cast<uint32_t*>(
+        static_cast<uint8_t*>(shared_mem.memory()) + i * buffer_size);
+  }
+  data.latencies.reserve(data.frames);
+
+  uint64_t start_usec = bench_now_usec();
+  uint64_t start_cpu_usec = bench_cpu_usec();
+  uint64_t start_sommelier_cpu_usec = pid > 0 ? bench_process_cpu_usec(pid)
+                                              : 0;
+  for (uint32_t n = 0; n < data.frames; ++n) {
+    int32_t width = data.width;
+    int32_t height = data.height;
+
+    // Sweep between half and full size.
+    if (data.mode == BENCH_MODE_RESIZE) {
+      uint32_t step = n % 64;
+      uint32_t phase = step < 32 ? step : 64 - step;
+      width = data.width / 2 + data.width * phase / 64;
+      height = data.height / 2 + data.height * phase / 64;
+    }
+
+    struct bench_buffer* buffer =
+        bench_get_buffer(&data, display, width, height);
+    if (!buffer) {
+      LOG(ERROR) << "Lost connection to display";
+      return -1;
+    }
+
+    bench_draw(&data, buffer, n);
+    wl_surface_attach(data.surface, buffer->buffer, 0, 0);
+    struct wl_callback* callback =
+        data.frame_callbacks ? wl_surface_frame(data.surface) : nullptr;
+    wl_surface_commit(data.surface);
+    if (!callback)
+      callback = wl_display_sync(display);
+    wl_callback_add_listener(callback, &done_listener, &data);
+    buffer->busy = true;
+    data.commit_usec = bench_now_usec();
+    data.pending = true;
+
+    while (data.pending) {
+      if (wl_display_dispatch(display) == -1) {
+        LOG(ERROR) << "Lost connection to display";
+        return -1;
+      }
+    }
+  }
+  uint64_t sommelier_cpu_usec =
+      pid > 0 ? bench_process_cpu_usec(pid) - start_sommelier_cpu_usec : 0;
+  bench_report(&data, label, bench_now_usec() - start_usec,
+               bench_cpu_usec() - start_cpu_usec, pid, sommelier_cpu_usec);
+
+  wl_display_disconnect(display);
+  return 0;
+}
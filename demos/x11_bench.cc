@@ -0,0 +1,225 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "base/command_line.h"
+#include "base/logging.h"
+#include "base/strings/string_number_conversions.h"
+#include "brillo/syslog_logging.h"
+
+constexpr char kModeFlag[] = "mode";
+constexpr char kIterationsFlag[] = "iterations";
+constexpr char kWindowsFlag[] = "windows";
+constexpr char kLabelFlag[] = "label";
+
+static uint64_t bench_now_usec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+// Waits for an event of |type| on |win|, dropping everything else.
+static void bench_wait_for_event(Display* dpy,
+                                 Window win,
+                                 int type,
+                                 XEvent* evt) {
+  for (;;) {
+    XWindowEvent(dpy, win, StructureNotifyMask | PropertyChangeMask, evt);
+    if (evt->type == type)
+      return;
+  }
+}
+
+static void bench_report(const std::string& label,
+                         const char* what,
+                         std::vector<uint64_t>* latencies,
+                         uint64_t usec) {
+  size_t count = latencies->size();
+  if (!count)
+    return;
+
+  std::sort(latencies->begin(), latencies->end());
+  printf("%s: %zu %s in %.2f s, %.1f/s\n", label.c_str(), count, what,
+         usec / 1e6, count * 1e6 / usec);
+  printf("%s: latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", label.c_str(),
+         (*latencies)[count / 2] / 1e3, (*latencies)[count * 99 / 100] / 1e3,
+         (*latencies)[count - 1] / 1e3);
+}
+
+// Maps and unmaps windows as fast as the window manager lets us. Sommelier
+// redirects the map requests, so the time until MapNotify is the time it
+// takes sommelier to handle them.
+static int bench_map_storm(Display* dpy,
+                           const std::string& label,
+                           uint32_t iterations,
+                           uint32_t num_windows) {
+  int screen = DefaultScreen(dpy);
+  std::vector<Window> windows;
+  for (uint32_t i = 0; i < num_windows; ++i) {
+    Window win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen), i * 8,
+                                     i * 8, 256, 256, 0, 0, 0x808080);
+    XSelectInput(dpy, win, StructureNotifyMask);
+    XStoreName(dpy, win, "x11_bench");
+    windows.push_back(win);
+  }
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(iterations * num_windows);
+  uint64_t start_usec = bench_now_usec();
+  XEvent evt;
+  for (uint32_t n = 0; n < iterations; ++n) {
+    for (Window win : windows) {
+      uint64_t map_usec = bench_now_usec();
+      XMapWindow(dpy, win);
+      bench_wait_for_event(dpy, win, MapNotify, &evt);
+      latencies.push_back(bench_now_usec() - map_usec);
+    }
+    for (Window win : windows) {
+      XUnmapWindow(dpy, win);
+      bench_wait_for_event(dpy, win, UnmapNotify, &evt);
+    }
+  }
+  bench_report(label, "maps", &latencies, bench_now_usec() - start_usec);
+
+  for (Window win : windows)
+    XDestroyWindow(dpy, win);
+  return 0;
+}
+
+// Returns the size of the current CLIPBOARD contents as UTF8_STRING, or -1
+// if the conversion failed. Incremental transfers are followed to the end.
+static long bench_convert_clipboard(Display* dpy, Window win) {
+  Atom clipboard = XInternAtom(dpy, "CLIPBOARD", False);
+  Atom utf8_string = XInternAtom(dpy, "UTF8_STRING", False);
+  Atom incr = XInternAtom(dpy, "INCR", False);
+  Atom property = XInternAtom(dpy, "X11_BENCH", False);
+  XEvent evt;
+
+  XConvertSelection(dpy, clipboard, utf8_string, property, win, CurrentTime);
+  do {
+    XNextEvent(dpy, &evt);
+  } while (evt.type != SelectionNotify);
+  if (evt.xselection.property == None)
+    return -1;
+
+  long total = 0;
+  bool incremental = false;
+  for (;;) {
+    Atom type;
+    int format;
+    unsigned long items, bytes_after;
+    unsigned char* value = nullptr;
+
+    if (XGetWindowProperty(dpy, win, property, 0, 0x1fffffff, True,
+                           AnyPropertyType, &type, &format, &items,
+                           &bytes_after, &value) != Success) {
+      return -1;
+    }
+    XFree(value);
+
+    if (type == incr) {
+      incremental = true;
+    } else {
+      total += items * format / 8;
+      if (!incremental || !items)
+        return total;
+    }
+
+    // Deleting the property asks for the next chunk.
+    do {
+      bench_wait_for_event(dpy, win, PropertyNotify, &evt);
+    } while (evt.xproperty.atom != property ||
+             evt.xproperty.state != PropertyNewValue);
+  }
+}
+
+// Reads the clipboard repeatedly. Sommelier streams it from the Wayland
+// selection owner each time unless its clipboard cache answers from memory.
+static int bench_clipboard(Display* dpy,
+                           const std::string& label,
+                           uint32_t iterations) {
+  int screen = DefaultScreen(dpy);
+  Window win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen), 0, 0, 1, 1, 0,
+                                   0, 0);
+  XSelectInput(dpy, win, PropertyChangeMask);
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(iterations);
+  uint64_t start_usec = bench_now_usec();
+  long bytes = 0;
+  for (uint32_t n = 0; n < iterations; ++n) {
+    uint64_t request_usec = bench_now_usec();
+    long size = bench_convert_clipboard(dpy, win);
+    if (size < 0) {
+      LOG(ERROR) << "Failed to convert clipboard";
+      return -1;
+    }
+    latencies.push_back(bench_now_usec() - request_usec);
+    bytes += size;
+  }
+  uint64_t usec = bench_now_usec() - start_usec;
+  bench_report(label, "transfers", &latencies, usec);
+  printf("%s: %ld bytes, %.1f MB/s\n", label.c_str(), bytes,
+         usec ? static_cast<double>(bytes) / usec : 0.0);
+
+  XDestroyWindow(dpy, win);
+  return 0;
+}
+
+// Generates map/unmap storms or repeated clipboard reads and reports their
+// rate and latency.
+int main(int argc, char* argv[]) {
+  brillo::InitLog(brillo::kLogToStderr);
+
+  base::CommandLine::Init(argc, argv);
+  base::CommandLine* cl = base::CommandLine::ForCurrentProcess();
+  std::string mode = "map";
+  if (cl->HasSwitch(kModeFlag))
+    mode = cl->GetSwitchValueASCII(kModeFlag);
+  uint32_t iterations = 100;
+  if (cl->HasSwitch(kIterationsFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kIterationsFlag),
+                          &iterations)) {
+    LOG(ERROR) << "Invalid iterations parameter passed";
+    return -1;
+  }
+  uint32_t num_windows = 16;
+  if (cl->HasSwitch(kWindowsFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kWindowsFlag),
+                          &num_windows)) {
+    LOG(ERROR) << "Invalid windows parameter passed";
+    return -1;
+  }
+  std::string label = mode;
+  if (cl->HasSwitch(kLabelFlag))
+    label = cl->GetSwitchValueASCII(kLabelFlag) + "/" + mode;
+
+  Display* dpy = XOpenDisplay(nullptr);
+  if (!dpy) {
+    LOG(ERROR) << "Failed opening display";
+    return -1;
+  }
+
+  int rv;
+  if (mode == "map") {
+    rv = bench_map_storm(dpy, label, iterations, num_windows);
+  } else if (mode == "clipboard") {
+    rv = bench_clipboard(dpy, label, iterations);
+  } else {
+    LOG(ERROR) << "Invalid mode, expected map or clipboard";
+    rv = -1;
+  }
+
+  XCloseDisplay(dpy);
+  return rv;
+}
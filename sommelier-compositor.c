@@ -11,9 +11,11 @@
 #include <limits.h>
 #include <linux/virtwl.h>
 #include <pixman.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
@@ -25,6 +27,32 @@
 #define MIN_SIZE (INT_MIN / 10)
 #define MAX_SIZE (INT_MAX / 10)
 
+#define ALIGN(x, a) (((x) + (a)-1) & ~((a)-1))
+
+// Number of frames of damage kept for each surface. Output buffers that are
+// older than this are fully updated.
+#define DAMAGE_HISTORY_LENGTH 4
+
+// Damage with more rectangles than this is reduced to its bounding box.
+#define DAMAGE_MAX_RECTS 32
+
+// Size of output buffers that can be cropped is rounded up to a multiple of
+// this to allow reuse while resizing.
+#define OUTPUT_BUFFER_SIZE_ALIGNMENT 64
+
+// Cursor images up to this size are kept in the cursor cache.
+#define CURSOR_CACHE_MAX_SIZE 256
+
+// Number of cursor images kept ready to be attached.
+#define CURSOR_CACHE_LENGTH 16
+
+// Maximum number of idle buffers in the pool. Bounds the search for a
+// buffer that fits.
+#define OUTPUT_BUFFER_POOL_LENGTH 16
+
+// Frame callbacks of hidden surfaces are done at most this often.
+#define HIDDEN_FRAME_CALLBACK_INTERVAL_MS 1000
+
 #define DMA_BUF_SYNC_READ (1 << 0)
 #define DMA_BUF_SYNC_WRITE (2 << 0)
 #define DMA_BUF_SYNC_RW (DMA_BUF_SYNC_READ | DMA_BUF_SYNC_WRITE)
@@ -33,6 +61,8 @@
 
 #define DMA_BUF_BASE 'b'
 #define DMA_BUF_IOCTL_SYNC _IOW(DMA_BUF_BASE, 0, struct dma_buf_sync)
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE \
+  _IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
 
 struct sl_host_compositor {
   struct sl_compositor* compositor;
@@ -47,14 +77,35 @@ struct sl_output_buffer {
   uint32_t format;
   struct wl_buffer* internal;
   struct sl_mmap* mmap;
-  struct pixman_region32 damage;
+  uint32_t frame;
+  double downscale;
+  struct sl_gpu_target* gpu_target;
+  uint64_t release_msec;
+  // Buffers in the cursor cache are immutable once committed.
+  int cached;
+  uint64_t cache_hash;
+  struct sl_context* ctx;
   struct sl_host_surface* surface;
 };
 
+// Damage of the last few frames committed to a surface. Frames are numbered
+// from 1 and an output buffer that was last updated with frame N needs the
+// damage of all frames after N.
+struct sl_damage_history {
+  uint32_t frame;
+  struct pixman_region32 pending;
+  struct pixman_region32 frames[DAMAGE_HISTORY_LENGTH];
+};
+
 struct dma_buf_sync {
   __u64 flags;
 };
 
+struct dma_buf_export_sync_file {
+  __u32 flags;
+  __s32 fd;
+};
+
 static void sl_dmabuf_sync(int fd, __u64 flags) {
   struct dma_buf_sync sync = {0};
   int rv;
@@ -65,12 +116,33 @@ static void sl_dmabuf_sync(int fd, __u64 flags) {
   } while (rv == -1 && errno == EINTR);
 }
 
-static void sl_dmabuf_begin_write(int fd) {
-  sl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+static void sl_dmabuf_begin_write(struct sl_mmap* map) {
+  sl_dmabuf_sync(map->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
 }
 
-static void sl_dmabuf_end_write(int fd) {
-  sl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+static void sl_dmabuf_end_write(struct sl_mmap* map) {
+  sl_dmabuf_sync(map->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+}
+
+// Returns a sync_file for the fences that need to signal before the dmabuf
+// can be accessed as specified by |flags|, or -1 if not supported.
+static int sl_dmabuf_export_fence(int fd, __u32 flags) {
+  struct dma_buf_export_sync_file export_sync_file = {0};
+  int rv;
+
+  export_sync_file.flags = flags;
+  export_sync_file.fd = -1;
+  do {
+    rv = ioctl(fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export_sync_file);
+  } while (rv == -1 && errno == EINTR);
+
+  return rv ? -1 : export_sync_file.fd;
+}
+
+static int sl_fence_is_signaled(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+
+  return poll(&pfd, 1, 0) == 1;
 }
 
 static void sl_virtwl_dmabuf_sync(int fd, __u32 flags) {
@@ -83,12 +155,92 @@ static void sl_virtwl_dmabuf_sync(int fd, __u32 flags) {
   UNUSED(rv);
 }
 
-static void sl_virtwl_dmabuf_begin_write(int fd) {
-  sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+static void sl_virtwl_dmabuf_begin_write(struct sl_mmap* map) {
+  sl_virtwl_dmabuf_sync(map->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+}
+
+static void sl_virtwl_dmabuf_end_write(struct sl_mmap* map) {
+  sl_virtwl_dmabuf_sync(map->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+}
+
+static void sl_damage_history_limit(struct pixman_region32* region) {
+  if (pixman_region32_n_rects(region) > DAMAGE_MAX_RECTS) {
+    pixman_box32_t extents = *pixman_region32_extents(region);
+
+    pixman_region32_reset(region, &extents);
+  }
+}
+
+static struct sl_damage_history* sl_damage_history_create() {
+  struct sl_damage_history* history;
+  size_t i;
+
+  history = malloc(sizeof(*history));
+  assert(history);
+  history->frame = 0;
+  pixman_region32_init(&history->pending);
+  for (i = 0; i < DAMAGE_HISTORY_LENGTH; ++i)
+    pixman_region32_init(&history->frames[i]);
+
+  return history;
 }
 
-static void sl_virtwl_dmabuf_end_write(int fd) {
-  sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+static void sl_damage_history_destroy(struct sl_damage_history* history) {
+  size_t i;
+
+  pixman_region32_fini(&history->pending);
+  for (i = 0; i < DAMAGE_HISTORY_LENGTH; ++i)
+    pixman_region32_fini(&history->frames[i]);
+  free(history);
+}
+
+// Compute the damage that needs to be copied to bring an output buffer that
+// was last updated with |frame| up to date with the pending frame.
+static void sl_damage_history_accumulate(struct sl_damage_history* history,
+                                         uint32_t frame,
+                                         struct pixman_region32* damage) {
+  uint32_t f;
+
+  if (!frame || history->frame - frame > DAMAGE_HISTORY_LENGTH) {
+    pixman_box32_t box = {0, 0, MAX_SIZE, MAX_SIZE};
+
+    pixman_region32_reset(damage, &box);
+    return;
+  }
+
+  pixman_region32_copy(damage, &history->pending);
+  for (f = frame + 1; f <= history->frame; ++f) {
+    pixman_region32_union(damage, damage,
+                          &history->frames[f % DAMAGE_HISTORY_LENGTH]);
+  }
+  sl_damage_history_limit(damage);
+}
+
+// Turn pending damage into a new frame and return its number.
+static uint32_t sl_damage_history_commit(struct sl_damage_history* history) {
+  struct pixman_region32* region;
+
+  history->frame++;
+  region = &history->frames[history->frame % DAMAGE_HISTORY_LENGTH];
+  pixman_region32_copy(region, &history->pending);
+  pixman_region32_clear(&history->pending);
+
+  return history->frame;
+}
+
+static pixman_format_code_t sl_pixman_format_for_shm_format(uint32_t format) {
+  switch (format) {
+    case WL_SHM_FORMAT_ARGB8888:
+      return PIXMAN_a8r8g8b8;
+    case WL_SHM_FORMAT_ABGR8888:
+      return PIXMAN_a8b8g8r8;
+    case WL_SHM_FORMAT_XRGB8888:
+      return PIXMAN_x8r8g8b8;
+    case WL_SHM_FORMAT_XBGR8888:
+      return PIXMAN_x8b8g8r8;
+  }
+  assert(0);
+  return 0;
 }
 
 static uint32_t sl_gbm_format_for_shm_format(uint32_t format) {
@@ -110,7 +262,7 @@ static uint32_t sl_gbm_format_for_shm_format(uint32_t format) {
   return 0;
 }
 
-static uint32_t sl_drm_format_for_shm_format(int format) {
+uint32_t sl_drm_format_for_shm_format(int format) {
   switch (format) {
     case WL_SHM_FORMAT_NV12:
       return WL_DRM_FORMAT_NV12;
@@ -129,43 +281,687 @@ static uint32_t sl_drm_format_for_shm_format(int format) {
   return 0;
 }
 
+static uint64_t sl_now_msec(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
 static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
+  buffer->ctx->output_buffer_size -= buffer->mmap->size;
+  if (buffer->gpu_target)
+    sl_gpu_target_destroy(buffer->ctx->gpu_engine, buffer->gpu_target);
   wl_buffer_destroy(buffer->internal);
   sl_mmap_unref(buffer->mmap);
-  pixman_region32_fini(&buffer->damage);
   wl_list_remove(&buffer->link);
   free(buffer);
 }
 
+// Accounts for |buffer| leaving the pool. The caller unlinks it.
+static void sl_output_buffer_pool_take(struct sl_context* ctx,
+                                       struct sl_output_buffer* buffer) {
+  ctx->output_buffer_pool_size -= buffer->mmap->size;
+  ctx->output_buffer_pool_length--;
+}
+
+// Evict least recently used buffers until the pool is within its limits.
+static void sl_output_buffer_pool_trim(struct sl_context* ctx) {
+  while ((ctx->output_buffer_pool_size > ctx->output_buffer_pool_limit ||
+          ctx->output_buffer_pool_length > OUTPUT_BUFFER_POOL_LENGTH) &&
+         !wl_list_empty(&ctx->output_buffer_pool)) {
+    struct sl_output_buffer* buffer;
+
+    buffer = wl_container_of(ctx->output_buffer_pool.prev, buffer, link);
+    sl_output_buffer_pool_take(ctx, buffer);
+    sl_output_buffer_destroy(buffer);
+  }
+}
+
+// Evict least recently used cursor images until at most |length| are left.
+// Destroying a buffer that the host is showing is fine as its contents never
+// change.
+static void sl_cursor_cache_trim(struct sl_context* ctx, int length) {
+  while (ctx->cursor_cache_length > length) {
+    struct sl_output_buffer* buffer;
+    struct sl_host_surface* host;
+
+    buffer = wl_container_of(ctx->cursor_cache.prev, buffer, link);
+    wl_list_for_each(host, &ctx->host_surfaces, link) {
+      if (host->current_buffer == buffer)
+        host->current_buffer = NULL;
+    }
+    ctx->cursor_cache_length--;
+    sl_output_buffer_destroy(buffer);
+  }
+}
+
+// Destroys all idle buffers and stops pooling new ones.
+void sl_output_buffer_pool_release(struct sl_context* ctx) {
+  ctx->output_buffer_pool_limit = 0;
+  sl_output_buffer_pool_trim(ctx);
+  sl_cursor_cache_trim(ctx, 0);
+}
+
+// Move an idle buffer to the context wide pool so it can be reused by any
+// surface.
+static void sl_output_buffer_recycle(struct sl_output_buffer* buffer) {
+  struct sl_context* ctx = buffer->ctx;
+
+  wl_list_remove(&buffer->link);
+  wl_list_insert(&ctx->output_buffer_pool, &buffer->link);
+  buffer->surface = NULL;
+  buffer->release_msec = sl_now_msec();
+  ctx->output_buffer_pool_size += buffer->mmap->size;
+  ctx->output_buffer_pool_length++;
+  sl_output_buffer_pool_trim(ctx);
+}
+
+// Frees idle buffers until all output buffers fit in the memory budget.
+// The pool goes first, then released buffers of the surfaces that were
+// committed least recently. Buffers of |keep| are left alone.
+static void sl_output_buffer_reclaim(struct sl_context* ctx,
+                                     struct sl_host_surface* keep) {
+  struct sl_host_surface* host;
+
+  if (!ctx->output_buffer_budget)
+    return;
+
+  while (ctx->output_buffer_size > ctx->output_buffer_budget &&
+         !wl_list_empty(&ctx->output_buffer_pool)) {
+    struct sl_output_buffer* buffer;
+
+    buffer = wl_container_of(ctx->output_buffer_pool.prev, buffer, link);
+    sl_output_buffer_pool_take(ctx, buffer);
+    sl_output_buffer_destroy(buffer);
+  }
+
+  wl_list_for_each_reverse(host, &ctx->host_surfaces, link) {
+    struct sl_output_buffer *buffer, *next;
+
+    if (host == keep)
+      continue;
+
+    wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+      if (ctx->output_buffer_size <= ctx->output_buffer_budget)
+        return;
+      if (buffer != host->current_buffer)
+        sl_output_buffer_destroy(buffer);
+    }
+  }
+}
+
+// Frees buffers that neither the host nor their surface have used for the
+// idle timeout. Surfaces keep the buffer the host is showing.
+static int sl_handle_output_buffer_idle_timer(void* data) {
+  struct sl_context* ctx = data;
+  uint64_t timeout = ctx->output_buffer_idle_timeout * 1000ULL;
+  uint64_t now = sl_now_msec();
+  struct sl_output_buffer *buffer, *next;
+  struct sl_host_surface* host;
+
+  wl_list_for_each_safe(buffer, next, &ctx->output_buffer_pool, link) {
+    if (now - buffer->release_msec >= timeout) {
+      sl_output_buffer_pool_take(ctx, buffer);
+      sl_output_buffer_destroy(buffer);
+    }
+  }
+
+  wl_list_for_each(host, &ctx->host_surfaces, link) {
+    wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+      if (buffer != host->current_buffer &&
+          now - buffer->release_msec >= timeout)
+        sl_output_buffer_destroy(buffer);
+    }
+  }
+
+  wl_event_source_timer_update(ctx->output_buffer_idle_timer,
+                               ctx->output_buffer_idle_timeout * 1000);
+  return 1;
+}
+
+// Scale factor between logical pixels of host surfaces and device pixels.
+// It is folded into the context scale, see sl_calculate_scale_for_xwayland().
+static double sl_device_scale_factor(struct sl_context* ctx) {
+  struct sl_host_output* output;
+
+  if (!ctx->aura_shell)
+    return 1.0;
+
+  wl_list_for_each(output, &ctx->host_outputs, link) {
+    if (output->internal)
+      return sl_output_aura_scale_factor_to_double(
+          output->device_scale_factor);
+  }
+  return 1.0;
+}
+
+// Returns the factor that contents of |host_buffer| are downscaled by when
+// copied to output buffers, or 1.0 if they are copied as is. Downscaled
+// contents are written at final device resolution so that the host doesn't
+// receive more pixels than it shows.
+static double sl_host_surface_downscale(struct sl_host_surface* host,
+                                        struct sl_host_buffer* host_buffer) {
+  double scale = host->ctx->scale * host->contents_scale /
+                 sl_device_scale_factor(host->ctx);
+  struct sl_mmap* mmap = host_buffer->shm_mmap;
+
+  // Client viewports have their own mapping of contents to the surface.
+  // Resampling is limited to 32 bpp formats that pixman can address.
+  if (!host->ctx->downscale || !host->viewport || scale <= 1.0 ||
+      !wl_list_empty(&host->contents_viewport) || mmap->bpp != 4 ||
+      mmap->num_planes != 1 || mmap->stride[0] % 4 || mmap->offset[0] % 4)
+    return 1.0;
+
+  return scale;
+}
+
+// Size that contents of |width| x |height| take up in output buffers.
+static void sl_host_surface_output_size(struct sl_host_surface* host,
+                                        uint32_t width,
+                                        uint32_t height,
+                                        uint32_t* output_width,
+                                        uint32_t* output_height) {
+  *output_width = ceil(width / host->contents_downscale);
+  *output_height = ceil(height / host->contents_downscale);
+}
+
+// Tiled output buffers are only worth it when contents are uploaded by the
+// GPU. The CPU would have to go through a slow detiling map of the whole
+// buffer for every copy. Cursors are kept linear for cursor planes.
+static int sl_host_surface_uses_tiled_buffers(struct sl_host_surface* host) {
+  return host->ctx->gpu_engine && !host->contents_gpu_fallback &&
+         !host->is_cursor;
+}
+
+// Returns true if |buffer| can be used for contents of |host_buffer|. Larger
+// buffers are cropped using the viewport but at most twice the area that is
+// needed is accepted.
+static int sl_output_buffer_fits(struct sl_output_buffer* buffer,
+                                 struct sl_host_surface* host,
+                                 struct sl_host_buffer* host_buffer) {
+  uint32_t width, height;
+
+  sl_host_surface_output_size(host, host_buffer->width, host_buffer->height,
+                              &width, &height);
+  if (buffer->format != host_buffer->shm_format)
+    return 0;
+
+  // Tiled buffers are only written by the GPU.
+  if (buffer->mmap->bo && !sl_host_surface_uses_tiled_buffers(host))
+    return 0;
+
+  // Contents don't match the damage history if the scale has changed.
+  if (buffer->downscale != host->contents_downscale && buffer->surface == host)
+    return 0;
+
+  if (buffer->width == width && buffer->height == height)
+    return 1;
+
+  return host->viewport && buffer->mmap->num_planes == 1 &&
+         buffer->width >= width && buffer->height >= height &&
+         (uint64_t)buffer->width * buffer->height <=
+             2 * (uint64_t)width * height;
+}
+
 static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
   struct sl_output_buffer* output_buffer = wl_buffer_get_user_data(buffer);
   struct sl_host_surface* host_surface = output_buffer->surface;
 
+  // Cached cursor images stay in the cache.
+  if (output_buffer->cached)
+    return;
+
+  // Surface is gone. Make the buffer available to other surfaces.
+  if (!host_surface) {
+    sl_output_buffer_recycle(output_buffer);
+    return;
+  }
+
   wl_list_remove(&output_buffer->link);
   wl_list_insert(&host_surface->released_buffers, &output_buffer->link);
+  output_buffer->release_msec = sl_now_msec();
 }
 
 static const struct wl_buffer_listener sl_output_buffer_listener = {
     sl_output_buffer_release};
 
+// Allocates a buffer object with one of the modifiers that the host supports
+// for |shm_format|, or returns NULL if there are none to choose from.
+static struct gbm_bo* sl_gbm_bo_create_with_host_modifiers(
+    struct sl_context* ctx,
+    uint32_t width,
+    uint32_t height,
+    uint32_t shm_format) {
+  uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
+  struct sl_dmabuf_modifier* modifier;
+  struct wl_array modifiers;
+  struct gbm_bo* bo = NULL;
+
+  wl_array_init(&modifiers);
+  wl_array_for_each(modifier, &ctx->linux_dmabuf->modifiers) {
+    if (modifier->format == drm_format &&
+        modifier->modifier != DRM_FORMAT_MOD_INVALID) {
+      uint64_t* p = wl_array_add(&modifiers, sizeof(*p));
+
+      assert(p);
+      *p = modifier->modifier;
+    }
+  }
+
+  // The driver picks the most efficient of the modifiers.
+  if (modifiers.size) {
+    bo = gbm_bo_create_with_modifiers(
+        ctx->gbm, width, height, sl_gbm_format_for_shm_format(shm_format),
+        modifiers.data, modifiers.size / sizeof(uint64_t));
+  }
+  wl_array_release(&modifiers);
+
+  return bo;
+}
+
+static struct sl_output_buffer* sl_output_buffer_create(
+    struct sl_host_surface* host,
+    size_t width,
+    size_t height) {
+  struct sl_output_buffer* buffer;
+  struct sl_mmap* contents = host->contents_shm_mmap;
+  uint32_t shm_format = host->contents_shm_format;
+  size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
+  size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
+
+  buffer = malloc(sizeof(struct sl_output_buffer));
+  assert(buffer);
+  host->ctx->stats.buffer_allocations++;
+  wl_list_insert(&host->released_buffers, &buffer->link);
+  buffer->width = width;
+  buffer->height = height;
+  buffer->format = shm_format;
+  buffer->ctx = host->ctx;
+  buffer->surface = host;
+  buffer->frame = 0;
+  buffer->downscale = host->contents_downscale;
+  buffer->gpu_target = NULL;
+  buffer->release_msec = sl_now_msec();
+  buffer->cached = 0;
+  buffer->cache_hash = 0;
+
+  switch (host->ctx->shm_driver) {
+    case SHM_DRIVER_DMABUF: {
+      uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
+      struct zwp_linux_buffer_params_v1* buffer_params;
+      uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+      struct gbm_bo* bo = NULL;
+      int stride0;
+      int fd;
+      int i;
+
+      if (num_planes == 1 && sl_host_surface_uses_tiled_buffers(host))
+        bo = sl_gbm_bo_create_with_host_modifiers(host->ctx, width, height,
+                                                  shm_format);
+      if (bo) {
+        modifier = gbm_bo_get_modifier(bo);
+      } else {
+        bo = gbm_bo_create(host->ctx->gbm, width, height,
+                           sl_gbm_format_for_shm_format(shm_format),
+                           GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+      }
+      stride0 = gbm_bo_get_stride(bo);
+      fd = gbm_bo_get_fd(bo);
+
+      // Tiled layouts can come with auxiliary planes, such as compression
+      // metadata, that live in the same buffer object.
+      buffer_params = zwp_linux_dmabuf_v1_create_params(
+          host->ctx->linux_dmabuf->internal);
+      for (i = 0; i < gbm_bo_get_plane_count(bo); ++i) {
+        zwp_linux_buffer_params_v1_add(
+            buffer_params, fd, i, gbm_bo_get_offset(bo, i),
+            gbm_bo_get_stride_for_plane(bo, i), modifier >> 32,
+            modifier & 0xffffffff);
+      }
+      buffer->internal = zwp_linux_buffer_params_v1_create_immed(
+          buffer_params, width, height, drm_format, 0);
+      zwp_linux_buffer_params_v1_destroy(buffer_params);
+
+      if (modifier == DRM_FORMAT_MOD_INVALID ||
+          modifier == DRM_FORMAT_MOD_LINEAR) {
+        buffer->mmap = sl_mmap_create(fd, height * stride0, bpp, 1, 0, stride0,
+                                      0, 0, 1, 0);
+        buffer->mmap->begin_write = sl_dmabuf_begin_write;
+        buffer->mmap->end_write = sl_dmabuf_end_write;
+        gbm_bo_destroy(bo);
+      } else {
+        // Contents of tiled buffers are written through gbm, which keeps the
+        // buffer object alive. The fd is kept for fences.
+        buffer->mmap = sl_mmap_create_gbm(bo, fd, height * stride0, bpp);
+      }
+    } break;
+    case SHM_DRIVER_VIRTWL: {
+      size_t size = contents->size;
+      size_t stride0 = contents->stride[0];
+      struct virtwl_ioctl_new ioctl_new;
+      struct wl_shm_pool* pool;
+      int rv;
+
+      // Buffers that have been rounded up to a larger size or hold
+      // downscaled contents have a single plane.
+      if (width != host->contents_width || height != host->contents_height) {
+        assert(num_planes == 1);
+        stride0 = width * bpp;
+        size = stride0 * height;
+      }
+
+      ioctl_new.type = VIRTWL_IOCTL_NEW_ALLOC;
+      ioctl_new.fd = -1;
+      ioctl_new.flags = 0;
+      ioctl_new.size = size;
+      rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
+      assert(rv == 0);
+      UNUSED(rv);
+
+      pool = wl_shm_create_pool(host->ctx->shm->internal, ioctl_new.fd, size);
+      buffer->internal = wl_shm_pool_create_buffer(pool, 0, width, height,
+                                                   stride0, shm_format);
+      wl_shm_pool_destroy(pool);
+
+      buffer->mmap = sl_mmap_create(
+          ioctl_new.fd, size, bpp, num_planes, 0, stride0,
+          contents->offset[1] - contents->offset[0], contents->stride[1],
+          contents->y_ss[0], contents->y_ss[1]);
+    } break;
+    case SHM_DRIVER_VIRTWL_DMABUF: {
+      uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
+      struct virtwl_ioctl_new ioctl_new = {
+          .type = VIRTWL_IOCTL_NEW_DMABUF,
+          .fd = -1,
+          .flags = 0,
+          .dmabuf = {.width = width, .height = height, .format = drm_format}};
+      struct zwp_linux_buffer_params_v1* buffer_params;
+      size_t size;
+      int rv;
+
+      rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
+      if (rv) {
+        fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
+                strerror(errno));
+        _exit(EXIT_FAILURE);
+      }
+
+      size = ioctl_new.dmabuf.stride0 * height;
+      buffer_params = zwp_linux_dmabuf_v1_create_params(
+          host->ctx->linux_dmabuf->internal);
+      zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 0,
+                                     ioctl_new.dmabuf.offset0,
+                                     ioctl_new.dmabuf.stride0, 0, 0);
+      if (num_planes > 1) {
+        zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 1,
+                                       ioctl_new.dmabuf.offset1,
+                                       ioctl_new.dmabuf.stride1, 0, 0);
+        size = MAX(size, ioctl_new.dmabuf.offset1 +
+                             ioctl_new.dmabuf.stride1 * height /
+                                 contents->y_ss[1]);
+      }
+      buffer->internal = zwp_linux_buffer_params_v1_create_immed(
+          buffer_params, width, height, drm_format, 0);
+      zwp_linux_buffer_params_v1_destroy(buffer_params);
+
+      buffer->mmap = sl_mmap_create(
+          ioctl_new.fd, size, bpp, num_planes, ioctl_new.dmabuf.offset0,
+          ioctl_new.dmabuf.stride0, ioctl_new.dmabuf.offset1,
+          ioctl_new.dmabuf.stride1, contents->y_ss[0], contents->y_ss[1]);
+      buffer->mmap->begin_write = sl_virtwl_dmabuf_begin_write;
+      buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
+    } break;
+  }
+
+  assert(buffer->internal);
+  assert(buffer->mmap);
+
+  host->ctx->output_buffer_size += buffer->mmap->size;
+  sl_output_buffer_reclaim(host->ctx, host);
+
+  if (host->ctx->output_buffer_idle_timeout &&
+      !host->ctx->output_buffer_idle_timer) {
+    host->ctx->output_buffer_idle_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(host->ctx->host_display),
+        sl_handle_output_buffer_idle_timer, host->ctx);
+    wl_event_source_timer_update(host->ctx->output_buffer_idle_timer,
+                                 host->ctx->output_buffer_idle_timeout * 1000);
+  }
+
+  wl_buffer_set_user_data(buffer->internal, buffer);
+  wl_buffer_add_listener(buffer->internal, &sl_output_buffer_listener, buffer);
+
+  return buffer;
+}
+
+// FNV-1a hash of the pixels of a cursor image.
+static uint64_t sl_cursor_hash(struct sl_mmap* map,
+                               uint32_t width,
+                               uint32_t height) {
+  const uint8_t* row = (const uint8_t*)map->addr + map->offset[0];
+  size_t bytes = width * map->bpp;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint32_t y;
+  size_t i;
+
+  for (y = 0; y < height; ++y) {
+    for (i = 0; i < bytes; ++i) {
+      hash ^= row[i];
+      hash *= 0x100000001b3ULL;
+    }
+    row += map->stride[0];
+  }
+  return hash;
+}
+
+static int sl_host_surface_caches_contents(struct sl_host_surface* host) {
+  return host->is_cursor && host->contents_shm_mmap &&
+         host->contents_shm_mmap->num_planes == 1 &&
+         host->contents_downscale == 1.0 &&
+         host->contents_width <= CURSOR_CACHE_MAX_SIZE &&
+         host->contents_height <= CURSOR_CACHE_MAX_SIZE;
+}
+
+// Picks the cached copy of a cursor image, or creates a buffer that is added
+// to the cache once the image has been copied into it. Clients can write to
+// the image until they commit it, so this is done at commit time.
+static void sl_host_surface_attach_cursor(struct sl_host_surface* host) {
+  struct sl_context* ctx = host->ctx;
+  uint64_t hash = sl_cursor_hash(host->contents_shm_mmap, host->contents_width,
+                                 host->contents_height);
+  struct sl_output_buffer* buffer;
+
+  wl_list_for_each(buffer, &ctx->cursor_cache, link) {
+    if (buffer->cache_hash == hash && buffer->width == host->contents_width &&
+        buffer->height == host->contents_height &&
+        buffer->format == host->contents_shm_format) {
+      wl_list_remove(&buffer->link);
+      wl_list_insert(&ctx->cursor_cache, &buffer->link);
+      host->current_buffer = buffer;
+      host->contents_cached = 1;
+      ctx->stats.cursor_cache_hits++;
+      return;
+    }
+  }
+
+  buffer = sl_output_buffer_create(host, host->contents_width,
+                                   host->contents_height);
+  wl_list_remove(&buffer->link);
+  wl_list_init(&buffer->link);
+  buffer->surface = NULL;
+  buffer->cached = 1;
+  host->current_buffer = buffer;
+  ctx->stats.cursor_cache_misses++;
+}
+
+// Cursor buffers only enter the cache once their contents are committed.
+static void sl_host_surface_drop_uncommitted_cursor(
+    struct sl_host_surface* host) {
+  struct sl_output_buffer* buffer = host->current_buffer;
+
+  if (buffer && buffer->cached && wl_list_empty(&buffer->link))
+    sl_output_buffer_destroy(buffer);
+  host->current_buffer = NULL;
+}
+
+static void sl_host_surface_do_commit(struct sl_host_surface* host);
+static void sl_host_surface_commit_contents(struct sl_host_surface* host);
+
+static void sl_host_surface_set_fence(struct sl_host_surface* host,
+                                      int fence_fd) {
+  if (host->contents_fence_fd >= 0)
+    close(host->contents_fence_fd);
+  host->contents_fence_fd = fence_fd;
+}
+
+static void sl_host_surface_apply_held_requests(struct sl_host_surface* host);
+
+static int sl_handle_host_surface_fence(int fd, uint32_t mask, void* data) {
+  struct sl_host_surface* host = data;
+
+  if (host->contents_fence_event_source) {
+    wl_event_source_remove(host->contents_fence_event_source);
+    host->contents_fence_event_source = NULL;
+  }
+  close(host->contents_fence_fd);
+  host->contents_fence_fd = -1;
+
+  sl_host_surface_do_commit(host);
+  sl_host_surface_apply_held_requests(host);
+
+  return 1;
+}
+
+// Complete a held commit by waiting for its fence.
+static void sl_host_surface_finish_commit(struct sl_host_surface* host) {
+  struct pollfd pfd = {
+      .fd = host->contents_fence_fd, .events = POLLIN, .revents = 0};
+  int rv;
+
+  do {
+    rv = poll(&pfd, 1, -1);
+  } while (rv == -1 && errno == EINTR);
+
+  sl_handle_host_surface_fence(host->contents_fence_fd, WL_EVENT_READABLE,
+                               host);
+}
+
+static void sl_held_request_destroy(struct sl_held_request* request) {
+  wl_list_remove(&request->link);
+  wl_list_remove(&request->resource_listener.link);
+  wl_list_remove(&request->object_listener.link);
+  if (request->buffer)
+    sl_host_buffer_unref(request->buffer);
+  if (request->region)
+    wl_region_destroy(request->region);
+  free(request);
+}
+
+static void sl_held_request_resource_destroyed(struct wl_listener* listener,
+                                               void* data) {
+  struct sl_held_request* request =
+      wl_container_of(listener, request, resource_listener);
+
+  sl_held_request_destroy(request);
+}
+
+static void sl_held_request_object_destroyed(struct wl_listener* listener,
+                                             void* data) {
+  struct sl_held_request* request =
+      wl_container_of(listener, request, object_listener);
+
+  wl_list_remove(&request->object_listener.link);
+  wl_list_init(&request->object_listener.link);
+  request->object = NULL;
+}
+
+// Requests for the next frame must not reach the host before a held commit
+// of the previous one. Returns a request to fill in and queue behind the held
+// commit, or NULL if |resource| can be handled right away.
+struct sl_held_request* sl_host_surface_hold_request(
+    struct sl_host_surface* host,
+    struct wl_resource* resource,
+    uint32_t opcode,
+    void (*apply)(struct sl_held_request* request)) {
+  struct sl_held_request* request;
+
+  if (!host)
+    return NULL;
+  if (!host->contents_fence_event_source &&
+      (host->applying_held_requests || wl_list_empty(&host->held_requests)))
+    return NULL;
+
+  request = malloc(sizeof(*request));
+  assert(request);
+
+  request->resource = resource;
+  request->resource_listener.notify = sl_held_request_resource_destroyed;
+  wl_resource_add_destroy_listener(resource, &request->resource_listener);
+  request->opcode = opcode;
+  memset(request->args, 0, sizeof(request->args));
+  request->object = NULL;
+  wl_list_init(&request->object_listener.link);
+  request->buffer = NULL;
+  request->region = NULL;
+  request->apply = apply;
+  wl_list_insert(host->held_requests.prev, &request->link);
+
+  return request;
+}
+
+void sl_held_request_set_object(struct sl_held_request* request,
+                                struct wl_resource* object) {
+  request->object = object;
+  if (object) {
+    request->object_listener.notify = sl_held_request_object_destroyed;
+    wl_resource_add_destroy_listener(object, &request->object_listener);
+  }
+}
+
+// Applies held requests until one of them holds a commit again.
+static void sl_host_surface_apply_held_requests(struct sl_host_surface* host) {
+  if (host->applying_held_requests)
+    return;
+
+  host->applying_held_requests = 1;
+  while (!host->contents_fence_event_source &&
+         !wl_list_empty(&host->held_requests)) {
+    struct sl_held_request* request =
+        wl_container_of(host->held_requests.next, request, link);
+
+    wl_list_remove(&request->link);
+    wl_list_init(&request->link);
+    request->apply(request);
+    sl_held_request_destroy(request);
+  }
+  host->applying_held_requests = 0;
+}
+
 static void sl_host_surface_destroy(struct wl_client* client,
                                     struct wl_resource* resource) {
   wl_resource_destroy(resource);
 }
 
-static void sl_host_surface_attach(struct wl_client* client,
-                                   struct wl_resource* resource,
-                                   struct wl_resource* buffer_resource,
-                                   int32_t x,
-                                   int32_t y) {
-  struct sl_host_surface* host = wl_resource_get_user_data(resource);
-  struct sl_host_buffer* host_buffer =
-      buffer_resource ? wl_resource_get_user_data(buffer_resource) : NULL;
+static void sl_host_surface_attach_buffer(struct sl_host_surface* host,
+                                          struct sl_host_buffer* host_buffer,
+                                          int32_t x,
+                                          int32_t y) {
   struct wl_buffer* buffer_proxy = NULL;
   struct sl_window* window;
   double scale = host->ctx->scale;
 
-  host->current_buffer = NULL;
+  // A deferred frame that is replaced before it reached the host is never
+  // shown, so its buffer can be released without copying it.
+  if (host->contents_commit_deferred) {
+    if (host->contents_shm_mmap && host->contents_shm_mmap->buffer_resource &&
+        (!host_buffer || host_buffer->shm_mmap != host->contents_shm_mmap))
+      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
+    host->contents_commit_deferred = 0;
+    host->ctx->stats.coalesced_commits++;
+  }
+
+  sl_host_surface_drop_uncommitted_cursor(host);
   if (host->contents_shm_mmap) {
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
@@ -174,185 +970,142 @@ static void sl_host_surface_attach(struct wl_client* client,
   if (host_buffer) {
     host->contents_width = host_buffer->width;
     host->contents_height = host_buffer->height;
+    host->contents_shm_format = host_buffer->shm_format;
     buffer_proxy = host_buffer->proxy;
-    if (host_buffer->shm_mmap)
+    // Buffers that have been shared with the host don't need to be copied.
+    if (host_buffer->shm_mmap && !host_buffer->proxy)
       host->contents_shm_mmap = sl_mmap_ref(host_buffer->shm_mmap);
   }
 
-  if (host->contents_shm_mmap) {
-    while (!wl_list_empty(&host->released_buffers)) {
-      host->current_buffer = wl_container_of(host->released_buffers.next,
-                                             host->current_buffer, link);
-
-      if (host->current_buffer->width == host_buffer->width &&
-          host->current_buffer->height == host_buffer->height &&
-          host->current_buffer->format == host_buffer->shm_format) {
-        break;
+  host->contents_downscale = host->contents_shm_mmap
+                                 ? sl_host_surface_downscale(host, host_buffer)
+                                 : 1.0;
+
+  // Cursor images get their buffer once they are committed.
+  host->contents_cached = 0;
+  if (host->contents_shm_mmap && !sl_host_surface_caches_contents(host)) {
+    struct sl_output_buffer *buffer, *next;
+
+    // Use a released buffer from this surface if possible as they have
+    // accurate damage. Recycle the rest.
+    wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+      if (sl_output_buffer_fits(buffer, host, host_buffer)) {
+        if (!host->current_buffer) {
+          host->current_buffer = buffer;
+          host->ctx->stats.buffer_surface_reuses++;
+        }
+      } else {
+        sl_output_buffer_recycle(buffer);
+      }
+    }
+
+    // Otherwise, try a buffer released by any surface.
+    if (!host->current_buffer) {
+      wl_list_for_each(buffer, &host->ctx->output_buffer_pool, link) {
+        if (sl_output_buffer_fits(buffer, host, host_buffer)) {
+          host->current_buffer = buffer;
+          break;
+        }
       }
 
-      sl_output_buffer_destroy(host->current_buffer);
-      host->current_buffer = NULL;
+      if (host->current_buffer) {
+        buffer = host->current_buffer;
+        wl_list_remove(&buffer->link);
+        sl_output_buffer_pool_take(host->ctx, buffer);
+        host->ctx->stats.buffer_pool_reuses++;
+        wl_list_insert(&host->released_buffers, &buffer->link);
+        buffer->surface = host;
+        // Contents are unknown.
+        buffer->frame = 0;
+        buffer->downscale = host->contents_downscale;
+      }
     }
 
     // Allocate new output buffer.
     if (!host->current_buffer) {
-      size_t width = host_buffer->width;
-      size_t height = host_buffer->height;
-      uint32_t shm_format = host_buffer->shm_format;
-      size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
-      size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
-
-      host->current_buffer = malloc(sizeof(struct sl_output_buffer));
-      assert(host->current_buffer);
-      wl_list_insert(&host->released_buffers, &host->current_buffer->link);
-      host->current_buffer->width = width;
-      host->current_buffer->height = height;
-      host->current_buffer->format = shm_format;
-      host->current_buffer->surface = host;
-      pixman_region32_init_rect(&host->current_buffer->damage, 0, 0, MAX_SIZE,
-                                MAX_SIZE);
-
-      switch (host->ctx->shm_driver) {
-        case SHM_DRIVER_DMABUF: {
-          struct zwp_linux_buffer_params_v1* buffer_params;
-          struct gbm_bo* bo;
-          int stride0;
-          int fd;
-
-          bo = gbm_bo_create(host->ctx->gbm, width, height,
-                             sl_gbm_format_for_shm_format(shm_format),
-                             GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
-          stride0 = gbm_bo_get_stride(bo);
-          fd = gbm_bo_get_fd(bo);
-
-          buffer_params = zwp_linux_dmabuf_v1_create_params(
-              host->ctx->linux_dmabuf->internal);
-          zwp_linux_buffer_params_v1_add(buffer_params, fd, 0, 0, stride0,
-                                         DRM_FORMAT_MOD_INVALID >> 32,
-                                         DRM_FORMAT_MOD_INVALID & 0xffffffff);
-          host->current_buffer->internal =
-              zwp_linux_buffer_params_v1_create_immed(
-                  buffer_params, width, height,
-                  sl_drm_format_for_shm_format(shm_format), 0);
-          zwp_linux_buffer_params_v1_destroy(buffer_params);
-
-          host->current_buffer->mmap = sl_mmap_create(
-              fd, height * stride0, bpp, 1, 0, stride0, 0, 0, 1, 0);
-          host->current_buffer->mmap->begin_write = sl_dmabuf_begin_write;
-          host->current_buffer->mmap->end_write = sl_dmabuf_end_write;
-
-          gbm_bo_destroy(bo);
-        } break;
-        case SHM_DRIVER_VIRTWL: {
-          size_t size = host_buffer->shm_mmap->size;
-          struct virtwl_ioctl_new ioctl_new = {.type = VIRTWL_IOCTL_NEW_ALLOC,
-                                               .fd = -1,
-                                               .flags = 0,
-                                               .size = size};
-          struct wl_shm_pool* pool;
-          int rv;
-
-          rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
-          assert(rv == 0);
-          UNUSED(rv);
-
-          pool =
-              wl_shm_create_pool(host->ctx->shm->internal, ioctl_new.fd, size);
-          host->current_buffer->internal = wl_shm_pool_create_buffer(
-              pool, 0, width, height, host_buffer->shm_mmap->stride[0],
-              shm_format);
-          wl_shm_pool_destroy(pool);
-
-          host->current_buffer->mmap = sl_mmap_create(
-              ioctl_new.fd, size, bpp, num_planes, 0,
-              host_buffer->shm_mmap->stride[0],
-              host_buffer->shm_mmap->offset[1] -
-                  host_buffer->shm_mmap->offset[0],
-              host_buffer->shm_mmap->stride[1], host_buffer->shm_mmap->y_ss[0],
-              host_buffer->shm_mmap->y_ss[1]);
-        } break;
-        case SHM_DRIVER_VIRTWL_DMABUF: {
-          uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
-          struct virtwl_ioctl_new ioctl_new = {
-              .type = VIRTWL_IOCTL_NEW_DMABUF,
-              .fd = -1,
-              .flags = 0,
-              .dmabuf = {
-                  .width = width, .height = height, .format = drm_format}};
-          struct zwp_linux_buffer_params_v1* buffer_params;
-          size_t size;
-          int rv;
-
-          rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
-          if (rv) {
-            fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
-                    strerror(errno));
-            _exit(EXIT_FAILURE);
-          }
+      uint32_t width, height;
 
-          size = ioctl_new.dmabuf.stride0 * height;
-          buffer_params = zwp_linux_dmabuf_v1_create_params(
-              host->ctx->linux_dmabuf->internal);
-          zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 0,
-                                         ioctl_new.dmabuf.offset0,
-                                         ioctl_new.dmabuf.stride0, 0, 0);
-          if (num_planes > 1) {
-            zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 1,
-                                           ioctl_new.dmabuf.offset1,
-                                           ioctl_new.dmabuf.stride1, 0, 0);
-            size = MAX(size, ioctl_new.dmabuf.offset1 +
-                                 ioctl_new.dmabuf.stride1 * height /
-                                     host_buffer->shm_mmap->y_ss[1]);
-          }
-          host->current_buffer->internal =
-              zwp_linux_buffer_params_v1_create_immed(buffer_params, width,
-                                                      height, drm_format, 0);
-          zwp_linux_buffer_params_v1_destroy(buffer_params);
-
-          host->current_buffer->mmap = sl_mmap_create(
-              ioctl_new.fd, size, bpp, num_planes, ioctl_new.dmabuf.offset0,
-              ioctl_new.dmabuf.stride0, ioctl_new.dmabuf.offset1,
-              ioctl_new.dmabuf.stride1, host_buffer->shm_mmap->y_ss[0],
-              host_buffer->shm_mmap->y_ss[1]);
-          host->current_buffer->mmap->begin_write =
-              sl_virtwl_dmabuf_begin_write;
-          host->current_buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
-        } break;
-      }
+      sl_host_surface_output_size(host, host_buffer->width, host_buffer->height,
+                                  &width, &height);
 
-      assert(host->current_buffer->internal);
-      assert(host->current_buffer->mmap);
+      // Round up the size of buffers that can be cropped so that they can be
+      // reused while resizing.
+      if (host->viewport &&
+          sl_shm_num_planes_for_shm_format(host_buffer->shm_format) == 1) {
+        width = ALIGN(width, OUTPUT_BUFFER_SIZE_ALIGNMENT);
+        height = ALIGN(height, OUTPUT_BUFFER_SIZE_ALIGNMENT);
+      }
 
-      wl_buffer_set_user_data(host->current_buffer->internal,
-                              host->current_buffer);
-      wl_buffer_add_listener(host->current_buffer->internal,
-                             &sl_output_buffer_listener, host->current_buffer);
+      host->current_buffer = sl_output_buffer_create(host, width, height);
     }
   }
 
+  // Contents of buffers that are not copied never reach the output buffers
+  // so they all need a full update the next time they are used.
+  if (host_buffer && !host->contents_shm_mmap) {
+    pixman_region32_union_rect(&host->damage_history->pending,
+                               &host->damage_history->pending, 0, 0, MAX_SIZE,
+                               MAX_SIZE);
+    sl_damage_history_commit(host->damage_history);
+  }
+
   x /= scale;
   y /= scale;
 
-  // TODO(davidriley): This should be done in the commit.
+  // Have the commit wait for rendering to the buffer to complete. Fall back
+  // to waiting here if the buffer doesn't provide fences.
   if (host_buffer && host_buffer->sync_point) {
-    host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
+    int fence_fd =
+        sl_dmabuf_export_fence(host_buffer->sync_point->fd, DMA_BUF_SYNC_READ);
+
+    if (fence_fd >= 0)
+      sl_host_surface_set_fence(host, fence_fd);
+    else if (host_buffer->sync_point->sync)
+      host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
   }
 
-  if (host->current_buffer) {
-    assert(host->current_buffer->internal);
-    wl_surface_attach(host->proxy, host->current_buffer->internal, x, y);
+  // Output buffers are attached by the commit that completes their contents
+  // so that other commits of the host surface don't show them early.
+  if (host->contents_shm_mmap) {
+    host->contents_attach_pending = 1;
+    host->contents_x = x;
+    host->contents_y = y;
   } else {
+    host->contents_attach_pending = 0;
     wl_surface_attach(host->proxy, buffer_proxy, x, y);
   }
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == wl_resource_get_id(resource)) {
-      while (sl_process_pending_configure_acks(window, host))
-        continue;
+  window = sl_lookup_host_surface_window(
+      host->ctx, wl_resource_get_id(host->resource), 0);
+  if (window) {
+    while (sl_process_pending_configure_acks(window, host))
+      continue;
+  }
+}
 
-      break;
-    }
+static void sl_host_surface_apply_held_request(struct sl_held_request* request);
+
+static void sl_host_surface_attach(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   struct wl_resource* buffer_resource,
+                                   int32_t x,
+                                   int32_t y) {
+  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_host_buffer* host_buffer =
+      buffer_resource ? wl_resource_get_user_data(buffer_resource) : NULL;
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host, resource, WL_SURFACE_ATTACH, sl_host_surface_apply_held_request);
+
+  // The buffer is kept in case the client destroys it before the request
+  // applies.
+  if (request) {
+    request->buffer = host_buffer ? sl_host_buffer_ref(host_buffer) : NULL;
+    request->args[0] = x;
+    request->args[1] = y;
+    return;
   }
+
+  sl_host_surface_attach_buffer(host, host_buffer, x, y);
 }
 
 static void sl_host_surface_damage(struct wl_client* client,
@@ -362,19 +1115,25 @@ static void sl_host_surface_damage(struct wl_client* client,
                                    int32_t width,
                                    int32_t height) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host, resource, WL_SURFACE_DAMAGE, sl_host_surface_apply_held_request);
   double scale = host->ctx->scale;
-  struct sl_output_buffer* buffer;
   int64_t x1, y1, x2, y2;
 
-  wl_list_for_each(buffer, &host->busy_buffers, link) {
-    pixman_region32_union_rect(&buffer->damage, &buffer->damage, x, y, width,
-                               height);
-  }
-  wl_list_for_each(buffer, &host->released_buffers, link) {
-    pixman_region32_union_rect(&buffer->damage, &buffer->damage, x, y, width,
-                               height);
+  if (request) {
+    request->args[0] = x;
+    request->args[1] = y;
+    request->args[2] = width;
+    request->args[3] = height;
+    return;
   }
 
+  // Output buffers get their damage from the history at commit time.
+  pixman_region32_union_rect(&host->damage_history->pending,
+                             &host->damage_history->pending, x, y, width,
+                             height);
+  sl_damage_history_limit(&host->damage_history->pending);
+
   x1 = x;
   y1 = y;
   x2 = x1 + width;
@@ -395,6 +1154,8 @@ static void sl_frame_callback_done(void* data,
                                    uint32_t time) {
   struct sl_host_callback* host = wl_callback_get_user_data(callback);
 
+  sl_timing_add(host->ctx, &host->ctx->stats.frame_callbacks,
+                host->request_usec);
   wl_callback_send_done(host->resource, time);
   wl_resource_destroy(host->resource);
 }
@@ -405,28 +1166,106 @@ static const struct wl_callback_listener sl_frame_callback_listener = {
 static void sl_host_callback_destroy(struct wl_resource* resource) {
   struct sl_host_callback* host = wl_resource_get_user_data(resource);
 
-  wl_callback_destroy(host->proxy);
+  if (host->proxy)
+    wl_callback_destroy(host->proxy);
+  else
+    wl_list_remove(&host->link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
 
+static void sl_host_surface_send_hidden_frames(struct sl_host_surface* host) {
+  struct timespec now;
+  uint32_t time;
+
+  if (host->hidden_frame_timer) {
+    wl_event_source_remove(host->hidden_frame_timer);
+    host->hidden_frame_timer = NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  time = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  while (!wl_list_empty(&host->hidden_frame_callbacks)) {
+    struct sl_host_callback* host_callback = wl_container_of(
+        host->hidden_frame_callbacks.next, host_callback, link);
+
+    wl_callback_send_done(host_callback->resource, time);
+    wl_resource_destroy(host_callback->resource);
+  }
+}
+
+static int sl_handle_hidden_frame_timer(void* data) {
+  sl_host_surface_send_hidden_frames(data);
+  return 1;
+}
+
+static void sl_host_surface_request_frame(
+    struct sl_host_surface* host,
+    struct sl_host_callback* host_callback) {
+  // The host might not update hidden surfaces at all, or as often as
+  // visible ones.
+  if (host->contents_hidden) {
+    wl_list_insert(&host->hidden_frame_callbacks, &host_callback->link);
+    if (!host->hidden_frame_timer) {
+      host->hidden_frame_timer = wl_event_loop_add_timer(
+          wl_display_get_event_loop(host->ctx->host_display),
+          sl_handle_hidden_frame_timer, host);
+      wl_event_source_timer_update(host->hidden_frame_timer,
+                                   HIDDEN_FRAME_CALLBACK_INTERVAL_MS);
+    }
+    return;
+  }
+
+  host_callback->proxy = wl_surface_frame(host->proxy);
+  wl_callback_set_user_data(host_callback->proxy, host_callback);
+  wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
+                           host_callback);
+}
+
 static void sl_host_surface_frame(struct wl_client* client,
                                   struct wl_resource* resource,
                                   uint32_t callback) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_host_callback* host_callback;
+  struct sl_held_request* request;
 
   host_callback = malloc(sizeof(*host_callback));
   assert(host_callback);
 
+  host_callback->ctx = host->ctx;
+  host_callback->request_usec = sl_stats_timestamp(host->ctx);
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, callback);
   wl_resource_set_implementation(host_callback->resource, NULL, host_callback,
                                  sl_host_callback_destroy);
-  host_callback->proxy = wl_surface_frame(host->proxy);
-  wl_callback_set_user_data(host_callback->proxy, host_callback);
-  wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
-                           host_callback);
+  host_callback->proxy = NULL;
+  wl_list_init(&host_callback->link);
+
+  request = sl_host_surface_hold_request(host, resource, WL_SURFACE_FRAME,
+                                         sl_host_surface_apply_held_request);
+  if (request) {
+    sl_held_request_set_object(request, host_callback->resource);
+    return;
+  }
+
+  sl_host_surface_request_frame(host, host_callback);
+}
+
+// Held region requests use a copy of the region as it was when the request
+// was made.
+static struct wl_region* sl_host_region_copy(struct sl_host_region* host) {
+  struct wl_region* region =
+      wl_compositor_create_region(host->ctx->compositor->internal);
+  pixman_box32_t* rects;
+  int i, n;
+
+  rects = pixman_region32_rectangles(host->contents, &n);
+  for (i = 0; i < n; ++i) {
+    wl_region_add(region, rects[i].x1, rects[i].y1, rects[i].x2 - rects[i].x1,
+                  rects[i].y2 - rects[i].y1);
+  }
+
+  return region;
 }
 
 static void sl_host_surface_set_opaque_region(
@@ -436,6 +1275,14 @@ static void sl_host_surface_set_opaque_region(
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_host_region* host_region =
       region_resource ? wl_resource_get_user_data(region_resource) : NULL;
+  struct sl_held_request* request =
+      sl_host_surface_hold_request(host, resource, WL_SURFACE_SET_OPAQUE_REGION,
+                                   sl_host_surface_apply_held_request);
+
+  if (request) {
+    request->region = host_region ? sl_host_region_copy(host_region) : NULL;
+    return;
+  }
 
   wl_surface_set_opaque_region(host->proxy,
                                host_region ? host_region->proxy : NULL);
@@ -448,23 +1295,102 @@ static void sl_host_surface_set_input_region(
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_host_region* host_region =
       region_resource ? wl_resource_get_user_data(region_resource) : NULL;
+  struct sl_held_request* request =
+      sl_host_surface_hold_request(host, resource, WL_SURFACE_SET_INPUT_REGION,
+                                   sl_host_surface_apply_held_request);
+
+  if (request) {
+    request->region = host_region ? sl_host_region_copy(host_region) : NULL;
+    return;
+  }
 
   wl_surface_set_input_region(host->proxy,
                               host_region ? host_region->proxy : NULL);
 }
 
-static void sl_host_surface_commit(struct wl_client* client,
-                                   struct wl_resource* resource) {
-  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+// Returns the render target of the current buffer if its contents are
+// uploaded by the GPU. Surfaces whose buffers can't be imported fall back to
+// CPU copies for good.
+static struct sl_gpu_target* sl_host_surface_gpu_target(
+    struct sl_host_surface* host) {
+  struct sl_output_buffer* buffer = host->current_buffer;
+
+  if (!host->ctx->gpu_engine || host->contents_gpu_fallback ||
+      host->contents_shm_mmap->num_planes != 1)
+    return NULL;
+
+  if (!buffer->gpu_target) {
+    buffer->gpu_target = sl_gpu_target_create(
+        host->ctx->gpu_engine, buffer->mmap, buffer->width, buffer->height,
+        sl_drm_format_for_shm_format(buffer->format));
+    if (!buffer->gpu_target) {
+      fprintf(stderr,
+              "warning: failed to import output buffer, using CPU copies"
+              " for surface %u\n",
+              wl_resource_get_id(host->resource));
+      host->contents_gpu_fallback = 1;
+    }
+  }
+
+  return buffer->gpu_target;
+}
+
+// Replaces the current buffer with a linear one after it failed to map for a
+// CPU copy. The surface keeps using linear buffers from then on.
+static void sl_host_surface_replace_unmapped_buffer(
+    struct sl_host_surface* host) {
+  struct sl_output_buffer* buffer = host->current_buffer;
+
+  fprintf(stderr,
+          "warning: failed to map output buffer, using linear buffers"
+          " for surface %u\n",
+          wl_resource_get_id(host->resource));
+  host->contents_gpu_fallback = 1;
+  host->current_buffer =
+      sl_output_buffer_create(host, buffer->width, buffer->height);
+  sl_output_buffer_destroy(buffer);
+  if (host->current_buffer->mmap->begin_write)
+    host->current_buffer->mmap->begin_write(host->current_buffer->mmap);
+}
+
+static void sl_host_surface_frame_done(void* data,
+                                       struct wl_callback* callback,
+                                       uint32_t time) {
+  struct sl_host_surface* host = data;
+
+  wl_callback_destroy(callback);
+  host->contents_frame_callback = NULL;
+
+  if (host->contents_commit_deferred && !host->contents_hidden) {
+    host->contents_commit_deferred = 0;
+    sl_host_surface_commit_contents(host);
+  }
+}
+
+static const struct wl_callback_listener sl_host_surface_frame_listener = {
+    sl_host_surface_frame_done};
+
+static void sl_host_surface_do_commit(struct sl_host_surface* host) {
   struct sl_viewport* viewport = NULL;
   struct sl_window* window;
 
+  sl_trace_begin(host->ctx, "commit");
+  host->commits++;
+  host->ctx->stats.commits++;
+
+  // Keep surfaces ordered by recent use for reclaiming buffers.
+  wl_list_remove(&host->link);
+  wl_list_insert(&host->ctx->host_surfaces, &host->link);
+
   if (!wl_list_empty(&host->contents_viewport))
     viewport = wl_container_of(host->contents_viewport.next, viewport, link);
 
-  if (host->contents_shm_mmap) {
+  if (host->contents_shm_mmap && host->contents_cached) {
+    // The attached cursor buffer already holds the contents.
+    sl_damage_history_commit(host->damage_history);
+  } else if (host->contents_shm_mmap) {
     uint8_t* src_addr = host->contents_shm_mmap->addr;
-    uint8_t* dst_addr = host->current_buffer->mmap->addr;
+    uint8_t* dst_addr;
     size_t* src_offset = host->contents_shm_mmap->offset;
     size_t* dst_offset = host->current_buffer->mmap->offset;
     size_t* src_stride = host->contents_shm_mmap->stride;
@@ -476,7 +1402,13 @@ static void sl_host_surface_commit(struct wl_client* client,
     double contents_scale_y = host->contents_scale;
     double contents_offset_x = 0.0;
     double contents_offset_y = 0.0;
+    struct pixman_region32 damage;
     pixman_box32_t* rect;
+    pixman_image_t* src_image = NULL;
+    pixman_image_t* dst_image = NULL;
+    struct sl_gpu_target* gpu_target = sl_host_surface_gpu_target(host);
+    uint32_t output_width, output_height;
+    uint64_t copy_start = sl_stats_timestamp(host->ctx);
     int n;
 
     // Determine scale and offset for damage based on current viewport.
@@ -505,10 +1437,64 @@ static void sl_host_surface_commit(struct wl_client* client,
       }
     }
 
-    if (host->current_buffer->mmap->begin_write)
-      host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd);
+    // The GPU resamples downscaled contents in the same pass as it uploads
+    // them, and the output buffer is never mapped.
+    if (gpu_target &&
+        !sl_gpu_engine_begin(host->ctx->gpu_engine, gpu_target,
+                             src_addr + src_offset[0], src_stride[0],
+                             host->current_buffer->format,
+                             host->contents_width, host->contents_height,
+                             host->contents_downscale)) {
+      gpu_target = NULL;
+    }
+
+    if (!gpu_target && host->current_buffer->mmap->begin_write)
+      host->current_buffer->mmap->begin_write(host->current_buffer->mmap);
+    if (!gpu_target && !host->current_buffer->mmap->addr) {
+      sl_host_surface_replace_unmapped_buffer(host);
+      dst_offset = host->current_buffer->mmap->offset;
+      dst_stride = host->current_buffer->mmap->stride;
+    }
+    dst_addr = host->current_buffer->mmap->addr;
+
+    // Downscaled contents are resampled straight into the output buffer.
+    sl_host_surface_output_size(host, host->contents_width,
+                                host->contents_height, &output_width,
+                                &output_height);
+    if (!gpu_target && host->contents_downscale > 1.0) {
+      pixman_format_code_t format =
+          sl_pixman_format_for_shm_format(host->current_buffer->format);
+      pixman_fixed_t downscale =
+          pixman_double_to_fixed(host->contents_downscale);
+      pixman_transform_t transform;
+      pixman_fixed_t* params;
+      int n_params;
+
+      src_image = pixman_image_create_bits_no_clear(
+          format, host->contents_width, host->contents_height,
+          (uint32_t*)(src_addr + src_offset[0]), src_stride[0]);
+      dst_image = pixman_image_create_bits_no_clear(
+          format, host->current_buffer->width, host->current_buffer->height,
+          (uint32_t*)(dst_addr + dst_offset[0]), dst_stride[0]);
+      pixman_transform_init_scale(&transform, downscale, downscale);
+      pixman_image_set_transform(src_image, &transform);
+
+      // Box filter that averages all source pixels covered by an output
+      // pixel. Bilinear sampling skips pixels at factors above 2.
+      params = pixman_filter_create_separable_convolution(
+          &n_params, downscale, downscale, PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+          PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX, 4, 4);
+      pixman_image_set_filter(src_image, PIXMAN_FILTER_SEPARABLE_CONVOLUTION,
+                              params, n_params);
+      free(params);
+      pixman_image_set_repeat(src_image, PIXMAN_REPEAT_PAD);
+    }
 
-    rect = pixman_region32_rectangles(&host->current_buffer->damage, &n);
+    pixman_region32_init(&damage);
+    sl_damage_history_accumulate(host->damage_history,
+                                 host->current_buffer->frame, &damage);
+
+    rect = pixman_region32_rectangles(&damage, &n);
     while (n--) {
       int32_t x1, y1, x2, y2;
 
@@ -523,7 +1509,29 @@ static void sl_host_surface_commit(struct wl_client* client,
       x2 = MIN(host->contents_width, x2);
       y2 = MIN(host->contents_height, y2);
 
-      if (x1 < x2 && y1 < y2) {
+      if (x1 < x2 && y1 < y2 && gpu_target) {
+        size_t bytes =
+            sl_gpu_engine_add(host->ctx->gpu_engine, x1, y1, x2, y2);
+
+        host->copy_bytes += bytes;
+        host->ctx->stats.copy_bytes += bytes;
+      } else if (x1 < x2 && y1 < y2 && src_image) {
+        double downscale = host->contents_downscale;
+        int32_t dx1, dy1, dx2, dy2;
+
+        // Same mapping as surface damage, outset by one pixel to account
+        // for filtering.
+        dx1 = MAX(0, floor(x1 / downscale) - 1);
+        dy1 = MAX(0, floor(y1 / downscale) - 1);
+        dx2 = MIN((int32_t)output_width, ceil(x2 / downscale) + 1);
+        dy2 = MIN((int32_t)output_height, ceil(y2 / downscale) + 1);
+
+        pixman_image_composite32(PIXMAN_OP_SRC, src_image, NULL, dst_image,
+                                 dx1, dy1, 0, 0, dx1, dy1, dx2 - dx1,
+                                 dy2 - dy1);
+        host->copy_bytes += (size_t)(dx2 - dx1) * (dy2 - dy1) * bpp;
+        host->ctx->stats.copy_bytes += (size_t)(dx2 - dx1) * (dy2 - dy1) * bpp;
+      } else if (x1 < x2 && y1 < y2) {
         size_t i;
 
         for (i = 0; i < num_planes; ++i) {
@@ -535,24 +1543,47 @@ static void sl_host_surface_commit(struct wl_client* client,
           int32_t height = (y2 - y1) / y_ss[i];
           size_t bytes = width * bpp;
 
-          while (height--) {
-            memcpy(dst, src, bytes);
-            dst += dst_stride[i];
-            src += src_stride[i];
+          if (height > 0) {
+            host->copy_bytes += bytes * height;
+            host->ctx->stats.copy_bytes += bytes * height;
           }
+          sl_copy_engine_add(host->ctx->copy_engine, dst, dst_stride[i], src,
+                             src_stride[i], bytes, height);
         }
       }
 
       ++rect;
     }
 
-    if (host->current_buffer->mmap->end_write)
-      host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd);
+    // All copies must have landed before the buffer is committed.
+    if (gpu_target)
+      sl_gpu_engine_end(host->ctx->gpu_engine);
+    else
+      sl_copy_engine_flush(host->ctx->copy_engine);
+    if (src_image) {
+      pixman_image_unref(src_image);
+      pixman_image_unref(dst_image);
+    }
+    host->copy_usec +=
+        sl_timing_add(host->ctx, &host->ctx->stats.copies, copy_start);
+
+    if (!gpu_target && host->current_buffer->mmap->end_write)
+      host->current_buffer->mmap->end_write(host->current_buffer->mmap);
 
-    pixman_region32_clear(&host->current_buffer->damage);
+    pixman_region32_fini(&damage);
+    host->current_buffer->frame =
+        sl_damage_history_commit(host->damage_history);
 
     wl_list_remove(&host->current_buffer->link);
-    wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
+    if (host->current_buffer->cached) {
+      host->current_buffer->cache_hash = sl_cursor_hash(
+          host->contents_shm_mmap, host->contents_width, host->contents_height);
+      wl_list_insert(&host->ctx->cursor_cache, &host->current_buffer->link);
+      host->ctx->cursor_cache_length++;
+      sl_cursor_cache_trim(host->ctx, CURSOR_CACHE_LENGTH);
+    } else {
+      wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
+    }
   }
 
   if (host->contents_width && host->contents_height) {
@@ -561,15 +1592,28 @@ static void sl_host_surface_commit(struct wl_client* client,
     if (host->viewport) {
       int width = host->contents_width;
       int height = host->contents_height;
+      int has_source = 0;
 
       // We need to take the client's viewport into account while still
       // making sure our scale is accounted for.
       if (viewport) {
         if (viewport->src_x >= 0 && viewport->src_y >= 0 &&
             viewport->src_width >= 0 && viewport->src_height >= 0) {
-          wp_viewport_set_source(host->viewport, viewport->src_x,
-                                 viewport->src_y, viewport->src_width,
-                                 viewport->src_height);
+          double downscale = host->contents_downscale;
+
+          // Source rectangle is in buffer coordinates, which are downscaled
+          // if the viewport was set after the buffer was attached.
+          wp_viewport_set_source(
+              host->viewport,
+              wl_fixed_from_double(wl_fixed_to_double(viewport->src_x) /
+                                   downscale),
+              wl_fixed_from_double(wl_fixed_to_double(viewport->src_y) /
+                                   downscale),
+              wl_fixed_from_double(wl_fixed_to_double(viewport->src_width) /
+                                   downscale),
+              wl_fixed_from_double(wl_fixed_to_double(viewport->src_height) /
+                                   downscale));
+          has_source = 1;
 
           // If the source rectangle is set and the destination size is not
           // set, then src_width and src_height should be integers, and the
@@ -585,6 +1629,32 @@ static void sl_host_surface_commit(struct wl_client* client,
         }
       }
 
+      // Crop output buffers that are larger than the contents.
+      if (has_source) {
+        host->contents_cropped = 0;
+      } else {
+        uint32_t output_width, output_height;
+        int cropped;
+
+        sl_host_surface_output_size(host, host->contents_width,
+                                    host->contents_height, &output_width,
+                                    &output_height);
+        cropped = host->current_buffer &&
+                  (host->current_buffer->width != output_width ||
+                   host->current_buffer->height != output_height);
+
+        if (cropped) {
+          wp_viewport_set_source(host->viewport, 0, 0,
+                                 wl_fixed_from_int(output_width),
+                                 wl_fixed_from_int(output_height));
+        } else if (host->contents_cropped) {
+          wp_viewport_set_source(host->viewport, wl_fixed_from_int(-1),
+                                 wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+                                 wl_fixed_from_int(-1));
+        }
+        host->contents_cropped = cropped;
+      }
+
       wp_viewport_set_destination(host->viewport, ceil(width / scale),
                                   ceil(height / scale));
     } else {
@@ -592,6 +1662,12 @@ static void sl_host_surface_commit(struct wl_client* client,
     }
   }
 
+  if (host->contents_attach_pending) {
+    wl_surface_attach(host->proxy, host->current_buffer->internal,
+                      host->contents_x, host->contents_y);
+    host->contents_attach_pending = 0;
+  }
+
   // No need to defer client commits if surface has a role. E.g. is a cursor
   // or shell surface.
   if (host->has_role) {
@@ -615,15 +1691,19 @@ static void sl_host_surface_commit(struct wl_client* client,
   } else {
     // Commit if surface is associated with a window. Otherwise, defer
     // commit until window is created.
-    wl_list_for_each(window, &host->ctx->windows, link) {
-      if (window->host_surface_id == wl_resource_get_id(resource)) {
-        if (window->xdg_surface) {
-          wl_surface_commit(host->proxy);
-          if (host->contents_width && host->contents_height)
-            window->realized = 1;
-        }
-        break;
+    window = sl_lookup_host_surface_window(
+        host->ctx, wl_resource_get_id(host->resource), 0);
+    if (window && window->xdg_surface) {
+      // Later commits are held back until the host has shown this one.
+      if (host->ctx->coalesce_commits && host->contents_shm_mmap &&
+          !host->contents_frame_callback) {
+        host->contents_frame_callback = wl_surface_frame(host->proxy);
+        wl_callback_add_listener(host->contents_frame_callback,
+                                 &sl_host_surface_frame_listener, host);
       }
+      wl_surface_commit(host->proxy);
+      if (host->contents_width && host->contents_height)
+        window->realized = 1;
     }
   }
 
@@ -633,12 +1713,117 @@ static void sl_host_surface_commit(struct wl_client* client,
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
   }
+  sl_trace_end(host->ctx);
+}
+
+static void sl_host_surface_commit_contents(struct sl_host_surface* host) {
+  if (host->contents_shm_mmap && !host->current_buffer)
+    sl_host_surface_attach_cursor(host);
+
+  // Copying into a dmabuf output buffer must wait for the host to finish
+  // reading from it.
+  if (host->contents_shm_mmap && !host->contents_cached &&
+      host->ctx->shm_driver == SHM_DRIVER_DMABUF) {
+    int fence_fd = sl_dmabuf_export_fence(host->current_buffer->mmap->fd,
+                                          DMA_BUF_SYNC_WRITE);
+
+    if (fence_fd >= 0)
+      sl_host_surface_set_fence(host, fence_fd);
+  }
+
+  // Hold the commit until the fence has signaled so that other surfaces are
+  // not blocked. Requests for the next frame are held until then. Without an
+  // event source the fence is waited for right away.
+  if (host->contents_fence_fd >= 0) {
+    if (!sl_fence_is_signaled(host->contents_fence_fd)) {
+      host->contents_fence_event_source = wl_event_loop_add_fd(
+          wl_display_get_event_loop(host->ctx->host_display),
+          host->contents_fence_fd, WL_EVENT_READABLE,
+          sl_handle_host_surface_fence, host);
+      if (!host->contents_fence_event_source)
+        sl_host_surface_finish_commit(host);
+      return;
+    }
+    close(host->contents_fence_fd);
+    host->contents_fence_fd = -1;
+  }
+
+  sl_host_surface_do_commit(host);
+}
+
+static void sl_host_surface_commit(struct wl_client* client,
+                                   struct wl_resource* resource) {
+  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+
+  if (sl_host_surface_hold_request(host, resource, WL_SURFACE_COMMIT,
+                                   sl_host_surface_apply_held_request))
+    return;
+
+  // Commits of contents that arrive while the host has yet to show the
+  // previous frame, or while the surface is hidden, only accumulate damage.
+  // The latest of them is copied and committed once the host frame callback
+  // is done or the surface becomes visible.
+  if ((host->contents_frame_callback || host->contents_hidden) &&
+      host->contents_shm_mmap) {
+    host->contents_commit_deferred = 1;
+    return;
+  }
+
+  host->contents_commit_deferred = 0;
+  sl_host_surface_commit_contents(host);
+}
+
+// Commits state that sommelier changed on behalf of the client, like roles
+// and configure acks. Contents that are held or deferred are committed along
+// with it, so the host never shows an older buffer in their place. A held
+// commit includes the state once its fence has signaled.
+void sl_host_surface_commit_state(struct sl_host_surface* host) {
+  if (host->contents_fence_event_source)
+    return;
+
+  if (host->contents_commit_deferred) {
+    host->contents_commit_deferred = 0;
+    sl_host_surface_commit_contents(host);
+    return;
+  }
+
+  wl_surface_commit(host->proxy);
+}
+
+// Surfaces of X11 windows are hidden while the host reports them as fully
+// occluded, or after they have left all outputs.
+void sl_host_surface_update_visibility(struct sl_host_surface* host) {
+  int hidden = host->ctx->throttle_hidden && !host->has_role &&
+               (host->contents_occluded ||
+                (host->has_output && !host->output_count));
+
+  if (hidden == host->contents_hidden)
+    return;
+
+  host->contents_hidden = hidden;
+  if (hidden)
+    return;
+
+  // Catch up with all damage accumulated while hidden in a single copy.
+  sl_host_surface_send_hidden_frames(host);
+  if (host->contents_commit_deferred && !host->contents_frame_callback) {
+    host->contents_commit_deferred = 0;
+    sl_host_surface_commit_contents(host);
+  }
 }
 
 static void sl_host_surface_set_buffer_transform(struct wl_client* client,
                                                  struct wl_resource* resource,
                                                  int32_t transform) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host, resource, WL_SURFACE_SET_BUFFER_TRANSFORM,
+      sl_host_surface_apply_held_request);
+
+  if (request) {
+    request->args[0] = transform;
+    return;
+  }
 
   wl_surface_set_buffer_transform(host->proxy, transform);
 }
@@ -647,6 +1832,14 @@ static void sl_host_surface_set_buffer_scale(struct wl_client* client,
                                              struct wl_resource* resource,
                                              int32_t scale) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host, resource, WL_SURFACE_SET_BUFFER_SCALE,
+      sl_host_surface_apply_held_request);
+
+  if (request) {
+    request->args[0] = scale;
+    return;
+  }
 
   host->contents_scale = scale;
 }
@@ -660,6 +1853,44 @@ static void sl_host_surface_damage_buffer(struct wl_client* client,
   assert(0);
 }
 
+static void sl_host_surface_apply_held_request(
+    struct sl_held_request* request) {
+  struct wl_resource* resource = request->resource;
+  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  int32_t* args = request->args;
+
+  switch (request->opcode) {
+    case WL_SURFACE_ATTACH:
+      sl_host_surface_attach_buffer(host, request->buffer, args[0], args[1]);
+      break;
+    case WL_SURFACE_DAMAGE:
+      sl_host_surface_damage(NULL, resource, args[0], args[1], args[2],
+                             args[3]);
+      break;
+    case WL_SURFACE_FRAME:
+      if (request->object) {
+        sl_host_surface_request_frame(
+            host, wl_resource_get_user_data(request->object));
+      }
+      break;
+    case WL_SURFACE_SET_OPAQUE_REGION:
+      wl_surface_set_opaque_region(host->proxy, request->region);
+      break;
+    case WL_SURFACE_SET_INPUT_REGION:
+      wl_surface_set_input_region(host->proxy, request->region);
+      break;
+    case WL_SURFACE_COMMIT:
+      sl_host_surface_commit(NULL, resource);
+      break;
+    case WL_SURFACE_SET_BUFFER_TRANSFORM:
+      sl_host_surface_set_buffer_transform(NULL, resource, args[0]);
+      break;
+    case WL_SURFACE_SET_BUFFER_SCALE:
+      sl_host_surface_set_buffer_scale(NULL, resource, args[0]);
+      break;
+  }
+}
+
 static const struct wl_surface_interface sl_surface_implementation = {
     sl_host_surface_destroy,
     sl_host_surface_attach,
@@ -674,34 +1905,59 @@ static const struct wl_surface_interface sl_surface_implementation = {
 
 static void sl_destroy_host_surface(struct wl_resource* resource) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
-  struct sl_window *window, *surface_window = NULL;
+  struct sl_window* surface_window;
   struct sl_output_buffer* buffer;
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == wl_resource_get_id(resource)) {
-      surface_window = window;
-      break;
-    }
-  }
-
+  surface_window = sl_lookup_host_surface_window(
+      host->ctx, wl_resource_get_id(resource), 0);
   if (surface_window) {
-    surface_window->host_surface_id = 0;
+    sl_window_set_host_surface_id(surface_window, 0);
     sl_window_update(surface_window);
   }
 
-  if (host->contents_shm_mmap)
+  wl_list_remove(&host->link);
+
+  while (!wl_list_empty(&host->held_requests)) {
+    struct sl_held_request* request =
+        wl_container_of(host->held_requests.next, request, link);
+
+    sl_held_request_destroy(request);
+  }
+  if (host->contents_fence_event_source)
+    wl_event_source_remove(host->contents_fence_event_source);
+  if (host->contents_fence_fd >= 0)
+    close(host->contents_fence_fd);
+  if (host->contents_frame_callback)
+    wl_callback_destroy(host->contents_frame_callback);
+  sl_host_surface_send_hidden_frames(host);
+  sl_host_surface_drop_uncommitted_cursor(host);
+  if (host->contents_shm_mmap) {
+    if (host->contents_commit_deferred &&
+        host->contents_shm_mmap->buffer_resource)
+      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
     sl_mmap_unref(host->contents_shm_mmap);
+  }
 
   while (!wl_list_empty(&host->released_buffers)) {
     buffer = wl_container_of(host->released_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    sl_output_buffer_recycle(buffer);
   }
+  // Busy buffers are recycled when released by the host.
   while (!wl_list_empty(&host->busy_buffers)) {
     buffer = wl_container_of(host->busy_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    wl_list_remove(&buffer->link);
+    wl_list_init(&buffer->link);
+    buffer->surface = NULL;
+  }
+  while (!wl_list_empty(&host->contents_viewport)) {
+    struct sl_viewport* viewport =
+        wl_container_of(host->contents_viewport.next, viewport, link);
+
+    viewport->host_surface = NULL;
+    wl_list_remove(&viewport->link);
+    wl_list_init(&viewport->link);
   }
-  while (!wl_list_empty(&host->contents_viewport))
-    wl_list_remove(host->contents_viewport.next);
+  sl_damage_history_destroy(host->damage_history);
 
   if (host->viewport)
     wp_viewport_destroy(host->viewport);
@@ -718,6 +1974,8 @@ static void sl_surface_enter(void* data,
 
   wl_surface_send_enter(host->resource, host_output->resource);
   host->has_output = 1;
+  host->output_count++;
+  sl_host_surface_update_visibility(host);
 }
 
 static void sl_surface_leave(void* data,
@@ -727,6 +1985,8 @@ static void sl_surface_leave(void* data,
   struct sl_host_output* host_output = wl_output_get_user_data(output);
 
   wl_surface_send_leave(host->resource, host_output->resource);
+  host->output_count = MAX(host->output_count - 1, 0);
+  sl_host_surface_update_visibility(host);
 }
 
 static const struct wl_surface_listener sl_surface_listener = {
@@ -752,6 +2012,8 @@ static void sl_region_add(struct wl_client* client,
   x2 = (x + width) / scale;
   y2 = (y + height) / scale;
 
+  pixman_region32_union_rect(host->contents, host->contents, x1, y1, x2 - x1,
+                             y2 - y1);
   wl_region_add(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -765,11 +2027,16 @@ static void sl_region_subtract(struct wl_client* client,
   double scale = host->ctx->scale;
   int32_t x1, y1, x2, y2;
 
+  struct pixman_region32 rect;
+
   x1 = x / scale;
   y1 = y / scale;
   x2 = (x + width) / scale;
   y2 = (y + height) / scale;
 
+  pixman_region32_init_rect(&rect, x1, y1, x2 - x1, y2 - y1);
+  pixman_region32_subtract(host->contents, host->contents, &rect);
+  pixman_region32_fini(&rect);
   wl_region_subtract(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -779,6 +2046,8 @@ static const struct wl_region_interface sl_region_implementation = {
 static void sl_destroy_host_region(struct wl_resource* resource) {
   struct sl_host_region* host = wl_resource_get_user_data(resource);
 
+  pixman_region32_fini(host->contents);
+  free(host->contents);
   wl_region_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
   free(host);
@@ -789,7 +2058,7 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
                                               uint32_t id) {
   struct sl_host_compositor* host = wl_resource_get_user_data(resource);
   struct sl_host_surface* host_surface;
-  struct sl_window *window, *unpaired_window = NULL;
+  struct sl_window* unpaired_window;
 
   host_surface = malloc(sizeof(*host_surface));
   assert(host_surface);
@@ -797,13 +2066,39 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   host_surface->ctx = host->compositor->ctx;
   host_surface->contents_width = 0;
   host_surface->contents_height = 0;
+  host_surface->contents_shm_format = 0;
   host_surface->contents_scale = 1;
   wl_list_init(&host_surface->contents_viewport);
   host_surface->contents_shm_mmap = NULL;
+  host_surface->contents_downscale = 1.0;
+  host_surface->contents_gpu_fallback = 0;
+  host_surface->contents_cropped = 0;
+  host_surface->contents_fence_fd = -1;
+  host_surface->contents_fence_event_source = NULL;
+  host_surface->contents_frame_callback = NULL;
+  host_surface->contents_commit_deferred = 0;
+  host_surface->contents_attach_pending = 0;
+  host_surface->contents_x = 0;
+  host_surface->contents_y = 0;
+  host_surface->is_cursor = 0;
+  host_surface->contents_cached = 0;
+  host_surface->contents_occluded = 0;
+  host_surface->contents_hidden = 0;
+  wl_list_init(&host_surface->hidden_frame_callbacks);
+  host_surface->hidden_frame_timer = NULL;
   host_surface->has_role = 0;
   host_surface->has_output = 0;
+  host_surface->output_count = 0;
   host_surface->last_event_serial = 0;
   host_surface->current_buffer = NULL;
+  host_surface->damage_history = sl_damage_history_create();
+  wl_list_init(&host_surface->held_requests);
+  host_surface->applying_held_requests = 0;
+  host_surface->create_usec = sl_stats_timestamp(host_surface->ctx);
+  host_surface->commits = 0;
+  host_surface->copy_bytes = 0;
+  host_surface->copy_usec = 0;
+  wl_list_insert(&host_surface->ctx->host_surfaces, &host_surface->link);
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
   host_surface->resource = wl_resource_create(
@@ -821,15 +2116,10 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
         host_surface->ctx->viewporter->internal, host_surface->proxy);
   }
 
-  wl_list_for_each(window, &host->compositor->ctx->unpaired_windows, link) {
-    if (window->host_surface_id == id) {
-      unpaired_window = window;
-      break;
-    }
-  }
-
+  unpaired_window =
+      sl_lookup_host_surface_window(host->compositor->ctx, id, 1);
   if (unpaired_window)
-    sl_window_update(window);
+    sl_window_update(unpaired_window);
 }
 
 static void sl_compositor_create_host_region(struct wl_client* client,
@@ -849,6 +2139,9 @@ static void sl_compositor_create_host_region(struct wl_client* client,
                                  sl_destroy_host_region);
   host_region->proxy = wl_compositor_create_region(host->proxy);
   wl_region_set_user_data(host_region->proxy, host_region);
+  host_region->contents = malloc(sizeof(*host_region->contents));
+  assert(host_region->contents);
+  pixman_region32_init(host_region->contents);
 }
 
 static const struct wl_compositor_interface sl_compositor_implementation = {
@@ -0,0 +1,313 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Copies smaller than this are done on the calling thread without being
+// split into bands.
+#define SL_COPY_BAND_MIN_BYTES (256 * 1024)
+
+// Rows shorter than this are not worth streaming around the cache.
+#define SL_COPY_STREAM_MIN_BYTES 256
+
+#define SL_COPY_MAX_THREADS 16
+
+typedef void (*sl_copy_func_t)(uint8_t* dst,
+                               size_t dst_stride,
+                               const uint8_t* src,
+                               size_t src_stride,
+                               size_t bytes,
+                               int32_t height);
+
+struct sl_copy_kernel {
+  const char* name;
+  sl_copy_func_t copy;
+};
+
+struct sl_copy_job {
+  uint8_t* dst;
+  const uint8_t* src;
+  size_t dst_stride;
+  size_t src_stride;
+  size_t bytes;
+  int32_t height;
+};
+
+struct sl_copy_engine {
+  const struct sl_copy_kernel* kernel;
+  struct wl_array jobs;
+  size_t num_jobs;
+  size_t next_job;
+  size_t pending_jobs;
+  int num_threads;
+  int quit;
+  pthread_t threads[SL_COPY_MAX_THREADS];
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+};
+
+static void sl_copy_memcpy(uint8_t* dst,
+                           size_t dst_stride,
+                           const uint8_t* src,
+                           size_t src_stride,
+                           size_t bytes,
+                           int32_t height) {
+  while (height--) {
+    memcpy(dst, src, bytes);
+    dst += dst_stride;
+    src += src_stride;
+  }
+}
+
+#ifdef __SSE2__
+// Destination buffers are typically write-combined virtwl or dmabuf
+// mappings that are never read back by us. Non-temporal stores avoid
+// polluting the cache with them and combine into full bus writes.
+static void sl_copy_sse2_stream(uint8_t* dst,
+                                size_t dst_stride,
+                                const uint8_t* src,
+                                size_t src_stride,
+                                size_t bytes,
+                                int32_t height) {
+  if (bytes < SL_COPY_STREAM_MIN_BYTES) {
+    sl_copy_memcpy(dst, dst_stride, src, src_stride, bytes, height);
+    return;
+  }
+
+  while (height--) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t n = bytes;
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+    // Align destination for streaming stores.
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    while (n >= 64) {
+      __m128i x0 = _mm_loadu_si128((const __m128i*)(s + 0));
+      __m128i x1 = _mm_loadu_si128((const __m128i*)(s + 16));
+      __m128i x2 = _mm_loadu_si128((const __m128i*)(s + 32));
+      __m128i x3 = _mm_loadu_si128((const __m128i*)(s + 48));
+
+      _mm_stream_si128((__m128i*)(d + 0), x0);
+      _mm_stream_si128((__m128i*)(d + 16), x1);
+      _mm_stream_si128((__m128i*)(d + 32), x2);
+      _mm_stream_si128((__m128i*)(d + 48), x3);
+      d += 64;
+      s += 64;
+      n -= 64;
+    }
+    while (n >= 16) {
+      _mm_stream_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+      d += 16;
+      s += 16;
+      n -= 16;
+    }
+    memcpy(d, s, n);
+
+    dst += dst_stride;
+    src += src_stride;
+  }
+
+  // Make streamed stores globally visible before the copy is reported as
+  // complete.
+  _mm_sfence();
+}
+#endif
+
+// Last entry is the default.
+static const struct sl_copy_kernel sl_copy_kernels[] = {
+    {"memcpy", sl_copy_memcpy},
+#ifdef __SSE2__
+    {"sse2", sl_copy_sse2_stream},
+#endif
+};
+
+static void sl_copy_run_job(struct sl_copy_engine* engine,
+                            struct sl_copy_job* job) {
+  engine->kernel->copy(job->dst, job->dst_stride, job->src, job->src_stride,
+                       job->bytes, job->height);
+}
+
+// Run jobs until none are left to claim. Called with |mutex| held.
+static void sl_copy_run_pending_jobs(struct sl_copy_engine* engine) {
+  struct sl_copy_job* jobs = engine->jobs.data;
+
+  while (engine->next_job < engine->num_jobs) {
+    struct sl_copy_job* job = &jobs[engine->next_job++];
+
+    pthread_mutex_unlock(&engine->mutex);
+    sl_copy_run_job(engine, job);
+    pthread_mutex_lock(&engine->mutex);
+
+    if (--engine->pending_jobs == 0)
+      pthread_cond_signal(&engine->done_cond);
+  }
+}
+
+static void* sl_copy_worker(void* data) {
+  struct sl_copy_engine* engine = data;
+
+  pthread_mutex_lock(&engine->mutex);
+  while (!engine->quit) {
+    if (engine->next_job < engine->num_jobs)
+      sl_copy_run_pending_jobs(engine);
+    else
+      pthread_cond_wait(&engine->work_cond, &engine->mutex);
+  }
+  pthread_mutex_unlock(&engine->mutex);
+
+  return NULL;
+}
+
+struct sl_copy_engine* sl_copy_engine_create(const char* kernel,
+                                             int num_threads) {
+  struct sl_copy_engine* engine;
+  sigset_t mask, old_mask;
+  size_t i;
+  int rv;
+
+  engine = malloc(sizeof(*engine));
+  assert(engine);
+
+  engine->kernel = &sl_copy_kernels[ARRAY_SIZE(sl_copy_kernels) - 1];
+  if (kernel) {
+    for (i = 0; i < ARRAY_SIZE(sl_copy_kernels); ++i) {
+      if (strcmp(sl_copy_kernels[i].name, kernel) == 0)
+        break;
+    }
+    if (i == ARRAY_SIZE(sl_copy_kernels)) {
+      free(engine);
+      return NULL;
+    }
+    engine->kernel = &sl_copy_kernels[i];
+  }
+
+  wl_array_init(&engine->jobs);
+  engine->num_jobs = 0;
+  engine->next_job = 0;
+  engine->pending_jobs = 0;
+  engine->num_threads = MIN(MAX(num_threads, 0), SL_COPY_MAX_THREADS);
+  engine->quit = 0;
+  pthread_mutex_init(&engine->mutex, NULL);
+  pthread_cond_init(&engine->work_cond, NULL);
+  pthread_cond_init(&engine->done_cond, NULL);
+
+  // Workers inherit the signal mask. Signals must only be delivered to the
+  // main thread, where the event loop reads them from a signalfd.
+  sigfillset(&mask);
+  pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+  for (i = 0; i < (size_t)engine->num_threads; ++i) {
+    rv = pthread_create(&engine->threads[i], NULL, sl_copy_worker, engine);
+    if (rv) {
+      fprintf(stderr, "warning: failed to create copy thread: %s\n",
+              strerror(rv));
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  engine->num_threads = i;
+
+  return engine;
+}
+
+void sl_copy_engine_add(struct sl_copy_engine* engine,
+                        uint8_t* dst,
+                        size_t dst_stride,
+                        const uint8_t* src,
+                        size_t src_stride,
+                        size_t bytes,
+                        int32_t height) {
+  size_t total = bytes * height;
+  int32_t band_height = height;
+  struct sl_copy_job* job;
+
+  if (!bytes || height <= 0)
+    return;
+
+  // Small copies are not worth the synchronization overhead.
+  if (!engine->num_threads || total < SL_COPY_BAND_MIN_BYTES) {
+    engine->kernel->copy(dst, dst_stride, src, src_stride, bytes, height);
+    return;
+  }
+
+  // Split into one band per thread, including the calling thread, but
+  // never make bands smaller than the minimum.
+  band_height = MAX(
+      (height + engine->num_threads) / (engine->num_threads + 1),
+      (int32_t)((SL_COPY_BAND_MIN_BYTES + bytes - 1) / bytes));
+
+  while (height > 0) {
+    int32_t rows = MIN(band_height, height);
+
+    job = wl_array_add(&engine->jobs, sizeof(*job));
+    assert(job);
+    job->dst = dst;
+    job->src = src;
+    job->dst_stride = dst_stride;
+    job->src_stride = src_stride;
+    job->bytes = bytes;
+    job->height = rows;
+
+    dst += rows * dst_stride;
+    src += rows * src_stride;
+    height -= rows;
+  }
+}
+
+void sl_copy_engine_flush(struct sl_copy_engine* engine) {
+  size_t num_jobs = engine->jobs.size / sizeof(struct sl_copy_job);
+
+  if (!num_jobs)
+    return;
+
+  pthread_mutex_lock(&engine->mutex);
+  engine->num_jobs = num_jobs;
+  engine->next_job = 0;
+  engine->pending_jobs = num_jobs;
+  pthread_cond_broadcast(&engine->work_cond);
+
+  // The calling thread takes part in the copy.
+  sl_copy_run_pending_jobs(engine);
+  while (engine->pending_jobs)
+    pthread_cond_wait(&engine->done_cond, &engine->mutex);
+
+  engine->num_jobs = 0;
+  engine->next_job = 0;
+  pthread_mutex_unlock(&engine->mutex);
+
+  engine->jobs.size = 0;
+}
+
+void sl_copy_engine_destroy(struct sl_copy_engine* engine) {
+  int i;
+
+  pthread_mutex_lock(&engine->mutex);
+  engine->quit = 1;
+  pthread_cond_broadcast(&engine->work_cond);
+  pthread_mutex_unlock(&engine->mutex);
+
+  for (i = 0; i < engine->num_threads; ++i)
+    pthread_join(engine->threads[i], NULL);
+
+  pthread_cond_destroy(&engine->done_cond);
+  pthread_cond_destroy(&engine->work_cond);
+  pthread_mutex_destroy(&engine->mutex);
+  wl_array_release(&engine->jobs);
+  free(engine);
+}
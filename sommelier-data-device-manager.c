@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
@@ -38,28 +40,79 @@ struct sl_host_data_offer {
   struct wl_data_offer* proxy;
 };
 
+// Initial and maximum size of the buffer used when data can't be spliced.
+#define DATA_TRANSFER_MIN_BUFFER_SIZE 4096
+#define DATA_TRANSFER_MAX_BUFFER_SIZE (1024 * 1024)
+
+// Maximum number of bytes moved by a single splice() call.
+#define DATA_TRANSFER_SPLICE_SIZE (1024 * 1024)
+
 struct sl_data_transfer {
+  struct sl_context* ctx;
   int read_fd;
   int write_fd;
+  int splice;
   size_t offset;
   size_t bytes_left;
-  uint8_t data[4096];
+  uint8_t* data;
+  size_t size;
+  uint64_t bytes;
+  struct timespec start_time;
   struct wl_event_source* read_event_source;
   struct wl_event_source* write_event_source;
 };
 
 static void sl_data_transfer_destroy(struct sl_data_transfer* transfer) {
+  sl_data_transfer_stats_add(&transfer->ctx->data_transfer_stats,
+                             transfer->bytes, transfer->splice,
+                             &transfer->start_time);
+
   assert(transfer->read_event_source);
   wl_event_source_remove(transfer->read_event_source);
   assert(transfer->write_event_source);
   wl_event_source_remove(transfer->write_event_source);
   close(transfer->read_fd);
   close(transfer->write_fd);
+  free(transfer->data);
   free(transfer);
 }
 
+// Move data straight from the read fd to the write fd. Returns 0 when the
+// transfer should continue in buffered mode instead.
+static int sl_data_transfer_splice(struct sl_data_transfer* transfer) {
+  ssize_t bytes = splice(transfer->read_fd, NULL, transfer->write_fd, NULL,
+                         DATA_TRANSFER_SPLICE_SIZE,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  if (bytes > 0) {
+    transfer->bytes += bytes;
+    return 1;
+  }
+
+  if (bytes < 0 && errno == EAGAIN) {
+    // The read fd is readable, so the write fd must be full. Wait for it to
+    // drain before splicing more.
+    wl_event_source_fd_update(transfer->read_event_source, 0);
+    wl_event_source_fd_update(transfer->write_event_source, WL_EVENT_WRITABLE);
+    return 1;
+  }
+
+  // Not every kind of fd supports splice. Fall back to copying if nothing has
+  // been transferred yet.
+  if (bytes < 0 && (errno == EINVAL || errno == ENOSYS) && !transfer->bytes) {
+    transfer->splice = 0;
+    return 0;
+  }
+
+  // On EOF or any other error, end the transfer.
+  sl_data_transfer_destroy(transfer);
+  return 1;
+}
+
 static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
   struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
+  ssize_t bytes;
+
   if ((mask & WL_EVENT_READABLE) == 0) {
     assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
 
@@ -82,9 +135,24 @@ static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
   // At this point we must be in the reading state.
   assert(!transfer->bytes_left);
 
-  transfer->bytes_left =
-      read(transfer->read_fd, transfer->data, sizeof(transfer->data));
-  if (transfer->bytes_left > 0) {
+  if (transfer->splice && sl_data_transfer_splice(transfer))
+    return 0;
+
+  // Grow the buffer when the last read filled it, so that large transfers
+  // take fewer wakeups.
+  if (!transfer->data || (transfer->offset == transfer->size &&
+                          transfer->size < DATA_TRANSFER_MAX_BUFFER_SIZE)) {
+    transfer->size = transfer->data ? transfer->size * 2
+                                    : DATA_TRANSFER_MIN_BUFFER_SIZE;
+    free(transfer->data);
+    transfer->data = malloc(transfer->size);
+    assert(transfer->data);
+  }
+
+  bytes = read(transfer->read_fd, transfer->data, transfer->size);
+  if (bytes > 0) {
+    transfer->bytes_left = bytes;
+    transfer->bytes += bytes;
     transfer->offset = 0;
     // There may still be data to read from the event source, but we have no
     // room in our buffer so move to the writing state.
@@ -111,6 +179,13 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
     return 0;
   }
 
+  // The write fd has drained, so go back to splicing once there's more data.
+  if (transfer->splice) {
+    wl_event_source_fd_update(transfer->write_event_source, 0);
+    wl_event_source_fd_update(transfer->read_event_source, WL_EVENT_READABLE);
+    return 0;
+  }
+
   // At this point we must be in the writing state.
   assert(transfer->bytes_left);
 
@@ -120,12 +195,13 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
   if (rv < 0) {
     // On a write error, end the transfer.
     sl_data_transfer_destroy(transfer);
-  } else {
-    assert(rv <= transfer->bytes_left);
-    transfer->bytes_left -= rv;
-    transfer->offset += rv;
+    return 0;
   }
 
+  assert(rv <= transfer->bytes_left);
+  transfer->bytes_left -= rv;
+  transfer->offset += rv;
+
   if (!transfer->bytes_left) {
     // If all data has been written, move back to the reading state.
     wl_event_source_fd_update(transfer->write_event_source, 0);
@@ -136,9 +212,17 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
   return 0;
 }
 
-static void sl_data_transfer_create(struct wl_event_loop* event_loop,
+static int sl_is_pipe(int fd) {
+  struct stat st;
+
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static void sl_data_transfer_create(struct sl_context* ctx,
                                     int read_fd,
                                     int write_fd) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
   struct sl_data_transfer* transfer;
   int flags;
   int rv;
@@ -151,15 +235,27 @@ static void sl_data_transfer_create(struct wl_event_loop* event_loop,
   // Start out the transfer in the reading state.
   transfer = malloc(sizeof(*transfer));
   assert(transfer);
+  transfer->ctx = ctx;
   transfer->read_fd = read_fd;
   transfer->write_fd = write_fd;
+  // splice() needs at least one end to be a pipe.
+  transfer->splice = sl_is_pipe(read_fd) || sl_is_pipe(write_fd);
   transfer->offset = 0;
   transfer->bytes_left = 0;
+  transfer->data = NULL;
+  transfer->size = 0;
+  transfer->bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &transfer->start_time);
   transfer->read_event_source =
       wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
                            sl_handle_data_transfer_read, transfer);
   transfer->write_event_source = wl_event_loop_add_fd(
       event_loop, write_fd, 0, sl_handle_data_transfer_write, transfer);
+
+  // Let a larger pipe buffer absorb each splice. This is best effort and
+  // limited by the system-wide maximum pipe size.
+  if (transfer->splice && sl_is_pipe(write_fd))
+    fcntl(write_fd, F_SETPIPE_SZ, DATA_TRANSFER_SPLICE_SIZE);
 }
 
 static void sl_data_offer_accept(struct wl_client* client,
@@ -195,8 +291,7 @@ static void sl_data_offer_receive(struct wl_client* client,
         return;
       }
 
-      sl_data_transfer_create(
-          wl_display_get_event_loop(host->ctx->host_display), new_pipe.fd, fd);
+      sl_data_transfer_create(host->ctx, new_pipe.fd, fd);
 
       wl_data_offer_receive(host->proxy, mime_type, new_pipe.fd);
     } break;
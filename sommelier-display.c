@@ -62,6 +62,8 @@ static void sl_display_sync(struct wl_client* client,
   host_callback = malloc(sizeof(*host_callback));
   assert(host_callback);
 
+  host_callback->ctx = ctx;
+  host_callback->request_usec = 0;
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, id);
   wl_resource_set_implementation(host_callback->resource, NULL, host_callback,
@@ -7,8 +7,10 @@
 #include <assert.h>
 #include <gbm.h>
 #include <libdrm/drm_fourcc.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -25,6 +27,113 @@ struct sl_host_drm {
   struct wl_callback* callback;
 };
 
+// GEM handle and virtio-gpu resource information of a dmabuf that is used
+// by one or more host buffers. Entries are looked up by the inode of the
+// dmabuf, which stays unique while the imported handle keeps it alive.
+struct sl_drm_prime_resource {
+  struct wl_list link;
+  ino_t ino;
+  uint32_t handle;
+  int32_t stride;
+  int is_gpu_buffer;
+  int refcount;
+};
+
+struct sl_drm_prime_buffer {
+  struct sl_drm_prime_resource* resource;
+  struct wl_listener destroy_listener;
+  int drm_fd;
+};
+
+// GEM handles are per drm fd, and the gbm device is shared by all client
+// threads. The cache is process-wide so that a handle is never closed while
+// another thread still uses it.
+static pthread_mutex_t sl_drm_prime_resources_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct wl_list sl_drm_prime_resources = {&sl_drm_prime_resources,
+                                                &sl_drm_prime_resources};
+
+// Returns a reference to the resource information of dmabuf |fd|, or NULL
+// if it cannot be imported by |drm_fd|.
+static struct sl_drm_prime_resource* sl_drm_prime_resource_get(int drm_fd,
+                                                               int fd) {
+  struct sl_drm_prime_resource* resource;
+  struct drm_prime_handle prime_handle;
+  struct drm_virtgpu_resource_info info_arg;
+  struct stat st;
+  int ret;
+
+  if (fstat(fd, &st))
+    return NULL;
+
+  pthread_mutex_lock(&sl_drm_prime_resources_mutex);
+  wl_list_for_each(resource, &sl_drm_prime_resources, link) {
+    if (resource->ino == st.st_ino) {
+      resource->refcount++;
+      pthread_mutex_unlock(&sl_drm_prime_resources_mutex);
+      return resource;
+    }
+  }
+
+  // First imports the prime fd to a gem handle. This will fail if this
+  // function was not passed a prime handle that can be imported by the drm
+  // device given to sommelier.
+  memset(&prime_handle, 0, sizeof(prime_handle));
+  prime_handle.fd = fd;
+  ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
+  if (ret) {
+    pthread_mutex_unlock(&sl_drm_prime_resources_mutex);
+    return NULL;
+  }
+
+  resource = malloc(sizeof(*resource));
+  assert(resource);
+  resource->ino = st.st_ino;
+  resource->handle = prime_handle.handle;
+  resource->stride = 0;
+  resource->is_gpu_buffer = 0;
+  resource->refcount = 1;
+
+  // Then attempts to get resource information. This will fail silently if
+  // the drm device passed to sommelier is not a virtio-gpu device.
+  memset(&info_arg, 0, sizeof(info_arg));
+  info_arg.bo_handle = prime_handle.handle;
+  ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info_arg);
+  if (!ret) {
+    resource->stride = info_arg.stride;
+    resource->is_gpu_buffer = 1;
+  }
+
+  wl_list_insert(&sl_drm_prime_resources, &resource->link);
+  pthread_mutex_unlock(&sl_drm_prime_resources_mutex);
+
+  return resource;
+}
+
+static void sl_drm_prime_resource_put(int drm_fd,
+                                      struct sl_drm_prime_resource* resource) {
+  pthread_mutex_lock(&sl_drm_prime_resources_mutex);
+  if (!--resource->refcount) {
+    struct drm_gem_close gem_close;
+
+    memset(&gem_close, 0, sizeof(gem_close));
+    gem_close.handle = resource->handle;
+    drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+
+    wl_list_remove(&resource->link);
+    free(resource);
+  }
+  pthread_mutex_unlock(&sl_drm_prime_resources_mutex);
+}
+
+static void sl_drm_prime_buffer_destroy_notify(struct wl_listener* listener,
+                                               void* data) {
+  struct sl_drm_prime_buffer* prime_buffer =
+      wl_container_of(listener, prime_buffer, destroy_listener);
+
+  sl_drm_prime_resource_put(prime_buffer->drm_fd, prime_buffer->resource);
+  free(prime_buffer);
+}
+
 static void sl_drm_authenticate(struct wl_client* client,
                                 struct wl_resource* resource,
                                 uint32_t id) {
@@ -60,32 +169,14 @@ static void sl_drm_create_planar_buffer(struct wl_client* client,
 
 static void sl_drm_sync(struct sl_context* ctx,
                         struct sl_sync_point* sync_point) {
-  int drm_fd = gbm_device_get_fd(ctx->gbm);
-  struct drm_prime_handle prime_handle;
-  int ret;
-
-  // First imports the prime fd to a gem handle. This will fail if this
-  // function was not passed a prime handle that can be imported by the drm
-  // device given to sommelier.
-  memset(&prime_handle, 0, sizeof(prime_handle));
-  prime_handle.fd = sync_point->fd;
-  ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-  if (!ret) {
-    struct drm_virtgpu_3d_wait wait_arg;
-    struct drm_gem_close gem_close;
-
-    // Then attempts to wait for GPU operations to complete. This will fail
-    // silently if the drm device passed to sommelier is not a virtio-gpu
-    // device.
-    memset(&wait_arg, 0, sizeof(wait_arg));
-    wait_arg.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_WAIT, &wait_arg);
-
-    // Always close the handle we imported.
-    memset(&gem_close, 0, sizeof(gem_close));
-    gem_close.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-  }
+  struct sl_drm_prime_buffer* prime_buffer = sync_point->data;
+  struct drm_virtgpu_3d_wait wait_arg;
+
+  // Waits for GPU operations to complete using the handle that was imported
+  // when the buffer was created.
+  memset(&wait_arg, 0, sizeof(wait_arg));
+  wait_arg.handle = prime_buffer->resource->handle;
+  drmIoctl(prime_buffer->drm_fd, DRM_IOCTL_VIRTGPU_WAIT, &wait_arg);
 }
 
 static void sl_drm_create_prime_buffer(struct wl_client* client,
@@ -113,37 +204,26 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
   // Attempts to correct stride0 with virtio-gpu specific resource information,
   // if available.  Ideally mesa/gbm should have the correct stride. Remove
   // after crbug.com/892242 is resolved in mesa.
+  struct sl_drm_prime_buffer* prime_buffer = NULL;
   int is_gpu_buffer = 0;
   if (host->ctx->gbm) {
     int drm_fd = gbm_device_get_fd(host->ctx->gbm);
-    struct drm_prime_handle prime_handle;
-    int ret;
-
-    // First imports the prime fd to a gem handle. This will fail if this
-    // function was not passed a prime handle that can be imported by the drm
-    // device given to sommelier.
-    memset(&prime_handle, 0, sizeof(prime_handle));
-    prime_handle.fd = name;
-    ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-    if (!ret) {
-      struct drm_virtgpu_resource_info info_arg;
-      struct drm_gem_close gem_close;
-
-      // Then attempts to get resource information. This will fail silently if
-      // the drm device passed to sommelier is not a virtio-gpu device.
-      memset(&info_arg, 0, sizeof(info_arg));
-      info_arg.bo_handle = prime_handle.handle;
-      ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info_arg);
+    struct sl_drm_prime_resource* prime_resource =
+        sl_drm_prime_resource_get(drm_fd, name);
+
+    if (prime_resource) {
+      prime_buffer = malloc(sizeof(*prime_buffer));
+      assert(prime_buffer);
+      prime_buffer->resource = prime_resource;
+      prime_buffer->drm_fd = drm_fd;
+      prime_buffer->destroy_listener.notify =
+          sl_drm_prime_buffer_destroy_notify;
+
       // Correct stride0 if we are able to get proper resource info.
-      if (!ret) {
-        stride0 = info_arg.stride;
+      if (prime_resource->is_gpu_buffer) {
+        stride0 = prime_resource->stride;
         is_gpu_buffer = 1;
       }
-
-      // Always close the handle we imported.
-      memset(&gem_close, 0, sizeof(gem_close));
-      gem_close.handle = prime_handle.handle;
-      drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
     }
   }
 
@@ -158,9 +238,14 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
                             zwp_linux_buffer_params_v1_create_immed(
                                 buffer_params, width, height, format, 0),
                             width, height);
+  // The imported handle is kept open for as long as the buffer exists.
+  if (prime_buffer)
+    wl_resource_add_destroy_listener(host_buffer->resource,
+                                     &prime_buffer->destroy_listener);
   if (is_gpu_buffer) {
     host_buffer->sync_point = sl_sync_point_create(name);
     host_buffer->sync_point->sync = sl_drm_sync;
+    host_buffer->sync_point->data = prime_buffer;
   } else {
     close(name);
   }
@@ -0,0 +1,566 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <assert.h>
+#include <gbm.h>
+#include <libdrm/drm_fourcc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#define SL_GPU_MAX_PLANES 4
+
+// Maximum number of bilinear taps per axis that the upload shader averages
+// for a downscaled pixel. Each tap covers 2 texels. Must match the loop
+// bounds in sl_gpu_fragment_shader.
+#define SL_GPU_MAX_TAPS 4
+
+struct sl_gpu_engine {
+  EGLDisplay display;
+  EGLContext context;
+  int has_modifiers;
+  GLuint program;
+  GLint position_loc;
+  GLint tex_coord_loc;
+  GLint tex_max_loc;
+  GLint tap_step_loc;
+  GLint taps_loc;
+  GLuint texture;
+  GLsizei texture_width;
+  GLsizei texture_height;
+  GLenum texture_format;
+  GLenum texture_type;
+  PFNEGLCREATEIMAGEKHRPROC create_image;
+  PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+  PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC image_target_renderbuffer;
+  // State of the upload started by sl_gpu_engine_begin().
+  struct sl_gpu_target* target;
+  const uint8_t* src;
+  size_t src_stride;
+  size_t bpp;
+  uint32_t width;
+  uint32_t height;
+  double downscale;
+  int taps;
+  struct wl_array vertices;
+};
+
+struct sl_gpu_target {
+  EGLImageKHR image;
+  GLuint renderbuffer;
+  GLuint framebuffer;
+  uint32_t width;
+  uint32_t height;
+};
+
+static const char sl_gpu_vertex_shader[] =
+    "attribute vec2 position;\n"
+    "attribute vec2 tex_coord;\n"
+    "varying vec2 v_tex_coord;\n"
+    "void main() {\n"
+    "  gl_Position = vec4(position, 0.0, 1.0);\n"
+    "  v_tex_coord = tex_coord;\n"
+    "}\n";
+
+// Texels outside the uploaded contents are stale, so sampling is clamped to
+// the centre of the last valid texel like PIXMAN_REPEAT_PAD does. Downscaled
+// pixels average a grid of |taps| x |taps| bilinear samples spread over the
+// source pixels they cover, like the box filter of the CPU path.
+static const char sl_gpu_fragment_shader[] =
+    "precision mediump float;\n"
+    "uniform sampler2D tex;\n"
+    "uniform vec2 tex_max;\n"
+    "uniform vec2 tap_step;\n"
+    "uniform float taps;\n"
+    "varying vec2 v_tex_coord;\n"
+    "void main() {\n"
+    "  vec2 origin = v_tex_coord - tap_step * (taps - 1.0) * 0.5;\n"
+    "  vec4 sum = vec4(0.0);\n"
+    "  for (int y = 0; y < 4; ++y) {\n"
+    "    for (int x = 0; x < 4; ++x) {\n"
+    "      if (float(x) < taps && float(y) < taps) {\n"
+    "        vec2 coord = origin + tap_step * vec2(float(x), float(y));\n"
+    "        sum += texture2D(tex, min(coord, tex_max));\n"
+    "      }\n"
+    "    }\n"
+    "  }\n"
+    "  gl_FragColor = sum / (taps * taps);\n"
+    "}\n";
+
+static int sl_gpu_has_extension(const char* extensions, const char* name) {
+  size_t length = strlen(name);
+  const char* s = extensions;
+
+  while (s && (s = strstr(s, name))) {
+    if ((s == extensions || s[-1] == ' ') &&
+        (s[length] == ' ' || s[length] == '\0'))
+      return 1;
+    s += length;
+  }
+  return 0;
+}
+
+static GLuint sl_gpu_compile_shader(GLenum type, const char* source) {
+  GLuint shader = glCreateShader(type);
+  GLint status;
+
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+static int sl_gpu_engine_init_gl(struct sl_gpu_engine* engine) {
+  const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+  const char* version = (const char*)glGetString(GL_VERSION);
+  GLuint vertex_shader, fragment_shader;
+  GLint status;
+
+  // Damaged rects are uploaded straight out of the client's mapping, which
+  // needs a row length that differs from the rect width.
+  if (!sl_gpu_has_extension(extensions, "GL_EXT_unpack_subimage") &&
+      (!version || strncmp(version, "OpenGL ES 3", 11))) {
+    fprintf(stderr, "warning: GL_EXT_unpack_subimage not supported\n");
+    return 0;
+  }
+  if (!sl_gpu_has_extension(extensions, "GL_EXT_texture_format_BGRA8888")) {
+    fprintf(stderr, "warning: GL_EXT_texture_format_BGRA8888 not supported\n");
+    return 0;
+  }
+  if (!sl_gpu_has_extension(extensions, "GL_OES_EGL_image")) {
+    fprintf(stderr, "warning: GL_OES_EGL_image not supported\n");
+    return 0;
+  }
+
+  vertex_shader = sl_gpu_compile_shader(GL_VERTEX_SHADER, sl_gpu_vertex_shader);
+  fragment_shader =
+      sl_gpu_compile_shader(GL_FRAGMENT_SHADER, sl_gpu_fragment_shader);
+  if (!vertex_shader || !fragment_shader) {
+    fprintf(stderr, "warning: failed to compile upload shaders\n");
+    return 0;
+  }
+
+  engine->program = glCreateProgram();
+  glAttachShader(engine->program, vertex_shader);
+  glAttachShader(engine->program, fragment_shader);
+  glLinkProgram(engine->program);
+  glDeleteShader(vertex_shader);
+  glDeleteShader(fragment_shader);
+  glGetProgramiv(engine->program, GL_LINK_STATUS, &status);
+  if (!status) {
+    fprintf(stderr, "warning: failed to link upload program\n");
+    return 0;
+  }
+
+  engine->position_loc = glGetAttribLocation(engine->program, "position");
+  engine->tex_coord_loc = glGetAttribLocation(engine->program, "tex_coord");
+  engine->tex_max_loc = glGetUniformLocation(engine->program, "tex_max");
+  engine->tap_step_loc = glGetUniformLocation(engine->program, "tap_step");
+  engine->taps_loc = glGetUniformLocation(engine->program, "taps");
+  glUseProgram(engine->program);
+  glUniform1i(glGetUniformLocation(engine->program, "tex"), 0);
+  glEnableVertexAttribArray(engine->position_loc);
+  glEnableVertexAttribArray(engine->tex_coord_loc);
+
+  glGenTextures(1, &engine->texture);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, engine->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glDisable(GL_BLEND);
+  glDisable(GL_DITHER);
+
+  return 1;
+}
+
+// Creates a surfaceless GLES context on |gbm|. Returns NULL if the EGL
+// implementation lacks any of the required extensions.
+struct sl_gpu_engine* sl_gpu_engine_create(struct gbm_device* gbm) {
+  static const EGLint context_attribs[] = {EGL_CONTEXT_CLIENT_VERSION, 2,
+                                           EGL_NONE};
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  struct sl_gpu_engine* engine;
+  EGLConfig config = EGL_NO_CONFIG_KHR;
+
+  if (!sl_gpu_has_extension(extensions, "EGL_MESA_platform_gbm") &&
+      !sl_gpu_has_extension(extensions, "EGL_KHR_platform_gbm")) {
+    fprintf(stderr, "warning: EGL gbm platform not supported\n");
+    return NULL;
+  }
+  get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+      "eglGetPlatformDisplayEXT");
+  if (!get_platform_display)
+    return NULL;
+
+  engine = malloc(sizeof(*engine));
+  assert(engine);
+  engine->context = EGL_NO_CONTEXT;
+  engine->program = 0;
+  engine->texture = 0;
+  engine->texture_width = 0;
+  engine->texture_height = 0;
+  engine->texture_format = GL_NONE;
+  engine->texture_type = GL_NONE;
+  engine->target = NULL;
+  wl_array_init(&engine->vertices);
+
+  engine->display = get_platform_display(EGL_PLATFORM_GBM_KHR, gbm, NULL);
+  if (engine->display == EGL_NO_DISPLAY ||
+      !eglInitialize(engine->display, NULL, NULL)) {
+    fprintf(stderr, "warning: failed to initialize EGL display\n");
+    engine->display = EGL_NO_DISPLAY;
+    goto fail;
+  }
+
+  extensions = eglQueryString(engine->display, EGL_EXTENSIONS);
+  if (!sl_gpu_has_extension(extensions, "EGL_KHR_surfaceless_context") ||
+      !sl_gpu_has_extension(extensions, "EGL_KHR_image_base") ||
+      !sl_gpu_has_extension(extensions, "EGL_EXT_image_dma_buf_import")) {
+    fprintf(stderr, "warning: EGL dmabuf import not supported\n");
+    goto fail;
+  }
+  engine->has_modifiers = sl_gpu_has_extension(
+      extensions, "EGL_EXT_image_dma_buf_import_modifiers");
+
+  if (!sl_gpu_has_extension(extensions, "EGL_KHR_no_config_context")) {
+    static const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, 0, EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_NONE};
+    EGLint num_configs;
+
+    if (!eglChooseConfig(engine->display, config_attribs, &config, 1,
+                         &num_configs) ||
+        !num_configs) {
+      fprintf(stderr, "warning: no EGL config for upload context\n");
+      goto fail;
+    }
+  }
+
+  eglBindAPI(EGL_OPENGL_ES_API);
+  engine->context = eglCreateContext(engine->display, config, EGL_NO_CONTEXT,
+                                     context_attribs);
+  if (engine->context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(engine->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                      engine->context)) {
+    fprintf(stderr, "warning: failed to create GLES context\n");
+    goto fail;
+  }
+
+  engine->create_image =
+      (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+  engine->destroy_image =
+      (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+  engine->image_target_renderbuffer =
+      (PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC)eglGetProcAddress(
+          "glEGLImageTargetRenderbufferStorageOES");
+  if (!engine->create_image || !engine->destroy_image ||
+      !engine->image_target_renderbuffer || !sl_gpu_engine_init_gl(engine))
+    goto fail;
+
+  return engine;
+
+fail:
+  sl_gpu_engine_destroy(engine);
+  return NULL;
+}
+
+void sl_gpu_engine_destroy(struct sl_gpu_engine* engine) {
+  if (engine->context != EGL_NO_CONTEXT) {
+    if (engine->texture)
+      glDeleteTextures(1, &engine->texture);
+    if (engine->program)
+      glDeleteProgram(engine->program);
+    eglMakeCurrent(engine->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+    eglDestroyContext(engine->display, engine->context);
+  }
+  if (engine->display != EGL_NO_DISPLAY)
+    eglTerminate(engine->display);
+  wl_array_release(&engine->vertices);
+  free(engine);
+}
+
+// Imports the dmabuf behind |map| as a render target. Linear buffers are
+// mapped from their fd while tiled buffers keep their gbm buffer object.
+struct sl_gpu_target* sl_gpu_target_create(struct sl_gpu_engine* engine,
+                                           struct sl_mmap* map,
+                                           uint32_t width,
+                                           uint32_t height,
+                                           uint32_t drm_format) {
+  static const EGLint plane_attribs[SL_GPU_MAX_PLANES][5] = {
+      {EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+       EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+       EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT},
+      {EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+       EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+       EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT},
+      {EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+       EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+       EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT},
+      {EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+       EGL_DMA_BUF_PLANE3_PITCH_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+       EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT},
+  };
+  EGLint attribs[7 + SL_GPU_MAX_PLANES * 10];
+  uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+  struct sl_gpu_target* target;
+  int num_planes = 1;
+  int fd = map->fd;
+  int n = 0;
+  int i;
+
+  if (map->bo) {
+    modifier = gbm_bo_get_modifier(map->bo);
+    num_planes = MIN(gbm_bo_get_plane_count(map->bo), SL_GPU_MAX_PLANES);
+    fd = gbm_bo_get_fd(map->bo);
+    if (fd < 0)
+      return NULL;
+  }
+
+  attribs[n++] = EGL_WIDTH;
+  attribs[n++] = width;
+  attribs[n++] = EGL_HEIGHT;
+  attribs[n++] = height;
+  attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+  attribs[n++] = drm_format;
+  for (i = 0; i < num_planes; ++i) {
+    attribs[n++] = plane_attribs[i][0];
+    attribs[n++] = fd;
+    attribs[n++] = plane_attribs[i][1];
+    attribs[n++] = map->bo ? gbm_bo_get_offset(map->bo, i) : map->offset[0];
+    attribs[n++] = plane_attribs[i][2];
+    attribs[n++] =
+        map->bo ? gbm_bo_get_stride_for_plane(map->bo, i) : map->stride[0];
+    if (engine->has_modifiers && modifier != DRM_FORMAT_MOD_INVALID) {
+      attribs[n++] = plane_attribs[i][3];
+      attribs[n++] = modifier & 0xffffffff;
+      attribs[n++] = plane_attribs[i][4];
+      attribs[n++] = modifier >> 32;
+    }
+  }
+  attribs[n++] = EGL_NONE;
+
+  // Tiled layouts can't be described without modifiers.
+  if (!engine->has_modifiers && modifier != DRM_FORMAT_MOD_LINEAR &&
+      modifier != DRM_FORMAT_MOD_INVALID) {
+    if (map->bo)
+      close(fd);
+    return NULL;
+  }
+
+  target = malloc(sizeof(*target));
+  assert(target);
+  target->width = width;
+  target->height = height;
+
+  // The image holds its own reference to the dmabuf.
+  target->image = engine->create_image(engine->display, EGL_NO_CONTEXT,
+                                       EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+  if (map->bo)
+    close(fd);
+  if (target->image == EGL_NO_IMAGE_KHR) {
+    free(target);
+    return NULL;
+  }
+
+  glGenRenderbuffers(1, &target->renderbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, target->renderbuffer);
+  engine->image_target_renderbuffer(GL_RENDERBUFFER, target->image);
+  glGenFramebuffers(1, &target->framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, target->renderbuffer);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    sl_gpu_target_destroy(engine, target);
+    return NULL;
+  }
+
+  return target;
+}
+
+void sl_gpu_target_destroy(struct sl_gpu_engine* engine,
+                           struct sl_gpu_target* target) {
+  glDeleteFramebuffers(1, &target->framebuffer);
+  glDeleteRenderbuffers(1, &target->renderbuffer);
+  engine->destroy_image(engine->display, target->image);
+  free(target);
+}
+
+// Starts uploading contents of |width| x |height| from |src| into |target|,
+// resampling them by |downscale|. Returns 0 if |shm_format| can't be
+// uploaded, or if |downscale| needs more taps than the shader has, in which
+// case the caller has to copy the contents itself.
+int sl_gpu_engine_begin(struct sl_gpu_engine* engine,
+                        struct sl_gpu_target* target,
+                        const uint8_t* src,
+                        size_t src_stride,
+                        uint32_t shm_format,
+                        uint32_t width,
+                        uint32_t height,
+                        double downscale) {
+  GLenum format, type;
+  GLint max_size;
+  GLint filter;
+  int taps = downscale > 1.0 ? ceil(downscale / 2.0) : 1;
+
+  // Textures hold the contents in memory order, so ARGB8888 is BGRA and
+  // ABGR8888 is RGBA on little endian machines.
+  switch (shm_format) {
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_XRGB8888:
+      format = GL_BGRA_EXT;
+      type = GL_UNSIGNED_BYTE;
+      break;
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_XBGR8888:
+      format = GL_RGBA;
+      type = GL_UNSIGNED_BYTE;
+      break;
+    case WL_SHM_FORMAT_RGB565:
+      format = GL_RGB;
+      type = GL_UNSIGNED_SHORT_5_6_5;
+      break;
+    default:
+      return 0;
+  }
+
+  if (taps > SL_GPU_MAX_TAPS)
+    return 0;
+
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+  if (width > (uint32_t)max_size || height > (uint32_t)max_size)
+    return 0;
+
+  // The staging texture only grows, and is reallocated when the format
+  // changes.
+  glBindTexture(GL_TEXTURE_2D, engine->texture);
+  if (format != engine->texture_format || type != engine->texture_type ||
+      (GLsizei)width > engine->texture_width ||
+      (GLsizei)height > engine->texture_height) {
+    engine->texture_width = MAX(engine->texture_width, (GLsizei)width);
+    engine->texture_height = MAX(engine->texture_height, (GLsizei)height);
+    engine->texture_format = format;
+    engine->texture_type = type;
+    glTexImage2D(GL_TEXTURE_2D, 0, format, engine->texture_width,
+                 engine->texture_height, 0, format, type, NULL);
+  }
+
+  filter = downscale > 1.0 ? GL_LINEAR : GL_NEAREST;
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+
+  engine->target = target;
+  engine->src = src;
+  engine->src_stride = src_stride;
+  engine->bpp = sl_shm_bpp_for_shm_format(shm_format);
+  engine->width = width;
+  engine->height = height;
+  engine->downscale = downscale;
+  engine->taps = taps;
+  engine->vertices.size = 0;
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, src_stride / engine->bpp);
+
+  return 1;
+}
+
+static void sl_gpu_engine_add_vertex(struct sl_gpu_engine* engine,
+                                     int32_t x,
+                                     int32_t y) {
+  GLfloat* v = wl_array_add(&engine->vertices, sizeof(GLfloat) * 4);
+
+  assert(v);
+  // Row 0 of both the texture and the render target is the first row in
+  // memory, so neither needs flipping.
+  v[0] = 2.0 * x / engine->target->width - 1.0;
+  v[1] = 2.0 * y / engine->target->height - 1.0;
+  v[2] = x * engine->downscale / engine->texture_width;
+  v[3] = y * engine->downscale / engine->texture_height;
+}
+
+// Uploads the damaged rect |x1|, |y1|, |x2|, |y2| in contents coordinates
+// and queues the quad that stores it in the target. Returns the number of
+// bytes written to the target.
+size_t sl_gpu_engine_add(struct sl_gpu_engine* engine,
+                         int32_t x1,
+                         int32_t y1,
+                         int32_t x2,
+                         int32_t y2) {
+  double downscale = engine->downscale;
+  int32_t dx1 = x1, dy1 = y1, dx2 = x2, dy2 = y2;
+
+  if (downscale > 1.0) {
+    uint32_t output_width = ceil(engine->width / downscale);
+    uint32_t output_height = ceil(engine->height / downscale);
+
+    // Same mapping as the CPU path, and the texels that the filter reads
+    // for the outset rect have to be uploaded too.
+    dx1 = MAX(0, floor(x1 / downscale) - 1);
+    dy1 = MAX(0, floor(y1 / downscale) - 1);
+    dx2 = MIN((int32_t)output_width, ceil(x2 / downscale) + 1);
+    dy2 = MIN((int32_t)output_height, ceil(y2 / downscale) + 1);
+    x1 = MAX(0, floor(dx1 * downscale) - 1);
+    y1 = MAX(0, floor(dy1 * downscale) - 1);
+    x2 = MIN((int32_t)engine->width, ceil(dx2 * downscale) + 1);
+    y2 = MIN((int32_t)engine->height, ceil(dy2 * downscale) + 1);
+  }
+
+  if (x1 >= x2 || y1 >= y2 || dx1 >= dx2 || dy1 >= dy2)
+    return 0;
+
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x1, y1, x2 - x1, y2 - y1,
+                  engine->texture_format, engine->texture_type,
+                  engine->src + y1 * engine->src_stride + x1 * engine->bpp);
+
+  sl_gpu_engine_add_vertex(engine, dx1, dy1);
+  sl_gpu_engine_add_vertex(engine, dx2, dy1);
+  sl_gpu_engine_add_vertex(engine, dx1, dy2);
+  sl_gpu_engine_add_vertex(engine, dx2, dy1);
+  sl_gpu_engine_add_vertex(engine, dx2, dy2);
+  sl_gpu_engine_add_vertex(engine, dx1, dy2);
+
+  return (size_t)(dx2 - dx1) * (dy2 - dy1) * engine->bpp;
+}
+
+// Draws all queued rects and submits them. The host compositor waits for
+// the rendering through the implicit fence attached to the dmabuf.
+void sl_gpu_engine_end(struct sl_gpu_engine* engine) {
+  GLfloat* v = engine->vertices.data;
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+  if (engine->vertices.size) {
+    glBindFramebuffer(GL_FRAMEBUFFER, engine->target->framebuffer);
+    glViewport(0, 0, engine->target->width, engine->target->height);
+    glUniform2f(engine->tex_max_loc,
+                (engine->width - 0.5) / engine->texture_width,
+                (engine->height - 0.5) / engine->texture_height);
+    glUniform2f(engine->tap_step_loc,
+                engine->downscale / engine->taps / engine->texture_width,
+                engine->downscale / engine->taps / engine->texture_height);
+    glUniform1f(engine->taps_loc, engine->taps);
+    glVertexAttribPointer(engine->position_loc, 2, GL_FLOAT, GL_FALSE,
+                          sizeof(GLfloat) * 4, v);
+    glVertexAttribPointer(engine->tex_coord_loc, 2, GL_FLOAT, GL_FALSE,
+                          sizeof(GLfloat) * 4, v + 2);
+    glDrawArrays(GL_TRIANGLES, 0,
+                 engine->vertices.size / (sizeof(GLfloat) * 4));
+    glFlush();
+  }
+  engine->target = NULL;
+}
@@ -27,6 +27,16 @@ struct sl_host_relative_pointer {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct zwp_relative_pointer_v1* proxy;
+  struct sl_host_pointer* pointer;
+  struct wl_list link;
+  // Deltas summed while the pointer is coalescing motion.
+  int motion_pending;
+  uint32_t utime_hi;
+  uint32_t utime_lo;
+  wl_fixed_t dx;
+  wl_fixed_t dy;
+  wl_fixed_t dx_unaccel;
+  wl_fixed_t dy_unaccel;
 };
 
 // Like ceil(), but strictly increases the magnitude of the input value (i.e.
@@ -49,6 +59,18 @@ static void sl_relative_pointer_relative_motion(
   struct sl_host_relative_pointer* host =
       zwp_relative_pointer_v1_get_user_data(relative_pointer);
 
+  // Sum deltas so that no movement is lost when motion events are dropped.
+  if (host->pointer && host->pointer->coalesce_motion) {
+    host->motion_pending = 1;
+    host->utime_hi = utime_hi;
+    host->utime_lo = utime_lo;
+    host->dx += dx;
+    host->dy += dy;
+    host->dx_unaccel += dx_unaccel;
+    host->dy_unaccel += dy_unaccel;
+    return;
+  }
+
   // Unfortunately, many x11 toolkits truncate RawMotion events. We force them
   // to interpret cursor movement by rounding to the next greater-magnitude
   // value.
@@ -61,9 +83,46 @@ static void sl_relative_pointer_relative_motion(
       host->resource, utime_hi, utime_lo, dx, dy, dx_unaccel, dy_unaccel);
 }
 
+void sl_host_pointer_flush_relative_motion(struct sl_host_pointer* pointer) {
+  struct sl_host_relative_pointer* host;
+
+  wl_list_for_each(host, &pointer->relative_pointers, link) {
+    wl_fixed_t dx_unaccel = host->dx_unaccel;
+    wl_fixed_t dy_unaccel = host->dy_unaccel;
+
+    if (!host->motion_pending)
+      continue;
+
+    if (host->ctx->xwayland) {
+      dx_unaccel = magnitude_ceil(dx_unaccel);
+      dy_unaccel = magnitude_ceil(dy_unaccel);
+    }
+
+    zwp_relative_pointer_v1_send_relative_motion(
+        host->resource, host->utime_hi, host->utime_lo, host->dx, host->dy,
+        dx_unaccel, dy_unaccel);
+
+    host->motion_pending = 0;
+    host->dx = host->dy = wl_fixed_from_int(0);
+    host->dx_unaccel = host->dy_unaccel = wl_fixed_from_int(0);
+  }
+}
+
+void sl_host_pointer_detach_relative_pointers(struct sl_host_pointer* pointer) {
+  struct sl_host_relative_pointer* host;
+  struct sl_host_relative_pointer* next;
+
+  wl_list_for_each_safe(host, next, &pointer->relative_pointers, link) {
+    host->pointer = NULL;
+    wl_list_remove(&host->link);
+    wl_list_init(&host->link);
+  }
+}
+
 static void sl_destroy_host_relative_pointer(struct wl_resource* resource) {
   struct sl_host_relative_pointer* host = wl_resource_get_user_data(resource);
 
+  wl_list_remove(&host->link);
   zwp_relative_pointer_v1_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
   free(host);
@@ -114,6 +173,16 @@ static void sl_relative_pointer_manager_get_relative_pointer(
   assert(relative_pointer_host);
   relative_pointer_host->resource = relative_pointer_resource;
   relative_pointer_host->ctx = host->ctx;
+  relative_pointer_host->pointer = host_pointer;
+  wl_list_insert(&host_pointer->relative_pointers,
+                 &relative_pointer_host->link);
+  relative_pointer_host->motion_pending = 0;
+  relative_pointer_host->utime_hi = 0;
+  relative_pointer_host->utime_lo = 0;
+  relative_pointer_host->dx = wl_fixed_from_int(0);
+  relative_pointer_host->dy = wl_fixed_from_int(0);
+  relative_pointer_host->dx_unaccel = wl_fixed_from_int(0);
+  relative_pointer_host->dy_unaccel = wl_fixed_from_int(0);
   relative_pointer_host->proxy =
       zwp_relative_pointer_manager_v1_get_relative_pointer(
           host->ctx->relative_pointer_manager->internal, host_pointer->proxy);
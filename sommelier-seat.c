@@ -6,6 +6,8 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -40,6 +42,145 @@ struct sl_host_touch {
   struct wl_listener focus_resource_listener;
 };
 
+// Number of compiled keymaps that are kept around for reuse.
+#define KEYMAP_CACHE_LENGTH 4
+
+struct sl_keymap_cache_entry {
+  uint64_t hash;
+  uint32_t size;
+  char* text;
+  struct xkb_keymap* keymap;
+  uint64_t last_use;
+};
+
+// Compiled keymaps are shared by all client threads of the process, so a
+// host that sends the same keymap to every keyboard only has it compiled
+// once. libxkbcommon reference counts are not atomic, which is why every
+// reference to a cached keymap, including the ones held by xkb_state
+// objects, is taken and dropped with the mutex held. The xkb context that
+// is used for compiling is shared too and only used with the mutex held.
+static pthread_mutex_t sl_keymap_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sl_keymap_cache_entry sl_keymap_cache[KEYMAP_CACHE_LENGTH];
+static uint64_t sl_keymap_cache_clock;
+
+static uint64_t sl_keymap_hash(const char* text, uint32_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  uint32_t i;
+
+  for (i = 0; i < size; ++i) {
+    hash ^= (uint8_t)text[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Returns a new reference to the compiled keymap for |text|. Must be called
+// with the keymap cache mutex held.
+static struct xkb_keymap* sl_keymap_cache_get(struct sl_context* ctx,
+                                              const char* text,
+                                              uint32_t size) {
+  uint64_t hash = sl_keymap_hash(text, size);
+  struct sl_keymap_cache_entry* oldest = &sl_keymap_cache[0];
+  struct xkb_keymap* keymap;
+  int i;
+
+  for (i = 0; i < KEYMAP_CACHE_LENGTH; ++i) {
+    struct sl_keymap_cache_entry* entry = &sl_keymap_cache[i];
+
+    if (entry->keymap && entry->hash == hash && entry->size == size &&
+        memcmp(entry->text, text, size) == 0) {
+      ctx->stats.keymap_cache_hits++;
+      entry->last_use = ++sl_keymap_cache_clock;
+      return xkb_keymap_ref(entry->keymap);
+    }
+    if (entry->last_use < oldest->last_use)
+      oldest = entry;
+  }
+
+  ctx->stats.keymap_cache_misses++;
+  keymap = xkb_keymap_new_from_string(ctx->xkb_context, text,
+                                      XKB_KEYMAP_FORMAT_TEXT_V1, 0);
+  if (!keymap)
+    return NULL;
+
+  // Replace the least recently used entry. Keyboards that still use its
+  // keymap keep their own references.
+  if (oldest->keymap) {
+    xkb_keymap_unref(oldest->keymap);
+    free(oldest->text);
+  }
+  oldest->text = malloc(size);
+  assert(oldest->text);
+  memcpy(oldest->text, text, size);
+  oldest->hash = hash;
+  oldest->size = size;
+  oldest->keymap = xkb_keymap_ref(keymap);
+  oldest->last_use = ++sl_keymap_cache_clock;
+
+  return keymap;
+}
+
+static void sl_host_keyboard_release_keymap(struct sl_host_keyboard* host) {
+  pthread_mutex_lock(&sl_keymap_cache_mutex);
+  if (host->state)
+    xkb_state_unref(host->state);
+  if (host->keymap)
+    xkb_keymap_unref(host->keymap);
+  pthread_mutex_unlock(&sl_keymap_cache_mutex);
+  host->state = NULL;
+  host->keymap = NULL;
+}
+
+static void sl_host_keyboard_set_keymap(struct sl_host_keyboard* host,
+                                        const char* text,
+                                        uint32_t size) {
+  sl_host_keyboard_release_keymap(host);
+
+  pthread_mutex_lock(&sl_keymap_cache_mutex);
+  host->keymap = sl_keymap_cache_get(host->seat->ctx, text, size);
+  assert(host->keymap);
+  host->state = xkb_state_new(host->keymap);
+  assert(host->state);
+  pthread_mutex_unlock(&sl_keymap_cache_mutex);
+
+  host->control_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Control");
+  host->alt_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Mod1");
+  host->shift_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Shift");
+}
+
+static uint32_t sl_accelerator_hash(uint32_t modifiers, xkb_keysym_t symbol) {
+  return ((symbol ^ (modifiers << 29)) * 2654435761u) >>
+         (32 - ACCELERATOR_INDEX_BITS);
+}
+
+void sl_accelerator_insert(struct sl_context* ctx,
+                           struct sl_accelerator* accelerator) {
+  wl_list_insert(ctx->accelerators.prev, &accelerator->link);
+  wl_list_insert(&ctx->accelerator_index[sl_accelerator_hash(
+                     accelerator->modifiers, accelerator->symbol)],
+                 &accelerator->index_link);
+}
+
+void sl_accelerator_remove(struct sl_accelerator* accelerator) {
+  wl_list_remove(&accelerator->link);
+  wl_list_remove(&accelerator->index_link);
+}
+
+static int sl_is_accelerator(struct sl_context* ctx,
+                             uint32_t modifiers,
+                             xkb_keysym_t symbol) {
+  struct sl_accelerator* accelerator;
+
+  wl_list_for_each(accelerator,
+                   &ctx->accelerator_index[sl_accelerator_hash(modifiers,
+                                                               symbol)],
+                   index_link) {
+    if (accelerator->modifiers == modifiers && accelerator->symbol == symbol)
+      return 1;
+  }
+  return 0;
+}
+
 static void sl_host_pointer_set_cursor(struct wl_client* client,
                                        struct wl_resource* resource,
                                        uint32_t serial,
@@ -53,8 +194,9 @@ static void sl_host_pointer_set_cursor(struct wl_client* client,
   if (surface_resource) {
     host_surface = wl_resource_get_user_data(surface_resource);
     host_surface->has_role = 1;
+    host_surface->is_cursor = 1;
     if (host_surface->contents_width && host_surface->contents_height)
-      wl_surface_commit(host_surface->proxy);
+      sl_host_surface_commit_state(host_surface);
   }
 
   wl_pointer_set_cursor(host->proxy, serial,
@@ -78,6 +220,49 @@ static void sl_set_last_event_serial(struct wl_resource* surface_resource,
   host_surface->last_event_serial = serial;
 }
 
+// Send coalesced motion that has not been forwarded yet.
+static void sl_pointer_send_pending_motion(struct sl_host_pointer* host) {
+  if (host->motion_pending) {
+    double scale = host->seat->ctx->scale;
+
+    host->motion_pending = 0;
+    if (host->focus_resource)
+      wl_pointer_send_motion(host->resource, host->motion_time,
+                             host->motion_x * scale, host->motion_y * scale);
+  }
+  sl_host_pointer_flush_relative_motion(host);
+}
+
+// Complete a held motion-only frame. Called before any event that must not
+// be reordered with respect to earlier motion.
+static void sl_pointer_release_held_frame(struct sl_host_pointer* host) {
+  if (!host->frame_held)
+    return;
+
+  host->frame_held = 0;
+  wl_list_remove(&host->held_link);
+  wl_list_init(&host->held_link);
+  sl_pointer_send_pending_motion(host);
+  wl_pointer_send_frame(host->resource);
+}
+
+// Called for every event other than motion that is part of a frame. Motion
+// that arrived earlier in the same frame is sent first so that, e.g., a
+// button is delivered at the position it was pressed at.
+static void sl_pointer_frame_event(struct sl_host_pointer* host) {
+  sl_pointer_release_held_frame(host);
+  sl_pointer_send_pending_motion(host);
+  host->frame_events = 1;
+}
+
+void sl_release_held_pointer_frames(struct sl_context* ctx) {
+  struct sl_host_pointer* host;
+  struct sl_host_pointer* next;
+
+  wl_list_for_each_safe(host, next, &ctx->held_pointers, held_link)
+      sl_pointer_release_held_frame(host);
+}
+
 static void sl_pointer_set_focus(struct sl_host_pointer* host,
                                  uint32_t serial,
                                  struct sl_host_surface* host_surface,
@@ -89,6 +274,9 @@ static void sl_pointer_set_focus(struct sl_host_pointer* host,
   if (surface_resource == host->focus_resource)
     return;
 
+  // Motion belongs to the surface that had focus when it was generated.
+  sl_pointer_frame_event(host);
+
   if (host->focus_resource)
     wl_pointer_send_leave(host->resource, serial, host->focus_resource);
 
@@ -101,9 +289,10 @@ static void sl_pointer_set_focus(struct sl_host_pointer* host,
     double scale = host->seat->ctx->scale;
 
     if (host->seat->ctx->xwayland) {
-      // Make sure focus surface is on top before sending enter event.
+      // Make sure focus surface is on top before the enter event is
+      // delivered.
       sl_restack_windows(host->seat->ctx, wl_resource_get_id(surface_resource));
-      sl_roundtrip(host->seat->ctx);
+      sl_sync_x_connection(host->seat->ctx);
     }
 
     wl_resource_add_destroy_listener(surface_resource,
@@ -151,6 +340,14 @@ static void sl_pointer_motion(void* data,
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   double scale = host->seat->ctx->scale;
 
+  if (host->coalesce_motion) {
+    host->motion_pending = 1;
+    host->motion_time = time;
+    host->motion_x = x;
+    host->motion_y = y;
+    return;
+  }
+
   wl_pointer_send_motion(host->resource, time, x * scale, y * scale);
 }
 
@@ -162,6 +359,7 @@ static void sl_pointer_button(void* data,
                               uint32_t state) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_frame_event(host);
   wl_pointer_send_button(host->resource, serial, time, button, state);
 
   if (host->focus_resource)
@@ -177,6 +375,7 @@ static void sl_pointer_axis(void* data,
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   double scale = host->seat->ctx->scale;
 
+  sl_pointer_frame_event(host);
   host->time = time;
   host->axis_delta[axis] += value * scale;
 }
@@ -196,6 +395,18 @@ static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
   // we don't want to do this because it would lead to erratic jumps.
   const int kDiscreteScrollUnit = 5;
 
+  // Hold back frames that only contain motion. The next motion replaces
+  // them unless another event needs them delivered first.
+  if (host->coalesce_motion && !host->frame_events) {
+    if (!host->frame_held) {
+      host->frame_held = 1;
+      wl_list_insert(host->seat->ctx->held_pointers.prev, &host->held_link);
+    }
+    return;
+  }
+  host->frame_events = 0;
+  sl_pointer_send_pending_motion(host);
+
   for (int axis = 0; axis < 2; axis++) {
     if (host->axis_discrete[axis] != 0) {
       wl_pointer_send_axis_discrete(host->resource, axis,
@@ -222,6 +433,7 @@ void sl_pointer_axis_source(void* data,
                             uint32_t axis_source) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_frame_event(host);
   wl_pointer_send_axis_source(host->resource, axis_source);
 }
 
@@ -231,6 +443,7 @@ static void sl_pointer_axis_stop(void* data,
                                  uint32_t axis) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_frame_event(host);
   wl_pointer_send_axis_stop(host->resource, time, axis);
 }
 
@@ -240,6 +453,7 @@ static void sl_pointer_axis_discrete(void* data,
                                      int32_t discrete) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_frame_event(host);
   host->axis_discrete[axis] += discrete;
 }
 
@@ -270,23 +484,9 @@ static void sl_keyboard_keymap(void* data,
 
     assert(data != MAP_FAILED);
 
-    if (host->keymap)
-      xkb_keymap_unref(host->keymap);
-
-    host->keymap = xkb_keymap_new_from_string(
-        host->seat->ctx->xkb_context, data, XKB_KEYMAP_FORMAT_TEXT_V1, 0);
-    assert(host->keymap);
+    sl_host_keyboard_set_keymap(host, data, size);
 
     munmap(data, size);
-
-    if (host->state)
-      xkb_state_unref(host->state);
-    host->state = xkb_state_new(host->keymap);
-    assert(host->state);
-
-    host->control_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Control");
-    host->alt_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Mod1");
-    host->shift_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Shift");
   }
 
   close(fd);
@@ -302,6 +502,9 @@ static void sl_keyboard_set_focus(struct sl_host_keyboard* host,
   if (surface_resource == host->focus_resource)
     return;
 
+  // Held pointer motion happened before any keyboard or touch event.
+  sl_release_held_pointer_frames(host->seat->ctx);
+
   if (host->focus_resource)
     wl_keyboard_send_leave(host->resource, serial, host->focus_resource);
 
@@ -385,27 +588,21 @@ static void sl_keyboard_key(void* data,
   struct sl_host_keyboard* host = wl_keyboard_get_user_data(keyboard);
   int handled = 1;
 
+  sl_release_held_pointer_frames(host->seat->ctx);
+
   if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
     if (host->state) {
       const xkb_keysym_t* symbols;
       uint32_t num_symbols;
       xkb_keysym_t symbol = XKB_KEY_NoSymbol;
       uint32_t code = key + 8;
-      struct sl_accelerator* accelerator;
 
       num_symbols = xkb_state_key_get_syms(host->state, code, &symbols);
       if (num_symbols == 1)
         symbol = symbols[0];
 
-      wl_list_for_each(accelerator, &host->seat->ctx->accelerators, link) {
-        if (host->modifiers != accelerator->modifiers)
-          continue;
-        if (symbol != accelerator->symbol)
-          continue;
-
+      if (sl_is_accelerator(host->seat->ctx, host->modifiers, symbol))
         handled = 0;
-        break;
-      }
     }
 
     // Forward key pressed event if it should be handled and not
@@ -443,6 +640,7 @@ static void sl_keyboard_modifiers(void* data,
   struct sl_host_keyboard* host = wl_keyboard_get_user_data(keyboard);
   xkb_mod_mask_t mask;
 
+  sl_release_held_pointer_frames(host->seat->ctx);
   wl_keyboard_send_modifiers(host->resource, serial, mods_depressed,
                              mods_latched, mods_locked, group);
 
@@ -503,6 +701,8 @@ static void sl_host_touch_down(void* data,
   if (!host_surface)
     return;
 
+  sl_release_held_pointer_frames(host->seat->ctx);
+
   if (host_surface->resource != host->focus_resource) {
     wl_list_remove(&host->focus_resource_listener.link);
     wl_list_init(&host->focus_resource_listener.link);
@@ -512,10 +712,10 @@ static void sl_host_touch_down(void* data,
   }
 
   if (host->seat->ctx->xwayland) {
-    // Make sure focus surface is on top before sending down event.
+    // Make sure focus surface is on top before the down event is delivered.
     sl_restack_windows(host->seat->ctx,
                        wl_resource_get_id(host_surface->resource));
-    sl_roundtrip(host->seat->ctx);
+    sl_sync_x_connection(host->seat->ctx);
   }
 
   wl_touch_send_down(host->resource, serial, time, host_surface->resource, id,
@@ -533,6 +733,8 @@ static void sl_host_touch_up(void* data,
                              int32_t id) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
 
+  sl_release_held_pointer_frames(host->seat->ctx);
+
   wl_list_remove(&host->focus_resource_listener.link);
   wl_list_init(&host->focus_resource_listener.link);
   host->focus_resource = NULL;
@@ -553,6 +755,7 @@ static void sl_host_touch_motion(void* data,
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
   double scale = host->seat->ctx->scale;
 
+  sl_release_held_pointer_frames(host->seat->ctx);
   wl_touch_send_motion(host->resource, time, id, x * scale, y * scale);
 }
 
@@ -565,6 +768,7 @@ static void sl_host_touch_frame(void* data, struct wl_touch* touch) {
 static void sl_host_touch_cancel(void* data, struct wl_touch* touch) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
 
+  sl_release_held_pointer_frames(host->seat->ctx);
   wl_touch_send_cancel(host->resource);
 }
 
@@ -581,6 +785,8 @@ static void sl_destroy_host_pointer(struct wl_resource* resource) {
     wl_pointer_destroy(host->proxy);
   }
   wl_list_remove(&host->focus_resource_listener.link);
+  wl_list_remove(&host->held_link);
+  sl_host_pointer_detach_relative_pointers(host);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
@@ -622,6 +828,18 @@ static void sl_host_seat_get_host_pointer(struct wl_client* client,
   host_pointer->axis_delta[1] = wl_fixed_from_int(0);
   host_pointer->axis_discrete[0] = 0;
   host_pointer->axis_discrete[1] = 0;
+  host_pointer->coalesce_motion =
+      host->seat->ctx->coalesce_pointer_motion &&
+      wl_pointer_get_version(host_pointer->proxy) >=
+          WL_POINTER_FRAME_SINCE_VERSION;
+  wl_list_init(&host_pointer->held_link);
+  host_pointer->frame_held = 0;
+  host_pointer->frame_events = 0;
+  host_pointer->motion_pending = 0;
+  host_pointer->motion_time = 0;
+  host_pointer->motion_x = 0;
+  host_pointer->motion_y = 0;
+  wl_list_init(&host_pointer->relative_pointers);
 }
 
 static void sl_destroy_host_keyboard(struct wl_resource* resource) {
@@ -631,10 +849,7 @@ static void sl_destroy_host_keyboard(struct wl_resource* resource) {
     zcr_extended_keyboard_v1_destroy(host->extended_keyboard_proxy);
 
   wl_array_release(&host->pressed_keys);
-  if (host->keymap)
-    xkb_keymap_unref(host->keymap);
-  if (host->state)
-    xkb_state_unref(host->state);
+  sl_host_keyboard_release_keymap(host);
 
   if (wl_keyboard_get_version(host->proxy) >=
       WL_KEYBOARD_RELEASE_SINCE_VERSION) {
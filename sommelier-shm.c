@@ -5,18 +5,35 @@
 #include "sommelier.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <linux/types.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
 #include "drm-server-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 
+#define UDMABUF_FLAGS_CLOEXEC 0x01
+
+#define UDMABUF_CREATE _IOW('u', 0x42, struct udmabuf_create)
+
+struct udmabuf_create {
+  __u32 memfd;
+  __u32 flags;
+  __u64 offset;
+  __u64 size;
+};
+
 struct sl_host_shm_pool {
   struct sl_shm* shm;
   struct wl_resource* resource;
   struct wl_shm_pool* proxy;
   int fd;
+  struct sl_mmap* mmap;
+  int dmabuf_fd;
+  size_t dmabuf_size;
 };
 
 struct sl_host_shm {
@@ -121,6 +138,96 @@ static size_t sl_size_for_shm_format(uint32_t format,
   return total_size;
 }
 
+// Map the whole pool. Buffers created from the pool are views into this
+// mapping. Empty pools are valid but can't be mapped, so they get no
+// mapping until they are resized.
+static struct sl_mmap* sl_host_shm_pool_map(int fd, int32_t size) {
+  struct sl_mmap* map;
+
+  if (size <= 0)
+    return NULL;
+
+  map = sl_mmap_create(fd, size, 1, 1, 0, 0, 0, 0, 1, 1);
+
+  // In the case of mmaps created from the client pool, we want to be able
+  // to close the FD when the client releases the shm pool (i.e. when it's
+  // done transferring) as opposed to when the mapping is freed (i.e. when
+  // we're done drawing).
+  // We do this by removing the handle to the FD after it has been mmapped,
+  // which prevents a double-close.
+  map->fd = -1;
+  return map;
+}
+
+// Wrap the pool in a dmabuf that can be shared with the host. This only
+// works for memfd backed pools that the client has sealed against shrinking
+// itself. Seals can't be removed, so they are never added on the client's
+// behalf. Other pools use the copy path.
+static void sl_host_shm_pool_import(struct sl_host_shm_pool* host,
+                                    int32_t size) {
+  struct sl_context* ctx = host->shm->ctx;
+  struct udmabuf_create create = {0};
+  long page_size = sysconf(_SC_PAGESIZE);
+  int seals;
+
+  if (host->dmabuf_fd >= 0) {
+    close(host->dmabuf_fd);
+    host->dmabuf_fd = -1;
+    host->dmabuf_size = 0;
+  }
+
+  if (ctx->udmabuf_fd < 0 || !ctx->linux_dmabuf)
+    return;
+
+  seals = fcntl(host->fd, F_GET_SEALS);
+  if (seals < 0 || (seals & F_SEAL_WRITE) || !(seals & F_SEAL_SHRINK))
+    return;
+
+  create.memfd = host->fd;
+  create.flags = UDMABUF_FLAGS_CLOEXEC;
+  create.offset = 0;
+  create.size = size / page_size * page_size;
+  if (!create.size)
+    return;
+
+  host->dmabuf_fd = ioctl(ctx->udmabuf_fd, UDMABUF_CREATE, &create);
+  if (host->dmabuf_fd >= 0)
+    host->dmabuf_size = create.size;
+}
+
+static void sl_shm_buffer_params_created(
+    void* data,
+    struct zwp_linux_buffer_params_v1* params,
+    struct wl_buffer* buffer) {
+  struct sl_host_buffer* host_buffer =
+      zwp_linux_buffer_params_v1_get_user_data(params);
+
+  // Switch to the host buffer unless the client buffer is already gone.
+  if (host_buffer) {
+    host_buffer->dmabuf_params = NULL;
+    sl_host_buffer_set_proxy(host_buffer, buffer);
+  } else {
+    wl_buffer_destroy(buffer);
+  }
+  zwp_linux_buffer_params_v1_destroy(params);
+}
+
+static void sl_shm_buffer_params_failed(
+    void* data,
+    struct zwp_linux_buffer_params_v1* params) {
+  struct sl_host_buffer* host_buffer =
+      zwp_linux_buffer_params_v1_get_user_data(params);
+
+  // Keep using the copy path.
+  if (host_buffer)
+    host_buffer->dmabuf_params = NULL;
+  zwp_linux_buffer_params_v1_destroy(params);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener
+    sl_shm_buffer_params_listener = {sl_shm_buffer_params_created,
+                                     sl_shm_buffer_params_failed};
+
 static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
                                                 struct wl_resource* resource,
                                                 uint32_t id,
@@ -140,23 +247,54 @@ static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
   } else {
     struct sl_host_buffer* host_buffer =
         sl_create_host_buffer(client, id, NULL, width, height);
+    size_t size = sl_size_for_shm_format(format, height, stride);
 
     host_buffer->shm_format = format;
-    host_buffer->shm_mmap = sl_mmap_create(
-        host->fd, sl_size_for_shm_format(format, height, stride),
-        sl_shm_bpp_for_shm_format(format),
-        sl_shm_num_planes_for_shm_format(format), offset, stride,
-        offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
-        stride, sl_y_subsampling_for_shm_format_plane(format, 0),
-        sl_y_subsampling_for_shm_format_plane(format, 1));
-    // In the case of mmaps created from the client buffer, we want to be able
-    // to close the FD when the client releases the shm pool (i.e. when it's
-    // done transferring) as opposed to when the pool is freed (i.e. when we're
-    // done drawing).
-    // We do this by removing the handle to the FD after it has been mmapped,
-    // which prevents a double-close.
-    host_buffer->shm_mmap->fd = -1;
+    // Buffers are views into the pool mapping unless the pool mapping could
+    // not be grown to cover the buffer.
+    if (host->mmap && offset + size <= host->mmap->size) {
+      host_buffer->shm_mmap = sl_mmap_create_view(
+          host->mmap, size, sl_shm_bpp_for_shm_format(format),
+          sl_shm_num_planes_for_shm_format(format), offset, stride,
+          offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
+          stride, sl_y_subsampling_for_shm_format_plane(format, 0),
+          sl_y_subsampling_for_shm_format_plane(format, 1));
+    } else {
+      host_buffer->shm_mmap = sl_mmap_create(
+          host->fd, size, sl_shm_bpp_for_shm_format(format),
+          sl_shm_num_planes_for_shm_format(format), offset, stride,
+          offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
+          stride, sl_y_subsampling_for_shm_format_plane(format, 0),
+          sl_y_subsampling_for_shm_format_plane(format, 1));
+      // The FD is owned by the pool.
+      host_buffer->shm_mmap->fd = -1;
+    }
     host_buffer->shm_mmap->buffer_resource = host_buffer->resource;
+
+    // Try to share the buffer with the host directly. The copy path is used
+    // until the host has accepted the buffer.
+    if (host->dmabuf_fd >= 0 &&
+        offset + sl_size_for_shm_format(format, height, stride) <=
+            host->dmabuf_size) {
+      struct zwp_linux_buffer_params_v1* buffer_params;
+      size_t i, num_planes = sl_shm_num_planes_for_shm_format(format);
+
+      buffer_params = zwp_linux_dmabuf_v1_create_params(
+          host->shm->ctx->linux_dmabuf->internal);
+      for (i = 0; i < num_planes; ++i) {
+        zwp_linux_buffer_params_v1_add(
+            buffer_params, host->dmabuf_fd, i,
+            offset + sl_offset_for_shm_format_plane(format, height, stride, i),
+            stride, 0, 0);
+      }
+      zwp_linux_buffer_params_v1_set_user_data(buffer_params, host_buffer);
+      zwp_linux_buffer_params_v1_add_listener(
+          buffer_params, &sl_shm_buffer_params_listener, host_buffer);
+      zwp_linux_buffer_params_v1_create(buffer_params, width, height,
+                                        sl_drm_format_for_shm_format(format),
+                                        0);
+      host_buffer->dmabuf_params = buffer_params;
+    }
   }
 }
 
@@ -170,8 +308,21 @@ static void sl_host_shm_pool_resize(struct wl_client* client,
                                     int32_t size) {
   struct sl_host_shm_pool* host = wl_resource_get_user_data(resource);
 
-  if (host->proxy)
+  if (host->proxy) {
     wl_shm_pool_resize(host->proxy, size);
+    return;
+  }
+
+  // Grow the pool mapping in place. If that is not possible, buffers
+  // created after this point use a new mapping while existing buffers keep
+  // a reference to the old one.
+  if (!host->mmap || !sl_mmap_resize(host->mmap, size)) {
+    if (host->mmap)
+      sl_mmap_unref(host->mmap);
+    host->mmap = sl_host_shm_pool_map(host->fd, size);
+  }
+
+  sl_host_shm_pool_import(host, size);
 }
 
 static const struct wl_shm_pool_interface sl_shm_pool_implementation = {
@@ -181,8 +332,12 @@ static const struct wl_shm_pool_interface sl_shm_pool_implementation = {
 static void sl_destroy_host_shm_pool(struct wl_resource* resource) {
   struct sl_host_shm_pool* host = wl_resource_get_user_data(resource);
 
+  if (host->mmap)
+    sl_mmap_unref(host->mmap);
   if (host->fd >= 0)
     close(host->fd);
+  if (host->dmabuf_fd >= 0)
+    close(host->dmabuf_fd);
   if (host->proxy)
     wl_shm_pool_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
@@ -202,6 +357,9 @@ static void sl_shm_create_host_pool(struct wl_client* client,
 
   host_shm_pool->shm = host->shm;
   host_shm_pool->fd = -1;
+  host_shm_pool->mmap = NULL;
+  host_shm_pool->dmabuf_fd = -1;
+  host_shm_pool->dmabuf_size = 0;
   host_shm_pool->proxy = NULL;
   host_shm_pool->resource =
       wl_resource_create(client, &wl_shm_pool_interface, 1, id);
@@ -216,9 +374,14 @@ static void sl_shm_create_host_pool(struct wl_client* client,
       close(fd);
       break;
     case SHM_DRIVER_DMABUF:
+      host_shm_pool->fd = fd;
+      host_shm_pool->mmap = sl_host_shm_pool_map(fd, size);
+      sl_host_shm_pool_import(host_shm_pool, size);
+      break;
     case SHM_DRIVER_VIRTWL:
     case SHM_DRIVER_VIRTWL_DMABUF:
       host_shm_pool->fd = fd;
+      host_shm_pool->mmap = sl_host_shm_pool_map(fd, size);
       break;
   }
 }
@@ -0,0 +1,304 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <xcb/xproto.h>
+
+#define TRACE_MARKER_PATH "/sys/kernel/tracing/trace_marker"
+#define DEBUGFS_TRACE_MARKER_PATH "/sys/kernel/debug/tracing/trace_marker"
+
+static const char* sl_x_event_names[STATS_X_EVENT_TYPES] = {
+    [0] = "Error",
+    [XCB_FOCUS_IN] = "FocusIn",
+    [XCB_FOCUS_OUT] = "FocusOut",
+    [XCB_CREATE_NOTIFY] = "CreateNotify",
+    [XCB_DESTROY_NOTIFY] = "DestroyNotify",
+    [XCB_UNMAP_NOTIFY] = "UnmapNotify",
+    [XCB_MAP_NOTIFY] = "MapNotify",
+    [XCB_MAP_REQUEST] = "MapRequest",
+    [XCB_REPARENT_NOTIFY] = "ReparentNotify",
+    [XCB_CONFIGURE_NOTIFY] = "ConfigureNotify",
+    [XCB_CONFIGURE_REQUEST] = "ConfigureRequest",
+    [XCB_PROPERTY_NOTIFY] = "PropertyNotify",
+    [XCB_SELECTION_REQUEST] = "SelectionRequest",
+    [XCB_SELECTION_NOTIFY] = "SelectionNotify",
+    [XCB_CLIENT_MESSAGE] = "ClientMessage",
+};
+
+static uint64_t sl_now_usec(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// Returns the start time for an operation that is going to be passed to
+// sl_timing_add(), or 0 if timing is disabled.
+uint64_t sl_stats_timestamp(struct sl_context* ctx) {
+  return ctx->stats.timing ? sl_now_usec() : 0;
+}
+
+// Counts an operation that started at |start|. Returns its duration.
+uint64_t sl_timing_add(struct sl_context* ctx,
+                       struct sl_timing* timing,
+                       uint64_t start) {
+  uint64_t usec;
+
+  timing->count++;
+  if (!start)
+    return 0;
+
+  usec = sl_now_usec() - start;
+  timing->usec += usec;
+  timing->max_usec = MAX(timing->max_usec, usec);
+  return usec;
+}
+
+// Trace markers use the systrace format that is understood by Perfetto.
+void sl_trace_begin(struct sl_context* ctx, const char* name) {
+  char marker[64];
+  int length;
+
+  if (ctx->stats.trace_fd < 0)
+    return;
+
+  length = snprintf(marker, sizeof(marker), "B|%d|%s", getpid(), name);
+  if (write(ctx->stats.trace_fd, marker, MIN(length, sizeof(marker) - 1)) < 0)
+    return;
+}
+
+void sl_trace_end(struct sl_context* ctx) {
+  char marker[16];
+  int length;
+
+  if (ctx->stats.trace_fd < 0)
+    return;
+
+  length = snprintf(marker, sizeof(marker), "E|%d", getpid());
+  if (write(ctx->stats.trace_fd, marker, length) < 0)
+    return;
+}
+
+void sl_data_transfer_stats_add(struct sl_data_transfer_stats* stats,
+                                uint64_t bytes,
+                                int spliced,
+                                const struct timespec* start_time) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  stats->transfers++;
+  stats->bytes += bytes;
+  if (spliced)
+    stats->spliced_bytes += bytes;
+  stats->last_bytes = bytes;
+  stats->last_usec = (now.tv_sec - start_time->tv_sec) * 1000000 +
+                     (now.tv_nsec - start_time->tv_nsec) / 1000;
+  stats->usec += stats->last_usec;
+}
+
+static void sl_print_timing(FILE* file,
+                            const char* name,
+                            struct sl_timing* timing) {
+  fprintf(file,
+          "%s: %" PRIu64 " times, %.1f us average, %" PRIu64 " us max\n", name,
+          timing->count,
+          timing->count ? (double)timing->usec / timing->count : 0.0,
+          timing->max_usec);
+}
+
+static void sl_print_virtwl_stats(FILE* file,
+                                  const char* direction,
+                                  struct sl_virtwl_stats* stats) {
+  fprintf(file,
+          "virtwl %s: %" PRIu64 " messages, %" PRIu64 " bytes, %" PRIu64
+          " fds, %" PRIu64 " ioctls\n",
+          direction, stats->messages, stats->bytes, stats->fds,
+          stats->ioctls);
+}
+
+static void sl_print_data_transfer_stats(FILE* file,
+                                         const char* name,
+                                         struct sl_data_transfer_stats* stats) {
+  // Throughput in bytes per microsecond is the same as MB/s.
+  fprintf(file,
+          "%s: %" PRIu64 " transfers, %" PRIu64 " bytes (%" PRIu64
+          " spliced), %.1f MB/s; last: %" PRIu64 " bytes, %.1f MB/s\n",
+          name, stats->transfers, stats->bytes, stats->spliced_bytes,
+          stats->usec ? (double)stats->bytes / stats->usec : 0.0,
+          stats->last_bytes,
+          stats->last_usec ? (double)stats->last_bytes / stats->last_usec
+                           : 0.0);
+}
+
+void sl_stats_report(struct sl_context* ctx, FILE* file) {
+  struct sl_stats* stats = &ctx->stats;
+  struct sl_host_surface* surface;
+  uint64_t now = sl_now_usec();
+  int i;
+
+  fprintf(file,
+          "commits: %" PRIu64 ", %" PRIu64 " coalesced, copied %" PRIu64
+          " bytes, %.1f MB/s\n",
+          stats->commits, stats->coalesced_commits, stats->copy_bytes,
+          stats->copies.usec ? (double)stats->copy_bytes / stats->copies.usec
+                             : 0.0);
+  sl_print_timing(file, "copies", &stats->copies);
+  fprintf(file, "configures: %" PRIu64 " sent to X, %" PRIu64 " coalesced\n",
+          stats->configures, stats->coalesced_configures);
+  fprintf(file,
+          "output buffers: %" PRIu64 " allocated, %" PRIu64
+          " reused by surface, %" PRIu64 " reused from pool, pool %zu/%zu"
+          " bytes\n",
+          stats->buffer_allocations, stats->buffer_surface_reuses,
+          stats->buffer_pool_reuses, ctx->output_buffer_pool_size,
+          ctx->output_buffer_pool_limit);
+  fprintf(file, "output buffer memory: %zu bytes, budget %zu bytes\n",
+          ctx->output_buffer_size, ctx->output_buffer_budget);
+  fprintf(file,
+          "cursor cache: %" PRIu64 " hits, %" PRIu64 " misses, %d buffers\n",
+          stats->cursor_cache_hits, stats->cursor_cache_misses,
+          ctx->cursor_cache_length);
+  fprintf(file, "keymap cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+          stats->keymap_cache_hits, stats->keymap_cache_misses);
+  // Host reads and post dispatch checks of the X connection used to flush
+  // their connection in addition to the flush at the end of each iteration.
+  fprintf(file,
+          "event loop: %" PRIu64 " iterations, %" PRIu64
+          " redundant flushes avoided\n",
+          stats->loop_iterations, stats->host_reads + stats->x_event_checks);
+  fprintf(file,
+          "host events: %" PRIu64 " in %" PRIu64 " reads, %.1f per read\n",
+          stats->host_events, stats->host_reads,
+          stats->host_reads ? (double)stats->host_events / stats->host_reads
+                            : 0.0);
+  fprintf(file,
+          "x events: %" PRIu64 " in %" PRIu64
+          " batches, %.1f per batch, %" PRIu64 " full batches deferred\n",
+          stats->x_events_handled, stats->x_event_batches,
+          stats->x_event_batches
+              ? (double)stats->x_events_handled / stats->x_event_batches
+              : 0.0,
+          stats->x_events_deferred);
+  sl_print_timing(file, "frame callbacks", &stats->frame_callbacks);
+
+  wl_list_for_each(surface, &ctx->host_surfaces, link) {
+    uint64_t age = surface->create_usec ? now - surface->create_usec : 0;
+
+    fprintf(file,
+            "surface %u: %" PRIu64 " commits, %.1f per second, copied %" PRIu64
+            " bytes in %" PRIu64 " us\n",
+            wl_resource_get_id(surface->resource), surface->commits,
+            age ? surface->commits * 1000000.0 / age : 0.0,
+            surface->copy_bytes, surface->copy_usec);
+  }
+
+  for (i = 0; i < STATS_X_EVENT_TYPES; ++i) {
+    char name[32];
+
+    if (!stats->x_events[i].count)
+      continue;
+
+    if (sl_x_event_names[i])
+      snprintf(name, sizeof(name), "x event %s", sl_x_event_names[i]);
+    else
+      snprintf(name, sizeof(name), "x event %d", i);
+    sl_print_timing(file, name, &stats->x_events[i]);
+  }
+
+  if (ctx->virtwl_ctx_fd >= 0) {
+    sl_print_virtwl_stats(file, "send", &ctx->virtwl_send_stats);
+    sl_print_virtwl_stats(file, "recv", &ctx->virtwl_recv_stats);
+  }
+  sl_print_data_transfer_stats(file, "data transfers",
+                               &ctx->data_transfer_stats);
+  sl_print_data_transfer_stats(file, "selection transfers",
+                               &ctx->selection_transfer_stats);
+
+  fprintf(file,
+          "queued: %d x requests, %d selection sends, %d selection"
+          " receives\n",
+          wl_list_length(&ctx->x_requests),
+          wl_list_length(&ctx->selection_data_source_send_pending),
+          wl_list_length(&ctx->selection_data_offer_receives));
+}
+
+static int sl_handle_stats_socket_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  int client_fd;
+  FILE* file;
+
+  client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+  if (client_fd < 0)
+    return 1;
+
+  // The report is small enough to be written out in one go.
+  file = fdopen(client_fd, "w");
+  if (!file) {
+    close(client_fd);
+    return 1;
+  }
+  sl_stats_report(ctx, file);
+  fclose(file);
+
+  return 1;
+}
+
+// Starts listening for stats requests on |socket_path| and opens the trace
+// marker file if |trace| is set. Durations are only measured when the stats
+// socket is used.
+int sl_stats_init(struct sl_context* ctx, const char* socket_path, int trace) {
+  if (socket_path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "error: stats socket path too long\n");
+      return 0;
+    }
+
+    addr.sun_family = AF_LOCAL;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    unlink(addr.sun_path);
+
+    fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 ||
+        bind(fd, (struct sockaddr*)&addr,
+             offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path)) <
+            0 ||
+        listen(fd, 4) < 0) {
+      fprintf(stderr, "error: failed to listen on %s: %m\n", socket_path);
+      if (fd >= 0)
+        close(fd);
+      return 0;
+    }
+
+    ctx->stats.socket_fd = fd;
+    ctx->stats.socket_event_source = wl_event_loop_add_fd(
+        wl_display_get_event_loop(ctx->host_display), fd, WL_EVENT_READABLE,
+        sl_handle_stats_socket_event, ctx);
+    ctx->stats.timing = 1;
+  }
+
+  if (trace) {
+    ctx->stats.trace_fd = open(TRACE_MARKER_PATH, O_WRONLY | O_CLOEXEC);
+    if (ctx->stats.trace_fd < 0)
+      ctx->stats.trace_fd =
+          open(DEBUGFS_TRACE_MARKER_PATH, O_WRONLY | O_CLOEXEC);
+    if (ctx->stats.trace_fd < 0)
+      fprintf(stderr, "warning: failed to open trace marker: %m\n");
+  }
+
+  return 1;
+}
@@ -18,8 +18,13 @@ struct sl_host_subsurface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_subsurface* proxy;
+  // Position and stacking apply with the next commit of the parent.
+  struct sl_host_surface* parent;
+  struct wl_listener parent_listener;
 };
 
+static void sl_subsurface_apply_held_request(struct sl_held_request* request);
+
 static void sl_subsurface_destroy(struct wl_client* client,
                                   struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -30,8 +35,17 @@ static void sl_subsurface_set_position(struct wl_client* client,
                                        int32_t x,
                                        int32_t y) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host->parent, resource, WL_SUBSURFACE_SET_POSITION,
+      sl_subsurface_apply_held_request);
   double scale = host->ctx->scale;
 
+  if (request) {
+    request->args[0] = x;
+    request->args[1] = y;
+    return;
+  }
+
   wl_subsurface_set_position(host->proxy, x / scale, y / scale);
 }
 
@@ -41,6 +55,14 @@ static void sl_subsurface_place_above(struct wl_client* client,
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
   struct sl_host_surface* host_sibling =
       wl_resource_get_user_data(sibling_resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host->parent, resource, WL_SUBSURFACE_PLACE_ABOVE,
+      sl_subsurface_apply_held_request);
+
+  if (request) {
+    sl_held_request_set_object(request, sibling_resource);
+    return;
+  }
 
   wl_subsurface_place_above(host->proxy, host_sibling->proxy);
 }
@@ -51,6 +73,14 @@ static void sl_subsurface_place_below(struct wl_client* client,
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
   struct sl_host_surface* host_sibling =
       wl_resource_get_user_data(sibling_resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host->parent, resource, WL_SUBSURFACE_PLACE_BELOW,
+      sl_subsurface_apply_held_request);
+
+  if (request) {
+    sl_held_request_set_object(request, sibling_resource);
+    return;
+  }
 
   wl_subsurface_place_below(host->proxy, host_sibling->proxy);
 }
@@ -69,6 +99,23 @@ static void sl_subsurface_set_desync(struct wl_client* client,
   wl_subsurface_set_desync(host->proxy);
 }
 
+static void sl_subsurface_apply_held_request(struct sl_held_request* request) {
+  switch (request->opcode) {
+    case WL_SUBSURFACE_SET_POSITION:
+      sl_subsurface_set_position(NULL, request->resource, request->args[0],
+                                 request->args[1]);
+      break;
+    case WL_SUBSURFACE_PLACE_ABOVE:
+      if (request->object)
+        sl_subsurface_place_above(NULL, request->resource, request->object);
+      break;
+    case WL_SUBSURFACE_PLACE_BELOW:
+      if (request->object)
+        sl_subsurface_place_below(NULL, request->resource, request->object);
+      break;
+  }
+}
+
 static const struct wl_subsurface_interface sl_subsurface_implementation = {
     sl_subsurface_destroy,     sl_subsurface_set_position,
     sl_subsurface_place_above, sl_subsurface_place_below,
@@ -77,6 +124,7 @@ static const struct wl_subsurface_interface sl_subsurface_implementation = {
 static void sl_destroy_host_subsurface(struct wl_resource* resource) {
   struct sl_host_subsurface* host = wl_resource_get_user_data(resource);
 
+  wl_list_remove(&host->parent_listener.link);
   wl_subsurface_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
   free(host);
@@ -87,6 +135,16 @@ static void sl_subcompositor_destroy(struct wl_client* client,
   wl_resource_destroy(resource);
 }
 
+static void sl_subsurface_parent_destroyed(struct wl_listener* listener,
+                                           void* data) {
+  struct sl_host_subsurface* host =
+      wl_container_of(listener, host, parent_listener);
+
+  wl_list_remove(&host->parent_listener.link);
+  wl_list_init(&host->parent_listener.link);
+  host->parent = NULL;
+}
+
 static void sl_subcompositor_get_subsurface(
     struct wl_client* client,
     struct wl_resource* resource,
@@ -112,6 +170,10 @@ static void sl_subcompositor_get_subsurface(
   host_subsurface->proxy = wl_subcompositor_get_subsurface(
       host->proxy, host_surface->proxy, host_parent->proxy);
   wl_subsurface_set_user_data(host_subsurface->proxy, host_subsurface);
+  host_subsurface->parent = host_parent;
+  host_subsurface->parent_listener.notify = sl_subsurface_parent_destroyed;
+  wl_resource_add_destroy_listener(parent_resource,
+                                   &host_subsurface->parent_listener);
   host_surface->has_role = 1;
 }
 
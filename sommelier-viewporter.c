@@ -26,6 +26,8 @@ static void sl_viewport_destroy(struct wl_client* client,
   wl_resource_destroy(resource);
 }
 
+static void sl_viewport_apply_held_request(struct sl_held_request* request);
+
 static void sl_viewport_set_source(struct wl_client* client,
                                    struct wl_resource* resource,
                                    wl_fixed_t x,
@@ -33,6 +35,17 @@ static void sl_viewport_set_source(struct wl_client* client,
                                    wl_fixed_t width,
                                    wl_fixed_t height) {
   struct sl_host_viewport* host = wl_resource_get_user_data(resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host->viewport.host_surface, resource, WP_VIEWPORT_SET_SOURCE,
+      sl_viewport_apply_held_request);
+
+  if (request) {
+    request->args[0] = x;
+    request->args[1] = y;
+    request->args[2] = width;
+    request->args[3] = height;
+    return;
+  }
 
   host->viewport.src_x = x;
   host->viewport.src_y = y;
@@ -45,11 +58,34 @@ static void sl_viewport_set_destination(struct wl_client* client,
                                         int32_t width,
                                         int32_t height) {
   struct sl_host_viewport* host = wl_resource_get_user_data(resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host->viewport.host_surface, resource, WP_VIEWPORT_SET_DESTINATION,
+      sl_viewport_apply_held_request);
+
+  if (request) {
+    request->args[0] = width;
+    request->args[1] = height;
+    return;
+  }
 
   host->viewport.dst_width = width;
   host->viewport.dst_height = height;
 }
 
+static void sl_viewport_apply_held_request(struct sl_held_request* request) {
+  int32_t* args = request->args;
+
+  switch (request->opcode) {
+    case WP_VIEWPORT_SET_SOURCE:
+      sl_viewport_set_source(NULL, request->resource, args[0], args[1],
+                             args[2], args[3]);
+      break;
+    case WP_VIEWPORT_SET_DESTINATION:
+      sl_viewport_set_destination(NULL, request->resource, args[0], args[1]);
+      break;
+  }
+}
+
 static const struct wp_viewport_interface sl_viewport_implementation = {
     sl_viewport_destroy, sl_viewport_set_source, sl_viewport_set_destination};
 
@@ -77,6 +113,7 @@ static void sl_viewporter_get_viewport(struct wl_client* client,
   host_viewport = malloc(sizeof(*host_viewport));
   assert(host_viewport);
 
+  host_viewport->viewport.host_surface = host_surface;
   host_viewport->viewport.src_x = -1;
   host_viewport->viewport.src_y = -1;
   host_viewport->viewport.src_width = -1;
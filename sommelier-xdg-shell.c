@@ -20,6 +20,8 @@ struct sl_host_xdg_surface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct xdg_surface* proxy;
+  struct sl_host_surface* host_surface;
+  struct wl_listener host_surface_listener;
 };
 
 struct sl_host_xdg_toplevel {
@@ -399,6 +401,10 @@ static void sl_xdg_surface_get_popup(struct wl_client* client,
                          host_xdg_popup);
 }
 
+static void sl_xdg_surface_apply_held_request(
+    struct sl_held_request* request);
+
+// Window geometry and configure acks apply with the next surface commit.
 static void sl_xdg_surface_set_window_geometry(struct wl_client* client,
                                                struct wl_resource* resource,
                                                int32_t x,
@@ -406,9 +412,20 @@ static void sl_xdg_surface_set_window_geometry(struct wl_client* client,
                                                int32_t width,
                                                int32_t height) {
   struct sl_host_xdg_surface* host = wl_resource_get_user_data(resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host->host_surface, resource, XDG_SURFACE_SET_WINDOW_GEOMETRY,
+      sl_xdg_surface_apply_held_request);
   double scale = host->ctx->scale;
   int32_t x1, y1, x2, y2;
 
+  if (request) {
+    request->args[0] = x;
+    request->args[1] = y;
+    request->args[2] = width;
+    request->args[3] = height;
+    return;
+  }
+
   x1 = x / scale;
   y1 = y / scale;
   x2 = (x + width) / scale;
@@ -421,10 +438,33 @@ static void sl_xdg_surface_ack_configure(struct wl_client* client,
                                          struct wl_resource* resource,
                                          uint32_t serial) {
   struct sl_host_xdg_surface* host = wl_resource_get_user_data(resource);
+  struct sl_held_request* request = sl_host_surface_hold_request(
+      host->host_surface, resource, XDG_SURFACE_ACK_CONFIGURE,
+      sl_xdg_surface_apply_held_request);
+
+  if (request) {
+    request->args[0] = serial;
+    return;
+  }
 
   xdg_surface_ack_configure(host->proxy, serial);
 }
 
+static void sl_xdg_surface_apply_held_request(
+    struct sl_held_request* request) {
+  int32_t* args = request->args;
+
+  switch (request->opcode) {
+    case XDG_SURFACE_SET_WINDOW_GEOMETRY:
+      sl_xdg_surface_set_window_geometry(NULL, request->resource, args[0],
+                                         args[1], args[2], args[3]);
+      break;
+    case XDG_SURFACE_ACK_CONFIGURE:
+      sl_xdg_surface_ack_configure(NULL, request->resource, args[0]);
+      break;
+  }
+}
+
 static const struct xdg_surface_interface sl_xdg_surface_implementation = {
     sl_xdg_surface_destroy, sl_xdg_surface_get_toplevel,
     sl_xdg_surface_get_popup, sl_xdg_surface_set_window_geometry,
@@ -444,6 +484,7 @@ static const struct xdg_surface_listener sl_xdg_surface_listener = {
 static void sl_destroy_host_xdg_surface(struct wl_resource* resource) {
   struct sl_host_xdg_surface* host = wl_resource_get_user_data(resource);
 
+  wl_list_remove(&host->host_surface_listener.link);
   xdg_surface_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
   free(host);
@@ -473,6 +514,17 @@ static void sl_xdg_shell_create_positioner(struct wl_client* client,
   xdg_positioner_set_user_data(host_xdg_positioner->proxy, host_xdg_positioner);
 }
 
+static void sl_xdg_surface_host_surface_destroyed(
+    struct wl_listener* listener,
+    void* data) {
+  struct sl_host_xdg_surface* host =
+      wl_container_of(listener, host, host_surface_listener);
+
+  wl_list_remove(&host->host_surface_listener.link);
+  wl_list_init(&host->host_surface_listener.link);
+  host->host_surface = NULL;
+}
+
 static void sl_xdg_shell_get_xdg_surface(struct wl_client* client,
                                          struct wl_resource* resource,
                                          uint32_t id,
@@ -496,6 +548,11 @@ static void sl_xdg_shell_get_xdg_surface(struct wl_client* client,
   xdg_surface_set_user_data(host_xdg_surface->proxy, host_xdg_surface);
   xdg_surface_add_listener(host_xdg_surface->proxy, &sl_xdg_surface_listener,
                            host_xdg_surface);
+  host_xdg_surface->host_surface = host_surface;
+  host_xdg_surface->host_surface_listener.notify =
+      sl_xdg_surface_host_surface_destroyed;
+  wl_resource_add_destroy_listener(surface_resource,
+                                   &host_xdg_surface->host_surface_listener);
   host_surface->has_role = 1;
 }
 
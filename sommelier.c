@@ -11,6 +11,9 @@
 #include <libgen.h>
 #include <linux/virtwl.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +24,7 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <xcb/composite.h>
@@ -160,6 +164,34 @@ struct sl_mwm_hints {
   uint32_t status;
 };
 
+// Maximum number of replies an asynchronous X request can wait for.
+#define X_REQUEST_MAX_REPLIES 16
+
+// Maximum number of X events handled before the other connections get a
+// chance to be serviced.
+#define X_EVENT_BATCH_SIZE 64
+
+// Longest time a configure is held back for the host to present the
+// contents of the previous one during an interactive resize.
+#define CONFIGURE_FRAME_TIMEOUT_MS 100
+
+struct sl_x_request;
+
+typedef void (*sl_x_request_handler_t)(struct sl_context* ctx,
+                                       struct sl_x_request* request);
+
+// A set of X requests for a window that are handled together once all of
+// their replies have arrived.
+struct sl_x_request {
+  struct wl_list link;
+  struct sl_window* window;
+  sl_x_request_handler_t handler;
+  int num_replies;
+  int num_received;
+  unsigned int sequences[X_REQUEST_MAX_REPLIES];
+  void* replies[X_REQUEST_MAX_REPLIES];
+};
+
 #define NET_WM_MOVERESIZE_SIZE_TOPLEFT 0
 #define NET_WM_MOVERESIZE_SIZE_TOP 1
 #define NET_WM_MOVERESIZE_SIZE_TOPRIGHT 2
@@ -195,6 +227,51 @@ struct sl_mwm_hints {
 #define LOCK_SUFFIX ".lock"
 #define LOCK_SUFFIXLEN 5
 
+#define UDMABUF_DEVICE "/dev/udmabuf"
+
+// Default memory limit for idle output buffers.
+#define DEFAULT_BUFFER_POOL_SIZE (64 * 1024 * 1024)
+
+// Default time in seconds after which unused output buffers are freed.
+#define DEFAULT_BUFFER_IDLE_TIMEOUT 30
+
+// Default virtwl transaction payload size, matching a single page including
+// the transaction header.
+#define DEFAULT_VIRTWL_BUFFER_SIZE (4096 - sizeof(struct virtwl_ioctl_txn))
+
+// Default number of damage copy worker threads. Every peer sommelier gets
+// its own engine, so the default stays at a single helper thread. Large
+// copies are then split between it and the main thread, which gets most of
+// the gain on memory bound copies without piling up idle threads per client.
+#define DEFAULT_COPY_THREADS 1
+
+// Maximum number of messages combined into one virtwl forwarding step.
+#define VIRTWL_MAX_BATCH 32
+
+// Lazily started Xwayland listens on the first free display up to this one.
+#define X11_MAX_DISPLAY 32
+
+#define X11_SOCKET_DIR "/tmp/.X11-unix"
+#define X11_LOCK_FORMAT "/tmp/.X%d-lock"
+
+// X11 lock files hold the pid of the server as "%10d\n".
+#define X11_LOCK_SIZE 11
+
+#define MAX_PEER_POOL_SIZE 16
+
+// Default number of seconds that pre-forked peers wait for a client.
+#define DEFAULT_PEER_IDLE_TIMEOUT 60
+
+// Selection data is transferred in chunks of at most this size, or less if
+// the X server limits request length further.
+#define SELECTION_MAX_CHUNK_SIZE (1024 * 1024)
+
+// Limit for data buffered by all Wayland to X selection transfers.
+#define SELECTION_MEMORY_LIMIT (16 * 1024 * 1024)
+
+// Room left in a request for the ChangeProperty and BIG-REQUESTS headers.
+#define SELECTION_REQUEST_HEADER_SIZE 32
+
 #define APPLICATION_ID_FORMAT_PREFIX "org.chromium.termina"
 #define XID_APPLICATION_ID_FORMAT APPLICATION_ID_FORMAT_PREFIX ".xid.%d"
 #define WM_CLIENT_LEADER_APPLICATION_ID_FORMAT \
@@ -247,6 +324,9 @@ struct sl_mmap* sl_mmap_create(int fd,
   map->begin_write = NULL;
   map->end_write = NULL;
   map->buffer_resource = NULL;
+  map->parent = NULL;
+  map->bo = NULL;
+  map->bo_map_data = NULL;
   map->addr =
       mmap(NULL, size + offset0, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   errno_assert(map->addr != MAP_FAILED);
@@ -254,6 +334,112 @@ struct sl_mmap* sl_mmap_create(int fd,
   return map;
 }
 
+struct sl_mmap* sl_mmap_create_view(struct sl_mmap* parent,
+                                    size_t size,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1) {
+  struct sl_mmap* map;
+
+  assert(!parent->parent);
+  assert(size + offset0 <= parent->size);
+
+  map = malloc(sizeof(*map));
+  assert(map);
+  map->refcount = 1;
+  map->fd = -1;
+  map->size = size;
+  map->num_planes = num_planes;
+  map->bpp = bpp;
+  map->offset[0] = offset0;
+  map->stride[0] = stride0;
+  map->offset[1] = offset1;
+  map->stride[1] = stride1;
+  map->y_ss[0] = y_ss0;
+  map->y_ss[1] = y_ss1;
+  map->begin_write = NULL;
+  map->end_write = NULL;
+  map->buffer_resource = NULL;
+  map->parent = sl_mmap_ref(parent);
+  map->bo = NULL;
+  map->bo_map_data = NULL;
+  map->addr = parent->addr;
+
+  return map;
+}
+
+static void sl_gbm_begin_write(struct sl_mmap* map) {
+  uint32_t stride;
+
+  // Contents outside of the damage are preserved, so the mapping needs to
+  // be readable too. The driver takes care of tiling on unmap.
+  // Callers check |addr| and fall back to a linear buffer on failure.
+  map->addr = gbm_bo_map(map->bo, 0, 0, gbm_bo_get_width(map->bo),
+                         gbm_bo_get_height(map->bo), GBM_BO_TRANSFER_READ_WRITE,
+                         &stride, &map->bo_map_data);
+  if (map->addr)
+    map->stride[0] = stride;
+}
+
+static void sl_gbm_end_write(struct sl_mmap* map) {
+  gbm_bo_unmap(map->bo, map->bo_map_data);
+  map->addr = NULL;
+  map->bo_map_data = NULL;
+}
+
+// Creates a mapping for a buffer that can't be accessed directly, such as one
+// with a tiled layout. Takes ownership of |bo| and its dmabuf |fd|.
+struct sl_mmap* sl_mmap_create_gbm(struct gbm_bo* bo,
+                                   int fd,
+                                   size_t size,
+                                   size_t bpp) {
+  struct sl_mmap* map;
+
+  map = malloc(sizeof(*map));
+  assert(map);
+  map->refcount = 1;
+  map->fd = fd;
+  map->size = size;
+  map->num_planes = 1;
+  map->bpp = bpp;
+  map->offset[0] = 0;
+  map->stride[0] = gbm_bo_get_stride(bo);
+  map->offset[1] = 0;
+  map->stride[1] = 0;
+  map->y_ss[0] = 1;
+  map->y_ss[1] = 1;
+  map->begin_write = sl_gbm_begin_write;
+  map->end_write = sl_gbm_end_write;
+  map->buffer_resource = NULL;
+  map->parent = NULL;
+  map->bo = bo;
+  map->bo_map_data = NULL;
+  map->addr = NULL;
+
+  return map;
+}
+
+int sl_mmap_resize(struct sl_mmap* map, size_t size) {
+  void* addr;
+
+  assert(!map->parent);
+  assert(!map->bo);
+
+  // Views point into the mapping so it can't be moved.
+  addr = mremap(map->addr, map->size + map->offset[0], size + map->offset[0],
+                0);
+  if (addr == MAP_FAILED)
+    return 0;
+
+  map->size = size;
+  return 1;
+}
+
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map) {
   map->refcount++;
   return map;
@@ -261,7 +447,12 @@ struct sl_mmap* sl_mmap_ref(struct sl_mmap* map) {
 
 void sl_mmap_unref(struct sl_mmap* map) {
   if (map->refcount-- == 1) {
-    munmap(map->addr, map->size + map->offset[0]);
+    if (map->parent)
+      sl_mmap_unref(map->parent);
+    else if (map->bo)
+      gbm_bo_destroy(map->bo);
+    else
+      munmap(map->addr, map->size + map->offset[0]);
     if (map->fd != -1)
       close(map->fd);
     free(map);
@@ -274,6 +465,7 @@ struct sl_sync_point* sl_sync_point_create(int fd) {
   sync_point = malloc(sizeof(*sync_point));
   sync_point->fd = fd;
   sync_point->sync = NULL;
+  sync_point->data = NULL;
 
   return sync_point;
 }
@@ -332,6 +524,8 @@ static void sl_adjust_window_position_for_screen_size(
 static void sl_configure_window(struct sl_window* window) {
   assert(!window->pending_config.serial);
 
+  window->ctx->stats.configures++;
+
   if (window->next_config.mask) {
     int values[5];
     int x = window->x;
@@ -433,9 +627,88 @@ void sl_restack_windows(struct sl_context* ctx, uint32_t focus_resource_id) {
   }
 }
 
-void sl_roundtrip(struct sl_context* ctx) {
-  free(xcb_get_input_focus_reply(ctx->connection,
-                                 xcb_get_input_focus(ctx->connection), NULL));
+// Makes sure that the X server has processed all requests made so far
+// before more events are delivered to Wayland clients, without waiting for
+// it here. Xwayland receives X requests and Wayland events on separate
+// connections, so for example a restack must reach it before the enter
+// event that depends on it.
+void sl_sync_x_connection(struct sl_context* ctx) {
+  if (ctx->x_sync_pending)
+    xcb_discard_reply(ctx->connection, ctx->x_sync_sequence);
+
+  ctx->x_sync_sequence = xcb_get_input_focus(ctx->connection).sequence;
+  ctx->x_sync_pending = 1;
+}
+
+// Returns 1 until the reply for the last sync has arrived.
+static int sl_x_sync_pending(struct sl_context* ctx) {
+  xcb_generic_error_t* error = NULL;
+  void* reply = NULL;
+
+  if (!ctx->x_sync_pending)
+    return 0;
+
+  if (!xcb_poll_for_reply(ctx->connection, ctx->x_sync_sequence, &reply,
+                          &error))
+    return 1;
+
+  free(reply);
+  free(error);
+  ctx->x_sync_pending = 0;
+  return 0;
+}
+
+static void sl_window_cancel_configure_frame(struct sl_window* window) {
+  if (window->configure_frame_callback) {
+    wl_callback_destroy(window->configure_frame_callback);
+    window->configure_frame_callback = NULL;
+  }
+  if (window->configure_frame_timer) {
+    wl_event_source_remove(window->configure_frame_timer);
+    window->configure_frame_timer = NULL;
+  }
+}
+
+// Sends the next configure to X and acks it right away if the contents
+// already have the right size.
+static void sl_window_apply_next_config(struct sl_window* window) {
+  struct wl_resource* host_resource;
+  struct sl_host_surface* host_surface = NULL;
+
+  host_resource =
+      wl_client_get_object(window->ctx->client, window->host_surface_id);
+  if (host_resource)
+    host_surface = wl_resource_get_user_data(host_resource);
+
+  sl_configure_window(window);
+
+  if (sl_process_pending_configure_acks(window, host_surface)) {
+    if (host_surface)
+      sl_host_surface_commit_state(host_surface);
+  }
+}
+
+static void sl_window_configure_frame_done(void* data,
+                                           struct wl_callback* callback,
+                                           uint32_t time) {
+  struct sl_window* window = (struct sl_window*)data;
+
+  sl_window_cancel_configure_frame(window);
+
+  if (window->next_config.serial && !window->pending_config.serial)
+    sl_window_apply_next_config(window);
+}
+
+static const struct wl_callback_listener sl_window_configure_frame_listener = {
+    sl_window_configure_frame_done};
+
+// The host might never present the contents, e.g. when the window is
+// hidden, so don't hold back the next configure for long.
+static int sl_handle_configure_frame_timer(void* data) {
+  struct sl_window* window = (struct sl_window*)data;
+
+  sl_window_configure_frame_done(window, NULL, 0);
+  return 1;
 }
 
 int sl_process_pending_configure_acks(struct sl_window* window,
@@ -460,7 +733,23 @@ int sl_process_pending_configure_acks(struct sl_window* window,
   }
   window->pending_config.serial = 0;
 
-  if (window->next_config.serial)
+  // Clients redraw at every size they are configured to. While the host
+  // drives an interactive resize, send at most one size per host frame and
+  // let newer configures replace the one that is waiting.
+  if (window->resizing && host_surface && !window->configure_frame_callback) {
+    window->configure_frame_callback = wl_surface_frame(host_surface->proxy);
+    wl_callback_add_listener(window->configure_frame_callback,
+                             &sl_window_configure_frame_listener, window);
+    window->configure_frame_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(window->ctx->host_display),
+        sl_handle_configure_frame_timer, window);
+    if (window->configure_frame_timer) {
+      wl_event_source_timer_update(window->configure_frame_timer,
+                                   CONFIGURE_FRAME_TIMEOUT_MS);
+    }
+  }
+
+  if (window->next_config.serial && !window->configure_frame_callback)
     sl_configure_window(window);
 
   return 1;
@@ -471,23 +760,12 @@ static void sl_internal_xdg_surface_configure(void* data,
                                               uint32_t serial) {
   struct sl_window* window = xdg_surface_get_user_data(xdg_surface);
 
+  // The newest configure replaces one that has not been sent to X yet.
+  if (window->next_config.serial)
+    window->ctx->stats.coalesced_configures++;
   window->next_config.serial = serial;
-  if (!window->pending_config.serial) {
-    struct wl_resource* host_resource;
-    struct sl_host_surface* host_surface = NULL;
-
-    host_resource =
-        wl_client_get_object(window->ctx->client, window->host_surface_id);
-    if (host_resource)
-      host_surface = wl_resource_get_user_data(host_resource);
-
-    sl_configure_window(window);
-
-    if (sl_process_pending_configure_acks(window, host_surface)) {
-      if (host_surface)
-        wl_surface_commit(host_surface->proxy);
-    }
-  }
+  if (!window->pending_config.serial && !window->configure_frame_callback)
+    sl_window_apply_next_config(window);
 }
 
 static const struct xdg_surface_listener sl_internal_xdg_surface_listener = {
@@ -528,6 +806,7 @@ static void sl_internal_xdg_toplevel_configure(
   }
 
   window->allow_resize = 1;
+  window->resizing = 0;
   wl_array_for_each(state, states) {
     if (*state == XDG_TOPLEVEL_STATE_FULLSCREEN) {
       window->allow_resize = 0;
@@ -543,8 +822,10 @@ static void sl_internal_xdg_toplevel_configure(
     }
     if (*state == XDG_TOPLEVEL_STATE_ACTIVATED)
       activated = 1;
-    if (*state == XDG_TOPLEVEL_STATE_RESIZING)
+    if (*state == XDG_TOPLEVEL_STATE_RESIZING) {
       window->allow_resize = 0;
+      window->resizing = 1;
+    }
   }
 
   if (activated != window->activated) {
@@ -593,6 +874,29 @@ static void sl_internal_xdg_popup_done(void* data,
 static const struct xdg_popup_listener sl_internal_xdg_popup_listener = {
     sl_internal_xdg_popup_configure, sl_internal_xdg_popup_done};
 
+static void sl_internal_aura_surface_occlusion_changed(
+    void* data,
+    struct zaura_surface* aura_surface,
+    wl_fixed_t occlusion_fraction,
+    uint32_t occlusion_reason) {
+  struct sl_window* window = zaura_surface_get_user_data(aura_surface);
+  struct wl_resource* host_resource;
+  struct sl_host_surface* host_surface;
+
+  host_resource =
+      wl_client_get_object(window->ctx->client, window->host_surface_id);
+  if (!host_resource)
+    return;
+
+  host_surface = wl_resource_get_user_data(host_resource);
+  host_surface->contents_occluded =
+      occlusion_fraction >= wl_fixed_from_int(1);
+  sl_host_surface_update_visibility(host_surface);
+}
+
+static const struct zaura_surface_listener sl_internal_aura_surface_listener =
+    {sl_internal_aura_surface_occlusion_changed};
+
 static void sl_window_set_wm_state(struct sl_window* window, int state) {
   struct sl_context* ctx = window->ctx;
   uint32_t values[2];
@@ -669,6 +973,7 @@ void sl_window_update(struct sl_window* window) {
       xdg_surface_destroy(window->xdg_surface);
       window->xdg_surface = NULL;
     }
+    sl_window_cancel_configure_frame(window);
     window->realized = 0;
     return;
   }
@@ -753,6 +1058,16 @@ void sl_window_update(struct sl_window* window) {
     if (!window->aura_surface) {
       window->aura_surface = zaura_shell_get_aura_surface(
           ctx->aura_shell->internal, host_surface->proxy);
+
+      // Occlusion tells us when the window is minimized or covered.
+      if (ctx->throttle_hidden &&
+          ctx->aura_shell->version >=
+              ZAURA_SURFACE_SET_OCCLUSION_TRACKING_SINCE_VERSION) {
+        zaura_surface_set_user_data(window->aura_surface, window);
+        zaura_surface_add_listener(window->aura_surface,
+                                   &sl_internal_aura_surface_listener, window);
+        zaura_surface_set_occlusion_tracking(window->aura_surface);
+      }
     }
 
     zaura_surface_set_frame(window->aura_surface,
@@ -827,7 +1142,7 @@ void sl_window_update(struct sl_window* window) {
                              (window->y - parent->y) / ctx->scale);
   }
 
-  wl_surface_commit(host_surface->proxy);
+  sl_host_surface_commit_state(host_surface);
   if (host_surface->contents_width && host_surface->contents_height)
     window->realized = 1;
 }
@@ -843,25 +1158,31 @@ static const struct wl_buffer_interface sl_buffer_implementation = {
 static void sl_buffer_release(void* data, struct wl_buffer* buffer) {
   struct sl_host_buffer* host = wl_buffer_get_user_data(buffer);
 
-  wl_buffer_send_release(host->resource);
+  if (host->resource)
+    wl_buffer_send_release(host->resource);
 }
 
 static const struct wl_buffer_listener sl_buffer_listener = {sl_buffer_release};
 
+// Held attach requests keep the host buffer after the client has destroyed
+// it.
 static void sl_destroy_host_buffer(struct wl_resource* resource) {
   struct sl_host_buffer* host = wl_resource_get_user_data(resource);
 
-  if (host->proxy)
-    wl_buffer_destroy(host->proxy);
-  if (host->shm_mmap) {
+  if (host->shm_mmap)
     host->shm_mmap->buffer_resource = NULL;
-    sl_mmap_unref(host->shm_mmap);
-  }
-  if (host->sync_point) {
-    sl_sync_point_destroy(host->sync_point);
-  }
+  // The sync callback data goes away with the resource. The fence of the
+  // buffer can still be exported.
+  if (host->sync_point)
+    host->sync_point->sync = NULL;
+  // Pending host import will be discarded when it completes.
+  if (host->dmabuf_params) {
+    zwp_linux_buffer_params_v1_set_user_data(host->dmabuf_params, NULL);
+    host->dmabuf_params = NULL;
+  }
+  host->resource = NULL;
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_host_buffer_unref(host);
 }
 
 struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
@@ -874,6 +1195,7 @@ struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
   host_buffer = malloc(sizeof(*host_buffer));
   assert(host_buffer);
 
+  host_buffer->refcount = 1;
   host_buffer->width = width;
   host_buffer->height = height;
   host_buffer->resource =
@@ -883,26 +1205,106 @@ struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
                                  sl_destroy_host_buffer);
   host_buffer->shm_mmap = NULL;
   host_buffer->shm_format = 0;
-  host_buffer->proxy = proxy;
-  if (host_buffer->proxy) {
-    wl_buffer_set_user_data(host_buffer->proxy, host_buffer);
-    wl_buffer_add_listener(host_buffer->proxy, &sl_buffer_listener,
-                           host_buffer);
-  }
+  host_buffer->proxy = NULL;
+  if (proxy)
+    sl_host_buffer_set_proxy(host_buffer, proxy);
   host_buffer->sync_point = NULL;
+  host_buffer->dmabuf_params = NULL;
 
   return host_buffer;
 }
 
+void sl_host_buffer_set_proxy(struct sl_host_buffer* host,
+                              struct wl_buffer* proxy) {
+  assert(!host->proxy);
+  host->proxy = proxy;
+  wl_buffer_set_user_data(host->proxy, host);
+  wl_buffer_add_listener(host->proxy, &sl_buffer_listener, host);
+}
+
+struct sl_host_buffer* sl_host_buffer_ref(struct sl_host_buffer* host) {
+  host->refcount++;
+  return host;
+}
+
+void sl_host_buffer_unref(struct sl_host_buffer* host) {
+  if (host->refcount-- == 1) {
+    if (host->proxy)
+      wl_buffer_destroy(host->proxy);
+    if (host->shm_mmap)
+      sl_mmap_unref(host->shm_mmap);
+    if (host->sync_point)
+      sl_sync_point_destroy(host->sync_point);
+    free(host);
+  }
+}
+
 static void sl_internal_data_offer_destroy(struct sl_data_offer* host) {
+  char** mime_type;
+
   wl_data_offer_destroy(host->internal);
   wl_array_release(&host->atoms);
   wl_array_release(&host->cookies);
+  wl_array_for_each(mime_type, &host->mime_types) {
+    free(*mime_type);
+  }
+  wl_array_release(&host->mime_types);
   free(host);
 }
 
+static struct sl_clipboard_cache_entry* sl_clipboard_cache_find(
+    struct sl_context* ctx, xcb_atom_t target) {
+  struct sl_clipboard_cache_entry* entry;
+
+  wl_list_for_each(entry, &ctx->clipboard_cache, link) {
+    if (entry->target == target)
+      return entry;
+  }
+  return NULL;
+}
+
+// Takes the data collected by a completed transfer for the cache.
+static void sl_clipboard_cache_add(struct sl_data_offer_receive* receive) {
+  struct sl_context* ctx = receive->ctx;
+  struct sl_clipboard_cache_entry* entry;
+
+  if (sl_clipboard_cache_find(ctx, receive->data_type) ||
+      ctx->clipboard_cache_bytes + receive->cache_data.size >
+          ctx->clipboard_cache_limit)
+    return;
+
+  entry = malloc(sizeof(*entry));
+  assert(entry);
+  entry->target = receive->data_type;
+  entry->data = receive->cache_data;
+  wl_array_init(&receive->cache_data);
+  wl_list_insert(&ctx->clipboard_cache, &entry->link);
+  ctx->clipboard_cache_bytes += entry->data.size;
+}
+
+static void sl_clipboard_cache_clear(struct sl_context* ctx) {
+  struct sl_clipboard_cache_entry *entry, *next;
+  struct sl_data_offer_receive* receive;
+
+  wl_list_for_each_safe(entry, next, &ctx->clipboard_cache, link) {
+    wl_list_remove(&entry->link);
+    wl_array_release(&entry->data);
+    free(entry);
+  }
+  ctx->clipboard_cache_bytes = 0;
+
+  // Transfers in progress are for the previous selection.
+  wl_list_for_each(receive, &ctx->selection_data_offer_receives, link) {
+    receive->cacheable = 0;
+    wl_array_release(&receive->cache_data);
+    wl_array_init(&receive->cache_data);
+  }
+}
+
 static void sl_set_selection(struct sl_context* ctx,
                              struct sl_data_offer* data_offer) {
+  sl_clipboard_cache_clear(ctx);
+
   if (ctx->selection_data_offer) {
     sl_internal_data_offer_destroy(ctx->selection_data_offer);
     ctx->selection_data_offer = NULL;
@@ -929,6 +1331,8 @@ static void sl_set_selection(struct sl_context* ctx,
       if (reply) {
         ((xcb_atom_t*)data_offer->atoms.data)[i + 2] = reply->atom;
         free(reply);
+      } else {
+        ((xcb_atom_t*)data_offer->atoms.data)[i + 2] = XCB_ATOM_NONE;
       }
     }
 
@@ -945,7 +1349,11 @@ static void sl_internal_data_offer_offer(void* data,
   struct sl_data_offer* host = data;
   xcb_intern_atom_cookie_t* cookie =
       wl_array_add(&host->cookies, sizeof(xcb_intern_atom_cookie_t));
+  char** mime_type = wl_array_add(&host->mime_types, sizeof(char*));
+
   *cookie = xcb_intern_atom(host->ctx->connection, 0, strlen(type), type);
+  *mime_type = strdup(type);
+  assert(*mime_type);
 }
 
 static void sl_internal_data_offer_source_actions(
@@ -973,6 +1381,7 @@ static void sl_internal_data_device_data_offer(
   host_data_offer->internal = data_offer;
   wl_array_init(&host_data_offer->atoms);
   wl_array_init(&host_data_offer->cookies);
+  wl_array_init(&host_data_offer->mime_types);
 
   wl_data_offer_add_listener(host_data_offer->internal,
                              &sl_internal_data_offer_listener, host_data_offer);
@@ -1076,6 +1485,31 @@ static void sl_global_destroy(struct sl_global* global) {
   free(global);
 }
 
+static void sl_linux_dmabuf_format(void* data,
+                                   struct zwp_linux_dmabuf_v1* linux_dmabuf,
+                                   uint32_t format) {}
+
+// Collects the modifiers that output buffers can be allocated with.
+static void sl_linux_dmabuf_modifier(void* data,
+                                     struct zwp_linux_dmabuf_v1* linux_dmabuf,
+                                     uint32_t format,
+                                     uint32_t modifier_hi,
+                                     uint32_t modifier_lo) {
+  struct sl_linux_dmabuf* host = data;
+  struct sl_dmabuf_modifier* modifier;
+
+  if (!host->ctx->dmabuf_modifiers)
+    return;
+
+  modifier = wl_array_add(&host->modifiers, sizeof(*modifier));
+  assert(modifier);
+  modifier->format = format;
+  modifier->modifier = ((uint64_t)modifier_hi << 32) | modifier_lo;
+}
+
+static const struct zwp_linux_dmabuf_v1_listener sl_linux_dmabuf_listener = {
+    sl_linux_dmabuf_format, sl_linux_dmabuf_modifier};
+
 static void sl_registry_handler(void* data,
                                 struct wl_registry* registry,
                                 uint32_t id,
@@ -1231,9 +1665,12 @@ static void sl_registry_handler(void* data,
     assert(linux_dmabuf);
     linux_dmabuf->ctx = ctx;
     linux_dmabuf->id = id;
-    linux_dmabuf->version = MIN(2, version);
+    linux_dmabuf->version = MIN(3, version);
     linux_dmabuf->internal = wl_registry_bind(
         registry, id, &zwp_linux_dmabuf_v1_interface, linux_dmabuf->version);
+    wl_array_init(&linux_dmabuf->modifiers);
+    zwp_linux_dmabuf_v1_add_listener(linux_dmabuf->internal,
+                                     &sl_linux_dmabuf_listener, linux_dmabuf);
     assert(!ctx->linux_dmabuf);
     ctx->linux_dmabuf = linux_dmabuf;
     linux_dmabuf->host_drm_global = sl_drm_global_create(ctx);
@@ -1277,13 +1714,13 @@ static void sl_registry_remover(void* data,
   }
   if (ctx->subcompositor && ctx->subcompositor->id == id) {
     sl_global_destroy(ctx->subcompositor->host_global);
-    wl_shm_destroy(ctx->shm->internal);
     free(ctx->subcompositor);
     ctx->subcompositor = NULL;
     return;
   }
   if (ctx->shm && ctx->shm->id == id) {
     sl_global_destroy(ctx->shm->host_global);
+    wl_shm_destroy(ctx->shm->internal);
     free(ctx->shm);
     ctx->shm = NULL;
     return;
@@ -1332,6 +1769,7 @@ static void sl_registry_remover(void* data,
     if (ctx->linux_dmabuf->host_drm_global)
       sl_global_destroy(ctx->linux_dmabuf->host_drm_global);
     zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf->internal);
+    wl_array_release(&ctx->linux_dmabuf->modifiers);
     free(ctx->linux_dmabuf);
     ctx->linux_dmabuf = NULL;
     return;
@@ -1385,28 +1823,153 @@ static void sl_registry_remover(void* data,
 static const struct wl_registry_listener sl_registry_listener = {
     sl_registry_handler, sl_registry_remover};
 
+// Releases everything bound from the host registry, as if each global had
+// been removed by the host.
+static void sl_release_globals(struct sl_context* ctx) {
+  struct sl_output *output, *next_output;
+  struct sl_seat *seat, *next_seat;
+
+  if (ctx->compositor)
+    sl_registry_remover(ctx, NULL, ctx->compositor->id);
+  if (ctx->subcompositor)
+    sl_registry_remover(ctx, NULL, ctx->subcompositor->id);
+  if (ctx->shm)
+    sl_registry_remover(ctx, NULL, ctx->shm->id);
+  if (ctx->shell)
+    sl_registry_remover(ctx, NULL, ctx->shell->id);
+  if (ctx->data_device_manager)
+    sl_registry_remover(ctx, NULL, ctx->data_device_manager->id);
+  if (ctx->xdg_shell)
+    sl_registry_remover(ctx, NULL, ctx->xdg_shell->id);
+  if (ctx->aura_shell)
+    sl_registry_remover(ctx, NULL, ctx->aura_shell->id);
+  if (ctx->viewporter)
+    sl_registry_remover(ctx, NULL, ctx->viewporter->id);
+  if (ctx->linux_dmabuf)
+    sl_registry_remover(ctx, NULL, ctx->linux_dmabuf->id);
+  if (ctx->keyboard_extension)
+    sl_registry_remover(ctx, NULL, ctx->keyboard_extension->id);
+  if (ctx->text_input_manager)
+    sl_registry_remover(ctx, NULL, ctx->text_input_manager->id);
+  if (ctx->relative_pointer_manager)
+    sl_registry_remover(ctx, NULL, ctx->relative_pointer_manager->id);
+  if (ctx->pointer_constraints)
+    sl_registry_remover(ctx, NULL, ctx->pointer_constraints->id);
+  wl_list_for_each_safe(output, next_output, &ctx->outputs, link)
+    sl_registry_remover(ctx, NULL, output->id);
+  wl_list_for_each_safe(seat, next_seat, &ctx->seats, link)
+    sl_registry_remover(ctx, NULL, seat->id);
+}
+
+// Ends the session served by |ctx|. In multi-client mode only the thread
+// serving the client stops, otherwise the process exits.
+static void sl_context_quit(struct sl_context* ctx) {
+  if (!ctx->multi_client)
+    exit(EXIT_SUCCESS);
+
+  ctx->quit = 1;
+}
+
+// Errors on the host connection are fatal as the display can't be used
+// anymore. Returns 0 so that the event source is not dispatched again.
+static int sl_handle_host_connection_error(struct sl_context* ctx) {
+  fprintf(stderr, "error: host connection failed: %s\n",
+          strerror(wl_display_get_error(ctx->display)));
+  if (!ctx->multi_client)
+    exit(EXIT_FAILURE);
+
+  ctx->quit = 1;
+  return 0;
+}
+
 static int sl_handle_event(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
   int count = 0;
+  int dispatched;
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
-    wl_client_flush(ctx->client);
-    exit(EXIT_SUCCESS);
+    if (ctx->client)
+      wl_client_flush(ctx->client);
+    sl_context_quit(ctx);
+    return 0;
   }
 
-  if (mask & WL_EVENT_READABLE)
-    count = wl_display_dispatch(ctx->display);
-  if (mask & WL_EVENT_WRITABLE)
-    wl_display_flush(ctx->display);
-
-  if (mask == 0) {
-    count = wl_display_dispatch_pending(ctx->display);
-    wl_display_flush(ctx->display);
+  // Unlike wl_display_dispatch(), this does not flush the connection
+  // before reading. Requests are flushed once per event loop iteration.
+  if (mask & WL_EVENT_READABLE) {
+    while (wl_display_prepare_read(ctx->display) != 0) {
+      dispatched = wl_display_dispatch_pending(ctx->display);
+      if (dispatched < 0)
+        return sl_handle_host_connection_error(ctx);
+      count += dispatched;
+    }
+    // A prepared read must be completed or cancelled. The read follows
+    // right away, and it releases the prepared read even when it fails.
+    if (wl_display_read_events(ctx->display) < 0)
+      return sl_handle_host_connection_error(ctx);
+    ctx->stats.host_reads++;
   }
+  dispatched = wl_display_dispatch_pending(ctx->display);
+  if (dispatched < 0)
+    return sl_handle_host_connection_error(ctx);
+  count += dispatched;
+  ctx->stats.host_events += count;
+
+  // Deliver the latest coalesced pointer motion from this dispatch.
+  sl_release_held_pointer_frames(ctx);
 
   return count;
 }
 
+static uint32_t sl_window_index_hash(uint32_t id) {
+  return (id * 2654435761u) >> (32 - WINDOW_INDEX_BITS);
+}
+
+static void sl_window_set_frame_id(struct sl_window* window,
+                                   xcb_window_t frame_id) {
+  wl_list_remove(&window->frame_id_link);
+  wl_list_init(&window->frame_id_link);
+  window->frame_id = frame_id;
+  if (frame_id != XCB_WINDOW_NONE) {
+    wl_list_insert(
+        &window->ctx->window_frame_id_index[sl_window_index_hash(frame_id)],
+        &window->frame_id_link);
+  }
+}
+
+void sl_window_set_host_surface_id(struct sl_window* window,
+                                   uint32_t host_surface_id) {
+  struct sl_context* ctx = window->ctx;
+
+  // A frame requested from the previous host surface might never be done.
+  if (host_surface_id != window->host_surface_id)
+    sl_window_cancel_configure_frame(window);
+
+  wl_list_remove(&window->host_surface_link);
+  wl_list_init(&window->host_surface_link);
+  window->host_surface_id = host_surface_id;
+  if (host_surface_id) {
+    wl_list_insert(
+        &ctx->window_host_surface_index[sl_window_index_hash(host_surface_id)],
+        &window->host_surface_link);
+  }
+}
+
+struct sl_window* sl_lookup_host_surface_window(struct sl_context* ctx,
+                                                uint32_t host_surface_id,
+                                                int unpaired) {
+  struct wl_list* bucket =
+      &ctx->window_host_surface_index[sl_window_index_hash(host_surface_id)];
+  struct sl_window* window;
+
+  wl_list_for_each(window, bucket, host_surface_link) {
+    if (window->host_surface_id == host_surface_id &&
+        window->unpaired == unpaired)
+      return window;
+  }
+  return NULL;
+}
+
 static void sl_create_window(struct sl_context* ctx,
                              xcb_window_t id,
                              int x,
@@ -1433,6 +1996,7 @@ static void sl_create_window(struct sl_context* ctx,
   window->activated = 0;
   window->maximized = 0;
   window->allow_resize = 1;
+  window->resizing = 0;
   window->transient_for = XCB_WINDOW_NONE;
   window->client_leader = XCB_WINDOW_NONE;
   window->decorated = 0;
@@ -1456,12 +2020,178 @@ static void sl_create_window(struct sl_context* ctx,
   window->pending_config.serial = 0;
   window->pending_config.mask = 0;
   window->pending_config.states_length = 0;
+  window->configure_frame_callback = NULL;
+  window->configure_frame_timer = NULL;
   wl_list_insert(&ctx->unpaired_windows, &window->link);
+  wl_list_insert(&ctx->window_id_index[sl_window_index_hash(id)],
+                 &window->id_link);
+  wl_list_init(&window->frame_id_link);
+  wl_list_init(&window->host_surface_link);
+  window->pending_x_requests = 0;
   values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE;
   xcb_change_window_attributes(ctx->connection, window->id, XCB_CW_EVENT_MASK,
                                values);
 }
 
+// Find the window with X window id or frame id |id|.
+static struct sl_window* sl_find_window(struct sl_context* ctx,
+                                        xcb_window_t id) {
+  uint32_t hash = sl_window_index_hash(id);
+  struct sl_window* window;
+
+  wl_list_for_each(window, &ctx->window_id_index[hash], id_link) {
+    if (window->id == id)
+      return window;
+  }
+  wl_list_for_each(window, &ctx->window_frame_id_index[hash], frame_id_link) {
+    if (window->frame_id == id)
+      return window;
+  }
+  return NULL;
+}
+
+// Create an asynchronous request for |window|. |size| allows handlers to
+// embed the request at the start of a larger struct.
+static struct sl_x_request* sl_x_request_create(
+    struct sl_window* window, sl_x_request_handler_t handler, size_t size) {
+  struct sl_x_request* request;
+
+  assert(size >= sizeof(*request));
+  request = malloc(size);
+  assert(request);
+  memset(request, 0, size);
+  wl_list_init(&request->link);
+  request->window = window;
+  request->handler = handler;
+
+  return request;
+}
+
+static void sl_x_request_add(struct sl_x_request* request,
+                             unsigned int sequence) {
+  assert(request->num_replies < X_REQUEST_MAX_REPLIES);
+  request->sequences[request->num_replies++] = sequence;
+}
+
+// Requests are handled in the order they were submitted.
+static void sl_x_request_submit(struct sl_context* ctx,
+                                struct sl_x_request* request) {
+  wl_list_insert(ctx->x_requests.prev, &request->link);
+  request->window->pending_x_requests++;
+}
+
+// Submit a follow-up request that must be handled before any request that
+// is already pending.
+static void sl_x_request_submit_next(struct sl_context* ctx,
+                                     struct sl_x_request* request) {
+  wl_list_insert(&ctx->x_requests, &request->link);
+  request->window->pending_x_requests++;
+}
+
+// Collect replies in order. Returns 1 once all replies have arrived.
+static int sl_x_request_poll(struct sl_context* ctx,
+                             struct sl_x_request* request,
+                             int block) {
+  while (request->num_received < request->num_replies) {
+    unsigned int sequence = request->sequences[request->num_received];
+    xcb_generic_error_t* error = NULL;
+    void* reply = NULL;
+
+    if (block) {
+      reply = xcb_wait_for_reply(ctx->connection, sequence, &error);
+    } else if (!xcb_poll_for_reply(ctx->connection, sequence, &reply,
+                                   &error)) {
+      return 0;
+    }
+    free(error);
+    request->replies[request->num_received++] = reply;
+  }
+
+  return 1;
+}
+
+static void sl_x_request_destroy(struct sl_context* ctx,
+                                 struct sl_x_request* request) {
+  int i;
+
+  for (i = 0; i < request->num_received; ++i)
+    free(request->replies[i]);
+  for (; i < request->num_replies; ++i)
+    xcb_discard_reply(ctx->connection, request->sequences[i]);
+
+  wl_list_remove(&request->link);
+  request->window->pending_x_requests--;
+  free(request);
+}
+
+static void sl_x_request_complete(struct sl_context* ctx,
+                                  struct sl_x_request* request) {
+  int i;
+
+  wl_list_remove(&request->link);
+  wl_list_init(&request->link);
+  request->window->pending_x_requests--;
+  request->handler(ctx, request);
+
+  for (i = 0; i < request->num_received; ++i)
+    free(request->replies[i]);
+  free(request);
+}
+
+// Handle requests for which all replies have arrived.
+static void sl_process_x_requests(struct sl_context* ctx) {
+  while (!wl_list_empty(&ctx->x_requests)) {
+    struct sl_x_request* request =
+        wl_container_of(ctx->x_requests.next, request, link);
+
+    if (!sl_x_request_poll(ctx, request, 0))
+      break;
+
+    sl_x_request_complete(ctx, request);
+  }
+}
+
+// Wait for and handle all pending requests for |window|.
+static void sl_finish_x_requests(struct sl_context* ctx,
+                                 struct sl_window* window) {
+  while (window->pending_x_requests) {
+    struct sl_x_request* request;
+
+    // Handlers can submit follow-up requests so start over every time.
+    wl_list_for_each(request, &ctx->x_requests, link) {
+      if (request->window == window)
+        break;
+    }
+    assert(&request->link != &ctx->x_requests);
+
+    sl_x_request_poll(ctx, request, 1);
+    sl_x_request_complete(ctx, request);
+  }
+}
+
+static void sl_cancel_x_requests(struct sl_context* ctx,
+                                 struct sl_window* window) {
+  struct sl_x_request* request;
+  struct sl_x_request* next;
+
+  wl_list_for_each_safe(request, next, &ctx->x_requests, link) {
+    if (request->window == window)
+      sl_x_request_destroy(ctx, request);
+  }
+}
+
+// Like sl_find_window() but also handles all pending requests for the
+// window so that events are processed in order.
+static struct sl_window* sl_lookup_window(struct sl_context* ctx,
+                                          xcb_window_t id) {
+  struct sl_window* window = sl_find_window(ctx, id);
+
+  if (window && window->pending_x_requests)
+    sl_finish_x_requests(ctx, window);
+
+  return window;
+}
+
 static void sl_destroy_window(struct sl_window* window) {
   if (window->frame_id != XCB_WINDOW_NONE)
     xcb_destroy_window(window->ctx->connection, window->frame_id);
@@ -1479,6 +2209,7 @@ static void sl_destroy_window(struct sl_window* window) {
     xdg_surface_destroy(window->xdg_surface);
   if (window->aura_surface)
     zaura_surface_destroy(window->aura_surface);
+  sl_window_cancel_configure_frame(window);
 
   if (window->name)
     free(window->name);
@@ -1487,37 +2218,14 @@ static void sl_destroy_window(struct sl_window* window) {
   if (window->startup_id)
     free(window->startup_id);
 
+  sl_cancel_x_requests(window->ctx, window);
   wl_list_remove(&window->link);
+  wl_list_remove(&window->id_link);
+  wl_list_remove(&window->frame_id_link);
+  wl_list_remove(&window->host_surface_link);
   free(window);
 }
 
-static int sl_is_window(struct sl_window* window, xcb_window_t id) {
-  if (window->id == id)
-    return 1;
-
-  if (window->frame_id != XCB_WINDOW_NONE) {
-    if (window->frame_id == id)
-      return 1;
-  }
-
-  return 0;
-}
-
-static struct sl_window* sl_lookup_window(struct sl_context* ctx,
-                                          xcb_window_t id) {
-  struct sl_window* window;
-
-  wl_list_for_each(window, &ctx->windows, link) {
-    if (sl_is_window(window, id))
-      return window;
-  }
-  wl_list_for_each(window, &ctx->unpaired_windows, link) {
-    if (sl_is_window(window, id))
-      return window;
-  }
-  return NULL;
-}
-
 static int sl_is_our_window(struct sl_context* ctx, xcb_window_t id) {
   const xcb_setup_t* setup = xcb_get_setup(ctx->connection);
 
@@ -1601,59 +2309,45 @@ static void sl_decode_wm_class(struct sl_window* window,
   }
 }
 
-static void sl_handle_map_request(struct sl_context* ctx,
-                                  xcb_map_request_event_t* event) {
-  struct sl_window* window = sl_lookup_window(ctx, event->window);
-  struct {
-    int type;
-    xcb_atom_t atom;
-  } properties[] = {
-      {PROPERTY_WM_NAME, XCB_ATOM_WM_NAME},
-      {PROPERTY_WM_CLASS, XCB_ATOM_WM_CLASS},
-      {PROPERTY_WM_TRANSIENT_FOR, XCB_ATOM_WM_TRANSIENT_FOR},
-      {PROPERTY_WM_NORMAL_HINTS, XCB_ATOM_WM_NORMAL_HINTS},
-      {PROPERTY_WM_CLIENT_LEADER, ctx->atoms[ATOM_WM_CLIENT_LEADER].value},
-      {PROPERTY_WM_PROTOCOLS, ctx->atoms[ATOM_WM_PROTOCOLS].value},
-      {PROPERTY_MOTIF_WM_HINTS, ctx->atoms[ATOM_MOTIF_WM_HINTS].value},
-      {PROPERTY_NET_STARTUP_ID, ctx->atoms[ATOM_NET_STARTUP_ID].value},
-      {PROPERTY_NET_WM_STATE, ctx->atoms[ATOM_NET_WM_STATE].value},
-      {PROPERTY_GTK_THEME_VARIANT, ctx->atoms[ATOM_GTK_THEME_VARIANT].value},
-  };
-  xcb_get_geometry_cookie_t geometry_cookie;
-  xcb_get_property_cookie_t property_cookies[ARRAY_SIZE(properties)];
-  struct sl_wm_size_hints size_hints = {0};
-  struct sl_mwm_hints mwm_hints = {0};
-  xcb_atom_t* reply_atoms;
-  bool maximize_h = false, maximize_v = false;
-  uint32_t values[5];
-  int i;
-
-  if (!window)
-    return;
+struct sl_map_request {
+  struct sl_x_request base;
+  int has_geometry;
+};
 
-  if (sl_is_our_window(ctx, event->window))
-    return;
+static void sl_map_window(struct sl_context* ctx, struct sl_window* window);
 
-  window->managed = 1;
-  if (window->frame_id == XCB_WINDOW_NONE)
-    geometry_cookie = xcb_get_geometry(ctx->connection, window->id);
+static void sl_handle_client_leader_startup_id(struct sl_context* ctx,
+                                               struct sl_x_request* request) {
+  struct sl_window* window = request->window;
+  xcb_get_property_reply_t* reply = request->replies[0];
 
-  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
-    property_cookies[i] =
-        xcb_get_property(ctx->connection, 0, window->id, properties[i].atom,
-                         XCB_ATOM_ANY, 0, 2048);
+  if (reply && reply->type != XCB_ATOM_NONE) {
+    window->startup_id = strndup(xcb_get_property_value(reply),
+                                 xcb_get_property_value_length(reply));
   }
 
-  if (window->frame_id == XCB_WINDOW_NONE) {
-    xcb_get_geometry_reply_t* geometry_reply =
-        xcb_get_geometry_reply(ctx->connection, geometry_cookie, NULL);
+  sl_map_window(ctx, window);
+}
+
+static void sl_handle_map_request_replies(struct sl_context* ctx,
+                                          struct sl_x_request* request) {
+  struct sl_map_request* map_request = (struct sl_map_request*)request;
+  struct sl_window* window = request->window;
+  xcb_get_property_reply_t** property_replies;
+  struct sl_wm_size_hints size_hints = {0};
+  struct sl_mwm_hints mwm_hints = {0};
+  xcb_atom_t* reply_atoms;
+  bool maximize_h = false, maximize_v = false;
+  int i, j;
+
+  if (map_request->has_geometry) {
+    xcb_get_geometry_reply_t* geometry_reply = request->replies[0];
     if (geometry_reply) {
       window->x = geometry_reply->x;
       window->y = geometry_reply->y;
       window->width = geometry_reply->width;
       window->height = geometry_reply->height;
       window->depth = geometry_reply->depth;
-      free(geometry_reply);
     }
   }
 
@@ -1669,19 +2363,20 @@ static void sl_handle_map_request(struct sl_context* ctx,
   window->size_flags = 0;
   window->dark_frame = 0;
 
-  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
-    xcb_get_property_reply_t* reply =
-        xcb_get_property_reply(ctx->connection, property_cookies[i], NULL);
+  // Property replies follow the geometry reply in PROPERTY_* order.
+  property_replies = (xcb_get_property_reply_t**)request->replies;
+  if (map_request->has_geometry)
+    property_replies++;
+  for (i = PROPERTY_WM_NAME; i <= PROPERTY_GTK_THEME_VARIANT; ++i) {
+    xcb_get_property_reply_t* reply = property_replies[i];
 
     if (!reply)
       continue;
 
-    if (reply->type == XCB_ATOM_NONE) {
-      free(reply);
+    if (reply->type == XCB_ATOM_NONE)
       continue;
-    }
 
-    switch (properties[i].type) {
+    switch (i) {
       case PROPERTY_WM_NAME:
         window->name = strndup(xcb_get_property_value(reply),
                                xcb_get_property_value_length(reply));
@@ -1704,10 +2399,10 @@ static void sl_handle_map_request(struct sl_context* ctx,
         break;
       case PROPERTY_WM_PROTOCOLS:
         reply_atoms = xcb_get_property_value(reply);
-        for (i = 0;
-             i < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
-             ++i) {
-          if (reply_atoms[i] == ctx->atoms[ATOM_WM_TAKE_FOCUS].value)
+        for (j = 0;
+             j < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+             ++j) {
+          if (reply_atoms[j] == ctx->atoms[ATOM_WM_TAKE_FOCUS].value)
             window->focus_model_take_focus = 1;
         }
         break;
@@ -1721,13 +2416,13 @@ static void sl_handle_map_request(struct sl_context* ctx,
         break;
       case PROPERTY_NET_WM_STATE:
         reply_atoms = xcb_get_property_value(reply);
-        for (i = 0;
-             i < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
-             ++i) {
-          if (reply_atoms[i] ==
+        for (j = 0;
+             j < xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+             ++j) {
+          if (reply_atoms[j] ==
               ctx->atoms[ATOM_NET_WM_STATE_MAXIMIZED_HORZ].value) {
             maximize_h = true;
-          } else if (reply_atoms[i] ==
+          } else if (reply_atoms[j] ==
                      ctx->atoms[ATOM_NET_WM_STATE_MAXIMIZED_VERT].value) {
             maximize_v = true;
           }
@@ -1744,7 +2439,6 @@ static void sl_handle_map_request(struct sl_context* ctx,
       default:
         break;
     }
-    free(reply);
   }
 
   if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
@@ -1758,23 +2452,6 @@ static void sl_handle_map_request(struct sl_context* ctx,
   if (window->transient_for)
     window->size_flags |= size_hints.flags & (US_POSITION | P_POSITION);
 
-  // If startup ID is not set, then try the client leader window.
-  if (!window->startup_id && window->client_leader) {
-    xcb_get_property_reply_t* reply = xcb_get_property_reply(
-        ctx->connection,
-        xcb_get_property(ctx->connection, 0, window->client_leader,
-                         ctx->atoms[ATOM_NET_STARTUP_ID].value, XCB_ATOM_ANY, 0,
-                         2048),
-        NULL);
-    if (reply) {
-      if (reply->type != XCB_ATOM_NONE) {
-        window->startup_id = strndup(xcb_get_property_value(reply),
-                                     xcb_get_property_value_length(reply));
-      }
-      free(reply);
-    }
-  }
-
   window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
   if (window->size_flags & P_MIN_SIZE) {
     window->min_width = size_hints.min_width;
@@ -1785,6 +2462,80 @@ static void sl_handle_map_request(struct sl_context* ctx,
     window->max_height = size_hints.max_height;
   }
 
+  // If startup ID is not set, then try the client leader window. The window
+  // is mapped once that reply arrives too.
+  if (!window->startup_id && window->client_leader) {
+    struct sl_x_request* leader_request =
+        sl_x_request_create(window, sl_handle_client_leader_startup_id,
+                            sizeof(*leader_request));
+
+    sl_x_request_add(
+        leader_request,
+        xcb_get_property(ctx->connection, 0, window->client_leader,
+                         ctx->atoms[ATOM_NET_STARTUP_ID].value, XCB_ATOM_ANY, 0,
+                         2048)
+            .sequence);
+    sl_x_request_submit_next(ctx, leader_request);
+    return;
+  }
+
+  sl_map_window(ctx, window);
+}
+
+static void sl_handle_map_request(struct sl_context* ctx,
+                                  xcb_map_request_event_t* event) {
+  struct sl_window* window = sl_find_window(ctx, event->window);
+  struct {
+    int type;
+    xcb_atom_t atom;
+  } properties[] = {
+      {PROPERTY_WM_NAME, XCB_ATOM_WM_NAME},
+      {PROPERTY_WM_CLASS, XCB_ATOM_WM_CLASS},
+      {PROPERTY_WM_TRANSIENT_FOR, XCB_ATOM_WM_TRANSIENT_FOR},
+      {PROPERTY_WM_NORMAL_HINTS, XCB_ATOM_WM_NORMAL_HINTS},
+      {PROPERTY_WM_CLIENT_LEADER, ctx->atoms[ATOM_WM_CLIENT_LEADER].value},
+      {PROPERTY_WM_PROTOCOLS, ctx->atoms[ATOM_WM_PROTOCOLS].value},
+      {PROPERTY_MOTIF_WM_HINTS, ctx->atoms[ATOM_MOTIF_WM_HINTS].value},
+      {PROPERTY_NET_STARTUP_ID, ctx->atoms[ATOM_NET_STARTUP_ID].value},
+      {PROPERTY_NET_WM_STATE, ctx->atoms[ATOM_NET_WM_STATE].value},
+      {PROPERTY_GTK_THEME_VARIANT, ctx->atoms[ATOM_GTK_THEME_VARIANT].value},
+  };
+  struct sl_map_request* map_request;
+  int i;
+
+  if (!window)
+    return;
+
+  if (sl_is_our_window(ctx, event->window))
+    return;
+
+  window->managed = 1;
+
+  // Replies are handled once they arrive so that many windows can be mapped
+  // without waiting for each of them in turn.
+  map_request = (struct sl_map_request*)sl_x_request_create(
+      window, sl_handle_map_request_replies, sizeof(*map_request));
+  map_request->has_geometry = window->frame_id == XCB_WINDOW_NONE;
+  if (map_request->has_geometry) {
+    sl_x_request_add(&map_request->base,
+                     xcb_get_geometry(ctx->connection, window->id).sequence);
+  }
+
+  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
+    assert(properties[i].type == i);
+    sl_x_request_add(
+        &map_request->base,
+        xcb_get_property(ctx->connection, 0, window->id, properties[i].atom,
+                         XCB_ATOM_ANY, 0, 2048)
+            .sequence);
+  }
+
+  sl_x_request_submit(ctx, &map_request->base);
+}
+
+static void sl_map_window(struct sl_context* ctx, struct sl_window* window) {
+  uint32_t values[5];
+
   window->border_width = 0;
   sl_adjust_window_size_for_screen_size(window);
   if (!(window->size_flags & (US_POSITION | P_POSITION)))
@@ -1821,7 +2572,7 @@ static void sl_handle_map_request(struct sl_context* ctx,
                 XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT;
     values[2] = ctx->colormaps[depth];
 
-    window->frame_id = xcb_generate_id(ctx->connection);
+    sl_window_set_frame_id(window, xcb_generate_id(ctx->connection));
     xcb_create_window(
         ctx->connection, depth, window->frame_id, ctx->screen->root, window->x,
         window->y, window->width, window->height, 0,
@@ -1874,7 +2625,7 @@ static void sl_handle_unmap_notify(struct sl_context* ctx,
   }
 
   if (window->host_surface_id) {
-    window->host_surface_id = 0;
+    sl_window_set_host_surface_id(window, 0);
     sl_window_update(window);
   }
 
@@ -1885,7 +2636,7 @@ static void sl_handle_unmap_notify(struct sl_context* ctx,
     xcb_reparent_window(ctx->connection, window->id, ctx->screen->root,
                         window->x, window->y);
     xcb_destroy_window(ctx->connection, window->frame_id);
-    window->frame_id = XCB_WINDOW_NONE;
+    sl_window_set_frame_id(window, XCB_WINDOW_NONE);
   }
 
   // Reset properties to unmanaged state in case the window transitions to
@@ -2097,18 +2848,11 @@ static void sl_request_attention(struct sl_context* ctx,
 static void sl_handle_client_message(struct sl_context* ctx,
                                      xcb_client_message_event_t* event) {
   if (event->type == ctx->atoms[ATOM_WL_SURFACE_ID].value) {
-    struct sl_window *window, *unpaired_window = NULL;
-
-    wl_list_for_each(window, &ctx->unpaired_windows, link) {
-      if (sl_is_window(window, event->window)) {
-        unpaired_window = window;
-        break;
-      }
-    }
+    struct sl_window* window = sl_lookup_window(ctx, event->window);
 
-    if (unpaired_window) {
-      unpaired_window->host_surface_id = event->data.data32[0];
-      sl_window_update(unpaired_window);
+    if (window && window->unpaired) {
+      sl_window_set_host_surface_id(window, event->data.data32[0]);
+      sl_window_update(window);
     }
   } else if (event->type == ctx->atoms[ATOM_NET_ACTIVE_WINDOW].value) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
@@ -2188,210 +2932,424 @@ static void sl_handle_focus_in(struct sl_context* ctx,
 static void sl_handle_focus_out(struct sl_context* ctx,
                                 xcb_focus_out_event_t* event) {}
 
-int sl_begin_data_source_send(struct sl_context* ctx,
-                              int fd,
-                              xcb_intern_atom_cookie_t cookie,
-                              struct sl_data_source* data_source) {
+static void sl_get_selection_data(struct sl_data_source_send* send);
+
+static int sl_find_send_slot(struct sl_context* ctx) {
+  int i;
+
+  for (i = 0; i < SELECTION_MAX_SENDS; ++i) {
+    if (!ctx->selection_data_source_sends[i])
+      return i;
+  }
+  return -1;
+}
+
+static struct sl_data_source_send* sl_find_data_source_send(
+    struct sl_context* ctx, xcb_atom_t property) {
+  int i;
+
+  for (i = 0; i < SELECTION_MAX_SENDS; ++i) {
+    if (ctx->selection_data_source_sends[i] &&
+        ctx->selection_send_atoms[i] == property)
+      return ctx->selection_data_source_sends[i];
+  }
+  return NULL;
+}
+
+// Returns the property used by transfers in |slot|, interning it the first
+// time the slot is used.
+static xcb_atom_t sl_selection_send_atom(struct sl_context* ctx, int slot) {
+  if (!ctx->selection_send_atoms[slot]) {
+    xcb_intern_atom_reply_t* reply;
+    char name[32];
+
+    snprintf(name, sizeof(name), "_WL_SELECTION_%d", slot);
+    reply = xcb_intern_atom_reply(
+        ctx->connection,
+        xcb_intern_atom(ctx->connection, 0, strlen(name), name), NULL);
+    if (!reply)
+      return XCB_ATOM_NONE;
+
+    ctx->selection_send_atoms[slot] = reply->atom;
+    free(reply);
+  }
+  return ctx->selection_send_atoms[slot];
+}
+
+static int sl_begin_data_source_send(struct sl_data_source_send* send,
+                                     int slot) {
+  struct sl_context* ctx = send->ctx;
   xcb_intern_atom_reply_t* reply =
-      xcb_intern_atom_reply(ctx->connection, cookie, NULL);
+      xcb_intern_atom_reply(ctx->connection, send->cookie, NULL);
+  xcb_atom_t property = sl_selection_send_atom(ctx, slot);
+  int flags, rv;
 
-  if (!reply) {
-    close(fd);
+  if (!reply || property == XCB_ATOM_NONE) {
+    free(reply);
+    close(send->fd);
+    free(send);
     return 0;
   }
 
-  int flags, rv;
+  send->target = reply->atom;
+  send->slot = slot;
+  ctx->selection_data_source_sends[slot] = send;
+  free(reply);
 
   xcb_convert_selection(ctx->connection, ctx->selection_window,
-                        ctx->atoms[ATOM_CLIPBOARD].value, reply->atom,
-                        ctx->atoms[ATOM_WL_SELECTION].value, XCB_CURRENT_TIME);
+                        ctx->atoms[ATOM_CLIPBOARD].value, send->target,
+                        property, XCB_CURRENT_TIME);
 
-  flags = fcntl(fd, F_GETFL, 0);
-  rv = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  flags = fcntl(send->fd, F_GETFL, 0);
+  rv = fcntl(send->fd, F_SETFL, flags | O_NONBLOCK);
   errno_assert(!rv);
 
-  ctx->selection_data_source_send_fd = fd;
-  free(reply);
   return 1;
 }
 
-void sl_process_data_source_send_pending_list(struct sl_context* ctx) {
-  while (!wl_list_empty(&ctx->selection_data_source_send_pending)) {
+static void sl_process_data_source_send_pending_list(struct sl_context* ctx) {
+  int slot;
+
+  while (!wl_list_empty(&ctx->selection_data_source_send_pending) &&
+         (slot = sl_find_send_slot(ctx)) >= 0) {
     struct wl_list* next = ctx->selection_data_source_send_pending.next;
-    struct sl_data_source_send_request* request;
-    request = wl_container_of(next, request, link);
+    struct sl_data_source_send* send;
+    send = wl_container_of(next, send, link);
     wl_list_remove(next);
 
-    int rv = sl_begin_data_source_send(ctx, request->fd, request->cookie,
-                                       request->data_source);
-    free(request);
-    if (rv)
-      break;
+    sl_begin_data_source_send(send, slot);
   }
 }
 
+static void sl_data_source_send_destroy(struct sl_data_source_send* send) {
+  struct sl_context* ctx = send->ctx;
+
+  sl_data_transfer_stats_add(&ctx->selection_transfer_stats, send->bytes, 0,
+                             &send->start_time);
+  if (send->event_source)
+    wl_event_source_remove(send->event_source);
+  free(send->property_reply);
+  close(send->fd);
+
+  // Free the slot for the next transfer. Deleting the property also
+  // completes an incremental transfer, whose final chunk is empty.
+  xcb_delete_property(ctx->connection, ctx->selection_window,
+                      ctx->selection_send_atoms[send->slot]);
+  ctx->selection_data_source_sends[send->slot] = NULL;
+  free(send);
+
+  sl_process_data_source_send_pending_list(ctx);
+}
+
 static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = data;
+  struct sl_data_source_send* send = data;
+  struct sl_context* ctx = send->ctx;
   uint8_t* value;
   int bytes, bytes_left;
 
-  value = xcb_get_property_value(ctx->selection_property_reply);
-  bytes_left = xcb_get_property_value_length(ctx->selection_property_reply) -
-               ctx->selection_property_offset;
+  value = xcb_get_property_value(send->property_reply);
+  bytes_left = xcb_get_property_value_length(send->property_reply) -
+               send->property_offset;
 
-  bytes = write(fd, value + ctx->selection_property_offset, bytes_left);
-  if (bytes == -1) {
+  bytes = write(fd, value + send->property_offset, bytes_left);
+  if (bytes == -1 && errno != EAGAIN) {
     fprintf(stderr, "write error to target fd: %m\n");
-    close(fd);
-    fd = -1;
-  } else if (bytes == bytes_left) {
-    if (ctx->selection_incremental_transfer) {
-      xcb_delete_property(ctx->connection, ctx->selection_window,
-                          ctx->atoms[ATOM_WL_SELECTION].value);
-    } else {
-      close(fd);
-      fd = -1;
+    sl_data_source_send_destroy(send);
+    return 1;
+  }
+  if (bytes > 0)
+    send->bytes += bytes;
+
+  if (bytes < bytes_left) {
+    if (bytes > 0)
+      send->property_offset += bytes;
+    if (!send->event_source) {
+      send->event_source = wl_event_loop_add_fd(
+          wl_display_get_event_loop(ctx->host_display), send->fd,
+          WL_EVENT_WRITABLE, sl_handle_selection_fd_writable, send);
     }
-  } else {
-    ctx->selection_property_offset += bytes;
     return 1;
   }
 
-  free(ctx->selection_property_reply);
-  ctx->selection_property_reply = NULL;
-  if (ctx->selection_send_event_source) {
-    wl_event_source_remove(ctx->selection_send_event_source);
-    ctx->selection_send_event_source = NULL;
+  free(send->property_reply);
+  send->property_reply = NULL;
+  if (send->event_source) {
+    wl_event_source_remove(send->event_source);
+    send->event_source = NULL;
   }
-  if (fd < 0) {
-    ctx->selection_data_source_send_fd = -1;
-    sl_process_data_source_send_pending_list(ctx);
+
+  if (send->more) {
+    sl_get_selection_data(send);
+  } else if (send->incremental) {
+    // Deleting the property asks the owner for the next chunk.
+    xcb_delete_property(ctx->connection, ctx->selection_window,
+                        ctx->selection_send_atoms[send->slot]);
+    send->long_offset = 0;
+  } else {
+    sl_data_source_send_destroy(send);
   }
   return 1;
 }
 
-static void sl_write_selection_property(struct sl_context* ctx,
+static void sl_write_selection_property(struct sl_data_source_send* send,
                                         xcb_get_property_reply_t* reply) {
-  ctx->selection_property_offset = 0;
-  ctx->selection_property_reply = reply;
-  sl_handle_selection_fd_writable(ctx->selection_data_source_send_fd,
-                                  WL_EVENT_WRITABLE, ctx);
-
-  if (!ctx->selection_property_reply)
-    return;
-
-  assert(!ctx->selection_send_event_source);
-  ctx->selection_send_event_source = wl_event_loop_add_fd(
-      wl_display_get_event_loop(ctx->host_display),
-      ctx->selection_data_source_send_fd, WL_EVENT_WRITABLE,
-      sl_handle_selection_fd_writable, ctx);
+  send->long_offset += xcb_get_property_value_length(reply) / 4;
+  send->more = reply->bytes_after > 0;
+  send->property_offset = 0;
+  send->property_reply = reply;
+  sl_handle_selection_fd_writable(send->fd, WL_EVENT_WRITABLE, send);
 }
 
-static void sl_send_selection_notify(struct sl_context* ctx,
-                                     xcb_atom_t property) {
+static void sl_send_selection_notify(
+    struct sl_context* ctx,
+    const xcb_selection_request_event_t* request,
+    xcb_atom_t property) {
   xcb_selection_notify_event_t event = {
       .response_type = XCB_SELECTION_NOTIFY,
       .sequence = 0,
-      .time = ctx->selection_request.time,
-      .requestor = ctx->selection_request.requestor,
-      .selection = ctx->selection_request.selection,
-      .target = ctx->selection_request.target,
+      .time = request->time,
+      .requestor = request->requestor,
+      .selection = request->selection,
+      .target = request->target,
       .property = property,
       .pad0 = 0};
 
-  xcb_send_event(ctx->connection, 0, ctx->selection_request.requestor,
+  xcb_send_event(ctx->connection, 0, request->requestor,
                  XCB_EVENT_MASK_NO_EVENT, (char*)&event);
 }
 
-static void sl_send_selection_data(struct sl_context* ctx) {
-  assert(!ctx->selection_data_ack_pending);
+static struct sl_data_offer_receive* sl_find_data_offer_receive(
+    struct sl_context* ctx, xcb_window_t requestor, xcb_atom_t property) {
+  struct sl_data_offer_receive* receive;
+
+  wl_list_for_each(receive, &ctx->selection_data_offer_receives, link) {
+    if (receive->request.requestor == requestor &&
+        receive->request.property == property)
+      return receive;
+  }
+  return NULL;
+}
+
+static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data);
+
+// Allocates a chunk buffer for |receive|. Fails while other transfers hold
+// buffers up to the selection memory limit.
+static int sl_data_offer_receive_reserve_buffer(
+    struct sl_data_offer_receive* receive) {
+  struct sl_context* ctx = receive->ctx;
+
+  if (receive->data)
+    return 1;
+
+  if (ctx->selection_buffer_bytes &&
+      ctx->selection_buffer_bytes + ctx->selection_chunk_size >
+          SELECTION_MEMORY_LIMIT)
+    return 0;
+
+  receive->data = malloc(ctx->selection_chunk_size);
+  assert(receive->data);
+  receive->data_size = 0;
+  ctx->selection_buffer_bytes += ctx->selection_chunk_size;
+  return 1;
+}
+
+// Starts reading from the data source unless already reading, or unable to
+// get a buffer, in which case the transfer waits for one to be released.
+static void sl_data_offer_receive_resume(
+    struct sl_data_offer_receive* receive) {
+  if (receive->event_source)
+    return;
+
+  receive->waiting = !sl_data_offer_receive_reserve_buffer(receive);
+  if (receive->waiting)
+    return;
+
+  receive->event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(receive->ctx->host_display), receive->fd,
+      WL_EVENT_READABLE, sl_handle_selection_fd_readable, receive);
+}
+
+static void sl_data_offer_receive_release_buffer(
+    struct sl_data_offer_receive* receive) {
+  struct sl_context* ctx = receive->ctx;
+  struct sl_data_offer_receive* waiting;
+
+  if (!receive->data)
+    return;
+
+  free(receive->data);
+  receive->data = NULL;
+  receive->data_size = 0;
+  ctx->selection_buffer_bytes -= ctx->selection_chunk_size;
+
+  wl_list_for_each(waiting, &ctx->selection_data_offer_receives, link) {
+    if (waiting->waiting)
+      sl_data_offer_receive_resume(waiting);
+  }
+}
+
+static void sl_data_offer_receive_destroy(
+    struct sl_data_offer_receive* receive) {
+  sl_data_transfer_stats_add(&receive->ctx->selection_transfer_stats,
+                             receive->bytes, 0, &receive->start_time);
+  if (receive->event_source)
+    wl_event_source_remove(receive->event_source);
+  if (receive->fd >= 0)
+    close(receive->fd);
+  wl_list_remove(&receive->link);
+  sl_data_offer_receive_release_buffer(receive);
+  wl_array_release(&receive->cache_data);
+  free(receive);
+}
+
+static void sl_send_selection_data(struct sl_data_offer_receive* receive) {
+  struct sl_context* ctx = receive->ctx;
+
+  assert(!receive->ack_pending);
   xcb_change_property(
-      ctx->connection, XCB_PROP_MODE_REPLACE, ctx->selection_request.requestor,
-      ctx->selection_request.property, ctx->selection_data_type,
-      /*format=*/8, ctx->selection_data.size, ctx->selection_data.data);
-  ctx->selection_data_ack_pending = 1;
-  ctx->selection_data.size = 0;
+      ctx->connection, XCB_PROP_MODE_REPLACE, receive->request.requestor,
+      receive->request.property, receive->data_type,
+      /*format=*/8, receive->data_size, receive->data);
+  receive->ack_pending = 1;
+
+  // xcb has copied or written out the request by now, so the chunk no
+  // longer needs to be buffered here.
+  sl_data_offer_receive_release_buffer(receive);
 }
 
-static const uint32_t sl_incr_chunk_size = 64 * 1024;
+// Sends what is left once the data source has been drained. Sending an
+// empty chunk completes the transfer.
+static void sl_data_offer_receive_flush(struct sl_data_offer_receive* receive) {
+  int done = !receive->data_size;
 
-static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = data;
-  int bytes, offset, bytes_left;
-  void* p;
+  sl_send_selection_data(receive);
+  if (done)
+    sl_data_offer_receive_destroy(receive);
+}
 
-  offset = ctx->selection_data.size;
-  if (ctx->selection_data.size < sl_incr_chunk_size)
-    p = wl_array_add(&ctx->selection_data, sl_incr_chunk_size);
-  else
-    p = (char*)ctx->selection_data.data + ctx->selection_data.size;
-  bytes_left = ctx->selection_data.alloc - offset;
+static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
+  struct sl_data_offer_receive* receive = data;
+  struct sl_context* ctx = receive->ctx;
+  int bytes;
+
+  if (!sl_data_offer_receive_reserve_buffer(receive)) {
+    wl_event_source_remove(receive->event_source);
+    receive->event_source = NULL;
+    receive->waiting = 1;
+    return 1;
+  }
 
-  bytes = read(fd, p, bytes_left);
+  bytes = read(fd, receive->data + receive->data_size,
+               ctx->selection_chunk_size - receive->data_size);
   if (bytes == -1) {
     fprintf(stderr, "read error from data source: %m\n");
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
-    ctx->selection_data_offer_receive_fd = -1;
-    close(fd);
-  } else {
-    ctx->selection_data.size = offset + bytes;
-    if (ctx->selection_data.size >= sl_incr_chunk_size) {
-      if (!ctx->selection_incremental_transfer) {
-        ctx->selection_incremental_transfer = 1;
-        xcb_change_property(
-            ctx->connection, XCB_PROP_MODE_REPLACE,
-            ctx->selection_request.requestor, ctx->selection_request.property,
-            ctx->atoms[ATOM_INCR].value, 32, 1, &sl_incr_chunk_size);
-        ctx->selection_data_ack_pending = 1;
-        sl_send_selection_notify(ctx, ctx->selection_request.property);
-      } else if (!ctx->selection_data_ack_pending) {
-        sl_send_selection_data(ctx);
-      }
-    } else if (bytes == 0) {
-      if (!ctx->selection_data_ack_pending)
-        sl_send_selection_data(ctx);
-      if (!ctx->selection_incremental_transfer) {
-        sl_send_selection_notify(ctx, ctx->selection_request.property);
-        ctx->selection_request.requestor = XCB_NONE;
-        wl_array_release(&ctx->selection_data);
-      }
-      xcb_flush(ctx->connection);
-      ctx->selection_data_offer_receive_fd = -1;
-      close(fd);
+    if (!receive->incremental)
+      sl_send_selection_notify(ctx, &receive->request, XCB_ATOM_NONE);
+    sl_data_offer_receive_destroy(receive);
+    return 1;
+  }
+
+  if (bytes == 0) {
+    wl_event_source_remove(receive->event_source);
+    receive->event_source = NULL;
+    close(receive->fd);
+    receive->fd = -1;
+
+    if (receive->cacheable)
+      sl_clipboard_cache_add(receive);
+
+    if (!receive->incremental) {
+      sl_send_selection_data(receive);
+      sl_send_selection_notify(ctx, &receive->request,
+                               receive->request.property);
+      sl_data_offer_receive_destroy(receive);
+    } else if (!receive->ack_pending) {
+      sl_data_offer_receive_flush(receive);
+    }
+    return 1;
+  }
+
+  if (receive->cacheable) {
+    // Only payloads that can be sent in a single chunk are cached.
+    if (receive->cache_data.size + bytes >
+        MIN(ctx->clipboard_cache_limit, ctx->selection_chunk_size)) {
+      receive->cacheable = 0;
+      wl_array_release(&receive->cache_data);
+      wl_array_init(&receive->cache_data);
     } else {
-      ctx->selection_data.size = offset + bytes;
-      return 1;
+      void* p = wl_array_add(&receive->cache_data, bytes);
+      assert(p);
+      memcpy(p, receive->data + receive->data_size, bytes);
     }
   }
 
-  wl_event_source_remove(ctx->selection_event_source);
-  ctx->selection_event_source = NULL;
+  receive->data_size += bytes;
+  receive->bytes += bytes;
+  if (receive->data_size < ctx->selection_chunk_size)
+    return 1;
+
+  if (!receive->incremental) {
+    receive->incremental = 1;
+    xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE,
+                        receive->request.requestor, receive->request.property,
+                        ctx->atoms[ATOM_INCR].value, 32, 1,
+                        &ctx->selection_chunk_size);
+    receive->ack_pending = 1;
+    sl_send_selection_notify(ctx, &receive->request,
+                             receive->request.property);
+  } else if (!receive->ack_pending) {
+    sl_send_selection_data(receive);
+  }
+
+  // Stop reading until the requestor has taken the buffered chunk.
+  if (receive->data) {
+    wl_event_source_remove(receive->event_source);
+    receive->event_source = NULL;
+  }
   return 1;
 }
 
-static void sl_handle_property_notify(struct sl_context* ctx,
-                                      xcb_property_notify_event_t* event) {
-  if (event->atom == XCB_ATOM_WM_NAME) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
+static void sl_handle_selection_property_delete(
+    struct sl_data_offer_receive* receive) {
+  receive->ack_pending = 0;
+
+  // Handle the case when there's more data to be received.
+  if (receive->fd >= 0) {
+    // Avoid sending empty data until transfer is complete.
+    if (receive->data_size)
+      sl_send_selection_data(receive);
+    sl_data_offer_receive_resume(receive);
+    return;
+  }
 
+  sl_data_offer_receive_flush(receive);
+}
+
+struct sl_property_request {
+  struct sl_x_request base;
+  xcb_atom_t atom;
+  uint8_t state;
+};
+
+static void sl_handle_window_property_reply(struct sl_context* ctx,
+                                            struct sl_x_request* request) {
+  struct sl_property_request* property_request =
+      (struct sl_property_request*)request;
+  struct sl_window* window = request->window;
+  xcb_atom_t atom = property_request->atom;
+  int deleted = property_request->state == XCB_PROPERTY_DELETE;
+  xcb_get_property_reply_t* reply =
+      request->num_replies ? request->replies[0] : NULL;
+
+  if (atom == XCB_ATOM_WM_NAME) {
     if (window->name) {
       free(window->name);
       window->name = NULL;
     }
 
-    if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_NAME,
-                           XCB_ATOM_ANY, 0, 2048),
-          NULL);
-      if (reply) {
-        window->name = strndup(xcb_get_property_value(reply),
-                               xcb_get_property_value_length(reply));
-        free(reply);
-      }
+    if (reply) {
+      window->name = strndup(xcb_get_property_value(reply),
+                             xcb_get_property_value_length(reply));
     }
 
     if (!window->xdg_toplevel)
@@ -2402,40 +3360,21 @@ static void sl_handle_property_notify(struct sl_context* ctx,
     } else {
       xdg_toplevel_set_title(window->xdg_toplevel, "");
     }
-  } else if (event->atom == XCB_ATOM_WM_CLASS) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window || event->state == XCB_PROPERTY_DELETE)
+  } else if (atom == XCB_ATOM_WM_CLASS) {
+    if (deleted)
       return;
 
-    xcb_get_property_cookie_t cookie =
-        xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_CLASS,
-                         XCB_ATOM_ANY, 0, 2048);
-    xcb_get_property_reply_t* reply =
-        xcb_get_property_reply(ctx->connection, cookie, NULL);
-    if (reply) {
+    if (reply)
       sl_decode_wm_class(window, reply);
-      free(reply);
-    }
     sl_update_application_id(ctx, window);
-  } else if (event->atom == XCB_ATOM_WM_NORMAL_HINTS) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
-
+  } else if (atom == XCB_ATOM_WM_NORMAL_HINTS) {
     window->size_flags &= ~(P_MIN_SIZE | P_MAX_SIZE);
 
-    if (event->state != XCB_PROPERTY_DELETE) {
+    if (!deleted) {
       struct sl_wm_size_hints size_hints = {0};
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_ANY, 0,
-                           sizeof(size_hints)),
-          NULL);
-      if (reply) {
+
+      if (reply)
         memcpy(&size_hints, xcb_get_property_value(reply), sizeof(size_hints));
-        free(reply);
-      }
 
       window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
       if (window->size_flags & P_MIN_SIZE) {
@@ -2466,51 +3405,29 @@ static void sl_handle_property_notify(struct sl_context* ctx,
     } else {
       xdg_toplevel_set_max_size(window->xdg_toplevel, 0, 0);
     }
-  } else if (event->atom == XCB_ATOM_WM_HINTS) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
-
-    if (event->state == XCB_PROPERTY_DELETE)
-      return;
+  } else if (atom == XCB_ATOM_WM_HINTS) {
     struct sl_wm_hints wm_hints = {0};
-    xcb_get_property_reply_t* reply = xcb_get_property_reply(
-        ctx->connection,
-        xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_HINTS,
-                         XCB_ATOM_ANY, 0, sizeof(wm_hints)),
-        NULL);
 
-    if (!reply)
+    if (deleted || !reply)
       return;
+
     memcpy(&wm_hints, xcb_get_property_value(reply), sizeof(wm_hints));
-    free(reply);
 
     if (wm_hints.flags & WM_HINTS_FLAG_URGENCY) {
       sl_request_attention(ctx, window, /*is_strong_request=*/false);
     }
-  } else if (event->atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
-
+  } else if (atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value) {
     // Managed windows are decorated by default.
     window->decorated = window->managed;
 
-    if (event->state != XCB_PROPERTY_DELETE) {
+    if (reply) {
       struct sl_mwm_hints mwm_hints = {0};
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           ctx->atoms[ATOM_MOTIF_WM_HINTS].value, XCB_ATOM_ANY,
-                           0, sizeof(mwm_hints)),
-          NULL);
-      if (reply) {
-        if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
-          if (mwm_hints.decorations & MWM_DECOR_ALL)
-            window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
-          else
-            window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
-        }
+
+      if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
+        if (mwm_hints.decorations & MWM_DECOR_ALL)
+          window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
+        else
+          window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
       }
     }
 
@@ -2522,28 +3439,14 @@ static void sl_handle_property_notify(struct sl_context* ctx,
                             : window->depth == 32
                                 ? ZAURA_SURFACE_FRAME_TYPE_NONE
                                 : ZAURA_SURFACE_FRAME_TYPE_SHADOW);
-  } else if (event->atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value) {
-    struct sl_window* window;
+  } else if (atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value) {
     uint32_t frame_color;
 
-    window = sl_lookup_window(ctx, event->window);
-    if (!window)
-      return;
-
     window->dark_frame = 0;
 
-    if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           ctx->atoms[ATOM_GTK_THEME_VARIANT].value,
-                           XCB_ATOM_ANY, 0, 2048),
-          NULL);
-      if (reply) {
-        if (xcb_get_property_value_length(reply) >= 4)
-          window->dark_frame = !strcmp(xcb_get_property_value(reply), "dark");
-        free(reply);
-      }
+    if (reply) {
+      if (xcb_get_property_value_length(reply) >= 4)
+        window->dark_frame = !strcmp(xcb_get_property_value(reply), "dark");
     }
 
     if (!window->aura_surface)
@@ -2552,62 +3455,71 @@ static void sl_handle_property_notify(struct sl_context* ctx,
     frame_color = window->dark_frame ? ctx->dark_frame_color : ctx->frame_color;
     zaura_surface_set_frame_colors(window->aura_surface, frame_color,
                                    frame_color);
-  } else if (event->atom == ctx->atoms[ATOM_WL_SELECTION].value) {
-    if (event->window == ctx->selection_window &&
-        event->state == XCB_PROPERTY_NEW_VALUE &&
-        ctx->selection_incremental_transfer) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, ctx->selection_window,
-                           ctx->atoms[ATOM_WL_SELECTION].value,
-                           XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
-          NULL);
-
-      if (!reply)
-        return;
+  }
+}
 
-      if (xcb_get_property_value_length(reply) > 0) {
-        sl_write_selection_property(ctx, reply);
-      } else {
-        assert(!ctx->selection_send_event_source);
-        close(ctx->selection_data_source_send_fd);
-        ctx->selection_data_source_send_fd = -1;
-        free(reply);
+static int sl_is_window_property(struct sl_context* ctx, xcb_atom_t atom) {
+  return atom == XCB_ATOM_WM_NAME || atom == XCB_ATOM_WM_CLASS ||
+         atom == XCB_ATOM_WM_NORMAL_HINTS || atom == XCB_ATOM_WM_HINTS ||
+         atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value ||
+         atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value;
+}
 
-        sl_process_data_source_send_pending_list(ctx);
-      }
-    }
-  } else if (event->atom == ctx->selection_request.property) {
-    if (event->window == ctx->selection_request.requestor &&
-        event->state == XCB_PROPERTY_DELETE &&
-        ctx->selection_incremental_transfer) {
-      int data_size = ctx->selection_data.size;
-
-      ctx->selection_data_ack_pending = 0;
-
-      // Handle the case when there's more data to be received.
-      if (ctx->selection_data_offer_receive_fd >= 0) {
-        // Avoid sending empty data until transfer is complete.
-        if (data_size)
-          sl_send_selection_data(ctx);
-
-        if (!ctx->selection_event_source) {
-          ctx->selection_event_source = wl_event_loop_add_fd(
-              wl_display_get_event_loop(ctx->host_display),
-              ctx->selection_data_offer_receive_fd, WL_EVENT_READABLE,
-              sl_handle_selection_fd_readable, ctx);
-        }
-        return;
-      }
+// Fetch a changed window property without waiting for the reply. Requests
+// for deleted properties are queued too so that changes to the same window
+// are applied in order.
+static void sl_fetch_window_property(struct sl_context* ctx,
+                                     struct sl_window* window,
+                                     xcb_atom_t atom,
+                                     uint8_t state) {
+  struct sl_property_request* request =
+      (struct sl_property_request*)sl_x_request_create(
+          window, sl_handle_window_property_reply, sizeof(*request));
+  uint32_t length = 2048;
+
+  request->atom = atom;
+  request->state = state;
+
+  if (atom == XCB_ATOM_WM_NORMAL_HINTS)
+    length = sizeof(struct sl_wm_size_hints);
+  else if (atom == XCB_ATOM_WM_HINTS)
+    length = sizeof(struct sl_wm_hints);
+  else if (atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value)
+    length = sizeof(struct sl_mwm_hints);
+
+  if (state != XCB_PROPERTY_DELETE) {
+    sl_x_request_add(&request->base,
+                     xcb_get_property(ctx->connection, 0, window->id, atom,
+                                      XCB_ATOM_ANY, 0, length)
+                         .sequence);
+  }
+
+  sl_x_request_submit(ctx, &request->base);
+}
 
-      sl_send_selection_data(ctx);
+static void sl_handle_property_notify(struct sl_context* ctx,
+                                      xcb_property_notify_event_t* event) {
+  if (sl_is_window_property(ctx, event->atom)) {
+    struct sl_window* window = sl_find_window(ctx, event->window);
+    if (!window)
+      return;
 
-      // Release data if transfer is complete.
-      if (!data_size) {
-        ctx->selection_request.requestor = XCB_NONE;
-        wl_array_release(&ctx->selection_data);
-      }
-    }
+    sl_fetch_window_property(ctx, window, event->atom, event->state);
+  } else if (event->window == ctx->selection_window) {
+    struct sl_data_source_send* send =
+        sl_find_data_source_send(ctx, event->atom);
+
+    // Each new value of an incremental transfer is the next chunk. The
+    // owner waits for the previous chunk to be written and deleted first.
+    if (send && send->incremental && !send->property_reply &&
+        event->state == XCB_PROPERTY_NEW_VALUE)
+      sl_get_selection_data(send);
+  } else if (event->state == XCB_PROPERTY_DELETE) {
+    struct sl_data_offer_receive* receive =
+        sl_find_data_offer_receive(ctx, event->window, event->atom);
+
+    if (receive && receive->incremental && receive->ack_pending)
+      sl_handle_selection_property_delete(receive);
   }
 }
 
@@ -2621,20 +3533,29 @@ static void sl_internal_data_source_send(void* data,
                                          int32_t fd) {
   struct sl_data_source* host = data;
   struct sl_context* ctx = host->ctx;
+  struct sl_data_source_send* send = malloc(sizeof(*send));
+  int slot = sl_find_send_slot(ctx);
 
-  xcb_intern_atom_cookie_t cookie =
+  assert(send);
+  send->ctx = ctx;
+  send->fd = fd;
+  send->cookie =
       xcb_intern_atom(ctx->connection, false, strlen(mime_type), mime_type);
-
-  if (ctx->selection_data_source_send_fd < 0) {
-    sl_begin_data_source_send(ctx, fd, cookie, host);
+  send->target = XCB_ATOM_NONE;
+  send->slot = -1;
+  send->incremental = 0;
+  send->long_offset = 0;
+  send->more = 0;
+  send->property_reply = NULL;
+  send->property_offset = 0;
+  send->event_source = NULL;
+  send->bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &send->start_time);
+
+  if (slot >= 0 && wl_list_empty(&ctx->selection_data_source_send_pending)) {
+    sl_begin_data_source_send(send, slot);
   } else {
-    struct sl_data_source_send_request* request =
-        malloc(sizeof(struct sl_data_source_send_request));
-
-    request->fd = fd;
-    request->cookie = cookie;
-    request->data_source = host;
-    wl_list_insert(&ctx->selection_data_source_send_pending, &request->link);
+    wl_list_insert(ctx->selection_data_source_send_pending.prev, &send->link);
   }
 }
 
@@ -2735,78 +3656,118 @@ static void sl_get_selection_targets(struct sl_context* ctx) {
   free(reply);
 }
 
-static void sl_get_selection_data(struct sl_context* ctx) {
+// Reads the next piece of the transfer property. Properties larger than a
+// chunk are read in several pieces to bound memory use.
+static void sl_get_selection_data(struct sl_data_source_send* send) {
+  struct sl_context* ctx = send->ctx;
   xcb_get_property_reply_t* reply = xcb_get_property_reply(
       ctx->connection,
-      xcb_get_property(ctx->connection, 1, ctx->selection_window,
-                       ctx->atoms[ATOM_WL_SELECTION].value,
-                       XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
+      xcb_get_property(ctx->connection, 0, ctx->selection_window,
+                       ctx->selection_send_atoms[send->slot],
+                       XCB_GET_PROPERTY_TYPE_ANY, send->long_offset,
+                       ctx->selection_chunk_size / 4),
       NULL);
-  if (!reply)
+  if (!reply) {
+    sl_data_source_send_destroy(send);
     return;
+  }
 
   if (reply->type == ctx->atoms[ATOM_INCR].value) {
-    ctx->selection_incremental_transfer = 1;
+    send->incremental = 1;
+    send->long_offset = 0;
     free(reply);
+    xcb_delete_property(ctx->connection, ctx->selection_window,
+                        ctx->selection_send_atoms[send->slot]);
+  } else if (send->incremental && !xcb_get_property_value_length(reply)) {
+    free(reply);
+    sl_data_source_send_destroy(send);
   } else {
-    ctx->selection_incremental_transfer = 0;
-    sl_write_selection_property(ctx, reply);
+    sl_write_selection_property(send, reply);
   }
 }
 
 static void sl_handle_selection_notify(struct sl_context* ctx,
                                        xcb_selection_notify_event_t* event) {
-  if (event->property == XCB_ATOM_NONE)
+  int i;
+
+  if (event->target == ctx->atoms[ATOM_TARGETS].value) {
+    if (event->property != XCB_ATOM_NONE)
+      sl_get_selection_targets(ctx);
     return;
+  }
 
-  if (event->target == ctx->atoms[ATOM_TARGETS].value)
-    sl_get_selection_targets(ctx);
-  else
-    sl_get_selection_data(ctx);
+  for (i = 0; i < SELECTION_MAX_SENDS; ++i) {
+    struct sl_data_source_send* send = ctx->selection_data_source_sends[i];
+
+    if (!send || send->target != event->target)
+      continue;
+
+    // A refused conversion doesn't name the property, so fail the first
+    // transfer of this target that hasn't started.
+    if (event->property == XCB_ATOM_NONE) {
+      if (send->incremental || send->property_reply)
+        continue;
+      sl_data_source_send_destroy(send);
+      return;
+    }
+
+    if (ctx->selection_send_atoms[i] == event->property) {
+      sl_get_selection_data(send);
+      return;
+    }
+  }
 }
 
-static void sl_send_targets(struct sl_context* ctx) {
+static void sl_send_targets(struct sl_context* ctx,
+                            const xcb_selection_request_event_t* request) {
   xcb_change_property(
-      ctx->connection, XCB_PROP_MODE_REPLACE, ctx->selection_request.requestor,
-      ctx->selection_request.property, XCB_ATOM_ATOM, 32,
+      ctx->connection, XCB_PROP_MODE_REPLACE, request->requestor,
+      request->property, XCB_ATOM_ATOM, 32,
       ctx->selection_data_offer->atoms.size / sizeof(xcb_atom_t),
       ctx->selection_data_offer->atoms.data);
 
-  sl_send_selection_notify(ctx, ctx->selection_request.property);
+  sl_send_selection_notify(ctx, request, request->property);
 }
 
-static void sl_send_timestamp(struct sl_context* ctx) {
+static void sl_send_timestamp(struct sl_context* ctx,
+                              const xcb_selection_request_event_t* request) {
   xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE,
-                      ctx->selection_request.requestor,
-                      ctx->selection_request.property, XCB_ATOM_INTEGER, 32, 1,
-                      &ctx->selection_timestamp);
+                      request->requestor, request->property, XCB_ATOM_INTEGER,
+                      32, 1, &ctx->selection_timestamp);
 
-  sl_send_selection_notify(ctx, ctx->selection_request.property);
+  sl_send_selection_notify(ctx, request, request->property);
 }
 
-static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
+static void sl_send_data(struct sl_context* ctx,
+                         const xcb_selection_request_event_t* request,
+                         xcb_atom_t data_type,
+                         const char* mime_type) {
+  struct sl_clipboard_cache_entry* entry;
+  struct sl_data_offer_receive* receive;
   int rv, fd_to_receive, fd_to_wayland;
 
   if (!ctx->selection_data_offer) {
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+    sl_send_selection_notify(ctx, request, XCB_ATOM_NONE);
     return;
   }
 
-  if (ctx->selection_event_source) {
-    fprintf(stderr, "error: selection transfer already pending\n");
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+  // The selection hasn't changed since this target was last transferred, so
+  // answer from memory instead of asking the data source again.
+  entry = sl_clipboard_cache_find(ctx, data_type);
+  if (entry) {
+    xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE,
+                        request->requestor, request->property, data_type,
+                        /*format=*/8, entry->data.size, entry->data.data);
+    sl_send_selection_notify(ctx, request, request->property);
     return;
   }
 
-  ctx->selection_data_type = data_type;
-
-  // We will need the name of this atom later to tell the wayland server what
-  // type of data to send us, so start the request now.
-  xcb_get_atom_name_cookie_t atom_name_cookie =
-      xcb_get_atom_name(ctx->connection, data_type);
-
-  wl_array_init(&ctx->selection_data);
-  ctx->selection_data_ack_pending = 0;
+  if (sl_find_data_offer_receive(ctx, request->requestor,
+                                 request->property)) {
+    fprintf(stderr, "error: selection transfer already pending\n");
+    sl_send_selection_notify(ctx, request, XCB_ATOM_NONE);
+    return;
+  }
 
   switch (ctx->data_driver) {
     case DATA_DRIVER_VIRTWL: {
@@ -2821,7 +3782,7 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
       if (rv) {
         fprintf(stderr, "error: failed to create virtwl pipe: %s\n",
                 strerror(errno));
-        sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+        sl_send_selection_notify(ctx, request, XCB_ATOM_NONE);
         return;
       }
 
@@ -2841,63 +3802,70 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
     } break;
   }
 
-  xcb_get_atom_name_reply_t* atom_name_reply =
-      xcb_get_atom_name_reply(ctx->connection, atom_name_cookie, NULL);
-  if (atom_name_reply) {
-    // If we got the atom name, then send the request to wayland and add our end
-    // of the pipe to the wayland event loop.
-    ctx->selection_data_offer_receive_fd = fd_to_receive;
-    char* name = sl_copy_atom_name(atom_name_reply);
-    wl_data_offer_receive(ctx->selection_data_offer->internal, name,
-                          fd_to_wayland);
-    free(atom_name_reply);
-    free(name);
-
-    ctx->selection_event_source = wl_event_loop_add_fd(
-        wl_display_get_event_loop(ctx->host_display),
-        ctx->selection_data_offer_receive_fd, WL_EVENT_READABLE,
-        sl_handle_selection_fd_readable, ctx);
-  } else {
-    // If getting the atom name failed, notify the requestor that there won't be
-    // any data, and close our end of the pipe.
-    close(fd_to_receive);
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
-  }
-
-  // Close the wayland end of the pipe, now that it's either been sent or not
-  // going to be sent. The VIRTWL driver uses the same fd for both ends of the
-  // pipe, so don't close the fd if both ends are the same.
+  // Send the request to wayland and add our end of the pipe to the wayland
+  // event loop.
+  receive = malloc(sizeof(*receive));
+  assert(receive);
+  receive->ctx = ctx;
+  receive->request = *request;
+  receive->data_type = data_type;
+  receive->fd = fd_to_receive;
+  receive->event_source = NULL;
+  receive->data = NULL;
+  receive->data_size = 0;
+  receive->incremental = 0;
+  receive->ack_pending = 0;
+  receive->waiting = 0;
+  receive->cacheable = ctx->clipboard_cache_limit > 0;
+  wl_array_init(&receive->cache_data);
+  receive->bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &receive->start_time);
+  wl_list_insert(ctx->selection_data_offer_receives.prev, &receive->link);
+
+  wl_data_offer_receive(ctx->selection_data_offer->internal, mime_type,
+                        fd_to_wayland);
+  sl_data_offer_receive_resume(receive);
+
+  // Close the wayland end of the pipe, now that it's been sent. The VIRTWL
+  // driver uses the same fd for both ends of the pipe, so don't close the fd
+  // if both ends are the same.
   if (fd_to_receive != fd_to_wayland)
     close(fd_to_wayland);
 }
 
 static void sl_handle_selection_request(struct sl_context* ctx,
                                         xcb_selection_request_event_t* event) {
-  ctx->selection_request = *event;
-  ctx->selection_incremental_transfer = 0;
-
   if (event->selection == ctx->atoms[ATOM_CLIPBOARD_MANAGER].value) {
-    sl_send_selection_notify(ctx, ctx->selection_request.property);
+    sl_send_selection_notify(ctx, event, event->property);
     return;
   }
 
   if (event->target == ctx->atoms[ATOM_TARGETS].value) {
-    sl_send_targets(ctx);
+    sl_send_targets(ctx, event);
   } else if (event->target == ctx->atoms[ATOM_TIMESTAMP].value) {
-    sl_send_timestamp(ctx);
-  } else {
+    sl_send_timestamp(ctx, event);
+  } else if (ctx->selection_data_offer) {
+    struct sl_data_offer* data_offer = ctx->selection_data_offer;
+    xcb_atom_t* atoms = data_offer->atoms.data;
+    char** mime_types = data_offer->mime_types.data;
+    size_t num_atoms = data_offer->atoms.size / sizeof(xcb_atom_t);
     int success = 0;
-    xcb_atom_t* atom;
-    wl_array_for_each(atom, &ctx->selection_data_offer->atoms) {
-      if (event->target == *atom) {
+    size_t i;
+
+    // The first two atoms are TARGETS and TIMESTAMP, followed by one for
+    // each offered MIME type.
+    for (i = 2; i < num_atoms; ++i) {
+      if (event->target == atoms[i]) {
         success = 1;
-        sl_send_data(ctx, *atom);
+        sl_send_data(ctx, event, atoms[i], mime_types[i - 2]);
         break;
       }
     }
     if (!success) {
-      sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+      sl_send_selection_notify(ctx, event, XCB_ATOM_NONE);
     }
+  } else {
+    sl_send_selection_notify(ctx, event, XCB_ATOM_NONE);
   }
 }
 
@@ -2915,6 +3883,7 @@ static void sl_handle_xfixes_selection_notify(
       }
     }
     ctx->selection_owner = XCB_WINDOW_NONE;
+    sl_clipboard_cache_clear(ctx);
     return;
   }
 
@@ -2926,7 +3895,8 @@ static void sl_handle_xfixes_selection_notify(
     return;
   }
 
-  ctx->selection_incremental_transfer = 0;
+  sl_clipboard_cache_clear(ctx);
+
   xcb_convert_selection(ctx->connection, ctx->selection_window,
                         ctx->atoms[ATOM_CLIPBOARD].value,
                         ctx->atoms[ATOM_TARGETS].value,
@@ -2944,8 +3914,16 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
     exit(EXIT_SUCCESS);
   }
 
-  while ((event = xcb_poll_for_event(ctx->connection))) {
-    switch (event->response_type & ~SEND_EVENT_MASK) {
+  if (mask == 0)
+    ctx->stats.x_event_checks++;
+
+  while (count < X_EVENT_BATCH_SIZE &&
+         (event = xcb_poll_for_event(ctx->connection))) {
+    uint8_t type = event->response_type & ~SEND_EVENT_MASK;
+    uint64_t start = sl_stats_timestamp(ctx);
+
+    sl_trace_begin(ctx, "x event");
+    switch (type) {
       case XCB_CREATE_NOTIFY:
         sl_handle_create_notify(ctx, (xcb_create_notify_event_t*)event);
         break;
@@ -2996,13 +3974,27 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
             ctx, (xcb_xfixes_selection_notify_event_t*)event);
         break;
     }
+    sl_trace_end(ctx);
+    sl_timing_add(ctx, &ctx->stats.x_events[type], start);
 
     free(event);
     ++count;
   }
 
-  if ((mask & ~WL_EVENT_WRITABLE) == 0)
-    xcb_flush(ctx->connection);
+  sl_process_x_requests(ctx);
+
+  if (count)
+    ctx->stats.x_event_batches++;
+  ctx->stats.x_events_handled += count;
+
+  // The rest of a full batch is handled on the next event loop iteration,
+  // after all connections have been flushed. Returning 0 ends the post
+  // dispatch check so that other connections are not starved.
+  ctx->x_events_pending = count == X_EVENT_BATCH_SIZE;
+  if (ctx->x_events_pending) {
+    ctx->stats.x_events_deferred++;
+    return 0;
+  }
 
   return count;
 }
@@ -3037,6 +4029,7 @@ static void sl_connect(struct sl_context* ctx) {
   xcb_depth_iterator_t depth_iterator;
   xcb_xfixes_query_version_reply_t* xfixes_query_version_reply;
   const xcb_query_extension_reply_t* composite_extension;
+  uint32_t max_request_length;
   unsigned i;
 
   ctx->connection = xcb_connect_to_fd(ctx->wm_fd, NULL);
@@ -3066,6 +4059,10 @@ static void sl_connect(struct sl_context* ctx) {
       wl_display_get_event_loop(ctx->host_display),
       xcb_get_file_descriptor(ctx->connection), WL_EVENT_READABLE,
       &sl_handle_x_connection_event, ctx);
+  // Replies to asynchronous requests can be read from the connection while
+  // waiting for other replies. Make sure they are handled after every event
+  // loop iteration.
+  wl_event_source_check(ctx->connection_event_source);
 
   ctx->xfixes_extension =
       xcb_get_extension_data(ctx->connection, &xcb_xfixes_id);
@@ -3109,6 +4106,14 @@ static void sl_connect(struct sl_context* ctx) {
     free(atom_reply);
   }
 
+  // Size selection chunks so that each one fits in a single request.
+  // Lengths are in 4 byte units.
+  max_request_length = xcb_get_maximum_request_length(ctx->connection);
+  ctx->selection_chunk_size =
+      MIN(SELECTION_MAX_CHUNK_SIZE / 4,
+          max_request_length - SELECTION_REQUEST_HEADER_SIZE / 4) *
+      4;
+
   depth_iterator = xcb_screen_allowed_depths_iterator(ctx->screen);
   while (depth_iterator.rem > 0) {
     int depth = depth_iterator.data->depth;
@@ -3214,6 +4219,8 @@ static int sl_handle_sigchld(int signal_number, void* data) {
       if (ctx->exit_with_child) {
         if (ctx->xwayland_pid >= 0)
           kill(ctx->xwayland_pid, SIGTERM);
+        else if (ctx->xwayland_launch && ctx->xwayland_launch->lazy)
+          exit(EXIT_SUCCESS);
       } else {
         // Notify systemd that we are ready to accept connections now that
         // child process has finished running and all environment is ready.
@@ -3233,6 +4240,17 @@ static int sl_handle_sigchld(int signal_number, void* data) {
   return 1;
 }
 
+// Signals handled by the event loop are blocked, and the mask is inherited
+// across exec. Spawned programs expect them to be deliverable.
+static void sl_unblock_event_loop_signals(void) {
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
 static void sl_execvp(const char* file,
                       char* const argv[],
                       int wayland_socked_fd) {
@@ -3244,6 +4262,7 @@ static void sl_execvp(const char* file,
 
   setenv("SOMMELIER_VERSION", SOMMELIER_VERSION, 1);
 
+  sl_unblock_event_loop_signals();
   execvp(file, argv);
   perror(file);
 }
@@ -3330,6 +4349,10 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
   sl_calculate_scale_for_xwayland(ctx);
   wl_display_flush_clients(ctx->host_display);
 
+  // The program was started before a lazily started Xwayland.
+  if (ctx->xwayland_launch->lazy)
+    return 1;
+
   putenv(sl_xasprintf("XCURSOR_SIZE=%d",
                       (int)(XCURSOR_SIZE_BASE * ctx->scale + 0.5)));
 
@@ -3340,191 +4363,1105 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
     _exit(EXIT_FAILURE);
   }
 
-  ctx->child_pid = pid;
+  ctx->child_pid = pid;
+
+  return 1;
+}
+
+static void sl_sigchld_handler(int signal) {
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    continue;
+}
+
+static void sl_client_destroy_notify(struct wl_listener* listener, void* data) {
+  struct sl_context* ctx =
+      wl_container_of(listener, ctx, client_destroy_listener);
+
+  ctx->client = NULL;
+  sl_context_quit(ctx);
+}
+
+// Size of one receive transaction slot, rounded up so that the fds of the
+// next slot stay aligned.
+static size_t sl_virtwl_txn_size(struct sl_context* ctx) {
+  return (sizeof(struct virtwl_ioctl_txn) + ctx->virtwl_buffer_size + 7) & ~7;
+}
+
+static int sl_fd_is_readable(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+static int sl_handle_virtwl_ctx_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  size_t txn_size = sl_virtwl_txn_size(ctx);
+  struct virtwl_ioctl_txn* ioctl_recv;
+  struct iovec buffer_iov[VIRTWL_MAX_BATCH];
+  int fds[VIRTWL_SEND_MAX_ALLOCS];
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  struct msghdr msg = {0};
+  size_t recv_size = 0;
+  ssize_t bytes;
+  int fd_count = 0;
+  int count = 0;
+  int failed = 0;
+  int rv;
+
+  if (!(mask & WL_EVENT_READABLE)) {
+    fprintf(stderr,
+            "Got error or hangup on virtwl ctx fd"
+            " (mask %d), exiting\n",
+            mask);
+    sl_context_quit(ctx);
+    return 0;
+  }
+
+  // Each transaction is received into its own slot and the slots are then
+  // gathered into a single sendmsg call. Batching stops after the first
+  // transaction that carries FDs so that they are never split from the data
+  // they belong to and never exceed what the client accepts in one message.
+  do {
+    int txn_fd_count;
+
+    ioctl_recv =
+        (struct virtwl_ioctl_txn*)(ctx->virtwl_recv_txns + count * txn_size);
+    ioctl_recv->len = ctx->virtwl_buffer_size;
+    rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
+    ctx->virtwl_recv_stats.ioctls++;
+    if (rv) {
+      failed = 1;
+      break;
+    }
+
+    // Count how many FDs the kernel gave us.
+    for (txn_fd_count = 0; txn_fd_count < VIRTWL_SEND_MAX_ALLOCS;
+         txn_fd_count++) {
+      if (ioctl_recv->fds[txn_fd_count] < 0)
+        break;
+    }
+    memcpy(fds, ioctl_recv->fds, txn_fd_count * sizeof(int));
+    fd_count = txn_fd_count;
+
+    buffer_iov[count].iov_base =
+        (uint8_t*)ioctl_recv + sizeof(struct virtwl_ioctl_txn);
+    buffer_iov[count].iov_len = ioctl_recv->len;
+    recv_size += ioctl_recv->len;
+    count++;
+  } while (!fd_count && count < ctx->virtwl_batch && sl_fd_is_readable(fd));
+
+  if (count) {
+    msg.msg_iov = buffer_iov;
+    msg.msg_iovlen = count;
+    msg.msg_control = fd_buffer;
+
+    if (fd_count) {
+      struct cmsghdr* cmsg;
+
+      // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
+      // cmsghdr. We copy every fd we just received from the ioctl into this
+      // cmsghdr.
+      msg.msg_controllen = sizeof(fd_buffer);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+      memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+      msg.msg_controllen = cmsg->cmsg_len;
+    }
+
+    bytes = sendmsg(ctx->virtwl_socket_fd, &msg, MSG_NOSIGNAL);
+    errno_assert(bytes == (ssize_t)recv_size);
+
+    ctx->virtwl_recv_stats.messages += count;
+    ctx->virtwl_recv_stats.bytes += recv_size;
+    ctx->virtwl_recv_stats.fds += fd_count;
+
+    while (fd_count--)
+      close(fds[fd_count]);
+  }
+
+  if (failed) {
+    close(ctx->virtwl_socket_fd);
+    ctx->virtwl_socket_fd = -1;
+    return 0;
+  }
+
+  return 1;
+}
+
+static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct virtwl_ioctl_txn* ioctl_send = ctx->virtwl_send_txn;
+  uint8_t* send_data =
+      (uint8_t*)ioctl_send + sizeof(struct virtwl_ioctl_txn);
+  size_t max_send_size = ctx->virtwl_buffer_size;
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  size_t send_size = 0;
+  int fd_count = 0;
+  int count = 0;
+  int rv;
+  int i;
+
+  if (!(mask & WL_EVENT_READABLE)) {
+    fprintf(stderr,
+            "Got error or hangup on virtwl socket"
+            " (mask %d), exiting\n",
+            mask);
+    sl_context_quit(ctx);
+    return 0;
+  }
+
+  // Drain the socket into a single transaction until the buffer is full or
+  // the batch limit is reached. The kernel never returns data past a message
+  // that carries FDs, so stopping after the first one keeps every FD attached
+  // to the transaction that contains its data.
+  do {
+    struct iovec buffer_iov;
+    struct msghdr msg = {0};
+    struct cmsghdr* cmsg;
+    ssize_t bytes;
+
+    buffer_iov.iov_base = send_data + send_size;
+    buffer_iov.iov_len = max_send_size - send_size;
+
+    msg.msg_iov = &buffer_iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = fd_buffer;
+    msg.msg_controllen = sizeof(fd_buffer);
+
+    bytes = recvmsg(ctx->virtwl_socket_fd, &msg, count ? MSG_DONTWAIT : 0);
+    if (count && bytes <= 0)
+      break;
+    errno_assert(bytes > 0);
+
+    // If there were any FDs recv'd by recvmsg, there will be some data in the
+    // msg_control buffer. To get the FDs out we iterate all cmsghdr's within
+    // and unpack the FDs if the cmsghdr type is SCM_RIGHTS.
+    for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      size_t cmsg_fd_count;
+
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+
+      cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      // fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
+      // control message buffer only allocates enough space for that many FDs
+      // and we stop reading once any have been received.
+      memcpy(&ioctl_send->fds[fd_count], CMSG_DATA(cmsg),
+             cmsg_fd_count * sizeof(int));
+      fd_count += cmsg_fd_count;
+    }
+
+    send_size += bytes;
+    count++;
+  } while (!fd_count && send_size < max_send_size &&
+           count < ctx->virtwl_batch);
+
+  for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
+    ioctl_send->fds[i] = -1;
+
+  // The FDs and data were extracted from the recvmsg calls into the
+  // ioctl_send structure which we now pass along to the kernel.
+  ioctl_send->len = send_size;
+  rv = ioctl(ctx->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, ioctl_send);
+  errno_assert(!rv);
+
+  ctx->virtwl_send_stats.messages += count;
+  ctx->virtwl_send_stats.bytes += send_size;
+  ctx->virtwl_send_stats.fds += fd_count;
+  ctx->virtwl_send_stats.ioctls++;
+
+  while (fd_count--)
+    close(ioctl_send->fds[fd_count]);
+
+  return 1;
+}
+
+static int sl_handle_sigusr1(int signal_number, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  sl_stats_report(ctx, stderr);
+
+  return 1;
+}
+
+// Break |str| into a sequence of zero or more nonempty arguments. No more
+// than |argc| arguments will be added to |argv|. Returns the total number of
+// argments found in |str|.
+static int sl_parse_cmd_prefix(char* str, int argc, char** argv) {
+  char* s = str;
+  int n = 0;
+  int delim = 0;
+
+  do {
+    // Look for ending delimiter if |delim| is set.
+    if (delim) {
+      if (*s == delim) {
+        delim = 0;
+        *s = '\0';
+      }
+      ++s;
+    } else {
+      // Skip forward to first non-space character.
+      while (*s == ' ' && *s != '\0')
+        ++s;
+
+      // Check for quote delimiter.
+      if (*s == '"') {
+        delim = '"';
+        ++s;
+      } else {
+        delim = ' ';
+      }
+
+      // Add string to arguments if there's room.
+      if (n < argc)
+        argv[n] = s;
+
+      ++n;
+    }
+  } while (*s != '\0');
+
+  return n;
+}
+
+// A pre-forked peer waiting for the master to hand it a client.
+struct sl_pooled_peer {
+  int ctrl_fd;
+  struct timespec spawn_time;
+};
+
+// Starts Xwayland with the options in |ctx->xwayland_launch|. Sockets that
+// sommelier has been listening on for a lazy start are handed over to it.
+static void sl_spawn_xwayland(struct sl_context* ctx) {
+  struct sl_xwayland_launch* launch = ctx->xwayland_launch;
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  int ds[2], wm[2];
+  pid_t pid;
+  int rv;
+  int j;
+
+  // Xwayland display ready socket.
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ds);
+  errno_assert(!rv);
+
+  ctx->display_ready_event_source =
+      wl_event_loop_add_fd(event_loop, ds[0], WL_EVENT_READABLE,
+                           sl_handle_display_ready_event, ctx);
+
+  // X connection to Xwayland.
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, wm);
+  errno_assert(!rv);
+
+  ctx->wm_fd = wm[0];
+
+  pid = fork();
+  errno_assert(pid != -1);
+  if (pid == 0) {
+    char* display_fd_str;
+    char* wm_fd_str;
+    char* xwayland_cmd_prefix_str;
+    char* args[64];
+    int i = 0;
+    int fd;
+
+    if (launch->cmd_prefix) {
+      xwayland_cmd_prefix_str = sl_xasprintf("%s", launch->cmd_prefix);
+
+      i = sl_parse_cmd_prefix(xwayland_cmd_prefix_str, 32, args);
+      if (i > 32) {
+        fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
+        i = 0;
+      }
+    }
+
+    args[i++] = sl_xasprintf("%s", launch->path ?: XWAYLAND_PATH);
+
+    fd = dup(ds[1]);
+    display_fd_str = sl_xasprintf("%d", fd);
+    fd = dup(wm[1]);
+    wm_fd_str = sl_xasprintf("%d", fd);
+
+    if (launch->display >= 0) {
+      args[i++] = sl_xasprintf(":%d", launch->display);
+    }
+    // Sockets that sommelier has been listening on are handed over.
+    for (j = 0; j < ARRAY_SIZE(launch->listen_fds); ++j) {
+      if (launch->listen_fds[j] >= 0) {
+        args[i++] = "-listen";
+        args[i++] = sl_xasprintf("%d", dup(launch->listen_fds[j]));
+      }
+    }
+    args[i++] = "-nolisten";
+    args[i++] = "tcp";
+    args[i++] = "-rootless";
+    // Use software rendering unless we have a DRM device and glamor is
+    // enabled.
+    if (!launch->glamor)
+      args[i++] = "-shm";
+    args[i++] = "-displayfd";
+    args[i++] = display_fd_str;
+    args[i++] = "-wm";
+    args[i++] = wm_fd_str;
+    if (launch->auth_path) {
+      args[i++] = "-auth";
+      args[i++] = sl_xasprintf("%s", launch->auth_path);
+    }
+    if (launch->font_path) {
+      args[i++] = "-fp";
+      args[i++] = sl_xasprintf("%s", launch->font_path);
+    }
+    args[i++] = NULL;
+
+    if (launch->gl_driver_path && *launch->gl_driver_path)
+      setenv("LIBGL_DRIVERS_PATH", launch->gl_driver_path, 1);
+
+    sl_execvp(args[0], args, launch->wayland_fd);
+    _exit(EXIT_FAILURE);
+  }
+  close(wm[1]);
+  ctx->xwayland_pid = pid;
+
+  close(launch->wayland_fd);
+  launch->wayland_fd = -1;
+
+  for (j = 0; j < ARRAY_SIZE(launch->listen_fds); ++j) {
+    if (launch->listen_event_sources[j]) {
+      wl_event_source_remove(launch->listen_event_sources[j]);
+      launch->listen_event_sources[j] = NULL;
+    }
+    if (launch->listen_fds[j] >= 0) {
+      close(launch->listen_fds[j]);
+      launch->listen_fds[j] = -1;
+    }
+  }
+}
+
+static int sl_handle_x_socket_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  // The pending connection is accepted by Xwayland once it is running.
+  sl_spawn_xwayland(ctx);
+  return 1;
+}
+
+// Takes the lock file for X11 display |display|. Lock files left behind by
+// servers that are no longer running are taken over.
+static int sl_lock_x_display(int display) {
+  char* path = sl_xasprintf(X11_LOCK_FORMAT, display);
+  char pid[X11_LOCK_SIZE + 1];
+  ssize_t bytes;
+  pid_t owner;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+  if (fd < 0 && errno == EEXIST) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      bytes = read(fd, pid, X11_LOCK_SIZE);
+      close(fd);
+      fd = -1;
+      if (bytes == X11_LOCK_SIZE) {
+        pid[X11_LOCK_SIZE] = '\0';
+        owner = strtol(pid, NULL, 10);
+        if (owner > 0 && kill(owner, 0) && errno == ESRCH && !unlink(path))
+          fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+      }
+    }
+  }
+  if (fd < 0) {
+    free(path);
+    return 0;
+  }
+
+  snprintf(pid, sizeof(pid), "%10d\n", getpid());
+  bytes = write(fd, pid, X11_LOCK_SIZE);
+  close(fd);
+  if (bytes != X11_LOCK_SIZE) {
+    unlink(path);
+    free(path);
+    return 0;
+  }
+
+  free(path);
+  return 1;
+}
+
+static int sl_bind_x_socket(const char* path, int abstract) {
+  struct sockaddr_un addr;
+  socklen_t size;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_LOCAL;
+  if (abstract) {
+    // Abstract socket names start with a NUL byte.
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "%s", path);
+    size = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(path);
+  } else {
+    unlink(path);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    size = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+  }
+
+  fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (bind(fd, (struct sockaddr*)&addr, size) < 0 || listen(fd, 128) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int sl_open_x_display(int display, int* fds) {
+  char* path;
+
+  if (!sl_lock_x_display(display))
+    return 0;
+
+  path = sl_xasprintf(X11_SOCKET_DIR "/X%d", display);
+  fds[0] = sl_bind_x_socket(path, 1);
+  fds[1] = sl_bind_x_socket(path, 0);
+  free(path);
+
+  if (fds[0] < 0 || fds[1] < 0) {
+    if (fds[0] >= 0)
+      close(fds[0]);
+    if (fds[1] >= 0)
+      close(fds[1]);
+    fds[0] = fds[1] = -1;
+
+    path = sl_xasprintf(X11_LOCK_FORMAT, display);
+    unlink(path);
+    free(path);
+    return 0;
+  }
+
+  return 1;
+}
+
+// X11 display that this process holds the lock file and socket of.
+static int sl_exit_x_display = -1;
+static pid_t sl_exit_x_display_pid;
+
+// Removes the lock file and socket when the display goes away with us.
+// Forked children don't own them.
+static void sl_remove_x_display_at_exit(void) {
+  char* path;
+
+  if (sl_exit_x_display < 0 || sl_exit_x_display_pid != getpid())
+    return;
+
+  path = sl_xasprintf(X11_SOCKET_DIR "/X%d", sl_exit_x_display);
+  unlink(path);
+  free(path);
+  path = sl_xasprintf(X11_LOCK_FORMAT, sl_exit_x_display);
+  unlink(path);
+  free(path);
+  sl_exit_x_display = -1;
+}
+
+// Listens on the X11 display sockets so that Xwayland can be started when
+// the first client connects. Uses the requested display or the first one
+// that is free. Returns 0 if no display could be set up.
+static int sl_listen_x_display(struct sl_context* ctx) {
+  struct sl_xwayland_launch* launch = ctx->xwayland_launch;
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  int display = MAX(launch->display, 0);
+  int last = launch->display >= 0 ? launch->display : X11_MAX_DISPLAY;
+  int j;
+
+  if (!mkdir(X11_SOCKET_DIR, 01777))
+    chmod(X11_SOCKET_DIR, 01777);
+
+  while (display <= last && !sl_open_x_display(display, launch->listen_fds))
+    ++display;
+
+  if (display > last) {
+    fprintf(stderr, "error: failed to listen on an X11 display\n");
+    return 0;
+  }
+
+  for (j = 0; j < ARRAY_SIZE(launch->listen_fds); ++j) {
+    launch->listen_event_sources[j] =
+        wl_event_loop_add_fd(event_loop, launch->listen_fds[j],
+                             WL_EVENT_READABLE, sl_handle_x_socket_event, ctx);
+  }
+
+  launch->display = display;
+  launch->lazy = 1;
+  putenv(sl_xasprintf("DISPLAY=:%d", display));
+
+  sl_exit_x_display = display;
+  sl_exit_x_display_pid = getpid();
+  atexit(sl_remove_x_display_at_exit);
+  return 1;
+}
+
+// Execs a peer sommelier. |fd_arg| passes either the client connection or
+// the control socket of a pooled peer.
+static void sl_exec_peer(int argc,
+                         char** argv,
+                         const char* peer_cmd_prefix,
+                         char* peer_pid_arg,
+                         char* fd_arg) {
+  char* peer_cmd_prefix_str;
+  char* args[64];
+  int i = 0, j;
+
+  if (!peer_cmd_prefix)
+    peer_cmd_prefix = PEER_CMD_PREFIX;
+
+  if (peer_cmd_prefix) {
+    peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
+
+    i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
+    if (i > 32) {
+      fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
+      i = 0;
+    }
+  }
+
+  args[i++] = argv[0];
+  if (peer_pid_arg)
+    args[i++] = peer_pid_arg;
+  args[i++] = fd_arg;
+
+  // forward some flags.
+  for (j = 1; j < argc; ++j) {
+    char* arg = argv[j];
+    if (strstr(arg, "--display") == arg ||
+        strstr(arg, "--scale") == arg ||
+        strstr(arg, "--accelerators") == arg ||
+        strstr(arg, "--virtwl-device") == arg ||
+        strstr(arg, "--drm-device") == arg ||
+        strstr(arg, "--shm-driver") == arg ||
+        strstr(arg, "--data-driver") == arg ||
+        strstr(arg, "--copy-kernel") == arg ||
+        strstr(arg, "--copy-threads") == arg ||
+        strstr(arg, "--buffer-pool-size") == arg ||
+        strstr(arg, "--buffer-budget") == arg ||
+        strstr(arg, "--buffer-idle-timeout") == arg ||
+        strstr(arg, "--virtwl-buffer-size") == arg ||
+        strstr(arg, "--virtwl-batch") == arg ||
+        strstr(arg, "--coalesce-pointer-motion") == arg ||
+        strstr(arg, "--coalesce-commits") == arg ||
+        strstr(arg, "--throttle-hidden") == arg ||
+        strstr(arg, "--downscale") == arg ||
+        strstr(arg, "--gpu-upload") == arg ||
+        strstr(arg, "--no-dmabuf-modifiers") == arg ||
+        strstr(arg, "--multi-client") == arg ||
+        strstr(arg, "--trace") == arg) {
+      args[i++] = arg;
+    }
+  }
+
+  args[i++] = NULL;
+
+  sl_unblock_event_loop_signals();
+  execvp(args[0], args);
+  _exit(EXIT_FAILURE);
+}
+
+static int sl_spawn_pooled_peer(int argc,
+                                char** argv,
+                                const char* peer_cmd_prefix,
+                                int sock_fd,
+                                int lock_fd,
+                                struct sl_pooled_peer* peer) {
+  pid_t pid;
+  int sv[2];
+  int rv;
+
+  rv = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+  if (rv) {
+    fprintf(stderr, "error: failed to create peer control socket: %m\n");
+    return 0;
+  }
+
+  pid = fork();
+  errno_assert(pid != -1);
+  if (pid == 0) {
+    close(sock_fd);
+    close(lock_fd);
+
+    // Only the peer end of the control socket is kept across exec.
+    rv = fcntl(sv[1], F_SETFD, 0);
+    errno_assert(!rv);
+
+    sl_exec_peer(argc, argv, peer_cmd_prefix, NULL,
+                 sl_xasprintf("--peer-ctrl-fd=%d", sv[1]));
+  }
+  close(sv[1]);
+
+  peer->ctrl_fd = sv[0];
+  clock_gettime(CLOCK_MONOTONIC, &peer->spawn_time);
+  return 1;
+}
+
+// Closes the control socket of each peer that has been waiting for longer
+// than |timeout| seconds, which makes it exit. Returns the number of
+// milliseconds until the next peer expires, or -1 if none are left.
+static int sl_expire_pooled_peers(struct sl_pooled_peer* peers,
+                                  int* num_peers,
+                                  int timeout) {
+  struct timespec now;
+  int64_t next = -1;
+  int i = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (i < *num_peers) {
+    int64_t idle = (now.tv_sec - peers[i].spawn_time.tv_sec) * 1000 +
+                   (now.tv_nsec - peers[i].spawn_time.tv_nsec) / 1000000;
+    int64_t left = timeout * 1000LL - idle;
+
+    if (left <= 0) {
+      close(peers[i].ctrl_fd);
+      --*num_peers;
+      memmove(&peers[i], &peers[i + 1], (*num_peers - i) * sizeof(*peers));
+      continue;
+    }
+
+    if (next < 0 || left < next)
+      next = left;
+    ++i;
+  }
+
+  return next;
+}
+
+// Sends |client_fd| to a pooled peer. Fails if the peer has exited.
+static int sl_hand_over_client(int ctrl_fd, pid_t client_pid, int client_fd) {
+  char fd_buffer[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  int32_t pid = client_pid;
+
+  iov.iov_base = &pid;
+  iov.iov_len = sizeof(pid);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = fd_buffer;
+  msg.msg_controllen = sizeof(fd_buffer);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+
+  return sendmsg(ctrl_fd, &msg, MSG_NOSIGNAL) == sizeof(pid);
+}
+
+// Waits for the master to hand over a client. Returns -1 if the master
+// closed the control socket instead. The control socket is left open.
+static int sl_receive_pooled_client(int ctrl_fd, pid_t* client_pid) {
+  char fd_buffer[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  int32_t pid;
+  int client_fd;
+  ssize_t bytes;
+
+  iov.iov_base = &pid;
+  iov.iov_len = sizeof(pid);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = fd_buffer;
+  msg.msg_controllen = sizeof(fd_buffer);
+
+  do {
+    bytes = recvmsg(ctrl_fd, &msg, 0);
+  } while (bytes == -1 && errno == EINTR);
+
+  if (bytes != sizeof(pid))
+    return -1;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+
+  memcpy(&client_fd, CMSG_DATA(cmsg), sizeof(int));
+  *client_pid = pid;
+  return client_fd;
+}
+
+static void sl_init_context_lists(struct sl_context* ctx) {
+  int i;
+
+  wl_list_init(&ctx->accelerators);
+  wl_list_init(&ctx->registries);
+  wl_list_init(&ctx->globals);
+  wl_list_init(&ctx->outputs);
+  wl_list_init(&ctx->seats);
+  wl_list_init(&ctx->windows);
+  wl_list_init(&ctx->unpaired_windows);
+  for (i = 0; i < WINDOW_INDEX_SIZE; ++i) {
+    wl_list_init(&ctx->window_id_index[i]);
+    wl_list_init(&ctx->window_frame_id_index[i]);
+    wl_list_init(&ctx->window_host_surface_index[i]);
+  }
+  for (i = 0; i < ACCELERATOR_INDEX_SIZE; ++i)
+    wl_list_init(&ctx->accelerator_index[i]);
+  wl_list_init(&ctx->host_outputs);
+  wl_list_init(&ctx->output_buffer_pool);
+  wl_list_init(&ctx->cursor_cache);
+  wl_list_init(&ctx->held_pointers);
+  wl_list_init(&ctx->x_requests);
+  wl_list_init(&ctx->selection_data_source_send_pending);
+  wl_list_init(&ctx->selection_data_offer_receives);
+  wl_list_init(&ctx->clipboard_cache);
+  wl_list_init(&ctx->host_surfaces);
+}
+
+// Creates a new virtwl context and starts forwarding it. Returns the fd that
+// the host display should be connected through, or -1 on failure.
+static int sl_open_virtwl_context(struct sl_context* ctx) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  struct virtwl_ioctl_new new_ctx = {
+      .type = VIRTWL_IOCTL_NEW_CTX,
+      .fd = -1,
+      .flags = 0,
+      .size = 0,
+  };
+  int vws[2];
+  int rv;
+
+  rv = ioctl(ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &new_ctx);
+  if (rv) {
+    fprintf(stderr, "error: failed to create virtwl context: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  ctx->virtwl_ctx_fd = new_ctx.fd;
 
-  return 1;
-}
+  // Connection to virtwl channel.
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, vws);
+  errno_assert(!rv);
 
-static void sl_sigchld_handler(int signal) {
-  while (waitpid(-1, NULL, WNOHANG) > 0)
-    continue;
+  ctx->virtwl_socket_fd = vws[0];
+
+  ctx->virtwl_send_txn =
+      malloc(sizeof(struct virtwl_ioctl_txn) + ctx->virtwl_buffer_size);
+  assert(ctx->virtwl_send_txn);
+  ctx->virtwl_recv_txns = malloc(sl_virtwl_txn_size(ctx) * ctx->virtwl_batch);
+  assert(ctx->virtwl_recv_txns);
+
+  ctx->virtwl_socket_event_source =
+      wl_event_loop_add_fd(event_loop, ctx->virtwl_socket_fd, WL_EVENT_READABLE,
+                           sl_handle_virtwl_socket_event, ctx);
+  ctx->virtwl_ctx_event_source =
+      wl_event_loop_add_fd(event_loop, ctx->virtwl_ctx_fd, WL_EVENT_READABLE,
+                           sl_handle_virtwl_ctx_event, ctx);
+
+  return vws[1];
 }
 
-static void sl_client_destroy_notify(struct wl_listener* listener, void* data) {
-  exit(0);
+static void sl_attach_client(struct sl_context* ctx, int client_fd) {
+  ctx->client = wl_client_create(ctx->host_display, client_fd);
+
+  // Replace the core display implementation. This is needed in order to
+  // implement sync handler properly.
+  sl_set_display_implementation(ctx);
+
+  ctx->client_destroy_listener.notify = sl_client_destroy_notify;
+  wl_client_add_destroy_listener(ctx->client, &ctx->client_destroy_listener);
 }
 
-static int sl_handle_virtwl_ctx_event(int fd, uint32_t mask, void* data) {
+static int sl_handle_peer_ctrl_event(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn* ioctl_recv = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* recv_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_recv_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
-  struct msghdr msg = {0};
-  struct iovec buffer_iov;
-  ssize_t bytes;
-  int fd_count;
-  int rv;
+  int client_fd = -1;
 
-  if (!(mask & WL_EVENT_READABLE)) {
-    fprintf(stderr,
-            "Got error or hangup on virtwl ctx fd"
-            " (mask %d), exiting\n",
-            mask);
-    exit(EXIT_SUCCESS);
+  if (mask & WL_EVENT_READABLE)
+    client_fd = sl_receive_pooled_client(fd, &ctx->peer_pid);
+
+  wl_event_source_remove(ctx->peer_ctrl_event_source);
+  ctx->peer_ctrl_event_source = NULL;
+  close(fd);
+
+  // The master closes the control socket of peers it no longer needs.
+  if (client_fd < 0) {
+    sl_context_quit(ctx);
+    return 1;
   }
 
-  ioctl_recv->len = max_recv_size;
-  rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
-  if (rv) {
-    close(ctx->virtwl_socket_fd);
-    ctx->virtwl_socket_fd = -1;
-    return 0;
+  sl_attach_client(ctx, client_fd);
+  return 1;
+}
+
+// State of a thread that serves one client in multi-client mode. Each
+// thread has its own context, host connection and event loop. Parsed
+// options, the GBM device and driver fds are shared with the context they
+// were copied from. Like pooled peers, a thread connects to the host before
+// its client is handed over on |ctrl_fd|.
+struct sl_client_thread {
+  struct sl_context ctx;
+  const char* display;
+  const char* copy_kernel;
+  struct wl_registry* registry;
+  int ctrl_fd;
+};
+
+static int sl_client_thread_connect(struct sl_client_thread* thread) {
+  struct sl_context* ctx = &thread->ctx;
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  const char* display = thread->display;
+  int display_fd = -1;
+
+  ctx->peer_ctrl_event_source =
+      wl_event_loop_add_fd(event_loop, thread->ctrl_fd, WL_EVENT_READABLE,
+                           sl_handle_peer_ctrl_event, ctx);
+  assert(ctx->peer_ctrl_event_source);
+
+  if (ctx->virtwl_fd != -1 && !display) {
+    display_fd = sl_open_virtwl_context(ctx);
+    if (display_fd == -1)
+      return 0;
   }
 
-  buffer_iov.iov_base = recv_data;
-  buffer_iov.iov_len = ioctl_recv->len;
+  // Clients get their parallelism from running on separate threads, so
+  // damage is copied on the client thread.
+  if (ctx->shm_driver != SHM_DRIVER_NOOP) {
+    ctx->copy_engine = sl_copy_engine_create(thread->copy_kernel, 0);
+    assert(ctx->copy_engine);
+  }
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
+  if (display_fd != -1) {
+    ctx->display = wl_display_connect_to_fd(display_fd);
+  } else {
+    if (display == NULL)
+      display = getenv("WAYLAND_DISPLAY");
+    if (display == NULL)
+      display = "wayland-0";
 
-  // Count how many FDs the kernel gave us.
-  for (fd_count = 0; fd_count < VIRTWL_SEND_MAX_ALLOCS; fd_count++) {
-    if (ioctl_recv->fds[fd_count] < 0)
-      break;
+    ctx->display = wl_display_connect(display);
   }
-  if (fd_count) {
-    struct cmsghdr* cmsg;
 
-    // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
-    // cmsghdr. We copy every fd we just received from the ioctl into this
-    // cmsghdr.
-    msg.msg_controllen = sizeof(fd_buffer);
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
-    memcpy(CMSG_DATA(cmsg), ioctl_recv->fds, fd_count * sizeof(int));
-    msg.msg_controllen = cmsg->cmsg_len;
+  if (!ctx->display) {
+    fprintf(stderr, "error: failed to connect to %s\n", display);
+    return 0;
   }
 
-  bytes = sendmsg(ctx->virtwl_socket_fd, &msg, MSG_NOSIGNAL);
-  errno_assert(bytes == ioctl_recv->len);
+  ctx->display_event_source =
+      wl_event_loop_add_fd(event_loop, wl_display_get_fd(ctx->display),
+                           WL_EVENT_READABLE, sl_handle_event, ctx);
 
-  while (fd_count--)
-    close(ioctl_recv->fds[fd_count]);
+  thread->registry = wl_display_get_registry(ctx->display);
+  wl_registry_add_listener(thread->registry, &sl_registry_listener, ctx);
 
   return 1;
 }
 
-static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = (struct sl_context*)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn* ioctl_send = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* send_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_send_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
-  struct iovec buffer_iov;
-  struct msghdr msg = {0};
-  struct cmsghdr* cmsg;
-  ssize_t bytes;
-  int fd_count = 0;
-  int rv;
-  int i;
+static void sl_client_thread_destroy(struct sl_client_thread* thread) {
+  struct sl_context* ctx = &thread->ctx;
+  struct sl_accelerator *accelerator, *next;
 
-  if (!(mask & WL_EVENT_READABLE)) {
-    fprintf(stderr,
-            "Got error or hangup on virtwl socket"
-            " (mask %d), exiting\n",
-            mask);
-    exit(EXIT_SUCCESS);
-  }
+  if (ctx->client)
+    wl_client_destroy(ctx->client);
+  // The control socket is closed once the client has been received.
+  if (ctx->peer_ctrl_event_source)
+    close(thread->ctrl_fd);
 
-  buffer_iov.iov_base = send_data;
-  buffer_iov.iov_len = max_send_size;
+  sl_release_globals(ctx);
+  sl_output_buffer_pool_release(ctx);
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
-  msg.msg_controllen = sizeof(fd_buffer);
+  if (thread->registry)
+    wl_registry_destroy(thread->registry);
+  if (ctx->display)
+    wl_display_disconnect(ctx->display);
+
+  if (ctx->virtwl_ctx_fd != -1)
+    close(ctx->virtwl_ctx_fd);
+  if (ctx->virtwl_socket_fd != -1)
+    close(ctx->virtwl_socket_fd);
+  free(ctx->virtwl_send_txn);
+  free(ctx->virtwl_recv_txns);
 
-  bytes = recvmsg(ctx->virtwl_socket_fd, &msg, 0);
-  errno_assert(bytes > 0);
+  if (ctx->copy_engine)
+    sl_copy_engine_destroy(ctx->copy_engine);
+  // Also removes the remaining event sources of this context.
+  wl_display_destroy(ctx->host_display);
 
-  // If there were any FDs recv'd by recvmsg, there will be some data in the
-  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
-  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
-  for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
-       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-    size_t cmsg_fd_count;
+  wl_list_for_each_safe(accelerator, next, &ctx->accelerators, link) {
+    sl_accelerator_remove(accelerator);
+    free(accelerator);
+  }
 
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
-      continue;
+  free(thread);
+}
 
-    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+static void* sl_client_thread_main(void* data) {
+  struct sl_client_thread* thread = (struct sl_client_thread*)data;
+  struct sl_context* ctx = &thread->ctx;
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
 
-    // fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
-    // control message buffer only allocates enough space for that many FDs.
-    memcpy(&ioctl_send->fds[fd_count], CMSG_DATA(cmsg),
-           cmsg_fd_count * sizeof(int));
-    fd_count += cmsg_fd_count;
+  if (sl_client_thread_connect(thread)) {
+    while (!ctx->quit) {
+      wl_display_flush_clients(ctx->host_display);
+      if (wl_display_flush(ctx->display) < 0)
+        break;
+      if (wl_event_loop_dispatch(event_loop, -1) == -1)
+        break;
+    }
   }
 
-  for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
-    ioctl_send->fds[i] = -1;
+  sl_client_thread_destroy(thread);
+  return NULL;
+}
 
-  // The FDs and data were extracted from the recvmsg call into the ioctl_send
-  // structure which we now pass along to the kernel.
-  ioctl_send->len = bytes;
-  rv = ioctl(ctx->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, ioctl_send);
-  errno_assert(!rv);
+// Starts a thread that connects to the host and waits for a client. Returns
+// the control socket to hand over the client on, or -1 on failure.
+static int sl_start_client_thread(struct sl_context* base,
+                                  const char* display,
+                                  const char* copy_kernel) {
+  struct sl_client_thread* thread;
+  struct sl_context* ctx;
+  struct sl_accelerator* accelerator;
+  pthread_attr_t attr;
+  pthread_t tid;
+  int sv[2];
+  int rv;
 
-  while (fd_count--)
-    close(ioctl_send->fds[fd_count]);
+  rv = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+  if (rv) {
+    fprintf(stderr, "error: failed to create client thread socket: %m\n");
+    return -1;
+  }
+
+  thread = malloc(sizeof(*thread));
+  assert(thread);
+  thread->display = display;
+  thread->copy_kernel = copy_kernel;
+  thread->registry = NULL;
+  thread->ctrl_fd = sv[1];
+
+  ctx = &thread->ctx;
+  *ctx = *base;
+  ctx->display = NULL;
+  ctx->host_display = wl_display_create();
+  assert(ctx->host_display);
+  ctx->client = NULL;
+  ctx->display_event_source = NULL;
+  ctx->virtwl_ctx_fd = -1;
+  ctx->virtwl_socket_fd = -1;
+  ctx->virtwl_ctx_event_source = NULL;
+  ctx->virtwl_socket_event_source = NULL;
+  ctx->stats_event_source = NULL;
+  ctx->peer_ctrl_event_source = NULL;
+  ctx->virtwl_send_txn = NULL;
+  ctx->virtwl_recv_txns = NULL;
+  ctx->copy_engine = NULL;
+  // The GLES context is current on the main thread only.
+  ctx->gpu_engine = NULL;
+  ctx->output_buffer_pool_size = 0;
+  ctx->output_buffer_pool_length = 0;
+  ctx->output_buffer_size = 0;
+  ctx->cursor_cache_length = 0;
+  ctx->output_buffer_idle_timer = NULL;
+  ctx->peer_pid = 0;
+  ctx->quit = 0;
+  // Stats and tracing are only collected for single client processes.
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  ctx->stats.trace_fd = -1;
+  ctx->stats.socket_fd = -1;
+  memset(&ctx->virtwl_send_stats, 0, sizeof(ctx->virtwl_send_stats));
+  memset(&ctx->virtwl_recv_stats, 0, sizeof(ctx->virtwl_recv_stats));
+  memset(&ctx->data_transfer_stats, 0, sizeof(ctx->data_transfer_stats));
+  memset(&ctx->selection_transfer_stats, 0,
+         sizeof(ctx->selection_transfer_stats));
+  sl_init_context_lists(ctx);
+
+  wl_list_for_each(accelerator, &base->accelerators, link) {
+    struct sl_accelerator* copy = malloc(sizeof(*copy));
+
+    assert(copy);
+    copy->modifiers = accelerator->modifiers;
+    copy->symbol = accelerator->symbol;
+    sl_accelerator_insert(ctx, copy);
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  rv = pthread_create(&tid, &attr, sl_client_thread_main, thread);
+  pthread_attr_destroy(&attr);
+  if (rv) {
+    fprintf(stderr, "error: failed to create client thread: %s\n",
+            strerror(rv));
+    sl_client_thread_destroy(thread);
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
 
-  return 1;
+  return sv[0];
 }
 
-// Break |str| into a sequence of zero or more nonempty arguments. No more
-// than |argc| arguments will be added to |argv|. Returns the total number of
-// argments found in |str|.
-static int sl_parse_cmd_prefix(char* str, int argc, char** argv) {
-  char* s = str;
-  int n = 0;
-  int delim = 0;
+// Serves each client handed over by the master on a thread of its own until
+// the master closes the control socket. A spare thread that is already
+// connected to the host is kept so that clients don't wait for the host
+// connection and registry.
+static void sl_serve_clients(struct sl_context* base,
+                             const char* display,
+                             const char* copy_kernel,
+                             int ctrl_fd) {
+  int spare_fd = sl_start_client_thread(base, display, copy_kernel);
 
   do {
-    // Look for ending delimiter if |delim| is set.
-    if (delim) {
-      if (*s == delim) {
-        delim = 0;
-        *s = '\0';
-      }
-      ++s;
-    } else {
-      // Skip forward to first non-space character.
-      while (*s == ' ' && *s != '\0')
-        ++s;
-
-      // Check for quote delimiter.
-      if (*s == '"') {
-        delim = '"';
-        ++s;
-      } else {
-        delim = ' ';
-      }
+    pid_t client_pid;
+    int client_fd = sl_receive_pooled_client(ctrl_fd, &client_pid);
 
-      // Add string to arguments if there's room.
-      if (n < argc)
-        argv[n] = s;
+    if (client_fd < 0)
+      break;
 
-      ++n;
+    // The spare thread is gone if it failed to connect to the host.
+    if (!sl_hand_over_client(spare_fd, client_pid, client_fd)) {
+      if (spare_fd != -1)
+        close(spare_fd);
+      spare_fd = sl_start_client_thread(base, display, copy_kernel);
+      if (!sl_hand_over_client(spare_fd, client_pid, client_fd))
+        fprintf(stderr, "error: failed to hand over client\n");
     }
-  } while (*s != '\0');
+    close(client_fd);
 
-  return n;
+    if (spare_fd != -1)
+      close(spare_fd);
+    spare_fd = sl_start_client_thread(base, display, copy_kernel);
+  } while (1);
+
+  if (spare_fd != -1)
+    close(spare_fd);
+  close(ctrl_fd);
+}
+
+// The copy engine of the main context and the process that owns its
+// threads. Most ways out of the event loop end in exit(), so the engine is
+// torn down from an exit handler. Forked children don't have the threads.
+static struct sl_copy_engine* sl_exit_copy_engine;
+static pid_t sl_exit_copy_engine_pid;
+
+static void sl_destroy_copy_engine_at_exit(void) {
+  if (sl_exit_copy_engine && sl_exit_copy_engine_pid == getpid())
+    sl_copy_engine_destroy(sl_exit_copy_engine);
+  sl_exit_copy_engine = NULL;
 }
 
 static void sl_print_usage() {
@@ -3536,22 +5473,44 @@ static void sl_print_usage() {
       "  --master\t\t\tRun as master and spawn child processes\n"
       "  --socket=SOCKET\t\tName of socket to listen on\n"
       "  --display=DISPLAY\t\tWayland display to connect to\n"
-      "  --shm-driver=DRIVER\t\tSHM driver to use (noop, dmabuf, virtwl)\n"
+      "  --shm-driver=DRIVER\t\tSHM driver to use (noop, dmabuf, udmabuf,"
+      " virtwl)\n"
       "  --data-driver=DRIVER\t\tData driver to use (noop, virtwl)\n"
+      "  --copy-kernel=KERNEL\t\tDamage copy kernel (memcpy, sse2)\n"
+      "  --copy-threads=N\t\tNumber of damage copy worker threads\n"
+      "  --buffer-pool-size=MB\t\tMemory limit for idle output buffers\n"
+      "  --buffer-budget=MB\t\tMemory limit for all output buffers\n"
+      "  --buffer-idle-timeout=SECONDS\tTime before unused buffers are freed\n"
       "  --scale=SCALE\t\t\tScale factor for contents\n"
+      "  --downscale\t\t\tCopy contents at device resolution\n"
+      "  --gpu-upload\t\t\tUpload damage to dmabuf buffers with GLES\n"
       "  --dpi=[DPI[,DPI...]]\t\tDPI buckets\n"
       "  --peer-cmd-prefix=PREFIX\tPeer process command line prefix\n"
+      "  --peer-pool-size=N\t\tNumber of pre-forked peers for --master\n"
+      "  --peer-idle-timeout=SECONDS\tTime pre-forked peers wait for a client\n"
+      "  --multi-client\t\tServe all clients from one peer process\n"
       "  --accelerators=ACCELERATORS\tList of keyboard accelerators\n"
       "  --application-id=ID\t\tForced application ID for X11 clients\n"
       "  --x-display=DISPLAY\t\tX11 display to listen on\n"
+      "  --lazy-xwayland\t\tStart Xwayland when the first X11 client"
+      " connects\n"
       "  --xwayland-path=PATH\t\tPath to Xwayland executable\n"
       "  --xwayland-gl-driver-path=PATH\tPath to GL drivers for Xwayland\n"
       "  --xwayland-cmd-prefix=PREFIX\tXwayland command line prefix\n"
       "  --no-exit-with-child\t\tKeep process alive after child exists\n"
       "  --no-clipboard-manager\tDisable X11 clipboard manager\n"
+      "  --clipboard-cache-size=KB\tCache small Wayland clipboard contents\n"
       "  --frame-color=COLOR\t\tWindow frame color for X11 clients\n"
       "  --virtwl-device=DEVICE\tVirtWL device to use\n"
+      "  --virtwl-buffer-size=BYTES\tVirtWL transaction buffer size\n"
+      "  --virtwl-batch=N\t\tMax messages per VirtWL transaction\n"
+      "  --coalesce-pointer-motion\tDrop intermediate pointer motion\n"
+      "  --coalesce-commits\t\tDrop frames the host has no time to show\n"
+      "  --throttle-hidden\t\tSkip copies for hidden windows\n"
+      "  --stats-socket=PATH\t\tServe stats and timings on a socket\n"
+      "  --trace\t\t\tEmit ftrace markers for Perfetto\n"
       "  --drm-device=DEVICE\t\tDRM device to use\n"
+      "  --no-dmabuf-modifiers\t\tUse linear DMABuf output buffers\n"
       "  --glamor\t\t\tUse glamor to accelerate X11 clients\n"
       "  --fullscreen-mode=MODE\tDefault fullscreen behavior (immersive,"
       " plain)\n");
@@ -3594,12 +5553,37 @@ int main(int argc, char** argv) {
       .virtwl_socket_fd = -1,
       .virtwl_ctx_event_source = NULL,
       .virtwl_socket_event_source = NULL,
+      .stats_event_source = NULL,
+      .peer_ctrl_event_source = NULL,
+      .virtwl_buffer_size = DEFAULT_VIRTWL_BUFFER_SIZE,
+      .virtwl_batch = 1,
+      .virtwl_send_txn = NULL,
+      .virtwl_recv_txns = NULL,
+      .coalesce_pointer_motion = 0,
+      .coalesce_commits = 0,
+      .throttle_hidden = 0,
+      .downscale = 0,
+      .dmabuf_modifiers = 1,
       .drm_device = NULL,
       .gbm = NULL,
+      .udmabuf_fd = -1,
+      .copy_engine = NULL,
+      .gpu_engine = NULL,
+      .output_buffer_pool_size = 0,
+      .output_buffer_pool_limit = DEFAULT_BUFFER_POOL_SIZE,
+      .output_buffer_pool_length = 0,
+      .output_buffer_size = 0,
+      .cursor_cache_length = 0,
+      .output_buffer_budget = 0,
+      .output_buffer_idle_timeout = DEFAULT_BUFFER_IDLE_TIMEOUT,
+      .output_buffer_idle_timer = NULL,
       .xwayland = 0,
       .xwayland_pid = -1,
+      .xwayland_launch = NULL,
       .child_pid = -1,
       .peer_pid = -1,
+      .multi_client = 0,
+      .quit = 0,
       .xkb_context = NULL,
       .next_global_id = 1,
       .connection = NULL,
@@ -3609,6 +5593,10 @@ int main(int argc, char** argv) {
       .window = 0,
       .host_focus_window = NULL,
       .needs_set_input_focus = 0,
+      .x_events_pending = 0,
+      .x_sync_pending = 0,
+      .x_sync_sequence = 0,
+      .stats = {.timing = 0, .trace_fd = -1, .socket_fd = -1},
       .desired_scale = 1.0,
       .scale = 1.0,
       .application_id = NULL,
@@ -3621,19 +5609,14 @@ int main(int argc, char** argv) {
       .default_seat = NULL,
       .selection_window = XCB_WINDOW_NONE,
       .selection_owner = XCB_WINDOW_NONE,
-      .selection_incremental_transfer = 0,
-      .selection_request = {.requestor = XCB_NONE, .property = XCB_ATOM_NONE},
       .selection_timestamp = XCB_CURRENT_TIME,
       .selection_data_device = NULL,
       .selection_data_offer = NULL,
       .selection_data_source = NULL,
-      .selection_data_source_send_fd = -1,
-      .selection_send_event_source = NULL,
-      .selection_property_reply = NULL,
-      .selection_property_offset = 0,
-      .selection_event_source = NULL,
-      .selection_data_offer_receive_fd = -1,
-      .selection_data_ack_pending = 0,
+      .selection_chunk_size = SELECTION_MAX_CHUNK_SIZE,
+      .selection_buffer_bytes = 0,
+      .clipboard_cache_limit = 0,
+      .clipboard_cache_bytes = 0,
       .atoms =
           {
               [ATOM_WM_S0] = {"WM_S0"},
@@ -3674,6 +5657,7 @@ int main(int argc, char** argv) {
   const char* scale = getenv("SOMMELIER_SCALE");
   const char* dpi = getenv("SOMMELIER_DPI");
   const char* clipboard_manager = getenv("SOMMELIER_CLIPBOARD_MANAGER");
+  const char* clipboard_cache_size = getenv("SOMMELIER_CLIPBOARD_CACHE_SIZE");
   const char* frame_color = getenv("SOMMELIER_FRAME_COLOR");
   const char* dark_frame_color = getenv("SOMMELIER_DARK_FRAME_COLOR");
   const char* virtwl_device = getenv("SOMMELIER_VIRTWL_DEVICE");
@@ -3682,10 +5666,30 @@ int main(int argc, char** argv) {
   const char* fullscreen_mode = getenv("SOMMELIER_FULLSCREEN_MODE");
   const char* shm_driver = getenv("SOMMELIER_SHM_DRIVER");
   const char* data_driver = getenv("SOMMELIER_DATA_DRIVER");
+  const char* copy_kernel = getenv("SOMMELIER_COPY_KERNEL");
+  const char* copy_threads = getenv("SOMMELIER_COPY_THREADS");
+  const char* buffer_pool_size = getenv("SOMMELIER_BUFFER_POOL_SIZE");
+  const char* buffer_budget = getenv("SOMMELIER_BUFFER_BUDGET");
+  const char* buffer_idle_timeout = getenv("SOMMELIER_BUFFER_IDLE_TIMEOUT");
+  const char* virtwl_buffer_size = getenv("SOMMELIER_VIRTWL_BUFFER_SIZE");
+  const char* virtwl_batch = getenv("SOMMELIER_VIRTWL_BATCH");
+  const char* coalesce_pointer_motion =
+      getenv("SOMMELIER_COALESCE_POINTER_MOTION");
+  const char* coalesce_commits = getenv("SOMMELIER_COALESCE_COMMITS");
+  const char* throttle_hidden = getenv("SOMMELIER_THROTTLE_HIDDEN");
+  const char* downscale = getenv("SOMMELIER_DOWNSCALE");
+  const char* gpu_upload = getenv("SOMMELIER_GPU_UPLOAD");
+  const char* dmabuf_modifiers = getenv("SOMMELIER_DMABUF_MODIFIERS");
+  const char* stats_socket = getenv("SOMMELIER_STATS_SOCKET");
+  const char* trace = getenv("SOMMELIER_TRACE");
   const char* peer_cmd_prefix = getenv("SOMMELIER_PEER_CMD_PREFIX");
+  const char* peer_pool_size = getenv("SOMMELIER_PEER_POOL_SIZE");
+  const char* peer_idle_timeout = getenv("SOMMELIER_PEER_IDLE_TIMEOUT");
+  const char* multi_client = getenv("SOMMELIER_MULTI_CLIENT");
   const char* xwayland_cmd_prefix = getenv("SOMMELIER_XWAYLAND_CMD_PREFIX");
   const char* accelerators = getenv("SOMMELIER_ACCELERATORS");
   const char* xwayland_path = getenv("SOMMELIER_XWAYLAND_PATH");
+  const char* lazy_xwayland = getenv("SOMMELIER_LAZY_XWAYLAND");
   const char* xwayland_gl_driver_path =
       getenv("SOMMELIER_XWAYLAND_GL_DRIVER_PATH");
   const char* xauth_path = getenv("SOMMELIER_XAUTH_PATH");
@@ -3693,14 +5697,14 @@ int main(int argc, char** argv) {
   const char* socket_name = "wayland-0";
   const char* runtime_dir;
   struct wl_event_loop* event_loop;
-  struct wl_listener client_destroy_listener = {.notify =
-                                                    sl_client_destroy_notify};
+  struct sl_xwayland_launch xwayland_launch;
   int sv[2];
   pid_t pid;
   int virtwl_display_fd = -1;
   int xdisplay = -1;
   int master = 0;
   int client_fd = -1;
+  int peer_ctrl_fd = -1;
   int rv;
   int i;
 
@@ -3725,6 +5729,36 @@ int main(int argc, char** argv) {
       shm_driver = sl_arg_value(arg);
     } else if (strstr(arg, "--data-driver") == arg) {
       data_driver = sl_arg_value(arg);
+    } else if (strstr(arg, "--copy-kernel") == arg) {
+      copy_kernel = sl_arg_value(arg);
+    } else if (strstr(arg, "--copy-threads") == arg) {
+      copy_threads = sl_arg_value(arg);
+    } else if (strstr(arg, "--buffer-pool-size") == arg) {
+      buffer_pool_size = sl_arg_value(arg);
+    } else if (strstr(arg, "--buffer-budget") == arg) {
+      buffer_budget = sl_arg_value(arg);
+    } else if (strstr(arg, "--buffer-idle-timeout") == arg) {
+      buffer_idle_timeout = sl_arg_value(arg);
+    } else if (strstr(arg, "--virtwl-buffer-size") == arg) {
+      virtwl_buffer_size = sl_arg_value(arg);
+    } else if (strstr(arg, "--virtwl-batch") == arg) {
+      virtwl_batch = sl_arg_value(arg);
+    } else if (strstr(arg, "--coalesce-pointer-motion") == arg) {
+      coalesce_pointer_motion = "1";
+    } else if (strstr(arg, "--coalesce-commits") == arg) {
+      coalesce_commits = "1";
+    } else if (strstr(arg, "--throttle-hidden") == arg) {
+      throttle_hidden = "1";
+    } else if (strstr(arg, "--downscale") == arg) {
+      downscale = "1";
+    } else if (strstr(arg, "--gpu-upload") == arg) {
+      gpu_upload = "1";
+    } else if (strstr(arg, "--no-dmabuf-modifiers") == arg) {
+      dmabuf_modifiers = "0";
+    } else if (strstr(arg, "--stats-socket") == arg) {
+      stats_socket = sl_arg_value(arg);
+    } else if (strstr(arg, "--trace") == arg) {
+      trace = "1";
     } else if (strstr(arg, "--peer-pid") == arg) {
       ctx.peer_pid = atoi(sl_arg_value(arg));
     } else if (strstr(arg, "--peer-cmd-prefix") == arg) {
@@ -3733,6 +5767,14 @@ int main(int argc, char** argv) {
       xwayland_cmd_prefix = sl_arg_value(arg);
     } else if (strstr(arg, "--client-fd") == arg) {
       client_fd = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--peer-ctrl-fd") == arg) {
+      peer_ctrl_fd = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--peer-pool-size") == arg) {
+      peer_pool_size = sl_arg_value(arg);
+    } else if (strstr(arg, "--peer-idle-timeout") == arg) {
+      peer_idle_timeout = sl_arg_value(arg);
+    } else if (strstr(arg, "--multi-client") == arg) {
+      multi_client = "1";
     } else if (strstr(arg, "--scale") == arg) {
       scale = sl_arg_value(arg);
     } else if (strstr(arg, "--dpi") == arg) {
@@ -3747,6 +5789,8 @@ int main(int argc, char** argv) {
       xdisplay = atoi(sl_arg_value(arg));
       // Automatically enable X forwarding if X display is specified.
       ctx.xwayland = 1;
+    } else if (strstr(arg, "--lazy-xwayland") == arg) {
+      lazy_xwayland = "1";
     } else if (strstr(arg, "--xwayland-path") == arg) {
       xwayland_path = sl_arg_value(arg);
     } else if (strstr(arg, "--xwayland-gl-driver-path") == arg) {
@@ -3757,6 +5801,8 @@ int main(int argc, char** argv) {
       ctx.sd_notify = sl_arg_value(arg);
     } else if (strstr(arg, "--no-clipboard-manager") == arg) {
       clipboard_manager = "0";
+    } else if (strstr(arg, "--clipboard-cache-size") == arg) {
+      clipboard_cache_size = sl_arg_value(arg);
     } else if (strstr(arg, "--frame-color") == arg) {
       frame_color = sl_arg_value(arg);
     } else if (strstr(arg, "--dark-frame-color") == arg) {
@@ -3798,6 +5844,11 @@ int main(int argc, char** argv) {
     struct sockaddr_un addr;
     struct sigaction sa;
     struct stat sock_stat;
+    struct sl_pooled_peer peer_pool[MAX_PEER_POOL_SIZE];
+    int num_pooled_peers = 0;
+    int refill_peer_pool = 1;
+    int peer_pool_limit = 0;
+    int peer_idle_time = DEFAULT_PEER_IDLE_TIMEOUT;
     int lock_fd;
     int sock_fd;
 
@@ -3862,9 +5913,41 @@ int main(int argc, char** argv) {
     rv = sigaction(SIGCHLD, &sa, NULL);
     errno_assert(rv >= 0);
 
+    if (peer_pool_size)
+      peer_pool_limit = MIN(MAX(atoi(peer_pool_size), 0), MAX_PEER_POOL_SIZE);
+    if (peer_idle_timeout)
+      peer_idle_time = MAX(atoi(peer_idle_timeout), 0);
+
+    // A single long-lived peer serves every client in multi-client mode.
+    if (multi_client && strcmp(multi_client, "0")) {
+      ctx.multi_client = 1;
+      peer_pool_limit = 1;
+      peer_idle_time = 0;
+    }
+
     do {
       struct ucred ucred;
       socklen_t length = sizeof(addr);
+      int handed_over = 0;
+
+      // Top up the pool after startup and after each client it served.
+      // Peers that expire are not replaced until there is demand again.
+      if (refill_peer_pool) {
+        while (num_pooled_peers < peer_pool_limit &&
+               sl_spawn_pooled_peer(argc, argv, peer_cmd_prefix, sock_fd,
+                                    lock_fd, &peer_pool[num_pooled_peers]))
+          ++num_pooled_peers;
+        refill_peer_pool = 0;
+      }
+
+      if (num_pooled_peers && peer_idle_time > 0) {
+        struct pollfd pollfd = {.fd = sock_fd, .events = POLLIN};
+        int timeout = sl_expire_pooled_peers(peer_pool, &num_pooled_peers,
+                                             peer_idle_time);
+
+        if (poll(&pollfd, 1, timeout) <= 0)
+          continue;
+      }
 
       client_fd = accept(sock_fd, (struct sockaddr*)&addr, &length);
       if (client_fd < 0) {
@@ -3876,55 +5959,35 @@ int main(int argc, char** argv) {
       length = sizeof(ucred);
       rv = getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &ucred, &length);
 
-      pid = fork();
-      errno_assert(pid != -1);
-      if (pid == 0) {
-        char* client_fd_str;
-        char* peer_pid_str;
-        char* peer_cmd_prefix_str;
-        char* args[64];
-        int i = 0, j;
-
-        close(sock_fd);
-        close(lock_fd);
-
-        if (!peer_cmd_prefix)
-          peer_cmd_prefix = PEER_CMD_PREFIX;
+      // Hand the client to the longest waiting pooled peer. A peer that
+      // has exited fails the hand over and the next one is tried.
+      while (num_pooled_peers && !handed_over) {
+        int ctrl_fd = peer_pool[0].ctrl_fd;
 
-        if (peer_cmd_prefix) {
-          peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
+        handed_over = sl_hand_over_client(ctrl_fd, ucred.pid, client_fd);
 
-          i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
-          if (i > 32) {
-            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
-            i = 0;
-          }
-        }
+        // A multi-client peer stays in the pool to serve the next client.
+        if (handed_over && ctx.multi_client)
+          break;
 
-        args[i++] = argv[0];
-        peer_pid_str = sl_xasprintf("--peer-pid=%d", ucred.pid);
-        args[i++] = peer_pid_str;
-        client_fd_str = sl_xasprintf("--client-fd=%d", client_fd);
-        args[i++] = client_fd_str;
-
-        // forward some flags.
-        for (j = 1; j < argc; ++j) {
-          char* arg = argv[j];
-          if (strstr(arg, "--display") == arg ||
-              strstr(arg, "--scale") == arg ||
-              strstr(arg, "--accelerators") == arg ||
-              strstr(arg, "--virtwl-device") == arg ||
-              strstr(arg, "--drm-device") == arg ||
-              strstr(arg, "--shm-driver") == arg ||
-              strstr(arg, "--data-driver") == arg) {
-            args[i++] = arg;
-          }
+        --num_pooled_peers;
+        memmove(&peer_pool[0], &peer_pool[1],
+                num_pooled_peers * sizeof(peer_pool[0]));
+        close(ctrl_fd);
+      }
+      refill_peer_pool = 1;
+
+      if (!handed_over) {
+        pid = fork();
+        errno_assert(pid != -1);
+        if (pid == 0) {
+          close(sock_fd);
+          close(lock_fd);
+
+          sl_exec_peer(argc, argv, peer_cmd_prefix,
+                       sl_xasprintf("--peer-pid=%d", ucred.pid),
+                       sl_xasprintf("--client-fd=%d", client_fd));
         }
-
-        args[i++] = NULL;
-
-        execvp(args[0], args);
-        _exit(EXIT_FAILURE);
       }
       close(client_fd);
     } while (1);
@@ -3933,19 +5996,26 @@ int main(int argc, char** argv) {
     assert(false);
   }
 
-  if (client_fd == -1) {
+  if (client_fd == -1 && peer_ctrl_fd == -1) {
     if (!ctx.runprog || !ctx.runprog[0]) {
       sl_print_usage();
       return EXIT_FAILURE;
     }
   }
 
+  // Only pooled peers are handed more than one client.
+  if (multi_client && peer_ctrl_fd != -1)
+    ctx.multi_client = !!strcmp(multi_client, "0");
+
   if (ctx.xwayland) {
     assert(client_fd == -1);
 
     ctx.clipboard_manager = 1;
     if (clipboard_manager)
       ctx.clipboard_manager = !!strcmp(clipboard_manager, "0");
+    if (clipboard_cache_size)
+      ctx.clipboard_cache_limit =
+          (size_t)MAX(atoi(clipboard_cache_size), 0) * 1024;
   }
 
   if (scale) {
@@ -3991,18 +6061,13 @@ int main(int argc, char** argv) {
   assert(ctx.host_display);
 
   event_loop = wl_display_get_event_loop(ctx.host_display);
+  ctx.stats_event_source =
+      wl_event_loop_add_signal(event_loop, SIGUSR1, sl_handle_sigusr1, &ctx);
 
   if (!virtwl_device)
     virtwl_device = VIRTWL_DEVICE;
 
   if (virtwl_device) {
-    struct virtwl_ioctl_new new_ctx = {
-        .type = VIRTWL_IOCTL_NEW_CTX,
-        .fd = -1,
-        .flags = 0,
-        .size = 0,
-    };
-
     ctx.virtwl_fd = open(virtwl_device, O_RDWR);
     if (ctx.virtwl_fd == -1) {
       fprintf(stderr, "error: could not open %s (%s)\n", virtwl_device,
@@ -4014,31 +6079,16 @@ int main(int argc, char** argv) {
     // WARNING: It's critical that we never call wl_display_roundtrip
     // as we're not spawning a new thread to handle forwarding. Calling
     // wl_display_roundtrip will cause a deadlock.
-    if (!display) {
-      int vws[2];
-
-      // Connection to virtwl channel.
-      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, vws);
-      errno_assert(!rv);
-
-      ctx.virtwl_socket_fd = vws[0];
-      virtwl_display_fd = vws[1];
-
-      rv = ioctl(ctx.virtwl_fd, VIRTWL_IOCTL_NEW, &new_ctx);
-      if (rv) {
-        fprintf(stderr, "error: failed to create virtwl context: %s\n",
-                strerror(errno));
+    if (virtwl_buffer_size)
+      ctx.virtwl_buffer_size = MAX(atoi(virtwl_buffer_size), 1);
+    if (virtwl_batch)
+      ctx.virtwl_batch = MIN(MAX(atoi(virtwl_batch), 1), VIRTWL_MAX_BATCH);
+
+    // Client threads create their own contexts in multi-client mode.
+    if (!display && !ctx.multi_client) {
+      virtwl_display_fd = sl_open_virtwl_context(&ctx);
+      if (virtwl_display_fd == -1)
         return EXIT_FAILURE;
-      }
-
-      ctx.virtwl_ctx_fd = new_ctx.fd;
-
-      ctx.virtwl_socket_event_source = wl_event_loop_add_fd(
-          event_loop, ctx.virtwl_socket_fd, WL_EVENT_READABLE,
-          sl_handle_virtwl_socket_event, &ctx);
-      ctx.virtwl_ctx_event_source =
-          wl_event_loop_add_fd(event_loop, ctx.virtwl_ctx_fd, WL_EVENT_READABLE,
-                               sl_handle_virtwl_ctx_event, &ctx);
     }
   }
 
@@ -4063,12 +6113,23 @@ int main(int argc, char** argv) {
     shm_driver = ctx.xwayland ? XWAYLAND_SHM_DRIVER : SHM_DRIVER;
 
   if (shm_driver) {
-    if (strcmp(shm_driver, "dmabuf") == 0) {
+    if (strcmp(shm_driver, "dmabuf") == 0 ||
+        strcmp(shm_driver, "udmabuf") == 0) {
       if (!ctx.drm_device) {
         fprintf(stderr, "error: need drm device for dmabuf driver\n");
         return EXIT_FAILURE;
       }
       ctx.shm_driver = SHM_DRIVER_DMABUF;
+      // The udmabuf driver shares client pools with the host when possible
+      // and falls back to the dmabuf driver otherwise.
+      if (strcmp(shm_driver, "udmabuf") == 0) {
+        ctx.udmabuf_fd = open(UDMABUF_DEVICE, O_RDWR | O_CLOEXEC);
+        if (ctx.udmabuf_fd == -1) {
+          fprintf(stderr,
+                  "warning: could not open %s (%s), using dmabuf instead\n",
+                  UDMABUF_DEVICE, strerror(errno));
+        }
+      }
     } else if (strcmp(shm_driver, "virtwl") == 0 ||
                strcmp(shm_driver, "virtwl-dmabuf") == 0) {
       if (ctx.virtwl_fd == -1) {
@@ -4109,6 +6170,66 @@ int main(int argc, char** argv) {
     ctx.shm_driver = SHM_DRIVER_VIRTWL_DMABUF;
   }
 
+  if (ctx.shm_driver != SHM_DRIVER_NOOP) {
+    // Leave one core for the main thread.
+    int num_threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN) - 1, 0),
+                          DEFAULT_COPY_THREADS);
+
+    if (copy_threads)
+      num_threads = atoi(copy_threads);
+    // Client threads do their own copies in multi-client mode.
+    if (ctx.multi_client)
+      num_threads = 0;
+
+    ctx.copy_engine = sl_copy_engine_create(copy_kernel, num_threads);
+    if (!ctx.copy_engine) {
+      fprintf(stderr, "error: unrecognised --copy-kernel\n");
+      sl_print_usage();
+      return EXIT_FAILURE;
+    }
+    sl_exit_copy_engine = ctx.copy_engine;
+    sl_exit_copy_engine_pid = getpid();
+    atexit(sl_destroy_copy_engine_at_exit);
+  }
+
+  if (coalesce_pointer_motion)
+    ctx.coalesce_pointer_motion = !!strcmp(coalesce_pointer_motion, "0");
+
+  if (coalesce_commits)
+    ctx.coalesce_commits = !!strcmp(coalesce_commits, "0");
+
+  if (throttle_hidden)
+    ctx.throttle_hidden = !!strcmp(throttle_hidden, "0");
+
+  if (downscale)
+    ctx.downscale = !!strcmp(downscale, "0");
+
+  if (dmabuf_modifiers)
+    ctx.dmabuf_modifiers = !!strcmp(dmabuf_modifiers, "0");
+
+  // Client threads in multi-client mode always copy on the CPU. Surfaces
+  // fall back to CPU copies when the engine can't be created.
+  if (gpu_upload && strcmp(gpu_upload, "0") && !ctx.multi_client) {
+    if (ctx.shm_driver == SHM_DRIVER_DMABUF && ctx.gbm) {
+      ctx.gpu_engine = sl_gpu_engine_create(ctx.gbm);
+      if (!ctx.gpu_engine)
+        fprintf(stderr, "warning: GPU upload not available, using CPU\n");
+    } else {
+      fprintf(stderr, "warning: --gpu-upload needs the dmabuf shm driver\n");
+    }
+  }
+
+  if (buffer_pool_size)
+    ctx.output_buffer_pool_limit =
+        (size_t)MAX(atoi(buffer_pool_size), 0) * 1024 * 1024;
+
+  if (buffer_budget)
+    ctx.output_buffer_budget =
+        (size_t)MAX(atoi(buffer_budget), 0) * 1024 * 1024;
+
+  if (buffer_idle_timeout)
+    ctx.output_buffer_idle_timeout = MAX(atoi(buffer_idle_timeout), 0);
+
   if (data_driver) {
     if (strcmp(data_driver, "virtwl") == 0) {
       if (ctx.virtwl_fd == -1) {
@@ -4151,31 +6272,7 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
-  if (virtwl_display_fd != -1) {
-    ctx.display = wl_display_connect_to_fd(virtwl_display_fd);
-  } else {
-    if (display == NULL)
-      display = getenv("WAYLAND_DISPLAY");
-    if (display == NULL)
-      display = "wayland-0";
-
-    ctx.display = wl_display_connect(display);
-  }
-
-  if (!ctx.display) {
-    fprintf(stderr, "error: failed to connect to %s\n", display);
-    return EXIT_FAILURE;
-  }
-
-  wl_list_init(&ctx.accelerators);
-  wl_list_init(&ctx.registries);
-  wl_list_init(&ctx.globals);
-  wl_list_init(&ctx.outputs);
-  wl_list_init(&ctx.seats);
-  wl_list_init(&ctx.windows);
-  wl_list_init(&ctx.unpaired_windows);
-  wl_list_init(&ctx.host_outputs);
-  wl_list_init(&ctx.selection_data_source_send_pending);
+  sl_init_context_lists(&ctx);
 
   // Parse the list of accelerators that should be reserved by the
   // compositor. Format is "|MODIFIERS|KEYSYM", where MODIFIERS is a
@@ -4215,7 +6312,7 @@ int main(int argc, char** argv) {
           return EXIT_FAILURE;
         }
 
-        wl_list_insert(&ctx.accelerators, &accelerator->link);
+        sl_accelerator_insert(&ctx, accelerator);
 
         modifiers = 0;
         accelerators = end;
@@ -4224,6 +6321,32 @@ int main(int argc, char** argv) {
     }
   }
 
+  // A multi-client peer serves each client handed over by the master on a
+  // thread of its own, and exits once the last of them is done.
+  if (ctx.multi_client) {
+    sl_serve_clients(&ctx, display, copy_kernel, peer_ctrl_fd);
+    pthread_exit(NULL);
+  }
+
+  if (!sl_stats_init(&ctx, stats_socket, trace && strcmp(trace, "0")))
+    return EXIT_FAILURE;
+
+  if (virtwl_display_fd != -1) {
+    ctx.display = wl_display_connect_to_fd(virtwl_display_fd);
+  } else {
+    if (display == NULL)
+      display = getenv("WAYLAND_DISPLAY");
+    if (display == NULL)
+      display = "wayland-0";
+
+    ctx.display = wl_display_connect(display);
+  }
+
+  if (!ctx.display) {
+    fprintf(stderr, "error: failed to connect to %s\n", display);
+    return EXIT_FAILURE;
+  }
+
   ctx.display_event_source =
       wl_event_loop_add_fd(event_loop, wl_display_get_fd(ctx.display),
                            WL_EVENT_READABLE, sl_handle_event, &ctx);
@@ -4231,11 +6354,15 @@ int main(int argc, char** argv) {
   wl_registry_add_listener(wl_display_get_registry(ctx.display),
                            &sl_registry_listener, &ctx);
 
-  ctx.client = wl_client_create(ctx.host_display, client_fd);
-
-  // Replace the core display implementation. This is needed in order to
-  // implement sync handler properly.
-  sl_set_display_implementation(&ctx);
+  // Pooled peers bind the host globals ahead of time while they wait for
+  // the master to hand over a client.
+  if (peer_ctrl_fd != -1) {
+    ctx.peer_ctrl_event_source =
+        wl_event_loop_add_fd(event_loop, peer_ctrl_fd, WL_EVENT_READABLE,
+                             sl_handle_peer_ctrl_event, &ctx);
+  } else {
+    sl_attach_client(&ctx, client_fd);
+  }
 
   if (ctx.runprog || ctx.xwayland) {
     ctx.sigchld_event_source =
@@ -4251,89 +6378,43 @@ int main(int argc, char** argv) {
     setenv("WAYLAND_DISPLAY", ".", 1);
 
     if (ctx.xwayland) {
-      int ds[2], wm[2];
-
-      // Xwayland display ready socket.
-      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ds);
-      errno_assert(!rv);
-
-      ctx.display_ready_event_source =
-          wl_event_loop_add_fd(event_loop, ds[0], WL_EVENT_READABLE,
-                               sl_handle_display_ready_event, &ctx);
-
-      // X connection to Xwayland.
-      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, wm);
-      errno_assert(!rv);
-
-      ctx.wm_fd = wm[0];
-
-      pid = fork();
-      errno_assert(pid != -1);
-      if (pid == 0) {
-        char* display_fd_str;
-        char* wm_fd_str;
-        char* xwayland_cmd_prefix_str;
-        char* args[64];
-        int i = 0;
-        int fd;
-
-        if (xwayland_cmd_prefix) {
-          xwayland_cmd_prefix_str = sl_xasprintf("%s", xwayland_cmd_prefix);
-
-          i = sl_parse_cmd_prefix(xwayland_cmd_prefix_str, 32, args);
-          if (i > 32) {
-            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
-            i = 0;
-          }
-        }
-
-        args[i++] = sl_xasprintf("%s", xwayland_path ?: XWAYLAND_PATH);
-
-        fd = dup(ds[1]);
-        display_fd_str = sl_xasprintf("%d", fd);
-        fd = dup(wm[1]);
-        wm_fd_str = sl_xasprintf("%d", fd);
-
-        if (xdisplay > 0) {
-          args[i++] = sl_xasprintf(":%d", xdisplay);
-        }
-        args[i++] = "-nolisten";
-        args[i++] = "tcp";
-        args[i++] = "-rootless";
-        // Use software rendering unless we have a DRM device and glamor is
-        // enabled.
-        if (!ctx.drm_device || !glamor || !strcmp(glamor, "0"))
-          args[i++] = "-shm";
-        args[i++] = "-displayfd";
-        args[i++] = display_fd_str;
-        args[i++] = "-wm";
-        args[i++] = wm_fd_str;
-        if (xauth_path) {
-          args[i++] = "-auth";
-          args[i++] = sl_xasprintf("%s", xauth_path);
-        }
-        if (xfont_path) {
-          args[i++] = "-fp";
-          args[i++] = sl_xasprintf("%s", xfont_path);
-        }
-        args[i++] = NULL;
-
-        // If a path is explicitly specified via command line or environment
-        // use that instead of the compiled in default.  In either case, only
-        // set the environment variable if the value specified is non-empty.
-        if (xwayland_gl_driver_path) {
-          if (*xwayland_gl_driver_path) {
-            setenv("LIBGL_DRIVERS_PATH", xwayland_gl_driver_path, 1);
-          }
-        } else if (XWAYLAND_GL_DRIVER_PATH && *XWAYLAND_GL_DRIVER_PATH) {
-          setenv("LIBGL_DRIVERS_PATH", XWAYLAND_GL_DRIVER_PATH, 1);
+      xwayland_launch.cmd_prefix = xwayland_cmd_prefix;
+      xwayland_launch.path = xwayland_path;
+      // If a path is explicitly specified via command line or environment
+      // use that instead of the compiled in default.  In either case, only
+      // set the environment variable if the value specified is non-empty.
+      xwayland_launch.gl_driver_path =
+          xwayland_gl_driver_path ?: XWAYLAND_GL_DRIVER_PATH;
+      xwayland_launch.auth_path = xauth_path;
+      xwayland_launch.font_path = xfont_path;
+      xwayland_launch.display = xdisplay;
+      xwayland_launch.glamor =
+          ctx.drm_device && glamor && strcmp(glamor, "0");
+      xwayland_launch.wayland_fd = sv[1];
+      xwayland_launch.lazy = 0;
+      for (i = 0; i < ARRAY_SIZE(xwayland_launch.listen_fds); ++i) {
+        xwayland_launch.listen_fds[i] = -1;
+        xwayland_launch.listen_event_sources[i] = NULL;
+      }
+      ctx.xwayland_launch = &xwayland_launch;
+
+      // With lazy startup the program runs right away and Xwayland is
+      // started once it, or anything else, connects to the X display.
+      if (lazy_xwayland && strcmp(lazy_xwayland, "0") &&
+          sl_listen_x_display(&ctx)) {
+        putenv(sl_xasprintf("XCURSOR_SIZE=%d",
+                            (int)(XCURSOR_SIZE_BASE * ctx.scale + 0.5)));
+
+        pid = fork();
+        errno_assert(pid != -1);
+        if (pid == 0) {
+          sl_execvp(ctx.runprog[0], ctx.runprog, -1);
+          _exit(EXIT_FAILURE);
         }
-
-        sl_execvp(args[0], args, sv[1]);
-        _exit(EXIT_FAILURE);
+        ctx.child_pid = pid;
+      } else {
+        sl_spawn_xwayland(&ctx);
       }
-      close(wm[1]);
-      ctx.xwayland_pid = pid;
     } else {
       pid = fork();
       errno_assert(pid != -1);
@@ -4342,14 +6423,18 @@ int main(int argc, char** argv) {
         _exit(EXIT_FAILURE);
       }
       ctx.child_pid = pid;
+      close(sv[1]);
     }
-    close(sv[1]);
   }
 
-  wl_client_add_destroy_listener(ctx.client, &client_destroy_listener);
-
+  // Output to clients, the host and Xwayland is flushed once per iteration,
+  // after all sources with pending input have been dispatched.
   do {
-    wl_display_flush_clients(ctx.host_display);
+    ctx.stats.loop_iterations++;
+    // Events for clients stay queued until a pending X sync completes.
+    // Its reply is read by the X connection handler.
+    if (!ctx.connection || !sl_x_sync_pending(&ctx))
+      wl_display_flush_clients(ctx.host_display);
     if (ctx.connection) {
       if (ctx.needs_set_input_focus) {
         sl_set_input_focus(&ctx, ctx.host_focus_window);
@@ -4359,7 +6444,9 @@ int main(int argc, char** argv) {
     }
     if (wl_display_flush(ctx.display) < 0)
       return EXIT_FAILURE;
-  } while (wl_event_loop_dispatch(event_loop, -1) != -1);
+    // Don't block when X events are left over from a full batch.
+  } while (wl_event_loop_dispatch(event_loop, ctx.x_events_pending ? 0 : -1) !=
+           -1);
 
   return EXIT_SUCCESS;
 }
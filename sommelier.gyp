@@ -32,6 +32,10 @@
 
     # Set this to the dark frame color to use for Xwayland clients.
     'dark_frame_color%': '"#323639"',
+
+    # Set this to 0 to build without EGL and GLESv2. All contents are then
+    # copied by the CPU.
+    'gpu_upload%': 1,
   },
   'targets': [
     {
@@ -68,11 +72,20 @@
           'xcb-xfixes',
           'xkbcommon',
         ],
+        'conditions': [
+          ['gpu_upload == 1', {
+            'exported_deps': [
+              'egl',
+              'glesv2',
+            ],
+          }],
+        ],
         'deps': ['<@(exported_deps)'],
       },
       'link_settings': {
         'libraries': [
           '-lm',
+          '-lpthread',
         ],
       },
       'dependencies': [
@@ -80,6 +93,7 @@
       ],
       'sources': [
         'sommelier-compositor.c',
+        'sommelier-copy.c',
         'sommelier-data-device-manager.c',
         'sommelier-display.c',
         'sommelier-drm.c',
@@ -87,6 +101,7 @@
         'sommelier-output.c',
         'sommelier-seat.c',
         'sommelier-shell.c',
+        'sommelier-stats.c',
         'sommelier-shm.c',
         'sommelier-subcompositor.c',
         'sommelier-text-input.c',
@@ -106,6 +121,12 @@
         'FRAME_COLOR=<@(frame_color)',
         'DARK_FRAME_COLOR=<@(dark_frame_color)',
       ],
+      'conditions': [
+        ['gpu_upload == 1', {
+          'sources': ['sommelier-gpu.c'],
+          'defines': ['HAVE_GPU_UPLOAD'],
+        }],
+      ],
     },
     {
       'target_name': 'wayland_demo',
@@ -144,5 +165,42 @@
         'demos/x11_demo.cc',
       ],
     },
+    {
+      'target_name': 'wayland_bench',
+      'type': 'executable',
+      'variables': {
+        'deps': [
+          'libbrillo-<(libbase_ver)',
+          'libchrome-<(libbase_ver)',
+          'wayland-client',
+        ],
+      },
+      'link_settings': {
+        'libraries': [
+          '-lwayland-client',
+        ],
+      },
+      'sources': [
+        'demos/wayland_bench.cc',
+      ],
+    },
+    {
+      'target_name': 'x11_bench',
+      'type': 'executable',
+      'variables': {
+        'deps': [
+          'libbrillo-<(libbase_ver)',
+          'libchrome-<(libbase_ver)',
+        ],
+      },
+      'link_settings': {
+        'libraries': [
+          '-lX11',
+        ],
+      },
+      'sources': [
+        'demos/x11_bench.cc',
+      ],
+    },
   ],
 }
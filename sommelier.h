@@ -5,7 +5,9 @@
 #ifndef VM_TOOLS_SOMMELIER_SOMMELIER_H_
 #define VM_TOOLS_SOMMELIER_SOMMELIER_H_
 
+#include <stdio.h>
 #include <sys/types.h>
+#include <time.h>
 #include <wayland-server.h>
 #include <wayland-util.h>
 #include <xcb/xcb.h>
@@ -24,6 +26,21 @@
 #define ALT_MASK (1 << 1)
 #define SHIFT_MASK (1 << 2)
 
+// Number of hash buckets used to index windows.
+#define WINDOW_INDEX_BITS 8
+#define WINDOW_INDEX_SIZE (1 << WINDOW_INDEX_BITS)
+
+// Number of hash buckets used to index accelerators.
+#define ACCELERATOR_INDEX_BITS 5
+#define ACCELERATOR_INDEX_SIZE (1 << ACCELERATOR_INDEX_BITS)
+
+// Maximum number of concurrent X to Wayland selection transfers. Each one
+// uses its own property on the selection window.
+#define SELECTION_MAX_SENDS 8
+
+// Dispatch time is recorded for each X event type below this.
+#define STATS_X_EVENT_TYPES 128
+
 struct sl_global;
 struct sl_compositor;
 struct sl_shm;
@@ -31,6 +48,7 @@ struct sl_shell;
 struct sl_data_device_manager;
 struct sl_data_offer;
 struct sl_data_source;
+struct sl_data_source_send;
 struct sl_xdg_shell;
 struct sl_subcompositor;
 struct sl_aura_shell;
@@ -41,8 +59,17 @@ struct sl_text_input_manager;
 struct sl_relative_pointer_manager;
 struct sl_pointer_constraints;
 struct sl_window;
+struct sl_xwayland_launch;
+struct sl_copy_engine;
+struct sl_gpu_engine;
+struct sl_gpu_target;
+struct sl_damage_history;
+struct sl_mmap;
+struct gbm_bo;
 struct zaura_shell;
 struct zcr_keyboard_extension_v1;
+struct zwp_linux_buffer_params_v1;
+struct virtwl_ioctl_txn;
 
 enum {
   ATOM_WM_S0,
@@ -89,11 +116,68 @@ enum {
   DATA_DRIVER_VIRTWL,
 };
 
+// Traffic counters for one direction of virtwl forwarding.
+struct sl_virtwl_stats {
+  uint64_t messages;
+  uint64_t bytes;
+  uint64_t fds;
+  uint64_t ioctls;
+};
+
+// Totals for clipboard and drag-and-drop data transfers.
+struct sl_data_transfer_stats {
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t spliced_bytes;
+  uint64_t usec;
+  uint64_t last_bytes;
+  uint64_t last_usec;
+};
+
+// Count and total duration of one kind of operation. Durations are only
+// measured while timing is enabled.
+struct sl_timing {
+  uint64_t count;
+  uint64_t usec;
+  uint64_t max_usec;
+};
+
+// Counters reported through the stats socket and on SIGUSR1.
+struct sl_stats {
+  int timing;
+  int trace_fd;
+  int socket_fd;
+  struct wl_event_source* socket_event_source;
+  uint64_t commits;
+  uint64_t coalesced_commits;
+  uint64_t configures;
+  uint64_t coalesced_configures;
+  uint64_t copy_bytes;
+  struct sl_timing copies;
+  uint64_t buffer_allocations;
+  uint64_t buffer_surface_reuses;
+  uint64_t buffer_pool_reuses;
+  uint64_t cursor_cache_hits;
+  uint64_t cursor_cache_misses;
+  uint64_t keymap_cache_hits;
+  uint64_t keymap_cache_misses;
+  uint64_t loop_iterations;
+  uint64_t host_reads;
+  uint64_t host_events;
+  uint64_t x_event_batches;
+  uint64_t x_events_handled;
+  uint64_t x_events_deferred;
+  uint64_t x_event_checks;
+  struct sl_timing frame_callbacks;
+  struct sl_timing x_events[STATS_X_EVENT_TYPES];
+};
+
 struct sl_context {
   char** runprog;
   struct wl_display* display;
   struct wl_display* host_display;
   struct wl_client* client;
+  struct wl_listener client_destroy_listener;
   struct sl_compositor* compositor;
   struct sl_subcompositor* subcompositor;
   struct sl_shm* shm;
@@ -121,14 +205,51 @@ struct sl_context {
   int virtwl_socket_fd;
   struct wl_event_source* virtwl_ctx_event_source;
   struct wl_event_source* virtwl_socket_event_source;
+  struct wl_event_source* stats_event_source;
+  struct wl_event_source* peer_ctrl_event_source;
+  size_t virtwl_buffer_size;
+  int virtwl_batch;
+  struct virtwl_ioctl_txn* virtwl_send_txn;
+  uint8_t* virtwl_recv_txns;
+  struct sl_virtwl_stats virtwl_send_stats;
+  struct sl_virtwl_stats virtwl_recv_stats;
+  struct sl_data_transfer_stats data_transfer_stats;
+  struct sl_data_transfer_stats selection_transfer_stats;
+  struct sl_stats stats;
+  struct wl_list host_surfaces;
+  int coalesce_pointer_motion;
+  int coalesce_commits;
+  int throttle_hidden;
+  int downscale;
+  int dmabuf_modifiers;
+  struct wl_list held_pointers;
   const char* drm_device;
   struct gbm_device* gbm;
+  int udmabuf_fd;
+  struct sl_copy_engine* copy_engine;
+  struct sl_gpu_engine* gpu_engine;
+  struct wl_list output_buffer_pool;
+  size_t output_buffer_pool_size;
+  size_t output_buffer_pool_limit;
+  int output_buffer_pool_length;
+  size_t output_buffer_size;
+  struct wl_list cursor_cache;
+  int cursor_cache_length;
+  size_t output_buffer_budget;
+  int output_buffer_idle_timeout;
+  struct wl_event_source* output_buffer_idle_timer;
   int xwayland;
   pid_t xwayland_pid;
+  struct sl_xwayland_launch* xwayland_launch;
   pid_t child_pid;
   pid_t peer_pid;
+  // Set when this context is one of several client threads in a process.
+  int multi_client;
+  int quit;
   struct xkb_context* xkb_context;
   struct wl_list accelerators;
+  // Hash index from modifiers and key symbol to accelerators.
+  struct wl_list accelerator_index[ACCELERATOR_INDEX_SIZE];
   struct wl_list registries;
   struct wl_list globals;
   struct wl_list host_outputs;
@@ -139,8 +260,17 @@ struct sl_context {
   xcb_screen_t* screen;
   xcb_window_t window;
   struct wl_list windows, unpaired_windows;
+  // Hash indexes from X window id, frame id and host surface id to windows.
+  struct wl_list window_id_index[WINDOW_INDEX_SIZE];
+  struct wl_list window_frame_id_index[WINDOW_INDEX_SIZE];
+  struct wl_list window_host_surface_index[WINDOW_INDEX_SIZE];
+  struct wl_list x_requests;
   struct sl_window* host_focus_window;
   int needs_set_input_focus;
+  int x_events_pending;
+  // Events to X11 clients are held back while the X server catches up.
+  int x_sync_pending;
+  unsigned int x_sync_sequence;
   double desired_scale;
   double scale;
   const char* application_id;
@@ -153,22 +283,19 @@ struct sl_context {
   struct sl_host_seat* default_seat;
   xcb_window_t selection_window;
   xcb_window_t selection_owner;
-  int selection_incremental_transfer;
-  xcb_selection_request_event_t selection_request;
   xcb_timestamp_t selection_timestamp;
   struct wl_data_device* selection_data_device;
   struct sl_data_offer* selection_data_offer;
   struct sl_data_source* selection_data_source;
-  int selection_data_source_send_fd;
+  struct sl_data_source_send* selection_data_source_sends[SELECTION_MAX_SENDS];
+  xcb_atom_t selection_send_atoms[SELECTION_MAX_SENDS];
   struct wl_list selection_data_source_send_pending;
-  struct wl_event_source* selection_send_event_source;
-  xcb_get_property_reply_t* selection_property_reply;
-  int selection_property_offset;
-  struct wl_event_source* selection_event_source;
-  xcb_atom_t selection_data_type;
-  struct wl_array selection_data;
-  int selection_data_offer_receive_fd;
-  int selection_data_ack_pending;
+  struct wl_list selection_data_offer_receives;
+  uint32_t selection_chunk_size;
+  size_t selection_buffer_bytes;
+  struct wl_list clipboard_cache;
+  size_t clipboard_cache_limit;
+  size_t clipboard_cache_bytes;
   union {
     const char* name;
     xcb_intern_atom_cookie_t cookie;
@@ -212,6 +339,17 @@ struct sl_host_pointer {
   uint32_t time;
   wl_fixed_t axis_delta[2];
   int32_t axis_discrete[2];
+  // Motion coalescing state. Motion-only frames are held back until the end
+  // of the current host dispatch or until another input event arrives.
+  int coalesce_motion;
+  struct wl_list held_link;
+  int frame_held;
+  int frame_events;
+  int motion_pending;
+  uint32_t motion_time;
+  wl_fixed_t motion_x;
+  wl_fixed_t motion_y;
+  struct wl_list relative_pointers;
 };
 
 struct sl_relative_pointer_manager {
@@ -223,6 +361,7 @@ struct sl_relative_pointer_manager {
 
 struct sl_viewport {
   struct wl_list link;
+  struct sl_host_surface* host_surface;
   wl_fixed_t src_x;
   wl_fixed_t src_y;
   wl_fixed_t src_width;
@@ -232,8 +371,29 @@ struct sl_viewport {
 };
 
 struct sl_host_callback {
+  struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_callback* proxy;
+  uint64_t request_usec;
+  // Frame callbacks of hidden surfaces are answered by us.
+  struct wl_list link;
+};
+
+// A client request for a surface that arrived while the previous commit of
+// the surface is held on a fence. It is applied once that commit has reached
+// the host, in the order it was received.
+struct sl_held_request {
+  struct wl_list link;
+  struct wl_resource* resource;
+  struct wl_listener resource_listener;
+  uint32_t opcode;
+  int32_t args[4];
+  // Object argument. Cleared if it is destroyed before the request applies.
+  struct wl_resource* object;
+  struct wl_listener object_listener;
+  struct sl_host_buffer* buffer;
+  struct wl_region* region;
+  void (*apply)(struct sl_held_request* request);
 };
 
 struct sl_host_surface {
@@ -243,24 +403,53 @@ struct sl_host_surface {
   struct wp_viewport* viewport;
   uint32_t contents_width;
   uint32_t contents_height;
+  uint32_t contents_shm_format;
   int32_t contents_scale;
   struct wl_list contents_viewport;
   struct sl_mmap* contents_shm_mmap;
+  double contents_downscale;
+  int contents_gpu_fallback;
+  int contents_cropped;
+  int contents_fence_fd;
+  struct wl_event_source* contents_fence_event_source;
+  struct wl_callback* contents_frame_callback;
+  int contents_commit_deferred;
+  int contents_attach_pending;
+  int32_t contents_x;
+  int32_t contents_y;
+  int contents_occluded;
+  int contents_hidden;
+  struct wl_list hidden_frame_callbacks;
+  struct wl_event_source* hidden_frame_timer;
+  int is_cursor;
+  int contents_cached;
   int has_role;
   int has_output;
+  int output_count;
   uint32_t last_event_serial;
   struct sl_output_buffer* current_buffer;
+  struct sl_damage_history* damage_history;
+  struct wl_list held_requests;
+  int applying_held_requests;
   struct wl_list released_buffers;
   struct wl_list busy_buffers;
+  struct wl_list link;
+  uint64_t create_usec;
+  uint64_t commits;
+  uint64_t copy_bytes;
+  uint64_t copy_usec;
 };
 
 struct sl_host_region {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_region* proxy;
+  // Copy of the host region, for requests that are held.
+  struct pixman_region32* contents;
 };
 
 struct sl_host_buffer {
+  int refcount;
   struct wl_resource* resource;
   struct wl_buffer* proxy;
   uint32_t width;
@@ -268,13 +457,51 @@ struct sl_host_buffer {
   struct sl_mmap* shm_mmap;
   uint32_t shm_format;
   struct sl_sync_point* sync_point;
+  struct zwp_linux_buffer_params_v1* dmabuf_params;
 };
 
-struct sl_data_source_send_request {
+// X selection data being sent to a Wayland client.
+struct sl_data_source_send {
+  struct sl_context* ctx;
+  struct wl_list link;
   int fd;
   xcb_intern_atom_cookie_t cookie;
-  struct sl_data_source* data_source;
+  xcb_atom_t target;
+  int slot;
+  int incremental;
+  uint32_t long_offset;
+  int more;
+  xcb_get_property_reply_t* property_reply;
+  int property_offset;
+  struct wl_event_source* event_source;
+  uint64_t bytes;
+  struct timespec start_time;
+};
+
+// Wayland selection data being received for an X requestor.
+struct sl_data_offer_receive {
+  struct sl_context* ctx;
+  struct wl_list link;
+  xcb_selection_request_event_t request;
+  xcb_atom_t data_type;
+  int fd;
+  struct wl_event_source* event_source;
+  uint8_t* data;
+  uint32_t data_size;
+  int incremental;
+  int ack_pending;
+  int waiting;
+  int cacheable;
+  struct wl_array cache_data;
+  uint64_t bytes;
+  struct timespec start_time;
+};
+
+// Contents of the current Wayland selection for one target.
+struct sl_clipboard_cache_entry {
   struct wl_list link;
+  xcb_atom_t target;
+  struct wl_array data;
 };
 
 struct sl_subcompositor {
@@ -329,8 +556,26 @@ struct sl_host_seat {
   struct wl_seat* proxy;
 };
 
+// Settings for starting Xwayland. With lazy startup, sommelier listens on
+// the X11 display sockets itself and starts Xwayland when the first client
+// connects to one of |listen_fds|.
+struct sl_xwayland_launch {
+  const char* cmd_prefix;
+  const char* path;
+  const char* gl_driver_path;
+  const char* auth_path;
+  const char* font_path;
+  int display;
+  int glamor;
+  int wayland_fd;
+  int lazy;
+  int listen_fds[2];
+  struct wl_event_source* listen_event_sources[2];
+};
+
 struct sl_accelerator {
   struct wl_list link;
+  struct wl_list index_link;
   uint32_t modifiers;
   xkb_keysym_t symbol;
 };
@@ -352,8 +597,9 @@ struct sl_data_device_manager {
 struct sl_data_offer {
   struct sl_context* ctx;
   struct wl_data_offer* internal;
-  struct wl_array atoms;    // Contains xcb_atom_t
-  struct wl_array cookies;  // Contains xcb_intern_atom_cookie_t
+  struct wl_array atoms;       // Contains xcb_atom_t
+  struct wl_array cookies;     // Contains xcb_intern_atom_cookie_t
+  struct wl_array mime_types;  // Contains char*
 };
 
 struct sl_text_input_manager {
@@ -398,6 +644,13 @@ struct sl_linux_dmabuf {
   uint32_t version;
   struct sl_global* host_drm_global;
   struct zwp_linux_dmabuf_v1* internal;
+  // Format and modifier pairs advertised by the host.
+  struct wl_array modifiers;
+};
+
+struct sl_dmabuf_modifier {
+  uint32_t format;
+  uint64_t modifier;
 };
 
 struct sl_global {
@@ -416,7 +669,7 @@ struct sl_host_registry {
   struct wl_list link;
 };
 
-typedef void (*sl_begin_end_access_func_t)(int fd);
+typedef void (*sl_begin_end_access_func_t)(struct sl_mmap* map);
 
 struct sl_mmap {
   int refcount;
@@ -431,6 +684,11 @@ struct sl_mmap {
   sl_begin_end_access_func_t begin_write;
   sl_begin_end_access_func_t end_write;
   struct wl_resource* buffer_resource;
+  struct sl_mmap* parent;
+  // Tiled buffers are only mapped through gbm between begin_write and
+  // end_write.
+  struct gbm_bo* bo;
+  void* bo_map_data;
 };
 
 typedef void (*sl_sync_func_t)(struct sl_context* ctx,
@@ -439,6 +697,7 @@ typedef void (*sl_sync_func_t)(struct sl_context* ctx,
 struct sl_sync_point {
   int fd;
   sl_sync_func_t sync;
+  void* data;
 };
 
 struct sl_config {
@@ -455,6 +714,10 @@ struct sl_window {
   xcb_window_t frame_id;
   uint32_t host_surface_id;
   int unpaired;
+  struct wl_list id_link;
+  struct wl_list frame_id_link;
+  struct wl_list host_surface_link;
+  int pending_x_requests;
   int x;
   int y;
   int width;
@@ -466,6 +729,7 @@ struct sl_window {
   int activated;
   int maximized;
   int allow_resize;
+  int resizing;
   xcb_window_t transient_for;
   xcb_window_t client_leader;
   int decorated;
@@ -481,6 +745,10 @@ struct sl_window {
   int max_height;
   struct sl_config next_config;
   struct sl_config pending_config;
+  // Holds back the next configure during an interactive resize until the
+  // host has presented the contents of the last one.
+  struct wl_callback* configure_frame_callback;
+  struct wl_event_source* configure_frame_timer;
   struct xdg_surface* xdg_surface;
   struct xdg_toplevel* xdg_toplevel;
   struct xdg_popup* xdg_popup;
@@ -494,6 +762,13 @@ struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
                                              int32_t width,
                                              int32_t height);
 
+void sl_host_buffer_set_proxy(struct sl_host_buffer* host,
+                              struct wl_buffer* proxy);
+
+struct sl_host_buffer* sl_host_buffer_ref(struct sl_host_buffer* host);
+
+void sl_host_buffer_unref(struct sl_host_buffer* host);
+
 struct sl_global* sl_global_create(struct sl_context* ctx,
                                    const struct wl_interface* interface,
                                    int version,
@@ -502,6 +777,8 @@ struct sl_global* sl_global_create(struct sl_context* ctx,
 
 struct sl_global* sl_compositor_global_create(struct sl_context* ctx);
 
+uint32_t sl_drm_format_for_shm_format(int format);
+
 size_t sl_shm_bpp_for_shm_format(uint32_t format);
 
 size_t sl_shm_num_planes_for_shm_format(uint32_t format);
@@ -539,6 +816,17 @@ struct sl_global* sl_pointer_constraints_global_create(struct sl_context* ctx);
 
 void sl_set_display_implementation(struct sl_context* ctx);
 
+void sl_host_surface_update_visibility(struct sl_host_surface* host);
+struct sl_held_request* sl_host_surface_hold_request(
+    struct sl_host_surface* host,
+    struct wl_resource* resource,
+    uint32_t opcode,
+    void (*apply)(struct sl_held_request* request));
+void sl_held_request_set_object(struct sl_held_request* request,
+                                struct wl_resource* object);
+void sl_host_surface_commit_state(struct sl_host_surface* host);
+void sl_output_buffer_pool_release(struct sl_context* ctx);
+
 struct sl_mmap* sl_mmap_create(int fd,
                                size_t size,
                                size_t bpp,
@@ -549,22 +837,135 @@ struct sl_mmap* sl_mmap_create(int fd,
                                size_t stride1,
                                size_t y_ss0,
                                size_t y_ss1);
+struct sl_mmap* sl_mmap_create_view(struct sl_mmap* parent,
+                                    size_t size,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1);
+struct sl_mmap* sl_mmap_create_gbm(struct gbm_bo* bo,
+                                   int fd,
+                                   size_t size,
+                                   size_t bpp);
+int sl_mmap_resize(struct sl_mmap* map, size_t size);
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map);
 void sl_mmap_unref(struct sl_mmap* map);
 
+struct sl_copy_engine* sl_copy_engine_create(const char* kernel,
+                                             int num_threads);
+void sl_copy_engine_add(struct sl_copy_engine* engine,
+                        uint8_t* dst,
+                        size_t dst_stride,
+                        const uint8_t* src,
+                        size_t src_stride,
+                        size_t bytes,
+                        int32_t height);
+void sl_copy_engine_flush(struct sl_copy_engine* engine);
+void sl_copy_engine_destroy(struct sl_copy_engine* engine);
+
+#ifdef HAVE_GPU_UPLOAD
+struct sl_gpu_engine* sl_gpu_engine_create(struct gbm_device* gbm);
+void sl_gpu_engine_destroy(struct sl_gpu_engine* engine);
+struct sl_gpu_target* sl_gpu_target_create(struct sl_gpu_engine* engine,
+                                           struct sl_mmap* map,
+                                           uint32_t width,
+                                           uint32_t height,
+                                           uint32_t drm_format);
+void sl_gpu_target_destroy(struct sl_gpu_engine* engine,
+                           struct sl_gpu_target* target);
+int sl_gpu_engine_begin(struct sl_gpu_engine* engine,
+                        struct sl_gpu_target* target,
+                        const uint8_t* src,
+                        size_t src_stride,
+                        uint32_t shm_format,
+                        uint32_t width,
+                        uint32_t height,
+                        double downscale);
+size_t sl_gpu_engine_add(struct sl_gpu_engine* engine,
+                         int32_t x1,
+                         int32_t y1,
+                         int32_t x2,
+                         int32_t y2);
+void sl_gpu_engine_end(struct sl_gpu_engine* engine);
+#else
+// Builds without EGL and GLESv2 have no GPU upload engine, so all contents
+// are copied by the CPU. Only creation is ever reached.
+static inline struct sl_gpu_engine* sl_gpu_engine_create(
+    struct gbm_device* gbm) {
+  return NULL;
+}
+static inline void sl_gpu_engine_destroy(struct sl_gpu_engine* engine) {}
+static inline struct sl_gpu_target* sl_gpu_target_create(
+    struct sl_gpu_engine* engine,
+    struct sl_mmap* map,
+    uint32_t width,
+    uint32_t height,
+    uint32_t drm_format) {
+  return NULL;
+}
+static inline void sl_gpu_target_destroy(struct sl_gpu_engine* engine,
+                                         struct sl_gpu_target* target) {}
+static inline int sl_gpu_engine_begin(struct sl_gpu_engine* engine,
+                                      struct sl_gpu_target* target,
+                                      const uint8_t* src,
+                                      size_t src_stride,
+                                      uint32_t shm_format,
+                                      uint32_t width,
+                                      uint32_t height,
+                                      double downscale) {
+  return 0;
+}
+static inline size_t sl_gpu_engine_add(struct sl_gpu_engine* engine,
+                                       int32_t x1,
+                                       int32_t y1,
+                                       int32_t x2,
+                                       int32_t y2) {
+  return 0;
+}
+static inline void sl_gpu_engine_end(struct sl_gpu_engine* engine) {}
+#endif
+
+int sl_stats_init(struct sl_context* ctx, const char* socket_path, int trace);
+uint64_t sl_stats_timestamp(struct sl_context* ctx);
+uint64_t sl_timing_add(struct sl_context* ctx,
+                       struct sl_timing* timing,
+                       uint64_t start);
+void sl_trace_begin(struct sl_context* ctx, const char* name);
+void sl_trace_end(struct sl_context* ctx);
+void sl_data_transfer_stats_add(struct sl_data_transfer_stats* stats,
+                                uint64_t bytes,
+                                int spliced,
+                                const struct timespec* start_time);
+void sl_stats_report(struct sl_context* ctx, FILE* file);
+
 struct sl_sync_point* sl_sync_point_create(int fd);
 void sl_sync_point_destroy(struct sl_sync_point* sync_point);
 
 void sl_host_seat_added(struct sl_host_seat* host);
+void sl_release_held_pointer_frames(struct sl_context* ctx);
+void sl_host_pointer_flush_relative_motion(struct sl_host_pointer* host);
+void sl_host_pointer_detach_relative_pointers(struct sl_host_pointer* host);
 void sl_host_seat_removed(struct sl_host_seat* host);
+void sl_accelerator_insert(struct sl_context* ctx,
+                           struct sl_accelerator* accelerator);
+void sl_accelerator_remove(struct sl_accelerator* accelerator);
 
 void sl_restack_windows(struct sl_context* ctx, uint32_t focus_resource_id);
 
-void sl_roundtrip(struct sl_context* ctx);
+void sl_sync_x_connection(struct sl_context* ctx);
 
 int sl_process_pending_configure_acks(struct sl_window* window,
                                       struct sl_host_surface* host_surface);
 
 void sl_window_update(struct sl_window* window);
+void sl_window_set_host_surface_id(struct sl_window* window,
+                                   uint32_t host_surface_id);
+struct sl_window* sl_lookup_host_surface_window(struct sl_context* ctx,
+                                                uint32_t host_surface_id,
+                                                int unpaired);
 
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_H_